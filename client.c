@@ -1,13 +1,27 @@
 #include "common.h"
 
 #define NM_PORT 8080
+#define NM_FAILOVER_SECONDS 10 // How long to look for a name server that answers
+#define BUSY_RETRIES 5 // Attempts after a server answers that it is busy
+#define BUSY_BACKOFF_MAX_MS 5000
 
 char username[MAX_USERNAME];
-char nm_ip[50];  // Store the Name Server IP
+// Name servers from the command line (a primary and its standbys)
+char nm_ips[MAX_NAME_SERVERS][INET_ADDRSTRLEN];
+int nm_ports[MAX_NAME_SERVERS];
+int num_name_servers = 0;
+int current_nm = 0;
 int nm_sock = -1;
+// Name servers splitting the namespace, from the shard map (0 = not sharded)
+char shard_ips[MAX_NM_SHARDS][INET_ADDRSTRLEN];
+int shard_ports[MAX_NM_SHARDS];
+int shard_socks[MAX_NM_SHARDS];
+int num_shards = 0;
 
 // Function prototypes
 void connect_to_nm();
+void load_shard_map(const char* map);
+int nm_request(Message* msg, Message* response);
 void print_menu();
 void handle_command(const char* command);
 void cmd_view(const char* args);
@@ -33,37 +47,294 @@ void cmd_revert_checkpoint(const char* filename, const char* tag);
 void cmd_list_checkpoints(const char* filename);
 // Bonus: Access request operations
 void cmd_request_access(const char* filename, const char* flag);
-void cmd_view_requests();
+void cmd_view_requests(int page);
 void cmd_approve_request(const char* requester, const char* filename);
 void cmd_deny_request(const char* requester, const char* filename);
 // Bonus: Search and metrics
 void cmd_search(const char* pattern);
 void cmd_metrics();
 
+// Connect to one name server and register; returns the socket or -1
+int open_nm_connection(const char* ip, int port) {
+    int sock = connect_to_server(ip, port);
+    if (sock < 0) return -1;
+    
+    // Register client
+    Message msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = MSG_REGISTER_CLIENT;
+    strcpy(msg.username, username);
+    
+    send_message(sock, &msg);
+    
+    Message response;
+    if (receive_message(sock, &response) != 0 || response.error_code != ERR_SUCCESS) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Try the name servers in turn, starting with `first`, until one answers.
+// Gives a standby time to take over from a primary that just went away.
+int find_nm(int first) {
+    time_t give_up = time(NULL) + NM_FAILOVER_SECONDS;
+    while (1) {
+        for (int i = 0; i < num_name_servers; i++) {
+            int index = (first + i) % num_name_servers;
+            nm_sock = open_nm_connection(nm_ips[index], nm_ports[index]);
+            if (nm_sock >= 0) {
+                current_nm = index;
+                return 0;
+            }
+        }
+        if (time(NULL) >= give_up) return -1;
+        usleep(500000);
+    }
+}
+
+// Replace the cached shard map ("ip:port,..." in shard order)
+void load_shard_map(const char* map) {
+    for (int i = 0; i < num_shards; i++) {
+        if (shard_socks[i] >= 0 && shard_socks[i] != nm_sock) close(shard_socks[i]);
+    }
+    num_shards = parse_server_list(map, shard_ips, shard_ports, MAX_NM_SHARDS, NM_PORT);
+    for (int i = 0; i < num_shards; i++) {
+        int current = strcmp(shard_ips[i], nm_ips[current_nm]) == 0 && shard_ports[i] == nm_ports[current_nm];
+        shard_socks[i] = current ? nm_sock : -1;
+    }
+}
+
 // Connect to Name Server
 void connect_to_nm() {
-    nm_sock = connect_to_server(nm_ip, NM_PORT);
-    if (nm_sock < 0) {
-        printf("ERROR: Cannot connect to Name Server at %s:%d\n", nm_ip, NM_PORT);
+    if (find_nm(0) < 0) {
+        printf("ERROR: Cannot connect to Name Server at %s:%d\n", nm_ips[0], nm_ports[0]);
         exit(1);
     }
     
-    // Register client
+    printf("✓ Connected to Name Server\n");
+    printf("✓ Registered as user: %s\n\n", username);
+    
+    // Is the namespace split across several name servers?
     Message msg;
     memset(&msg, 0, sizeof(msg));
-    msg.type = MSG_REGISTER_CLIENT;
+    msg.type = MSG_NM_SHARD_MAP;
     strcpy(msg.username, username);
-    
     send_message(nm_sock, &msg);
     
     Message response;
-    if (receive_message(nm_sock, &response) == 0 && response.error_code == ERR_SUCCESS) {
-        printf("✓ Connected to Name Server\n");
-        printf("✓ Registered as user: %s\n\n", username);
-    } else {
-        printf("ERROR: Failed to register with Name Server\n");
-        close(nm_sock);
-        exit(1);
+    if (receive_message(nm_sock, &response) == 0 && response.error_code == ERR_SUCCESS && response.flags > 1) {
+        load_shard_map(response.data);
+        printf("✓ Namespace is split across %d name servers\n\n", num_shards);
+    }
+}
+
+// The name server went away: try the others in the list (its standby takes
+// over within a few seconds), starting with the next one
+int reconnect_to_nm() {
+    if (nm_sock >= 0) close(nm_sock);
+    nm_sock = -1;
+    
+    if (find_nm(current_nm + 1) < 0) return -1;
+    printf("✓ Reconnected to Name Server at %s:%d\n", nm_ips[current_nm], nm_ports[current_nm]);
+    return 0;
+}
+
+// A server answered ERR_SERVER_BUSY: wait out its retry-after hint, doubled
+// on each attempt and jittered so rejected clients do not return together.
+// Returns 0 if the request should be sent again.
+int busy_backoff(int attempt, const Message* response) {
+    if (response->error_code != ERR_SERVER_BUSY || attempt >= BUSY_RETRIES) return -1;
+    
+    int delay_ms = response->flags > 0 ? response->flags : 100;
+    for (int i = 0; i < attempt && delay_ms < BUSY_BACKOFF_MAX_MS; i++) delay_ms *= 2;
+    if (delay_ms > BUSY_BACKOFF_MAX_MS) delay_ms = BUSY_BACKOFF_MAX_MS;
+    delay_ms = delay_ms / 2 + rand() % (delay_ms + 1); // 0.5x to 1.5x
+    
+    printf("Server busy, retrying in %d ms...\n", delay_ms);
+    usleep(delay_ms * 1000);
+    return 0;
+}
+
+// Requests a name server can safely get twice: they only read state, or
+// (READ/WRITE/STREAM) look up where the file is. A lost connection gives no
+// answer either way, so only these are resent automatically.
+int request_is_resendable(int type) {
+    switch (type) {
+        case MSG_REGISTER_CLIENT:
+        case MSG_VIEW_FILES:
+        case MSG_READ_FILE:
+        case MSG_WRITE_FILE:
+        case MSG_INFO_FILE:
+        case MSG_STREAM_FILE:
+        case MSG_LIST_USERS:
+        case MSG_VIEW_FOLDER:
+        case MSG_VIEW_CHECKPOINT:
+        case MSG_LIST_CHECKPOINTS:
+        case MSG_VIEW_REQUESTS:
+        case MSG_SEARCH_FILE:
+        case MSG_GET_METRICS:
+        case MSG_NM_SHARD_MAP:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// A name server only writes in answer to a request, so a readable idle
+// socket means it closed the connection: reconnect before sending anything
+int connection_closed(int sock) {
+    char byte;
+    ssize_t n = recv(sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+// The connection dropped after a request that changes state was sent: it
+// may or may not have been applied, so say so instead of resending it
+int outcome_unknown(Message* response) {
+    printf("Request not resent: it may or may not have been applied. Check before retrying.\n");
+    response->error_code = ERR_CONNECTION_FAILED;
+    strcpy(response->data, "Name Server connection lost; the request may or may not have been applied. "
+                           "Check before retrying.");
+    return -1;
+}
+
+// One request to one shard, reconnecting once if the connection dropped
+// and backing off while the shard is busy
+int shard_call(int shard, Message* msg, Message* response) {
+    for (int attempt = 0, busy = 0; attempt < 2; attempt++) {
+        if (shard_socks[shard] >= 0 && connection_closed(shard_socks[shard])) {
+            close(shard_socks[shard]);
+            if (shard_socks[shard] == nm_sock) nm_sock = -1;
+            shard_socks[shard] = -1;
+        }
+        if (shard_socks[shard] < 0) {
+            shard_socks[shard] = open_nm_connection(shard_ips[shard], shard_ports[shard]);
+            if (shard_socks[shard] < 0) break;
+        }
+        send_message(shard_socks[shard], msg);
+        if (receive_message(shard_socks[shard], response) == 0) {
+            if (busy_backoff(busy++, response) == 0) {
+                attempt--;
+                continue;
+            }
+            return 0;
+        }
+        close(shard_socks[shard]);
+        if (shard_socks[shard] == nm_sock) nm_sock = -1;
+        shard_socks[shard] = -1;
+        if (!request_is_resendable(msg->type)) return outcome_unknown(response);
+    }
+    
+    response->error_code = ERR_CONNECTION_FAILED;
+    sprintf(response->data, "Cannot reach name server %s:%d", shard_ips[shard], shard_ports[shard]);
+    return -1;
+}
+
+int has_line(const char* text, const char* line) {
+    size_t len = strlen(line);
+    for (const char* p = text; (p = strstr(p, line)) != NULL; p++) {
+        if ((p == text || p[-1] == '\n') && p[len] == '\n') return 1;
+    }
+    return 0;
+}
+
+// Listings, search and metrics: every shard answers for its own names
+int shard_broadcast(Message* msg, Message* response) {
+    Message* part = (Message*)malloc(sizeof(Message));
+    if (!part) return -1;
+    
+    int answered = 0;
+    int len = 0;
+    for (int shard = 0; shard < num_shards; shard++) {
+        if (shard_call(shard, msg, part) < 0 || part->error_code != ERR_SUCCESS) {
+            if (!answered && shard == num_shards - 1) memcpy(response, part, sizeof(Message));
+            continue;
+        }
+        if (!answered) {
+            memcpy(response, part, sizeof(Message));
+            response->data[0] = '\0';
+        }
+        answered++;
+        
+        if (msg->type == MSG_GET_METRICS) {
+            len += snprintf(response->data + len, sizeof(response->data) - len,
+                            "── Name server %s:%d ──\n", shard_ips[shard], shard_ports[shard]);
+        }
+        // The same user shows up on several shards
+        char* saveptr = NULL;
+        for (char* line = strtok_r(part->data, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+            if (msg->type == MSG_LIST_USERS && has_line(response->data, line)) continue;
+            if (len + (int)strlen(line) + 2 >= (int)sizeof(response->data)) break;
+            len += sprintf(response->data + len, "%s\n", line);
+        }
+    }
+    
+    free(part);
+    return answered > 0 ? 0 : -1;
+}
+
+// Send a request to the shard owning its name, following that server's map
+// if ours is out of date
+int shard_request(Message* msg, Message* response) {
+    const char* name = request_shard_name(msg);
+    if (!name) return shard_broadcast(msg, response);
+    
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (shard_call(shard_of(name, num_shards), msg, response) < 0) return -1;
+        if (response->error_code != ERR_WRONG_SHARD) return 0;
+        load_shard_map(response->data);
+    }
+    return 0;
+}
+
+// Send a request to the name server and wait for its reply, failing over
+// to another name server if the connection is lost. The request is resent
+// once if it was never sent or is safe to repeat.
+int nm_exchange(Message* msg, Message* response) {
+    int sent = 0;
+    if (nm_sock >= 0 && !connection_closed(nm_sock)) {
+        send_message(nm_sock, msg);
+        if (receive_message(nm_sock, response) == 0) return 0;
+        sent = 1;
+    }
+    
+    printf("Name Server connection lost, failing over...\n");
+    if (reconnect_to_nm() < 0) {
+        response->error_code = ERR_CONNECTION_FAILED;
+        strcpy(response->data, "Cannot reach any Name Server");
+        return -1;
+    }
+    if (sent && !request_is_resendable(msg->type)) return outcome_unknown(response);
+    send_message(nm_sock, msg);
+    return receive_message(nm_sock, response);
+}
+
+int nm_request(Message* msg, Message* response) {
+    if (num_shards > 1) return shard_request(msg, response);
+    
+    for (int attempt = 0; ; attempt++) {
+        int result = nm_exchange(msg, response);
+        if (result != 0 || busy_backoff(attempt, response) != 0) return result;
+    }
+}
+
+// Connect to a storage server, send a request and receive the first reply,
+// backing off while the server is busy. Returns the open socket, -1 if the
+// server cannot be reached, or -2 if it closed without answering.
+int ss_request(const char* ip, int port, Message* msg, Message* response) {
+    for (int attempt = 0; ; attempt++) {
+        int ss_sock = connect_to_server(ip, port);
+        if (ss_sock < 0) return -1;
+        
+        send_message(ss_sock, msg);
+        if (receive_message(ss_sock, response) != 0) {
+            close(ss_sock);
+            return -2;
+        }
+        if (response->error_code != ERR_SERVER_BUSY || attempt >= BUSY_RETRIES) return ss_sock;
+        close(ss_sock);
+        busy_backoff(attempt, response);
     }
 }
 
@@ -99,13 +370,14 @@ void print_menu() {
     printf("───────────────────────────────────────────────────────────\n");
     printf("Bonus - Access Requests:\n");
     printf("  REQUESTACCESS -R/-W <file> - Request file access\n");
-    printf("  VIEWREQUESTS              - View pending requests (owner)\n");
+    printf("  VIEWREQUESTS [page]       - View pending requests (owner)\n");
     printf("  APPROVEREQUEST <user> <file> - Approve request\n");
     printf("  DENYREQUEST <user> <file> - Deny request\n");
     printf("───────────────────────────────────────────────────────────\n");
     printf("Bonus - Unique Features:\n");
-    printf("  SEARCH <pattern>          - Search files by name\n");
+    printf("  SEARCH <pattern>          - Search files by name or content\n");
     printf("  METRICS                   - View system metrics\n");
+    printf("  REPLICATION <file|folder> <n> - Set number of copies kept\n");
     printf("───────────────────────────────────────────────────────────\n");
     printf("  HELP                      - Show this menu\n");
     printf("  EXIT                      - Exit client\n");
@@ -125,10 +397,8 @@ void cmd_view(const char* args) {
         if (strstr(args, "l")) msg.flags |= 2;
     }
     
-    send_message(nm_sock, &msg);
-    
     Message response;
-    if (receive_message(nm_sock, &response) == 0) {
+    if (nm_request(&msg, &response) == 0) {
         if (response.error_code == ERR_SUCCESS) {
             printf("%s", response.data);
         } else {
@@ -139,46 +409,135 @@ void cmd_view(const char* args) {
     }
 }
 
-// READ command
-void cmd_read(const char* filename) {
-    // Get SS info from NM
-    Message msg;
-    memset(&msg, 0, sizeof(msg));
-    msg.type = MSG_READ_FILE;
-    strcpy(msg.username, username);
-    strcpy(msg.filename, filename);
-    
-    send_message(nm_sock, &msg);
-    
-    Message response;
-    if (receive_message(nm_sock, &response) != 0 || response.error_code != ERR_SUCCESS) {
-        printf("ERROR: %s\n", response.data);
-        return;
+// ═══════════════════════════════════════════════════════════════════
+// LOCATION CACHE - Leased READ/STREAM locations, reused without the NM hop
+// ═══════════════════════════════════════════════════════════════════
+
+#define LOCATION_CACHE_SIZE 64
+
+typedef struct {
+    char filename[MAX_FILENAME];
+    char ss_ip[INET_ADDRSTRLEN];
+    int ss_port;
+    int epoch;
+    time_t expires; // 0 = free slot
+} CachedLocation;
+
+CachedLocation location_cache[LOCATION_CACHE_SIZE];
+
+CachedLocation* find_cached_location(const char* filename) {
+    for (int i = 0; i < LOCATION_CACHE_SIZE; i++) {
+        if (location_cache[i].expires && strcmp(location_cache[i].filename, filename) == 0) {
+            return &location_cache[i];
+        }
+    }
+    return NULL;
+}
+
+void forget_location(const char* filename) {
+    CachedLocation* entry = find_cached_location(filename);
+    if (entry) entry->expires = 0;
+}
+
+void remember_location(const char* filename, Message* location) {
+    if (location->lease_ttl <= 0) return;
+    
+    CachedLocation* entry = find_cached_location(filename);
+    if (!entry) {
+        // Take a free slot, else evict the lease closest to expiry
+        entry = &location_cache[0];
+        for (int i = 0; i < LOCATION_CACHE_SIZE; i++) {
+            if (location_cache[i].expires < entry->expires) entry = &location_cache[i];
+            if (!entry->expires) break;
+        }
     }
     
-    // Connect to SS
-    int ss_sock = connect_to_server(response.ss_ip, response.ss_port);
-    if (ss_sock < 0) {
-        printf("ERROR: Cannot connect to Storage Server\n");
-        return;
+    strcpy(entry->filename, filename);
+    strcpy(entry->ss_ip, location->ss_ip);
+    entry->ss_port = location->ss_port;
+    entry->epoch = location->epoch;
+    entry->expires = time(NULL) + location->lease_ttl;
+}
+
+// Find the storage server for a READ/STREAM, from an unexpired lease when
+// use_cache is set, otherwise from the NM. Fills ss_ip, ss_port and epoch of
+// location; returns -1 with the NM's error in location->data on failure.
+int lookup_location(int type, const char* filename, int use_cache, Message* location) {
+    if (use_cache) {
+        CachedLocation* entry = find_cached_location(filename);
+        if (entry && entry->expires > time(NULL)) {
+            memset(location, 0, sizeof(*location));
+            location->error_code = ERR_SUCCESS;
+            strcpy(location->ss_ip, entry->ss_ip);
+            location->ss_port = entry->ss_port;
+            location->epoch = entry->epoch;
+            return 1;
+        }
     }
     
-    // Send read request to SS
+    Message msg;
     memset(&msg, 0, sizeof(msg));
-    msg.type = MSG_READ_FILE;
-    strcpy(msg.filename, filename); // filename now includes path (e.g., "documents/test.txt")
+    msg.type = type;
     strcpy(msg.username, username);
+    strcpy(msg.filename, filename);
     
-    send_message(ss_sock, &msg);
-    
-    // Receive content
-    if (receive_message(ss_sock, &response) == 0 && response.error_code == ERR_SUCCESS) {
-        printf("%s\n", response.data);
-    } else {
-        printf("ERROR: %s\n", response.data);
+    if (nm_request(&msg, location) != 0 || location->error_code != ERR_SUCCESS) {
+        forget_location(filename);
+        return -1;
     }
     
-    close(ss_sock);
+    remember_location(filename, location);
+    return 0;
+}
+
+// READ command
+void cmd_read(const char* filename) {
+    // A cached lease may be stale (file moved, access revoked): retry once via the NM
+    for (int use_cache = 1; use_cache >= 0; use_cache--) {
+        Message response;
+        int cached = lookup_location(MSG_READ_FILE, filename, use_cache, &response);
+        if (cached < 0) {
+            printf("ERROR: %s\n", response.data);
+            return;
+        }
+        
+        // Send read request to SS
+        Message msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.type = MSG_READ_FILE;
+        strcpy(msg.filename, filename); // filename now includes path (e.g., "documents/test.txt")
+        strcpy(msg.username, username);
+        msg.epoch = response.epoch;
+        
+        char ss_ip[INET_ADDRSTRLEN];
+        strcpy(ss_ip, response.ss_ip);
+        int ss_sock = ss_request(ss_ip, response.ss_port, &msg, &response);
+        if (ss_sock == -1) {
+            if (cached) {
+                forget_location(filename);
+                continue;
+            }
+            printf("ERROR: Cannot connect to Storage Server\n");
+            return;
+        }
+        
+        // Receive content
+        int received = ss_sock >= 0;
+        if (received) close(ss_sock);
+        
+        if (cached && (!received || response.error_code == ERR_STALE_EPOCH ||
+                       response.error_code == ERR_FILE_NOT_FOUND)) {
+            forget_location(filename);
+            continue;
+        }
+        
+        if (received && response.error_code == ERR_SUCCESS) {
+            printf("%s\n", response.data);
+        } else {
+            printf("ERROR: %s\n", response.data);
+        }
+        return;
+    }
 }
 
 // CREATE command
@@ -189,10 +548,8 @@ void cmd_create(const char* filename) {
     strcpy(msg.username, username);
     strcpy(msg.filename, filename);
     
-    send_message(nm_sock, &msg);
-    
     Message response;
-    if (receive_message(nm_sock, &response) == 0) {
+    if (nm_request(&msg, &response) == 0) {
         printf("%s\n", response.data);
     } else {
         printf("ERROR: Communication failed\n");
@@ -209,34 +566,33 @@ void cmd_write(const char* filename, int sentence_num) {
     strcpy(msg.filename, filename);
     msg.flags = sentence_num;
     
-    send_message(nm_sock, &msg);
-    
     Message response;
-    if (receive_message(nm_sock, &response) != 0 || response.error_code != ERR_SUCCESS) {
+    if (nm_request(&msg, &response) != 0 || response.error_code != ERR_SUCCESS) {
         printf("ERROR: %s\n", response.data);
         return;
     }
     
-    // Connect to SS
-    int ss_sock = connect_to_server(response.ss_ip, response.ss_port);
-    if (ss_sock < 0) {
-        printf("ERROR: Cannot connect to Storage Server\n");
-        return;
-    }
-    
     // Send write request
     memset(&msg, 0, sizeof(msg));
     msg.type = MSG_WRITE_FILE;
     strcpy(msg.filename, filename); // filename now includes path (e.g., "documents/test.txt")
     strcpy(msg.username, username);
     msg.flags = sentence_num;
+    msg.epoch = response.epoch;
+    msg.write_seq = response.write_seq;
     
-    send_message(ss_sock, &msg);
+    char ss_ip[INET_ADDRSTRLEN];
+    strcpy(ss_ip, response.ss_ip);
+    int ss_sock = ss_request(ss_ip, response.ss_port, &msg, &response);
+    if (ss_sock == -1) {
+        printf("ERROR: Cannot connect to Storage Server\n");
+        return;
+    }
     
     // Receive lock acknowledgment
-    if (receive_message(ss_sock, &response) != 0 || response.error_code != ERR_SUCCESS) {
-        printf("ERROR: %s\n", response.data);
-        close(ss_sock);
+    if (ss_sock < 0 || response.error_code != ERR_SUCCESS) {
+        printf("ERROR: %s\n", ss_sock < 0 ? "Communication failed" : response.data);
+        if (ss_sock >= 0) close(ss_sock);
         return;
     }
     
@@ -299,10 +655,9 @@ void cmd_delete(const char* filename) {
     strcpy(msg.username, username);
     strcpy(msg.filename, filename);
     
-    send_message(nm_sock, &msg);
-    
+    forget_location(filename);
     Message response;
-    if (receive_message(nm_sock, &response) == 0) {
+    if (nm_request(&msg, &response) == 0) {
         printf("%s\n", response.data);
     } else {
         printf("ERROR: Communication failed\n");
@@ -317,10 +672,8 @@ void cmd_info(const char* filename) {
     strcpy(msg.username, username);
     strcpy(msg.filename, filename);
     
-    send_message(nm_sock, &msg);
-    
     Message response;
-    if (receive_message(nm_sock, &response) == 0) {
+    if (nm_request(&msg, &response) == 0) {
         printf("%s", response.data);
     } else {
         printf("ERROR: Communication failed\n");
@@ -329,53 +682,70 @@ void cmd_info(const char* filename) {
 
 // STREAM command
 void cmd_stream(const char* filename) {
-    // Get SS info from NM
-    Message msg;
-    memset(&msg, 0, sizeof(msg));
-    msg.type = MSG_STREAM_FILE;
-    strcpy(msg.username, username);
-    strcpy(msg.filename, filename);
-    
-    send_message(nm_sock, &msg);
-    
-    Message response;
-    if (receive_message(nm_sock, &response) != 0 || response.error_code != ERR_SUCCESS) {
-        printf("ERROR: %s\n", response.data);
-        return;
-    }
-    
-    // Connect to SS
-    int ss_sock = connect_to_server(response.ss_ip, response.ss_port);
-    if (ss_sock < 0) {
-        printf("ERROR: Cannot connect to Storage Server\n");
-        return;
-    }
-    
-    // Send stream request
-    memset(&msg, 0, sizeof(msg));
-    msg.type = MSG_STREAM_FILE;
-    strcpy(msg.filename, filename); // filename now includes path (e.g., "documents/test.txt")
-    strcpy(msg.username, username);
-    
-    send_message(ss_sock, &msg);
-    
-    // Receive words
-    while (1) {
-        if (receive_message(ss_sock, &response) != 0) {
-            printf("\nERROR: Storage server disconnected\n");
-            break;
+    for (int use_cache = 1; use_cache >= 0; use_cache--) {
+        Message response;
+        int cached = lookup_location(MSG_STREAM_FILE, filename, use_cache, &response);
+        if (cached < 0) {
+            printf("ERROR: %s\n", response.data);
+            return;
         }
         
-        if (strcmp(response.data, "STOP") == 0) {
-            printf("\n");
-            break;
+        // Send stream request
+        Message msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.type = MSG_STREAM_FILE;
+        strcpy(msg.filename, filename); // filename now includes path (e.g., "documents/test.txt")
+        strcpy(msg.username, username);
+        msg.epoch = response.epoch;
+        
+        char ss_ip[INET_ADDRSTRLEN];
+        strcpy(ss_ip, response.ss_ip);
+        int ss_sock = ss_request(ss_ip, response.ss_port, &msg, &response);
+        if (ss_sock == -1) {
+            if (cached) {
+                forget_location(filename);
+                continue;
+            }
+            printf("ERROR: Cannot connect to Storage Server\n");
+            return;
         }
         
-        printf("%s ", response.data);
-        fflush(stdout);
+        // Receive words; the first one came with the reply to the request
+        int words = 0;
+        int have_word = ss_sock >= 0;
+        while (1) {
+            if (!have_word && (ss_sock < 0 || receive_message(ss_sock, &response) != 0)) {
+                if (cached && words == 0) break;
+                printf("\nERROR: Storage server disconnected\n");
+                break;
+            }
+            
+            if (words == 0 && response.error_code != ERR_SUCCESS) {
+                break;
+            }
+            
+            if (strcmp(response.data, "STOP") == 0) {
+                printf("\n");
+                break;
+            }
+            
+            printf("%s ", response.data);
+            fflush(stdout);
+            words++;
+            have_word = 0;
+        }
+        
+        if (ss_sock >= 0) close(ss_sock);
+        
+        if (words == 0 && cached) {
+            forget_location(filename);
+            continue;
+        }
+        if (words == 0 && response.error_code != ERR_SUCCESS) {
+            printf("ERROR: %s\n", response.data);
+        }
+        return;
     }
-    
-    close(ss_sock);
 }
 
 // LIST command
@@ -385,10 +755,8 @@ void cmd_list() {
     msg.type = MSG_LIST_USERS;
     strcpy(msg.username, username);
     
-    send_message(nm_sock, &msg);
-    
     Message response;
-    if (receive_message(nm_sock, &response) == 0) {
+    if (nm_request(&msg, &response) == 0) {
         printf("%s", response.data);
     } else {
         printf("ERROR: Communication failed\n");
@@ -405,10 +773,8 @@ void cmd_add_access(const char* flag, const char* filename, const char* target_u
     strcpy(msg.target_user, target_user);
     msg.flags = (strcmp(flag, "-R") == 0) ? 1 : 2;
     
-    send_message(nm_sock, &msg);
-    
     Message response;
-    if (receive_message(nm_sock, &response) == 0) {
+    if (nm_request(&msg, &response) == 0) {
         printf("%s\n", response.data);
     } else {
         printf("ERROR: Communication failed\n");
@@ -424,10 +790,8 @@ void cmd_rem_access(const char* filename, const char* target_user) {
     strcpy(msg.filename, filename);
     strcpy(msg.target_user, target_user);
     
-    send_message(nm_sock, &msg);
-    
     Message response;
-    if (receive_message(nm_sock, &response) == 0) {
+    if (nm_request(&msg, &response) == 0) {
         printf("%s\n", response.data);
     } else {
         printf("ERROR: Communication failed\n");
@@ -442,10 +806,8 @@ void cmd_exec(const char* filename) {
     strcpy(msg.username, username);
     strcpy(msg.filename, filename);
     
-    send_message(nm_sock, &msg);
-    
     Message response;
-    if (receive_message(nm_sock, &response) == 0) {
+    if (nm_request(&msg, &response) == 0) {
         if (response.error_code == ERR_SUCCESS) {
             printf("%s", response.data);
         } else {
@@ -465,37 +827,34 @@ void cmd_undo(const char* filename) {
     strcpy(msg.username, username);
     strcpy(msg.filename, filename);
     
-    send_message(nm_sock, &msg);
-    
     Message response;
-    if (receive_message(nm_sock, &response) != 0 || response.error_code != ERR_SUCCESS) {
+    if (nm_request(&msg, &response) != 0 || response.error_code != ERR_SUCCESS) {
         printf("ERROR: %s\n", response.data);
         return;
     }
     
-    // Connect to SS
-    int ss_sock = connect_to_server(response.ss_ip, response.ss_port);
-    if (ss_sock < 0) {
-        printf("ERROR: Cannot connect to Storage Server\n");
-        return;
-    }
-    
     // Send undo request
     memset(&msg, 0, sizeof(msg));
     msg.type = MSG_UNDO_FILE;
     strcpy(msg.filename, filename); // filename now includes path (e.g., "documents/test.txt")
     strcpy(msg.username, username);
+    msg.epoch = response.epoch;
     
-    send_message(ss_sock, &msg);
+    char ss_ip[INET_ADDRSTRLEN];
+    strcpy(ss_ip, response.ss_ip);
+    int ss_sock = ss_request(ss_ip, response.ss_port, &msg, &response);
+    if (ss_sock == -1) {
+        printf("ERROR: Cannot connect to Storage Server\n");
+        return;
+    }
     
     // Receive response
-    if (receive_message(ss_sock, &response) == 0) {
+    if (ss_sock >= 0) {
         printf("%s\n", response.data);
+        close(ss_sock);
     } else {
         printf("ERROR: Communication failed\n");
     }
-    
-    close(ss_sock);
 }
 
 // ═══════════════════════════════════════════════════════════════════
@@ -510,10 +869,8 @@ void cmd_create_folder(const char* foldername) {
     strcpy(msg.username, username);
     strcpy(msg.folder_path, foldername);
     
-    send_message(nm_sock, &msg);
-    
     Message response;
-    if (receive_message(nm_sock, &response) == 0) {
+    if (nm_request(&msg, &response) == 0) {
         printf("%s\n", response.data);
     } else {
         printf("ERROR: Communication failed\n");
@@ -529,10 +886,9 @@ void cmd_move_file(const char* filename, const char* foldername) {
     strcpy(msg.filename, filename);
     strcpy(msg.folder_path, foldername);
     
-    send_message(nm_sock, &msg);
-    
+    forget_location(filename);
     Message response;
-    if (receive_message(nm_sock, &response) == 0) {
+    if (nm_request(&msg, &response) == 0) {
         printf("%s\n", response.data);
     } else {
         printf("ERROR: Communication failed\n");
@@ -547,10 +903,8 @@ void cmd_view_folder(const char* foldername) {
     strcpy(msg.username, username);
     strcpy(msg.folder_path, foldername);
     
-    send_message(nm_sock, &msg);
-    
     Message response;
-    if (receive_message(nm_sock, &response) == 0) {
+    if (nm_request(&msg, &response) == 0) {
         printf("%s", response.data);
     } else {
         printf("ERROR: Communication failed\n");
@@ -566,10 +920,8 @@ void cmd_checkpoint(const char* filename, const char* tag) {
     strcpy(msg.filename, filename);
     strcpy(msg.checkpoint_tag, tag);
     
-    send_message(nm_sock, &msg);
-    
     Message response;
-    if (receive_message(nm_sock, &response) == 0) {
+    if (nm_request(&msg, &response) == 0) {
         printf("%s\n", response.data);
     } else {
         printf("ERROR: Communication failed\n");
@@ -585,10 +937,8 @@ void cmd_view_checkpoint(const char* filename, const char* tag) {
     strcpy(msg.filename, filename);
     strcpy(msg.checkpoint_tag, tag);
     
-    send_message(nm_sock, &msg);
-    
     Message response;
-    if (receive_message(nm_sock, &response) == 0) {
+    if (nm_request(&msg, &response) == 0) {
         if (response.error_code == ERR_SUCCESS) {
             printf("─── Checkpoint '%s' of '%s' ───\n%s\n", tag, filename, response.data);
         } else {
@@ -608,10 +958,8 @@ void cmd_revert_checkpoint(const char* filename, const char* tag) {
     strcpy(msg.filename, filename);
     strcpy(msg.checkpoint_tag, tag);
     
-    send_message(nm_sock, &msg);
-    
     Message response;
-    if (receive_message(nm_sock, &response) == 0) {
+    if (nm_request(&msg, &response) == 0) {
         printf("%s\n", response.data);
     } else {
         printf("ERROR: Communication failed\n");
@@ -626,10 +974,8 @@ void cmd_list_checkpoints(const char* filename) {
     strcpy(msg.username, username);
     strcpy(msg.filename, filename);
     
-    send_message(nm_sock, &msg);
-    
     Message response;
-    if (receive_message(nm_sock, &response) == 0) {
+    if (nm_request(&msg, &response) == 0) {
         printf("%s", response.data);
     } else {
         printf("ERROR: Communication failed\n");
@@ -645,10 +991,8 @@ void cmd_request_access(const char* filename, const char* flag) {
     strcpy(msg.filename, filename);
     msg.flags = (strcmp(flag, "-R") == 0) ? ACCESS_READ : ACCESS_WRITE;
     
-    send_message(nm_sock, &msg);
-    
     Message response;
-    if (receive_message(nm_sock, &response) == 0) {
+    if (nm_request(&msg, &response) == 0) {
         printf("%s\n", response.data);
     } else {
         printf("ERROR: Communication failed\n");
@@ -656,16 +1000,15 @@ void cmd_request_access(const char* filename, const char* flag) {
 }
 
 // VIEWREQUESTS command
-void cmd_view_requests() {
+void cmd_view_requests(int page) {
     Message msg;
     memset(&msg, 0, sizeof(msg));
     msg.type = MSG_VIEW_REQUESTS;
     strcpy(msg.username, username);
-    
-    send_message(nm_sock, &msg);
+    msg.flags = page;
     
     Message response;
-    if (receive_message(nm_sock, &response) == 0) {
+    if (nm_request(&msg, &response) == 0) {
         printf("%s", response.data);
     } else {
         printf("ERROR: Communication failed\n");
@@ -681,10 +1024,8 @@ void cmd_approve_request(const char* requester, const char* filename) {
     strcpy(msg.target_user, requester);
     strcpy(msg.filename, filename);
     
-    send_message(nm_sock, &msg);
-    
     Message response;
-    if (receive_message(nm_sock, &response) == 0) {
+    if (nm_request(&msg, &response) == 0) {
         printf("%s\n", response.data);
     } else {
         printf("ERROR: Communication failed\n");
@@ -700,10 +1041,8 @@ void cmd_deny_request(const char* requester, const char* filename) {
     strcpy(msg.target_user, requester);
     strcpy(msg.filename, filename);
     
-    send_message(nm_sock, &msg);
-    
     Message response;
-    if (receive_message(nm_sock, &response) == 0) {
+    if (nm_request(&msg, &response) == 0) {
         printf("%s\n", response.data);
     } else {
         printf("ERROR: Communication failed\n");
@@ -718,10 +1057,8 @@ void cmd_search(const char* pattern) {
     strcpy(msg.username, username);
     strcpy(msg.data, pattern);
     
-    send_message(nm_sock, &msg);
-    
     Message response;
-    if (receive_message(nm_sock, &response) == 0) {
+    if (nm_request(&msg, &response) == 0) {
         printf("%s", response.data);
     } else {
         printf("ERROR: Communication failed\n");
@@ -735,16 +1072,31 @@ void cmd_metrics() {
     msg.type = MSG_GET_METRICS;
     strcpy(msg.username, username);
     
-    send_message(nm_sock, &msg);
-    
     Message response;
-    if (receive_message(nm_sock, &response) == 0) {
+    if (nm_request(&msg, &response) == 0) {
         printf("%s", response.data);
     } else {
         printf("ERROR: Communication failed\n");
     }
 }
 
+// REPLICATION command
+void cmd_replication(const char* name, int copies) {
+    Message msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = MSG_SET_REPLICATION;
+    strcpy(msg.username, username);
+    strcpy(msg.filename, name);
+    msg.flags = copies;
+    
+    Message response;
+    if (nm_request(&msg, &response) == 0) {
+        printf("%s\n", response.data);
+    } else {
+        printf("ERROR: Communication failed\n");
+    }
+}
+
 // Handle command
 void handle_command(const char* command) {
     char cmd[MAX_BUFFER_SIZE];
@@ -931,7 +1283,8 @@ void handle_command(const char* command) {
         }
     }
     else if (strcasecmp(token, "VIEWREQUESTS") == 0) {
-        cmd_view_requests();
+        char* page = strtok(NULL, " ");
+        cmd_view_requests(page ? atoi(page) : 1);
     }
     else if (strcasecmp(token, "APPROVEREQUEST") == 0) {
         char* requester = strtok(NULL, " ");
@@ -965,6 +1318,15 @@ void handle_command(const char* command) {
     else if (strcasecmp(token, "METRICS") == 0) {
         cmd_metrics();
     }
+    else if (strcasecmp(token, "REPLICATION") == 0) {
+        char* name = strtok(NULL, " ");
+        char* copies = strtok(NULL, " ");
+        if (name && copies) {
+            cmd_replication(name, atoi(copies));
+        } else {
+            printf("ERROR: Usage: REPLICATION <file|folder> <copies>\n");
+        }
+    }
     else {
         printf("ERROR: Unknown command. Type HELP for list of commands.\n");
     }
@@ -977,16 +1339,20 @@ int main(int argc, char *argv[]) {
     
     // Check if IP address is provided as argument
     if (argc < 2) {
-        printf("Usage: %s <name_server_ip>\n", argv[0]);
+        printf("Usage: %s <name_server_ip[:port][,standby_ip[:port]...]>\n", argv[0]);
         printf("Example: %s 10.42.0.238\n", argv[0]);
         return 1;
     }
+    srand((unsigned int)time(NULL) ^ (unsigned int)getpid()); // Backoff jitter
     
-    // Get Name Server IP from command line argument
-    strncpy(nm_ip, argv[1], sizeof(nm_ip) - 1);
-    nm_ip[sizeof(nm_ip) - 1] = '\0';
+    // Get Name Server IP (and any standbys) from command line argument
+    num_name_servers = parse_server_list(argv[1], nm_ips, nm_ports, MAX_NAME_SERVERS, NM_PORT);
+    if (num_name_servers == 0) {
+        printf("Cannot parse name server list '%s'\n", argv[1]);
+        return 1;
+    }
     
-    printf("Connecting to Name Server at: %s:%d\n\n", nm_ip, NM_PORT);
+    printf("Connecting to Name Server at: %s:%d\n\n", nm_ips[0], nm_ports[0]);
     
     // Get username
     printf("Enter username: ");
@@ -1,5 +1,6 @@
 #include "common.h"
 #include <stdarg.h>
+#include <stddef.h>
 
 // Logging utility
 void log_message(const char* component, const char* format, ...) {
@@ -26,7 +27,7 @@ void send_message(int sock, Message* msg) {
     char* ptr = (char*)msg;
     
     while (total_sent < bytes_to_send) {
-        int sent = send(sock, ptr + total_sent, bytes_to_send - total_sent, 0);
+        int sent = send(sock, ptr + total_sent, bytes_to_send - total_sent, MSG_NOSIGNAL);
         if (sent <= 0) {
             log_message("COMMON", "Error sending message: %s", strerror(errno));
             return;
@@ -56,6 +57,77 @@ int receive_message(int sock, Message* msg) {
     return 0;
 }
 
+// Compact framing: fixed fields first, then only data_len bytes of data.
+// Used on long-lived channels where most messages carry little data.
+#define COMPACT_HEAD_SIZE offsetof(Message, data)
+#define COMPACT_TAIL_OFFSET offsetof(Message, data_len)
+#define COMPACT_TAIL_SIZE (sizeof(Message) - COMPACT_TAIL_OFFSET)
+
+static int send_all(int sock, const char* ptr, size_t len) {
+    size_t total_sent = 0;
+    while (total_sent < len) {
+        ssize_t sent = send(sock, ptr + total_sent, len - total_sent, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            log_message("COMMON", "Error sending message: %s", strerror(errno));
+            return -1;
+        }
+        total_sent += sent;
+    }
+    return 0;
+}
+
+static int receive_all(int sock, char* ptr, size_t len) {
+    size_t total_received = 0;
+    while (total_received < len) {
+        ssize_t received = recv(sock, ptr + total_received, len - total_received, 0);
+        if (received <= 0) {
+            if (received == 0) {
+                log_message("COMMON", "Connection closed");
+            } else {
+                log_message("COMMON", "Error receiving message: %s", strerror(errno));
+            }
+            return -1;
+        }
+        total_received += received;
+    }
+    return 0;
+}
+
+// Send message with compact framing
+int send_compact_message(int sock, Message* msg) {
+    if (msg->data_len < 0 || msg->data_len > MAX_BUFFER_SIZE) {
+        msg->data_len = strnlen(msg->data, MAX_BUFFER_SIZE);
+    }
+    
+    if (send_all(sock, (char*)msg, COMPACT_HEAD_SIZE) < 0 ||
+        send_all(sock, (char*)msg + COMPACT_TAIL_OFFSET, COMPACT_TAIL_SIZE) < 0 ||
+        send_all(sock, msg->data, msg->data_len) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Receive message with compact framing
+int receive_compact_message(int sock, Message* msg) {
+    if (receive_all(sock, (char*)msg, COMPACT_HEAD_SIZE) < 0 ||
+        receive_all(sock, (char*)msg + COMPACT_TAIL_OFFSET, COMPACT_TAIL_SIZE) < 0) {
+        return -1;
+    }
+    
+    if (msg->data_len < 0 || msg->data_len > MAX_BUFFER_SIZE) {
+        log_message("COMMON", "Invalid compact message length: %d", msg->data_len);
+        return -1;
+    }
+    
+    if (receive_all(sock, msg->data, msg->data_len) < 0) {
+        return -1;
+    }
+    if (msg->data_len < MAX_BUFFER_SIZE) {
+        msg->data[msg->data_len] = '\0';
+    }
+    return 0;
+}
+
 // Format time for display
 void format_time(time_t time, char* buffer, size_t size) {
     strftime(buffer, size, "%Y-%m-%d %H:%M:%S", localtime(&time));
@@ -124,3 +196,65 @@ int connect_to_server(const char* ip, int port) {
     
     return sock;
 }
+
+// Parse "ip[:port][,ip[:port]...]" (a name server and its standbys) into at
+// most max addresses. Returns how many were read.
+int parse_server_list(const char* list, char ips[][INET_ADDRSTRLEN], int* ports, int max, int default_port) {
+    int count = 0;
+    const char* entry = list;
+    while (*entry && count < max) {
+        const char* end = strchr(entry, ',');
+        size_t len = end ? (size_t)(end - entry) : strlen(entry);
+        
+        char item[64];
+        if (len > 0 && len < sizeof(item)) {
+            memcpy(item, entry, len);
+            item[len] = '\0';
+            char* colon = strchr(item, ':');
+            ports[count] = default_port;
+            if (colon) {
+                *colon = '\0';
+                ports[count] = atoi(colon + 1);
+            }
+            if (strlen(item) < INET_ADDRSTRLEN && ports[count] > 0) {
+                strcpy(ips[count], item);
+                count++;
+            }
+        }
+        
+        if (!end) break;
+        entry = end + 1;
+    }
+    return count;
+}
+
+// Shard owning a file or folder name: a hash of its top-level component, so
+// a folder and everything in it live on one name server
+int shard_of(const char* name, int num_shards) {
+    if (num_shards <= 1) return 0;
+    unsigned int hash = 5381;
+    for (const char* p = name; *p && *p != '/'; p++) {
+        hash = ((hash << 5) + hash) + (unsigned char)*p;
+    }
+    return hash % num_shards;
+}
+
+// Name a client request is routed by, or NULL for requests every shard
+// answers (listings, search, metrics)
+const char* request_shard_name(const Message* msg) {
+    switch (msg->type) {
+        case MSG_VIEW_FILES:
+        case MSG_LIST_USERS:
+        case MSG_VIEW_REQUESTS:
+        case MSG_SEARCH_FILE:
+        case MSG_GET_METRICS:
+        case MSG_REGISTER_CLIENT:
+        case MSG_NM_SHARD_MAP:
+            return NULL;
+        case MSG_CREATE_FOLDER:
+        case MSG_VIEW_FOLDER:
+            return msg->folder_path;
+        default:
+            return msg->filename;
+    }
+}
@@ -21,9 +21,12 @@
 #define MAX_CLIENTS 100
 #define MAX_STORAGE_SERVERS 50
 #define MAX_FILES 10000
+#define MAX_REPLICAS 4 // Copies besides the primary
 #define MAX_SENTENCE_LENGTH 4096
 #define MAX_WORD_LENGTH 256
 #define LRU_CACHE_SIZE 100
+#define MAX_NAME_SERVERS 4 // Primary plus hot standbys a client or SS can fail over to
+#define MAX_NM_SHARDS 8 // Name servers the namespace can be split across
 
 // Error Codes
 #define ERR_SUCCESS 0
@@ -37,6 +40,12 @@
 #define ERR_INVALID_COMMAND 8
 #define ERR_SERVER_ERROR 9
 #define ERR_NO_UNDO_AVAILABLE 10
+#define ERR_STALE_EPOCH 11 // Location lease is older than the file's current epoch
+#define ERR_QUORUM_FAILED 12 // Write committed on the primary but too few replicas acknowledged
+#define ERR_RESYNC_NEEDED 13 // Replica cannot apply a delta and needs the whole file
+#define ERR_WRONG_SHARD 14 // Another name server owns this name; data holds the shard map
+#define ERR_SERVER_BUSY 15 // Overloaded; flags holds a retry-after hint in milliseconds
+#define ERR_STALE_VERSION 16 // Replica already holds a newer version than the update
 
 // Message Types
 #define MSG_REGISTER_SS 100
@@ -70,22 +79,70 @@
 // Bonus: Search and Metrics
 #define MSG_SEARCH_FILE 125
 #define MSG_GET_METRICS 126
+#define MSG_SET_REPLICATION 127
 #define MSG_RESPONSE 200
 #define MSG_SS_CREATE 201
-#define MSG_SS_DELETE 202
+#define MSG_SS_DELETE 202      // flags SS_DELETE_BATCH: data lists one filename per line
 #define MSG_SS_READ 203
 #define MSG_SS_WRITE 204
 #define MSG_SS_STREAM 205
 #define MSG_SS_UNDO 206
 #define MSG_SS_STAT 207
 #define MSG_SS_CHECKPOINT 208
-#define MSG_SS_REPLICATE 209
-#define MSG_HEARTBEAT 210
+#define MSG_SS_REPLICATE 209   // Primary -> NM: send me this file's replica set
+#define MSG_HEARTBEAT 210 // flags = highest name server generation the SS has seen
 #define MSG_SS_CREATE_FOLDER 211
 #define MSG_SS_MOVE_FILE 212
+#define MSG_SS_SEARCH 213
+#define MSG_SS_STAT_BATCH 214
+#define MSG_SS_EXPORT 215
+#define MSG_SS_MIGRATE 216
+#define MSG_SS_EPOCH 217        // flags SS_EPOCH_BATCH: data lists "<epoch> <file>" lines
+#define MSG_SS_SESSION 218   // Open a long-lived SS -> NM channel; flags = highest generation
+                             // seen, the ACK's flags = the name server's own
+#define MSG_SS_REPLICA_SET 219 // NM -> primary: replica addresses and write quorum (flags REPLICA_SET_*)
+#define MSG_SS_REPLICA_PUT 220 // Primary -> replica: committed file content; in chain mode
+                               // folder_path lists the hops still to go ("ip:port ...")
+#define MSG_SS_REPLICA_DELTA 221 // Primary -> replica: splice of the last pushed version,
+                                 // data "<base> <offset> <removed> <hash>\n<text>"
+#define MSG_SS_PEER_SESSION 222  // Open a long-lived SS -> SS replication channel
+#define MSG_SS_MERKLE_ROOT 223   // Primary -> replica: root of the hash tree over shared files;
+                                 // reply flags 1 = match, else data lists the bucket hashes
+#define MSG_SS_MERKLE_BUCKET 224 // Primary -> replica: "<file> <hash>" lines of one bucket (word_index);
+                                 // reply lists the files that differ
+#define MSG_SS_MERKLE_BLOCKS 225 // Primary -> replica: sentence block lengths and hashes of a file
+#define MSG_SS_REPAIR_PATCH 226  // Primary -> replica: "<offset> <removed> <hash>\n<text>" at the
+                                 // primary's version (removed -1 replaces the whole file)
+#define MSG_SS_MANIFEST 227      // SS -> NM: more "<file> <size> <mtime> <hash>" lines after MSG_REGISTER_SS
+#define MSG_SS_ANTI_ENTROPY 228  // NM -> primary: sync your copies on ss_ip:ss_port now
+#define MSG_NM_STANDBY 229       // Standby NM -> primary NM: stream metadata changes to me
+#define MSG_NM_METADATA 230      // Primary NM -> standby: batch of metadata records (none = keepalive);
+                                 // flags = generation, word_index = snapshot begin/end bits
+#define MSG_NM_SHARD_MAP 231     // -> NM: which name servers own which names; reply data is
+                                 // "ip:port,..." in shard order, flags = shard count
+#define MSG_NM_MOVE_PREPARE 232  // NM -> NM: reserve a file moving in from another shard;
+                                 // flags = source shard, word_index = its move sequence number
+#define MSG_NM_MOVE_COMMIT 233   // NM -> NM: the storage servers renamed it, make it visible
+                                 // (repeating a committed move's id succeeds again)
+#define MSG_NM_MOVE_ABORT 234    // NM -> NM: drop the reservation
 #define MSG_ACK 250
 #define MSG_ERROR 255
 
+// MSG_SS_DELETE / MSG_SS_EPOCH flags
+#define SS_DELETE_BATCH 1
+#define SS_EPOCH_BATCH 1
+
+// MSG_SS_REPLICA_SET flags
+#define REPLICA_SET_CHAIN 1 // Writes walk the set in order
+#define REPLICA_SET_RESET 2 // Drop every set held before applying the listed ones
+
+// MSG_SS_EXPORT parts (flags)
+#define EXPORT_FILE 0
+#define EXPORT_UNDO 1
+#define EXPORT_CHECKPOINT_LIST 2
+#define EXPORT_CHECKPOINT 3
+#define EXPORT_CHECKSUM 4
+
 // Access Rights
 #define ACCESS_NONE 0
 #define ACCESS_READ 1
@@ -107,6 +164,10 @@ typedef struct {
     // Bonus fields
     char folder_path[MAX_FILENAME];
     char checkpoint_tag[MAX_USERNAME];
+    // Location leases
+    int epoch;     // File location epoch (0 = not checked)
+    int lease_ttl; // Seconds a client may reuse the returned location
+    int write_seq; // Per-file WRITE counter the NM handed out, echoed in pushed stats
 } Message;
 
 // File metadata structure
@@ -120,7 +181,11 @@ typedef struct {
     int word_count;
     int char_count;
     int ss_index; // Index of storage server
-    int replica_ss_index; // Bonus: replication
+    int replicas[MAX_REPLICAS]; // Replica storage servers, first num_replicas valid
+    int num_replicas;
+    int replication_factor; // Copies wanted, primary included
+    int epoch; // Bumped when the file's location or access changes
+    int writes_issued; // WRITEs handed out; the primary reports the latest it applied
 } FileMetadata;
 
 // User access structure
@@ -137,6 +202,7 @@ typedef struct {
     int is_active;
     time_t last_heartbeat;
     int replica_of; // Bonus: -1 if primary, else index of primary SS
+    int capacity_weight; // Relative capacity used by placement (>= 1)
 } StorageServerInfo;
 
 // Bonus: Access Request structure
@@ -147,20 +213,17 @@ typedef struct {
     time_t request_time;
 } AccessRequest;
 
-// Bonus: Checkpoint structure
-typedef struct {
-    char filename[MAX_FILENAME];
-    char tag[MAX_USERNAME];
-    char content[MAX_BUFFER_SIZE];
-    time_t created;
-} Checkpoint;
-
 // Utility functions
 void log_message(const char* component, const char* format, ...);
 void send_message(int sock, Message* msg);
 int receive_message(int sock, Message* msg);
+int send_compact_message(int sock, Message* msg);
+int receive_compact_message(int sock, Message* msg);
 void format_time(time_t time, char* buffer, size_t size);
 int create_socket(int port);
 int connect_to_server(const char* ip, int port);
+int parse_server_list(const char* list, char ips[][INET_ADDRSTRLEN], int* ports, int max, int default_port);
+int shard_of(const char* name, int num_shards);
+const char* request_shard_name(const Message* msg);
 
 #endif
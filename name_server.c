@@ -1,15 +1,39 @@
 #include "common.h"
 #include <signal.h>
 #include <stdarg.h>
+#include <math.h>
+#include <stdint.h>
+#include <stddef.h>
 
 #define NM_PORT 8080
 #define METADATA_FILE "nm_metadata.dat"
+#define METADATA_MAGIC "NMMD"
+#define METADATA_VERSION 1 // Bump when FileMetadata or the record layout changes
+#define STAT_REPLY_EXTRA 80 // Bytes a MSG_SS_STAT_BATCH reply line adds to the filename (counts, mtime, hash, write seq)
 
 // Global data structures
+// One checkpoint of a file, as recorded when it was created
+typedef struct {
+    char tag[MAX_USERNAME];
+    time_t created;
+    long size;
+    unsigned long long hash; // Content hash of the checkpointed copy
+} CheckpointInfo;
+
 typedef struct FileNode {
     FileMetadata metadata;
     UserAccess* access_list;
     int access_count;
+    time_t stats_updated; // When the primary SS last pushed word/char counts (0 = never)
+    int writes_seen; // Highest metadata.writes_issued value the primary has reported applying
+    unsigned long long primary_hash; // Content hashes last reported by primary and replicas
+    unsigned long long replica_hash[MAX_REPLICAS]; // (0 = unknown), by replica slot
+    time_t replica_fresh_at[MAX_REPLICAS]; // Last time each replica was known to match the primary
+    int repair_queued; // In the re-replication queue
+    int replica_set_dirty; // Primary has not been sent the current replica set
+    CheckpointInfo* checkpoint_list;
+    int checkpoint_count;
+    int checkpoints_known; // checkpoint_list is complete (0 = ask the primary SS once)
     struct FileNode* next;
 } FileNode;
 
@@ -56,19 +80,13 @@ typedef struct FolderNode {
     char foldername[MAX_FILENAME];
     char owner[MAX_USERNAME];
     time_t created;
+    int replication_factor; // Copies for files moved in, 0 = server default
     struct FolderNode* next;
 } FolderNode;
 FolderNode* folder_list = NULL;
 
-// Bonus: Checkpoints (reduce size)
-Checkpoint* checkpoints = NULL;
+// Bonus: Checkpoints, catalogued per file
 int num_checkpoints = 0;
-int max_checkpoints = 100;
-
-// Bonus: Access Requests (reduce size)
-AccessRequest* access_requests = NULL;
-int num_access_requests = 0;
-int max_access_requests = 50;
 
 // Bonus: System metrics
 typedef struct {
@@ -88,16 +106,25 @@ void cache_put(const char* filename, FileNode* file);
 unsigned int hash_function(const char* str);
 FileNode* find_file(const char* filename);
 void add_file(FileMetadata* metadata);
+void reset_replica_freshness(FileNode* file);
 int get_user_access(FileNode* file, const char* username);
 void* handle_client(void* arg);
 void* handle_storage_server(void* arg);
 void save_metadata();
 void load_metadata();
+void save_server_table();
+void load_server_table();
+void save_checkpoint_catalog();
+void load_checkpoint_catalog();
+void request_metadata_ship();
+void drop_file_requests(const char* owner, const char* filename);
+void handle_standby_join(int standby_sock, Message* msg);
 void log_to_file(const char* format, ...);
 // Bonus function prototypes
 void handle_create_folder(int client_sock, Message* msg);
 void handle_move_file(int client_sock, Message* msg);
 void handle_view_folder(int client_sock, Message* msg);
+void handle_set_replication(int client_sock, Message* msg);
 void handle_checkpoint(int client_sock, Message* msg);
 void handle_view_checkpoint(int client_sock, Message* msg);
 void handle_revert_checkpoint(int client_sock, Message* msg);
@@ -113,7 +140,8 @@ int count_folders();
 // Bonus: Fault tolerance
 void* monitor_storage_servers(void* arg);
 void handle_heartbeat(Message* msg);
-void handle_replication_request(int client_sock, Message* msg);
+void handle_replica_set_request(int client_sock, Message* msg);
+void handle_ss_session(int ss_sock, Message* msg);
 
 // Initialize LRU cache
 void init_cache() {
@@ -208,6 +236,14 @@ void add_file(FileMetadata* metadata) {
     memcpy(&node->metadata, metadata, sizeof(FileMetadata));
     node->access_list = NULL;
     node->access_count = 0;
+    node->stats_updated = 0;
+    node->writes_seen = 0;
+    reset_replica_freshness(node);
+    node->repair_queued = 0;
+    node->replica_set_dirty = 0;
+    node->checkpoint_list = NULL;
+    node->checkpoint_count = 0;
+    node->checkpoints_known = 1; // A new file has none
     node->next = NULL;
     
     // Add owner with full access
@@ -234,6 +270,92 @@ void add_file(FileMetadata* metadata) {
     file_list = node;
 }
 
+// Add a file with a ready access list (taken over by the node), as read
+// back from disk or shipped from the primary name server
+FileNode* insert_file_node(FileMetadata* metadata, int access_count, UserAccess* access_list) {
+    FileNode* node = (FileNode*)malloc(sizeof(FileNode));
+    if (!node) {
+        free(access_list);
+        return NULL;
+    }
+    memcpy(&node->metadata, metadata, sizeof(FileMetadata));
+    node->access_count = access_count;
+    node->access_list = access_list;
+    node->stats_updated = 0; // Persisted counts are served until the SS pushes new ones
+    node->writes_seen = 0;
+    reset_replica_freshness(node);
+    node->repair_queued = 0;
+    node->replica_set_dirty = 0;
+    node->checkpoint_list = NULL;
+    node->checkpoint_count = 0;
+    node->checkpoints_known = 0; // Until the catalog is loaded, or the primary is asked
+    
+    node->next = file_list;
+    file_list = node;
+    
+    // Add to hash table
+    unsigned int index = hash_function(metadata->filename);
+    if (file_hash[index] == NULL) {
+        HashEntry* entry = (HashEntry*)malloc(sizeof(HashEntry));
+        strcpy(entry->key, metadata->filename);
+        entry->file = node;
+        file_hash[index] = entry;
+    }
+    return node;
+}
+
+// find_file without the cache (and its logging), for bulk updates
+FileNode* lookup_file_node(const char* filename) {
+    unsigned int index = hash_function(filename);
+    if (!file_hash[index]) return NULL;
+    if (strcmp(file_hash[index]->key, filename) == 0) return file_hash[index]->file;
+    
+    for (FileNode* current = file_list; current; current = current->next) {
+        if (strcmp(current->metadata.filename, filename) == 0) return current;
+    }
+    return NULL;
+}
+
+// Drop a file from the list, the hash table and the cache, along with
+// its pending access requests
+void remove_file_node(const char* filename) {
+    // Clear from cache
+    unsigned int cache_index = hash_function(filename) % LRU_CACHE_SIZE;
+    if (cache.cache_map[cache_index] && 
+        strcmp(cache.cache_map[cache_index]->key, filename) == 0) {
+        free(cache.cache_map[cache_index]);
+        cache.cache_map[cache_index] = NULL;
+    }
+    
+    // Remove from hash table
+    unsigned int index = hash_function(filename);
+    if (file_hash[index] && strcmp(file_hash[index]->key, filename) == 0) {
+        free(file_hash[index]);
+        file_hash[index] = NULL;
+    }
+    
+    // Remove from linked list
+    FileNode* prev = NULL;
+    FileNode* current = file_list;
+    while (current) {
+        if (strcmp(current->metadata.filename, filename) == 0) {
+            if (prev) {
+                prev->next = current->next;
+            } else {
+                file_list = current->next;
+            }
+            drop_file_requests(current->metadata.owner, filename);
+            num_checkpoints -= current->checkpoint_count;
+            free(current->checkpoint_list);
+            free(current->access_list);
+            free(current);
+            break;
+        }
+        prev = current;
+        current = current->next;
+    }
+}
+
 // Get user access rights
 int get_user_access(FileNode* file, const char* username) {
     for (int i = 0; i < file->access_count; i++) {
@@ -244,30 +366,299 @@ int get_user_access(FileNode* file, const char* username) {
     return ACCESS_NONE;
 }
 
-// Update file statistics from Storage Server
-void update_file_stats(FileNode* file) {
-    if (!file || file->metadata.ss_index >= num_storage_servers) return;
+// One request/response exchange with a storage server's NM port
+typedef struct {
+    char ip[INET_ADDRSTRLEN];
+    int port;
+    Message request;
+    Message response;
+    int ok; // 1 if a response was received
+} SSCall;
+
+void* ss_call_thread(void* arg) {
+    SSCall* call = (SSCall*)arg;
+    call->ok = 0;
     
-    int ss_index = file->metadata.ss_index;
-    int ss_sock = connect_to_server(storage_servers[ss_index].ip, 
-        storage_servers[ss_index].nm_port);
+    int ss_sock = connect_to_server(call->ip, call->port);
+    if (ss_sock < 0) return NULL;
     
-    if (ss_sock < 0) return;
+    send_message(ss_sock, &call->request);
+    if (receive_message(ss_sock, &call->response) == 0) {
+        call->ok = 1;
+    }
     
-    Message msg;
-    memset(&msg, 0, sizeof(msg));
-    msg.type = MSG_SS_STAT;
-    strcpy(msg.filename, file->metadata.filename);
+    close(ss_sock);
+    return NULL;
+}
+
+// Run several storage server calls concurrently and wait for all of them.
+// Must be called without data_mutex held.
+void ss_call_parallel(SSCall* calls, int count) {
+    pthread_t* threads = (pthread_t*)malloc(count * sizeof(pthread_t));
+    int* started = (int*)calloc(count, sizeof(int));
+    
+    for (int i = 0; i < count; i++) {
+        if (threads && started && pthread_create(&threads[i], NULL, ss_call_thread, &calls[i]) == 0) {
+            started[i] = 1;
+        } else {
+            ss_call_thread(&calls[i]); // Fall back to a synchronous call
+        }
+    }
     
-    send_message(ss_sock, &msg);
+    for (int i = 0; i < count; i++) {
+        if (started && started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
     
-    Message response;
-    if (receive_message(ss_sock, &response) == 0 && response.error_code == ERR_SUCCESS) {
-        // Response data contains: word_count char_count
-        sscanf(response.data, "%d %d", &file->metadata.word_count, &file->metadata.char_count);
+    free(threads);
+    free(started);
+}
+
+// Line-per-item requests bound for storage servers (MSG_SS_DELETE and
+// MSG_SS_EPOCH batches): one request per server, split when it fills a message
+typedef struct {
+    int type;
+    int flags;
+    SSCall* calls;
+    int count;
+    int capacity;
+    int items;                          // Lines queued in all batches
+    int open_call[MAX_STORAGE_SERVERS]; // Batch still taking lines, -1 = none
+} SSBatch;
+
+void ss_batch_init(SSBatch* batch, int type, int flags) {
+    memset(batch, 0, sizeof(*batch));
+    batch->type = type;
+    batch->flags = flags;
+    for (int i = 0; i < MAX_STORAGE_SERVERS; i++) batch->open_call[i] = -1;
+}
+
+// Queue one line for ss_index (data_mutex held). Returns -1 when out of memory.
+int ss_batch_add(SSBatch* batch, int ss_index, const char* line) {
+    int line_len = strlen(line) + 1;
+    int c = batch->open_call[ss_index];
+    if (c < 0 || batch->calls[c].request.data_len + line_len >= MAX_BUFFER_SIZE) {
+        if (batch->count == batch->capacity) {
+            int capacity = batch->capacity ? batch->capacity * 2 : 4;
+            SSCall* grown = (SSCall*)realloc(batch->calls, capacity * sizeof(SSCall));
+            if (!grown) return -1;
+            batch->calls = grown;
+            batch->capacity = capacity;
+        }
+        c = batch->count++;
+        memset(&batch->calls[c], 0, sizeof(SSCall));
+        strcpy(batch->calls[c].ip, storage_servers[ss_index].ip);
+        batch->calls[c].port = storage_servers[ss_index].nm_port;
+        batch->calls[c].request.type = batch->type;
+        batch->calls[c].request.flags = batch->flags;
+        batch->open_call[ss_index] = c;
     }
     
-    close(ss_sock);
+    SSCall* call = &batch->calls[c];
+    sprintf(call->request.data + call->request.data_len, "%s\n", line);
+    call->request.data_len += line_len;
+    batch->items++;
+    return 0;
+}
+
+// Send every batch in parallel and free them. Must be called without
+// data_mutex held.
+void ss_batch_send(SSBatch* batch) {
+    if (batch->count > 0) ss_call_parallel(batch->calls, batch->count);
+    free(batch->calls);
+    batch->calls = NULL;
+    batch->count = batch->capacity = 0;
+}
+
+// Pushed stats are missing (never reported since NM start) or predate the
+// latest WRITE the NM handed out. WRITEs are counted rather than timed, so
+// one handed out in the same second as the last push still counts.
+int stats_are_stale(FileNode* file) {
+    return file->stats_updated == 0 || file->writes_seen < file->metadata.writes_issued;
+}
+
+// A new or restarted primary has no WRITE counter for the file: its next
+// report is taken as current for every WRITE handed out so far
+void rebase_write_counter(FileNode* file) {
+    file->writes_seen = file->metadata.writes_issued;
+    file->stats_updated = 0;
+}
+
+// Replicas whose hash matches the primary's were current at `now`
+void note_replicas_current(FileNode* file, time_t now) {
+    for (int slot = 0; slot < file->metadata.num_replicas; slot++) {
+        if (file->replica_hash[slot] != 0 && file->replica_hash[slot] == file->primary_hash) {
+            file->replica_fresh_at[slot] = now;
+        }
+    }
+}
+
+// Forget what we know about the copies, e.g. after primary/replicas changed
+void reset_replica_freshness(FileNode* file) {
+    file->primary_hash = 0;
+    memset(file->replica_hash, 0, sizeof(file->replica_hash));
+    memset(file->replica_fresh_at, 0, sizeof(file->replica_fresh_at));
+}
+
+// ── Replica sets ──
+
+int default_replication = 2; // Copies per new file, primary included
+int write_quorum = 1;        // Copies that must hold a WRITE before the client hears back
+int chain_replication = 0;   // Writes flow primary -> replicas[0] -> ... -> tail, reads hit the tail
+
+// Copies the file should have, primary included
+int replication_target(FileNode* file) {
+    int factor = file->metadata.replication_factor > 0 ? file->metadata.replication_factor : default_replication;
+    if (factor < 1) factor = 1;
+    if (factor > MAX_REPLICAS + 1) factor = MAX_REPLICAS + 1;
+    return factor;
+}
+
+// Copies that must hold a WRITE, primary included, before the client is answered.
+// A chain write is complete only once it reaches the tail.
+int file_write_quorum(FileNode* file) {
+    if (chain_replication) return 1 + file->metadata.num_replicas;
+    int target = replication_target(file);
+    int quorum = write_quorum < 1 ? 1 : write_quorum;
+    return quorum < target ? quorum : target;
+}
+
+// Slot of ss_index in the file's replica set, -1 if it holds no replica
+int replica_slot(FileNode* file, int ss_index) {
+    for (int slot = 0; slot < file->metadata.num_replicas; slot++) {
+        if (file->metadata.replicas[slot] == ss_index) return slot;
+    }
+    return -1;
+}
+
+int holds_copy(FileNode* file, int ss_index) {
+    return file->metadata.ss_index == ss_index || replica_slot(file, ss_index) >= 0;
+}
+
+int add_replica(FileNode* file, int ss_index) {
+    if (file->metadata.num_replicas >= MAX_REPLICAS || holds_copy(file, ss_index)) return -1;
+    int slot = file->metadata.num_replicas++;
+    file->metadata.replicas[slot] = ss_index;
+    file->replica_hash[slot] = 0;
+    file->replica_fresh_at[slot] = 0;
+    return slot;
+}
+
+void remove_replica(FileNode* file, int slot) {
+    for (int i = slot; i < file->metadata.num_replicas - 1; i++) {
+        file->metadata.replicas[i] = file->metadata.replicas[i + 1];
+        file->replica_hash[i] = file->replica_hash[i + 1];
+        file->replica_fresh_at[i] = file->replica_fresh_at[i + 1];
+    }
+    file->metadata.num_replicas--;
+}
+
+// The repair thread also delivers replica sets to primaries
+pthread_cond_t repair_cond = PTHREAD_COND_INITIALIZER;
+int replica_sets_pending = 0;
+int replica_sets_reset[MAX_STORAGE_SERVERS]; // Server must drop all its sets before new ones
+
+// Queue the file's replica set for its primary (data_mutex held)
+void mark_replica_set_dirty(FileNode* file) {
+    file->replica_set_dirty = 1;
+    replica_sets_pending = 1;
+    pthread_cond_signal(&repair_cond);
+}
+
+// Refresh stale word/char counts with one MSG_SS_STAT_BATCH per storage server
+// (split so every reply fits in one message), issued in parallel.
+// With only_file set just that file is considered, otherwise every file the
+// user may see. Must be called without data_mutex held.
+void refresh_stale_stats(const char* only_file, const char* username, int show_all) {
+    SSCall* calls = NULL;
+    int call_count = 0;
+    int call_capacity = 0;
+    int open_call[MAX_STORAGE_SERVERS];
+    int reply_bytes[MAX_STORAGE_SERVERS]; // Worst-case reply size of the open call
+    for (int i = 0; i < MAX_STORAGE_SERVERS; i++) open_call[i] = -1;
+    
+    pthread_mutex_lock(&data_mutex);
+    for (FileNode* file = file_list; file; file = file->next) {
+        if (only_file && strcmp(file->metadata.filename, only_file) != 0) continue;
+        if (!show_all && get_user_access(file, username) == ACCESS_NONE) continue;
+        if (!stats_are_stale(file)) continue;
+        
+        int ss_index = file->metadata.ss_index;
+        if (ss_index < 0 || ss_index >= num_storage_servers || !storage_servers[ss_index].is_active) {
+            continue;
+        }
+        
+        int name_len = strlen(file->metadata.filename) + 1;
+        int c = open_call[ss_index];
+        if (c < 0 || reply_bytes[ss_index] + name_len + STAT_REPLY_EXTRA >= MAX_BUFFER_SIZE) {
+            if (call_count == call_capacity) {
+                int capacity = call_capacity ? call_capacity * 2 : 8;
+                SSCall* grown = (SSCall*)realloc(calls, capacity * sizeof(SSCall));
+                if (!grown) break;
+                calls = grown;
+                call_capacity = capacity;
+            }
+            c = call_count++;
+            memset(&calls[c], 0, sizeof(SSCall));
+            strcpy(calls[c].ip, storage_servers[ss_index].ip);
+            calls[c].port = storage_servers[ss_index].nm_port;
+            calls[c].request.type = MSG_SS_STAT_BATCH;
+            open_call[ss_index] = c;
+            reply_bytes[ss_index] = 0;
+        }
+        
+        sprintf(calls[c].request.data + calls[c].request.data_len, "%s\n", file->metadata.filename);
+        calls[c].request.data_len += name_len;
+        reply_bytes[ss_index] += name_len + STAT_REPLY_EXTRA;
+    }
+    pthread_mutex_unlock(&data_mutex);
+    
+    if (call_count == 0) {
+        free(calls);
+        return;
+    }
+    
+    ss_call_parallel(calls, call_count);
+    
+    pthread_mutex_lock(&data_mutex);
+    time_t now = time(NULL);
+    int refreshed = 0;
+    for (int i = 0; i < call_count; i++) {
+        if (!calls[i].ok || calls[i].response.error_code != ERR_SUCCESS) continue;
+        
+        char* saveptr;
+        char* line = strtok_r(calls[i].response.data, "\n", &saveptr);
+        while (line) {
+            char filename[MAX_FILENAME];
+            int word_count, char_count;
+            long modified;
+            unsigned long long hash = 0;
+            int write_seq = 0;
+            if (sscanf(line, "%255s %d %d %ld %llx %d", filename, &word_count, &char_count, &modified, &hash,
+                       &write_seq) >= 4 &&
+                word_count >= 0) {
+                FileNode* file = find_file(filename);
+                if (file) {
+                    note_replicas_current(file, now);
+                    file->primary_hash = hash;
+                    file->metadata.word_count = word_count;
+                    file->metadata.char_count = char_count;
+                    if ((time_t)modified > file->metadata.last_modified) {
+                        file->metadata.last_modified = (time_t)modified;
+                    }
+                    if (write_seq > file->writes_seen) file->writes_seen = write_seq;
+                    file->stats_updated = now;
+                    refreshed++;
+                }
+            }
+            line = strtok_r(NULL, "\n", &saveptr);
+        }
+    }
+    pthread_mutex_unlock(&data_mutex);
+    
+    log_message("NM", "Refreshed %d file stat(s) with %d batch RPC(s)", refreshed, call_count);
+    free(calls);
 }
 
 // Log to file with timestamp
@@ -292,11 +683,16 @@ void log_to_file(const char* format, ...) {
 
 // Handle VIEW command
 void handle_view(int client_sock, Message* msg) {
-    pthread_mutex_lock(&data_mutex);
-    
     int show_all = (msg->flags & 1);
     int show_details = (msg->flags & 2);
     
+    // Counts never pushed (or lagging a WRITE) are fetched in batches first
+    if (show_details) {
+        refresh_stale_stats(NULL, msg->username, show_all);
+    }
+    
+    pthread_mutex_lock(&data_mutex);
+    
     Message response;
     memset(&response, 0, sizeof(response));
     response.type = MSG_RESPONSE;
@@ -312,17 +708,21 @@ void handle_view(int client_sock, Message* msg) {
             "|------------|-------|-------|------------------|-------|\n");
     }
     
+    time_t oldest_stats = 0;
+    int unreported_stats = 0;
+    
     FileNode* current = file_list;
     while (current && offset < MAX_BUFFER_SIZE - 1024) {
         int access = get_user_access(current, msg->username);
         
         if (show_all || access != ACCESS_NONE) {
-            // Update stats if showing details
-            if (show_details) {
-                update_file_stats(current);
-            }
-            
             if (show_details) {
+                if (current->stats_updated == 0) {
+                    unreported_stats++;
+                } else if (oldest_stats == 0 || current->stats_updated < oldest_stats) {
+                    oldest_stats = current->stats_updated;
+                }
+                
                 char time_str[32];
                 format_time(current->metadata.last_accessed, time_str, sizeof(time_str));
                 offset += sprintf(buffer + offset, "| %-10s | %5d | %5d | %16s | %5s |\n",
@@ -341,6 +741,16 @@ void handle_view(int client_sock, Message* msg) {
     if (show_details) {
         offset += sprintf(buffer + offset, 
             "---------------------------------------------------------\n");
+        
+        // Counts are served from the values storage servers push with heartbeats
+        if (oldest_stats > 0) {
+            char stats_str[32];
+            format_time(oldest_stats, stats_str, sizeof(stats_str));
+            offset += sprintf(buffer + offset, "(word/char counts as of %s or later)\n", stats_str);
+        } else if (unreported_stats > 0) {
+            offset += sprintf(buffer + offset, "(%d file(s) have counts from saved metadata only)\n",
+                unreported_stats);
+        }
     }
     
     strcpy(response.data, buffer);
@@ -354,6 +764,8 @@ void handle_view(int client_sock, Message* msg) {
 
 // Handle INFO command
 void handle_info(int client_sock, Message* msg) {
+    refresh_stale_stats(msg->filename, msg->username, 0);
+    
     pthread_mutex_lock(&data_mutex);
     
     FileNode* file = find_file(msg->filename);
@@ -371,12 +783,9 @@ void handle_info(int client_sock, Message* msg) {
             response.error_code = ERR_UNAUTHORIZED;
             strcpy(response.data, "ERROR: Unauthorized access");
         } else {
-            // Update file stats first
-            update_file_stats(file);
-            
             response.error_code = ERR_SUCCESS;
             char buffer[MAX_BUFFER_SIZE];
-            char created_str[32], modified_str[32], accessed_str[32];
+            char created_str[32], modified_str[32], accessed_str[32], stats_str[64];
             
             format_time(file->metadata.created, created_str, sizeof(created_str));
             format_time(file->metadata.last_modified, modified_str, sizeof(modified_str));
@@ -404,6 +813,15 @@ void handle_info(int client_sock, Message* msg) {
             offset += sprintf(buffer + offset, "\n--> Last Accessed: %s by %s\n",
                 accessed_str, file->metadata.owner);
             
+            // Counts are pushed by the storage server; say how fresh they are
+            if (file->stats_updated > 0) {
+                format_time(file->stats_updated, stats_str, sizeof(stats_str));
+            } else {
+                strcpy(stats_str, "not yet reported (saved metadata)");
+            }
+            offset += sprintf(buffer + offset, "--> Words: %d, Stats As Of: %s\n",
+                file->metadata.word_count, stats_str);
+            
             strcpy(response.data, buffer);
             response.data_len = strlen(buffer);
         }
@@ -489,8 +907,48 @@ void handle_list_users(int client_sock, Message* msg) {
     log_to_file("LIST USERS request from %s", msg->username);
 }
 
+// ═══════════════════════════════════════════════════════════════════
+// LOCATION LEASES - Epochs that let clients cache file locations
+// ═══════════════════════════════════════════════════════════════════
+
+// Clients may reuse a READ/STREAM location this long without asking the NM.
+// Storage servers reject leases whose epoch is older than the file's, so
+// moves and access revocations take effect on the next request anyway.
+#define LOCATION_LEASE_SECONDS 30
+
+int location_epoch = 0; // Highest epoch handed out; epochs are unique across files
+
+// Give a file a new epoch (data_mutex held)
+int bump_file_epoch(FileNode* file) {
+    file->metadata.epoch = ++location_epoch;
+    return file->metadata.epoch;
+}
+
+// Tell a storage server about a file's new epoch so older leases are refused.
+// Must be called without data_mutex held.
+void push_file_epoch(const char* ip, int port, const char* filename, int epoch) {
+    int ss_sock = connect_to_server(ip, port);
+    if (ss_sock < 0) return;
+    
+    Message msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = MSG_SS_EPOCH;
+    strcpy(msg.filename, filename);
+    msg.epoch = epoch;
+    send_message(ss_sock, &msg);
+    
+    Message response;
+    receive_message(ss_sock, &response);
+    close(ss_sock);
+}
+
 // Handle access control commands
 void handle_access_control(int client_sock, Message* msg) {
+    char revoke_ip[2][INET_ADDRSTRLEN];
+    int revoke_port[2];
+    int revoke_count = 0;
+    int revoke_epoch = 0;
+    
     pthread_mutex_lock(&data_mutex);
     
     FileNode* file = find_file(msg->filename);
@@ -545,6 +1003,20 @@ void handle_access_control(int client_sock, Message* msg) {
                 }
                 file->access_count--;
                 strcpy(response.data, "Access removed successfully!");
+                
+                // Invalidate leases the user may still hold on primary and replica
+                revoke_epoch = bump_file_epoch(file);
+                int holders[MAX_REPLICAS + 1];
+                holders[0] = file->metadata.ss_index;
+                memcpy(holders + 1, file->metadata.replicas, file->metadata.num_replicas * sizeof(int));
+                for (int i = 0; i < file->metadata.num_replicas + 1; i++) {
+                    if (holders[i] >= 0 && holders[i] < num_storage_servers &&
+                        storage_servers[holders[i]].is_active) {
+                        strcpy(revoke_ip[revoke_count], storage_servers[holders[i]].ip);
+                        revoke_port[revoke_count] = storage_servers[holders[i]].nm_port;
+                        revoke_count++;
+                    }
+                }
             } else {
                 response.error_code = ERR_INVALID_COMMAND;
                 strcpy(response.data, "ERROR: Cannot remove owner access or user not found");
@@ -556,91 +1028,3538 @@ void handle_access_control(int client_sock, Message* msg) {
     
     pthread_mutex_unlock(&data_mutex);
     
+    for (int i = 0; i < revoke_count; i++) {
+        push_file_epoch(revoke_ip[i], revoke_port[i], msg->filename, revoke_epoch);
+    }
+    
     send_message(client_sock, &response);
     log_to_file("ACCESS CONTROL from %s for file %s, target %s", 
         msg->username, msg->filename, msg->target_user);
 }
 
-// Handle CREATE command
-void handle_create(int client_sock, Message* msg) {
-    pthread_mutex_lock(&data_mutex);
-    
-    FileNode* existing = find_file(msg->filename);
-    
-    Message response;
-    memset(&response, 0, sizeof(response));
-    response.type = MSG_RESPONSE;
-    
-    if (existing) {
-        response.error_code = ERR_FILE_EXISTS;
-        strcpy(response.data, "ERROR: File already exists");
-        pthread_mutex_unlock(&data_mutex);
-        send_message(client_sock, &response);
-        return;
+// ═══════════════════════════════════════════════════════════════════
+// FAILURE DETECTOR - Phi-accrual suspicion from heartbeat arrival times
+// ═══════════════════════════════════════════════════════════════════
+
+#define PHI_WINDOW 100            // Inter-arrival samples kept per server
+#define PHI_MIN_SAMPLES 5         // Fewer than this: fall back to the fixed timeout
+#define PHI_MIN_STDDEV_MS 100.0   // Keeps a very regular sender from failing on small jitter
+#define PHI_SUSPECT 3.0           // Steer reads and new files away
+#define PHI_FAIL 8.0              // Declare dead and fail over
+#define PHI_FALLBACK_TIMEOUT 30   // Seconds without heartbeats when phi is unknown
+#define MONITOR_INTERVAL_MS 100
+#define MONITOR_STALL_MS 1000     // A tick this late means the NM stalled, not the servers
+
+typedef struct {
+    double intervals[PHI_WINDOW]; // Milliseconds between consecutive heartbeats
+    int next;                     // Ring slot for the next interval
+    int count;
+    double last_arrival_ms;       // 0 = no heartbeat since (re)start
+    int suspect;
+    int session_lost;             // Its session closed; suspect until it pulses again
+} FailureDetector;
+
+FailureDetector detectors[MAX_STORAGE_SERVERS];
+
+double monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// Forget arrival history, e.g. when a dead server comes back and the gap
+// would otherwise be learned as a normal interval
+void detector_reset(int ss_index) {
+    memset(&detectors[ss_index], 0, sizeof(FailureDetector));
+}
+
+// Record a heartbeat arrival (data_mutex held)
+void detector_heartbeat(int ss_index, double now_ms) {
+    FailureDetector* detector = &detectors[ss_index];
+    if (detector->last_arrival_ms > 0) {
+        detector->intervals[detector->next] = now_ms - detector->last_arrival_ms;
+        detector->next = (detector->next + 1) % PHI_WINDOW;
+        if (detector->count < PHI_WINDOW) detector->count++;
     }
+    detector->last_arrival_ms = now_ms;
     
-    // Find available storage server - RANDOM assignment for load balancing
-    int ss_index = -1;
-    int replica_ss_index = -1;
-    
-    if (num_storage_servers >= 2) {
-        // Use filename as seed for randomness (consistent for same file)
-        srand(time(NULL) + (unsigned int)strlen(msg->filename));
-        
-        // Randomly select primary
-        int primary_idx = rand() % num_storage_servers;
-        
-        // Find first active server starting from random position
-        for (int i = 0; i < num_storage_servers; i++) {
-            int idx = (primary_idx + i) % num_storage_servers;
-            if (storage_servers[idx].is_active) {
-                ss_index = idx;
-                break;
-            }
-        }
-        
-        // Randomly select secondary (different from primary)
-        if (ss_index >= 0) {
-            int secondary_idx = (ss_index + 1 + (rand() % (num_storage_servers - 1))) % num_storage_servers;
-            
-            for (int i = 0; i < num_storage_servers; i++) {
-                int idx = (secondary_idx + i) % num_storage_servers;
-                if (idx != ss_index && storage_servers[idx].is_active) {
-                    replica_ss_index = idx;
-                    break;
-                }
+    if (detector->suspect || detector->session_lost) {
+        log_message("NM", "Storage Server SS%d is no longer suspect", ss_index);
+    }
+    detector->suspect = 0;
+    detector->session_lost = 0;
+}
+
+// Suspicion that the server is down: -log10 of the probability that a
+// heartbeat arrives this late, under a normal fit of recent intervals.
+// Returns -1 when there is too little history to judge.
+double detector_phi(int ss_index, double now_ms) {
+    FailureDetector* detector = &detectors[ss_index];
+    if (detector->count < PHI_MIN_SAMPLES || detector->last_arrival_ms <= 0) return -1;
+    
+    double sum = 0, sum_sq = 0;
+    for (int i = 0; i < detector->count; i++) {
+        sum += detector->intervals[i];
+        sum_sq += detector->intervals[i] * detector->intervals[i];
+    }
+    double mean = sum / detector->count;
+    double variance = sum_sq / detector->count - mean * mean;
+    double stddev = variance > 0 ? sqrt(variance) : 0;
+    if (stddev < PHI_MIN_STDDEV_MS) stddev = PHI_MIN_STDDEV_MS;
+    
+    double elapsed = now_ms - detector->last_arrival_ms;
+    double p_later = 0.5 * erfc((elapsed - mean) / (stddev * sqrt(2.0)));
+    if (p_later < 1e-300) return 300;
+    return -log10(p_later);
+}
+
+int server_suspect(int ss_index) {
+    return detectors[ss_index].suspect || detectors[ss_index].session_lost;
+}
+
+// A server's session closed: usually the process is gone, so stop sending
+// it new work while phi confirms (data_mutex not held)
+void detector_session_lost(const char* ip, int nm_port) {
+    pthread_mutex_lock(&data_mutex);
+    for (int i = 0; i < num_storage_servers; i++) {
+        if (strcmp(storage_servers[i].ip, ip) == 0 && storage_servers[i].nm_port == nm_port) {
+            if (storage_servers[i].is_active && !detectors[i].session_lost) {
+                detectors[i].session_lost = 1;
+                log_message("NM", "Storage Server SS%d is suspect (session closed)", i);
             }
+            break;
         }
+    }
+    pthread_mutex_unlock(&data_mutex);
+}
+
+// ═══════════════════════════════════════════════════════════════════
+// TELEMETRY - Load and health samples storage servers send with heartbeats
+// ═══════════════════════════════════════════════════════════════════
+
+#define TELEMETRY_HISTORY 150    // Samples kept per server (~5 minutes of heartbeats)
+#define TELEMETRY_WINDOW 15      // Samples averaged for load decisions (~30 s)
+#define TELEMETRY_MAX_AGE 60     // Seconds before a server's samples are ignored
+#define MIN_FREE_KB (10 * 1024)  // Servers with less free disk get no new files
+
+typedef struct {
+    time_t at;
+    double read_rate;   // Requests per second by type
+    double write_rate;
+    double stream_rate;
+    double undo_rate;
+    double nm_rate;
+    long long p99_us;   // READ/UNDO latency
+    int conns;
+    int inflight;
+    long long free_kb;  // -1 if unknown
+    int files;
+    long long bytes;
+    double repl_bps;    // Bytes per second pushed to replicas
+    int resyncs;        // Deltas replicas could not apply
+    int repl_queue;     // Files waiting for replica updates
+    double repl_lag_ms; // Age of the oldest update not yet on every replica
+    int ae_repairs;     // Replica files anti-entropy has repaired since the server started
+    int shed;           // Client requests it turned away as busy since it started
+} TelemetrySample;
+
+typedef struct {
+    TelemetrySample samples[TELEMETRY_HISTORY];
+    int next;  // Ring slot for the next sample
+    int count;
+} TelemetryHistory;
+
+TelemetryHistory server_telemetry[MAX_STORAGE_SERVERS];
+
+// Parse the leading "L key=value ..." line of a heartbeat (data_mutex held)
+void apply_telemetry(int ss_index, const char* data) {
+    if (strncmp(data, "L ", 2) != 0) return;
+    
+    char line[512];
+    size_t len = strcspn(data, "\n");
+    if (len >= sizeof(line)) len = sizeof(line) - 1;
+    memcpy(line, data, len);
+    line[len] = '\0';
+    
+    TelemetrySample sample;
+    memset(&sample, 0, sizeof(sample));
+    sample.at = time(NULL);
+    sample.free_kb = -1;
+    
+    char* saveptr;
+    for (char* token = strtok_r(line + 2, " ", &saveptr); token; token = strtok_r(NULL, " ", &saveptr)) {
+        char* value = strchr(token, '=');
+        if (!value) continue;
+        *value++ = '\0';
         
-        log_message("NM", "File '%s' assigned: Primary=SS%d, Secondary=SS%d", 
-                   msg->filename, ss_index, replica_ss_index);
-    } else if (num_storage_servers == 1) {
-        // Only one server available
-        if (storage_servers[0].is_active) {
-            ss_index = 0;
-            replica_ss_index = -1;
-            log_message("NM", "File '%s' assigned: Primary=SS%d (No secondary available)", 
-                       msg->filename, ss_index);
-        }
+        if (strcmp(token, "read") == 0) sample.read_rate = atof(value);
+        else if (strcmp(token, "write") == 0) sample.write_rate = atof(value);
+        else if (strcmp(token, "stream") == 0) sample.stream_rate = atof(value);
+        else if (strcmp(token, "undo") == 0) sample.undo_rate = atof(value);
+        else if (strcmp(token, "nm") == 0) sample.nm_rate = atof(value);
+        else if (strcmp(token, "p99_us") == 0) sample.p99_us = atoll(value);
+        else if (strcmp(token, "conns") == 0) sample.conns = atoi(value);
+        else if (strcmp(token, "inflight") == 0) sample.inflight = atoi(value);
+        else if (strcmp(token, "free_kb") == 0) sample.free_kb = atoll(value);
+        else if (strcmp(token, "files") == 0) sample.files = atoi(value);
+        else if (strcmp(token, "bytes") == 0) sample.bytes = atoll(value);
+        else if (strcmp(token, "repl_bps") == 0) sample.repl_bps = atof(value);
+        else if (strcmp(token, "resyncs") == 0) sample.resyncs = atoi(value);
+        else if (strcmp(token, "repl_queue") == 0) sample.repl_queue = atoi(value);
+        else if (strcmp(token, "repl_lag_ms") == 0) sample.repl_lag_ms = atof(value);
+        else if (strcmp(token, "ae_repairs") == 0) sample.ae_repairs = atoi(value);
+        else if (strcmp(token, "shed") == 0) sample.shed = atoi(value);
     }
     
-    if (ss_index < 0) {
-        response.error_code = ERR_NO_STORAGE_SERVER;
-        strcpy(response.data, "ERROR: No storage server available");
-        pthread_mutex_unlock(&data_mutex);
-        send_message(client_sock, &response);
-        return;
+    TelemetryHistory* history = &server_telemetry[ss_index];
+    history->samples[history->next] = sample;
+    history->next = (history->next + 1) % TELEMETRY_HISTORY;
+    if (history->count < TELEMETRY_HISTORY) history->count++;
+}
+
+// i-th most recent sample (0 = latest), NULL if missing or too old
+TelemetrySample* telemetry_sample(int ss_index, int i) {
+    TelemetryHistory* history = &server_telemetry[ss_index];
+    if (i >= history->count) return NULL;
+    
+    TelemetrySample* sample = &history->samples[(history->next - 1 - i + TELEMETRY_HISTORY) % TELEMETRY_HISTORY];
+    if (time(NULL) - sample->at > TELEMETRY_MAX_AGE) return NULL;
+    return sample;
+}
+
+// Client requests per second averaged over the recent window, -1 if unknown
+double reported_request_rate(int ss_index) {
+    double total = 0;
+    int n = 0;
+    TelemetrySample* sample;
+    while (n < TELEMETRY_WINDOW && (sample = telemetry_sample(ss_index, n)) != NULL) {
+        total += sample->read_rate + sample->write_rate + sample->stream_rate + sample->undo_rate;
+        n++;
     }
-    
-    pthread_mutex_unlock(&data_mutex);
-    
-    // Forward to storage server
-    int ss_sock = connect_to_server(storage_servers[ss_index].ip, 
-        storage_servers[ss_index].nm_port);
-    
+    return n > 0 ? total / n : -1;
+}
+
+// Worst p99 latency over the recent window, -1 if unknown
+long long reported_p99_us(int ss_index) {
+    long long worst = -1;
+    TelemetrySample* sample;
+    for (int n = 0; n < TELEMETRY_WINDOW && (sample = telemetry_sample(ss_index, n)) != NULL; n++) {
+        if (sample->p99_us > worst) worst = sample->p99_us;
+    }
+    return worst;
+}
+
+// Server reported it is nearly out of disk
+int server_low_on_space(int ss_index) {
+    TelemetrySample* sample = telemetry_sample(ss_index, 0);
+    return sample && sample->free_kb >= 0 && sample->free_kb < MIN_FREE_KB;
+}
+
+// ═══════════════════════════════════════════════════════════════════
+// PLACEMENT - Pluggable policies for choosing storage servers on CREATE
+// ═══════════════════════════════════════════════════════════════════
+
+// Load signals the NM derives from what it already sees (data_mutex held)
+typedef struct {
+    int file_count;         // Files whose primary copy lives here
+    long bytes_stored;      // Sum of pushed char counts of those files
+    double recent_requests; // Exponentially decayed count of requests routed here
+    time_t decay_time;      // When recent_requests was last decayed
+} ServerLoad;
+
+ServerLoad server_load[MAX_STORAGE_SERVERS];
+unsigned int placement_seed = 0; // rand_r state, only touched under data_mutex
+
+#define REQUEST_DECAY_SECONDS 60.0
+
+typedef struct {
+    const char* name;
+    // Pick one of candidates[0..count-1] (storage server indexes) for filename
+    int (*choose)(const char* filename, const int* candidates, int count);
+} PlacementPolicy;
+
+int choose_random(const char* filename, const int* candidates, int count);
+int choose_power_of_two(const char* filename, const int* candidates, int count);
+int choose_capacity_weighted(const char* filename, const int* candidates, int count);
+int choose_ring(const char* filename, const int* candidates, int count);
+
+PlacementPolicy placement_policies[] = {
+    {"random", choose_random},
+    {"p2c", choose_power_of_two},
+    {"weighted", choose_capacity_weighted},
+    {"ring", choose_ring},
+};
+PlacementPolicy* placement_policy = &placement_policies[1];
+
+int set_placement_policy(const char* name) {
+    for (size_t i = 0; i < sizeof(placement_policies) / sizeof(placement_policies[0]); i++) {
+        if (strcmp(placement_policies[i].name, name) == 0) {
+            placement_policy = &placement_policies[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Decay a server's recent request count to the present
+void decay_server_requests(int ss_index, time_t now) {
+    ServerLoad* load = &server_load[ss_index];
+    if (load->decay_time != 0 && now > load->decay_time) {
+        load->recent_requests *= exp(-(double)(now - load->decay_time) / REQUEST_DECAY_SECONDS);
+    }
+    load->decay_time = now;
+}
+
+// Count a request the NM routed (or forwarded) to a storage server
+void note_server_request(int ss_index) {
+    if (ss_index < 0 || ss_index >= MAX_STORAGE_SERVERS) return;
+    decay_server_requests(ss_index, time(NULL));
+    server_load[ss_index].recent_requests += 1.0;
+}
+
+// Refresh per-server file counts and stored bytes from metadata
+void refresh_server_load() {
+    time_t now = time(NULL);
+    for (int i = 0; i < num_storage_servers; i++) {
+        server_load[i].file_count = 0;
+        server_load[i].bytes_stored = 0;
+        decay_server_requests(i, now);
+    }
+    for (FileNode* file = file_list; file; file = file->next) {
+        int ss_index = file->metadata.ss_index;
+        if (ss_index >= 0 && ss_index < num_storage_servers) {
+            server_load[ss_index].file_count++;
+            server_load[ss_index].bytes_stored += file->metadata.char_count;
+        }
+    }
+}
+
+int server_weight(int ss_index) {
+    int weight = storage_servers[ss_index].capacity_weight;
+    return weight > 0 ? weight : 1;
+}
+
+// Request pressure on a server: requests the NM routed there (decayed), or
+// what the server itself reports, which also sees lease-cached client traffic
+double server_request_load(int ss_index) {
+    double routed = server_load[ss_index].recent_requests;
+    double reported = reported_request_rate(ss_index) * REQUEST_DECAY_SECONDS;
+    return reported > routed ? reported : routed;
+}
+
+// Load per unit of capacity: lower is better
+double server_load_score(int ss_index) {
+    ServerLoad* load = &server_load[ss_index];
+    return (load->file_count + server_request_load(ss_index) + load->bytes_stored / 4096.0) /
+        server_weight(ss_index);
+}
+
+int choose_random(const char* filename, const int* candidates, int count) {
+    (void)filename;
+    return candidates[rand_r(&placement_seed) % count];
+}
+
+// Power of two choices: sample two servers, keep the less loaded one
+int choose_power_of_two(const char* filename, const int* candidates, int count) {
+    (void)filename;
+    int a = candidates[rand_r(&placement_seed) % count];
+    if (count == 1) return a;
+    
+    int b = candidates[rand_r(&placement_seed) % (count - 1)];
+    if (b == a) b = candidates[count - 1]; // Sample without replacement
+    
+    return server_load_score(b) < server_load_score(a) ? b : a;
+}
+
+// Pick with probability proportional to capacity weight
+int choose_capacity_weighted(const char* filename, const int* candidates, int count) {
+    (void)filename;
+    int total = 0;
+    for (int i = 0; i < count; i++) {
+        total += server_weight(candidates[i]);
+    }
+    
+    int pick = rand_r(&placement_seed) % total;
+    for (int i = 0; i < count; i++) {
+        pick -= server_weight(candidates[i]);
+        if (pick < 0) return candidates[i];
+    }
+    return candidates[count - 1];
+}
+
+// ─── Consistent-hash ring ───
+// Every registered server owns capacity_weight * RING_VNODES_PER_WEIGHT
+// points, hashed from its ip:port so placement only depends on the file
+// name and the membership list. Lookups walk clockwise from the file's hash
+// and take the first point whose server is a candidate, so a server that
+// goes down or comes back only moves the keys adjacent to its own points.
+
+#define RING_VNODES_PER_WEIGHT 64
+#define RING_MAX_WEIGHT 16
+
+typedef struct {
+    uint64_t hash;
+    int ss_index;
+} RingPoint;
+
+RingPoint* ring_points = NULL;
+int num_ring_points = 0;
+
+// FNV-1a followed by a 64-bit finalizer so nearby names spread out
+uint64_t ring_hash(const char* key) {
+    uint64_t h = 1469598103934665603ULL;
+    for (const unsigned char* p = (const unsigned char*)key; *p; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+int compare_ring_points(const void* a, const void* b) {
+    uint64_t ha = ((const RingPoint*)a)->hash;
+    uint64_t hb = ((const RingPoint*)b)->hash;
+    if (ha != hb) return ha < hb ? -1 : 1;
+    return ((const RingPoint*)a)->ss_index - ((const RingPoint*)b)->ss_index;
+}
+
+// Rebuild the ring from the registered servers (data_mutex held)
+void rebuild_ring() {
+    int total = 0;
+    for (int i = 0; i < num_storage_servers; i++) {
+        int weight = server_weight(i);
+        if (weight > RING_MAX_WEIGHT) weight = RING_MAX_WEIGHT;
+        total += weight * RING_VNODES_PER_WEIGHT;
+    }
+    
+    RingPoint* points = total > 0 ? (RingPoint*)malloc(total * sizeof(RingPoint)) : NULL;
+    if (total > 0 && !points) {
+        log_message("NM", "Failed to allocate placement ring");
+        return;
+    }
+    
+    int n = 0;
+    for (int i = 0; i < num_storage_servers; i++) {
+        int weight = server_weight(i);
+        if (weight > RING_MAX_WEIGHT) weight = RING_MAX_WEIGHT;
+        for (int v = 0; v < weight * RING_VNODES_PER_WEIGHT; v++) {
+            char key[64];
+            snprintf(key, sizeof(key), "%s:%d#%d", storage_servers[i].ip, 
+                storage_servers[i].nm_port, v);
+            points[n].hash = ring_hash(key);
+            points[n].ss_index = i;
+            n++;
+        }
+    }
+    qsort(points, n, sizeof(RingPoint), compare_ring_points);
+    
+    free(ring_points);
+    ring_points = points;
+    num_ring_points = n;
+}
+
+// First server clockwise from filename's hash that is among the candidates
+int choose_ring(const char* filename, const int* candidates, int count) {
+    if (num_ring_points == 0) return candidates[0];
+    
+    uint64_t h = ring_hash(filename);
+    int lo = 0, hi = num_ring_points;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (ring_points[mid].hash < h) lo = mid + 1;
+        else hi = mid;
+    }
+    
+    for (int step = 0; step < num_ring_points; step++) {
+        int ss_index = ring_points[(lo + step) % num_ring_points].ss_index;
+        for (int i = 0; i < count; i++) {
+            if (candidates[i] == ss_index) return ss_index;
+        }
+    }
+    return candidates[0];
+}
+
+// Servers on the same host fail together
+int same_failure_domain(int a, int b) {
+    return strcmp(storage_servers[a].ip, storage_servers[b].ip) == 0;
+}
+
+// Choose primary and replica for a new file; -1 where none is available.
+// The replica goes to another failure domain whenever one is active.
+// Pick one of candidates not already in chosen[], preferring servers
+// outside the failure domains chosen[] already covers. -1 if none is left.
+int choose_spread(const char* filename, const int* candidates, int count, const int* chosen, int chosen_count) {
+    int remote[MAX_STORAGE_SERVERS];
+    int remote_count = 0;
+    int local[MAX_STORAGE_SERVERS];
+    int local_count = 0;
+    for (int i = 0; i < count; i++) {
+        int shared = 0, taken = 0;
+        for (int j = 0; j < chosen_count; j++) {
+            if (candidates[i] == chosen[j]) taken = 1;
+            if (same_failure_domain(candidates[i], chosen[j])) shared = 1;
+        }
+        if (taken) continue;
+        if (shared) {
+            local[local_count++] = candidates[i];
+        } else {
+            remote[remote_count++] = candidates[i];
+        }
+    }
+    
+    if (remote_count > 0) return placement_policy->choose(filename, remote, remote_count);
+    if (local_count > 0) return placement_policy->choose(filename, local, local_count);
+    return -1;
+}
+
+// Choose a primary and up to `wanted` replicas for a new file.
+// Returns the number of replicas chosen.
+int choose_placement(const char* filename, int* primary, int* replicas, int wanted) {
+    int candidates[MAX_STORAGE_SERVERS];
+    int count = 0;
+    
+    *primary = -1;
+    
+    int fallback[MAX_STORAGE_SERVERS];
+    int fallback_count = 0;
+    for (int i = 0; i < num_storage_servers; i++) {
+        if (!storage_servers[i].is_active) continue;
+        if (server_low_on_space(i) || server_suspect(i)) {
+            fallback[fallback_count++] = i;
+        } else {
+            candidates[count++] = i;
+        }
+    }
+    if (count == 0) {
+        // Every server is short on disk or suspect: still place the file somewhere
+        memcpy(candidates, fallback, fallback_count * sizeof(int));
+        count = fallback_count;
+    }
+    if (count == 0) return 0;
+    
+    refresh_server_load();
+    *primary = placement_policy->choose(filename, candidates, count);
+    
+    // Replicas preferably each in a failure domain of its own
+    int chosen[MAX_REPLICAS + 1];
+    chosen[0] = *primary;
+    int replica_count = 0;
+    while (replica_count < wanted && replica_count < MAX_REPLICAS) {
+        int pick = choose_spread(filename, candidates, count, chosen, replica_count + 1);
+        if (pick < 0) break;
+        replicas[replica_count++] = pick;
+        chosen[replica_count] = pick;
+    }
+    return replica_count;
+}
+
+// ═══════════════════════════════════════════════════════════════════
+// REBALANCER - Move files toward the target distribution in the background
+// ═══════════════════════════════════════════════════════════════════
+
+#define REBALANCE_INTERVAL 30 // Seconds between planning rounds when idle
+#define REBALANCE_BATCH 32    // Moves planned per round
+
+typedef struct {
+    char filename[MAX_FILENAME];
+    int from;
+    int to;
+} PlannedMove;
+
+// Progress counters reported by METRICS (data_mutex held)
+typedef struct {
+    int rounds;
+    int planned;
+    int moved;
+    int deferred;  // Source busy or changed during the copy, retried next round
+    int failed;
+    long bytes_moved;
+    int pending;   // Moves left in the current round
+    char current[MAX_FILENAME];
+    time_t last_round;
+} RebalanceStats;
+
+RebalanceStats rebalance_stats;
+int rebalance_kbps = 512; // Bandwidth cap for migration traffic, 0 = unlimited
+int rebalance_requested = 0;
+pthread_cond_t rebalance_cond = PTHREAD_COND_INITIALIZER;
+
+// Ask the rebalancer to plan a round now (data_mutex held)
+void request_rebalance() {
+    rebalance_requested = 1;
+    pthread_cond_signal(&rebalance_cond);
+}
+
+int is_planned(PlannedMove* moves, int count, const char* filename) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(moves[i].filename, filename) == 0) return 1;
+    }
+    return 0;
+}
+
+// Plan up to max moves (data_mutex held). With the ring policy every file
+// goes to its ring owner; otherwise primaries are spread in proportion to
+// capacity_weight, one file at a time from the most over-full server to the
+// most under-full one.
+int plan_rebalance(PlannedMove* moves, int max) {
+    int active[MAX_STORAGE_SERVERS];
+    int active_count = 0;
+    for (int i = 0; i < num_storage_servers; i++) {
+        if (storage_servers[i].is_active) active[active_count++] = i;
+    }
+    if (active_count < 2) return 0;
+    
+    int count = 0;
+    
+    if (placement_policy->choose == choose_ring) {
+        for (FileNode* file = file_list; file && count < max; file = file->next) {
+            int from = file->metadata.ss_index;
+            if (from < 0 || from >= num_storage_servers || !storage_servers[from].is_active) continue;
+            
+            int owner = choose_ring(file->metadata.filename, active, active_count);
+            if (owner != from) {
+                strcpy(moves[count].filename, file->metadata.filename);
+                moves[count].from = from;
+                moves[count].to = owner;
+                count++;
+            }
+        }
+        return count;
+    }
+    
+    refresh_server_load();
+    int files[MAX_STORAGE_SERVERS] = {0};
+    int total_files = 0;
+    int total_weight = 0;
+    for (int i = 0; i < active_count; i++) {
+        files[active[i]] = server_load[active[i]].file_count;
+        total_files += files[active[i]];
+        total_weight += server_weight(active[i]);
+    }
+    
+    while (count < max) {
+        int over = -1, under = -1;
+        double most_over = 0, most_under = 0;
+        for (int i = 0; i < active_count; i++) {
+            int s = active[i];
+            double excess = files[s] - (double)total_files * server_weight(s) / total_weight;
+            if (over < 0 || excess > most_over) { over = s; most_over = excess; }
+            if (under < 0 || excess < most_under) { under = s; most_under = excess; }
+        }
+        if (most_over < 1.0 || most_under > -1.0) break;
+        
+        // Prefer a file already replicated on the destination: no copy is lost
+        FileNode* pick = NULL;
+        for (FileNode* file = file_list; file; file = file->next) {
+            if (file->metadata.ss_index != over || is_planned(moves, count, file->metadata.filename)) continue;
+            if (!pick || replica_slot(file, under) >= 0) pick = file;
+            if (replica_slot(file, under) >= 0) break;
+        }
+        if (!pick) break;
+        
+        strcpy(moves[count].filename, pick->metadata.filename);
+        moves[count].from = over;
+        moves[count].to = under;
+        count++;
+        files[over]--;
+        files[under]++;
+    }
+    return count;
+}
+
+// Checksum of the source copy; sets *busy while a WRITE session is open on it
+int fetch_source_checksum(SSCall* call, const char* ip, int port, const char* filename,
+                          char* checksum, int* busy) {
+    memset(call, 0, sizeof(*call));
+    strcpy(call->ip, ip);
+    call->port = port;
+    call->request.type = MSG_SS_EXPORT;
+    call->request.flags = EXPORT_CHECKSUM;
+    strcpy(call->request.filename, filename);
+    ss_call_thread(call);
+    
+    if (!call->ok || call->response.error_code != ERR_SUCCESS) return -1;
+    snprintf(checksum, 32, "%.31s", call->response.data);
+    *busy = call->response.word_index;
+    return 0;
+}
+
+// Copy one file from its source to the destination, verify it and flip
+// ss_index. Returns 1 when moved (bytes copied in *bytes), 0 when deferred
+// to a later round, -1 on failure.
+int execute_move(PlannedMove* move, SSCall* call, int* bytes) {
+    char src_ip[INET_ADDRSTRLEN], dst_ip[INET_ADDRSTRLEN];
+    int src_port, dst_port, dst_is_replica;
+    
+    pthread_mutex_lock(&data_mutex);
+    FileNode* file = find_file(move->filename);
+    if (!file || file->metadata.ss_index != move->from ||
+        !storage_servers[move->from].is_active || !storage_servers[move->to].is_active) {
+        pthread_mutex_unlock(&data_mutex);
+        return 0; // Plan went stale; the next round will re-plan
+    }
+    strcpy(src_ip, storage_servers[move->from].ip);
+    src_port = storage_servers[move->from].nm_port;
+    strcpy(dst_ip, storage_servers[move->to].ip);
+    dst_port = storage_servers[move->to].nm_port;
+    dst_is_replica = replica_slot(file, move->to) >= 0;
+    pthread_mutex_unlock(&data_mutex);
+    
+    char before[32], copied[32], after[32];
+    int busy = 0;
+    if (fetch_source_checksum(call, src_ip, src_port, move->filename, before, &busy) != 0) return -1;
+    if (busy) return 0;
+    
+    // Destination pulls file, undo copy and checkpoints straight from the source
+    memset(call, 0, sizeof(*call));
+    strcpy(call->ip, dst_ip);
+    call->port = dst_port;
+    call->request.type = MSG_SS_MIGRATE;
+    strcpy(call->request.filename, move->filename);
+    strcpy(call->request.ss_ip, src_ip);
+    call->request.ss_port = src_port;
+    ss_call_thread(call);
+    if (!call->ok || call->response.error_code != ERR_SUCCESS) return -1;
+    snprintf(copied, sizeof(copied), "%.31s", call->response.data);
+    *bytes = call->response.word_index;
+    
+    // Verify nothing changed underneath the copy before handing out the new location
+    int verified = fetch_source_checksum(call, src_ip, src_port, move->filename, after, &busy) == 0 &&
+        !busy && strcmp(before, copied) == 0 && strcmp(after, copied) == 0;
+    
+    pthread_mutex_lock(&data_mutex);
+    file = find_file(move->filename);
+    if (!verified || !file || file->metadata.ss_index != move->from) {
+        pthread_mutex_unlock(&data_mutex);
+        if (!dst_is_replica) {
+            // Drop the unused copy; the replica copy is left in place
+            memset(call, 0, sizeof(*call));
+            strcpy(call->ip, dst_ip);
+            call->port = dst_port;
+            call->request.type = MSG_SS_DELETE;
+            strcpy(call->request.filename, move->filename);
+            ss_call_thread(call);
+        }
+        return 0;
+    }
+    file->metadata.ss_index = move->to;
+    int keep_source = 0;
+    int slot = replica_slot(file, move->to);
+    if (slot >= 0) {
+        file->metadata.replicas[slot] = move->from; // Old primary keeps serving as replica
+        keep_source = 1;
+    }
+    mark_replica_set_dirty(file);
+    rebase_write_counter(file); // Next push comes from the new primary
+    reset_replica_freshness(file);
+    int epoch = bump_file_epoch(file);
+    save_metadata();
+    pthread_mutex_unlock(&data_mutex);
+    
+    // Cached leases still point at the source
+    push_file_epoch(dst_ip, dst_port, move->filename, epoch);
+    if (keep_source) {
+        push_file_epoch(src_ip, src_port, move->filename, epoch);
+    }
+    
+    // A WRITE routed just before the flip may have landed on the source: pull it
+    // again until an idle source matches the copy, and only then delete it
+    int source_settled = keep_source;
+    for (int attempt = 0; !source_settled && attempt < 3; attempt++) {
+        if (fetch_source_checksum(call, src_ip, src_port, move->filename, after, &busy) != 0) break;
+        if (busy) {
+            usleep(200000);
+            continue;
+        }
+        if (strcmp(after, copied) == 0) {
+            source_settled = 1;
+            break;
+        }
+        log_message("NM", "Rebalance: '%s' changed during flip, re-copying", move->filename);
+        memset(call, 0, sizeof(*call));
+        strcpy(call->ip, dst_ip);
+        call->port = dst_port;
+        call->request.type = MSG_SS_MIGRATE;
+        strcpy(call->request.filename, move->filename);
+        strcpy(call->request.ss_ip, src_ip);
+        call->request.ss_port = src_port;
+        ss_call_thread(call);
+        if (!call->ok || call->response.error_code != ERR_SUCCESS) break;
+        snprintf(copied, sizeof(copied), "%.31s", call->response.data);
+        *bytes += call->response.word_index;
+    }
+    
+    if (!keep_source && source_settled) {
+        memset(call, 0, sizeof(*call));
+        strcpy(call->ip, src_ip);
+        call->port = src_port;
+        call->request.type = MSG_SS_DELETE;
+        strcpy(call->request.filename, move->filename);
+        ss_call_thread(call);
+    } else if (!keep_source) {
+        log_message("NM", "Rebalance: kept source copy of '%s' on SS %d; it could not be confirmed idle and unchanged",
+                    move->filename, move->from);
+    }
+    
+    return 1;
+}
+
+// Sleep long enough to keep background copy traffic under kbps (0 = no cap)
+void throttle_transfer(int bytes, int kbps) {
+    if (kbps <= 0 || bytes <= 0) return;
+    long long usec = (long long)bytes * 1000000LL / ((long long)kbps * 1024);
+    if (usec > 0) usleep(usec);
+}
+
+void* rebalance_thread(void* arg) {
+    (void)arg;
+    PlannedMove* moves = (PlannedMove*)malloc(REBALANCE_BATCH * sizeof(PlannedMove));
+    SSCall* call = (SSCall*)malloc(sizeof(SSCall));
+    if (!moves || !call) {
+        log_message("NM", "Rebalancer disabled: out of memory");
+        free(moves);
+        free(call);
+        return NULL;
+    }
+    
+    while (1) {
+        pthread_mutex_lock(&data_mutex);
+        if (!rebalance_requested) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += REBALANCE_INTERVAL;
+            pthread_cond_timedwait(&rebalance_cond, &data_mutex, &deadline);
+        }
+        rebalance_requested = 0;
+        
+        int count = plan_rebalance(moves, REBALANCE_BATCH);
+        rebalance_stats.rounds++;
+        rebalance_stats.planned += count;
+        rebalance_stats.pending = count;
+        time(&rebalance_stats.last_round);
+        pthread_mutex_unlock(&data_mutex);
+        
+        if (count > 0) {
+            log_message("NM", "Rebalance: %d move(s) planned", count);
+        }
+        
+        int progressed = 0;
+        for (int i = 0; i < count; i++) {
+            pthread_mutex_lock(&data_mutex);
+            strcpy(rebalance_stats.current, moves[i].filename);
+            pthread_mutex_unlock(&data_mutex);
+            
+            int bytes = 0;
+            int result = execute_move(&moves[i], call, &bytes);
+            
+            pthread_mutex_lock(&data_mutex);
+            rebalance_stats.pending--;
+            rebalance_stats.current[0] = '\0';
+            if (result > 0) {
+                rebalance_stats.moved++;
+                rebalance_stats.bytes_moved += bytes;
+                progressed = 1;
+            } else if (result == 0) {
+                rebalance_stats.deferred++;
+            } else {
+                rebalance_stats.failed++;
+            }
+            pthread_mutex_unlock(&data_mutex);
+            
+            if (result > 0) {
+                log_message("NM", "Rebalance: moved '%s' SS%d -> SS%d (%d bytes)",
+                    moves[i].filename, moves[i].from, moves[i].to, bytes);
+                log_to_file("REBALANCE: %s SS%d -> SS%d", moves[i].filename, moves[i].from, moves[i].to);
+            }
+            throttle_transfer(bytes, rebalance_kbps);
+        }
+        
+        // A full batch usually means more work is queued: plan again right away
+        if (count == REBALANCE_BATCH && progressed) {
+            pthread_mutex_lock(&data_mutex);
+            rebalance_requested = 1;
+            pthread_mutex_unlock(&data_mutex);
+        }
+    }
+    
+    return NULL;
+}
+
+// ═══════════════════════════════════════════════════════════════════
+// REPAIR - Restore lost replicas, fewest surviving copies first
+// ═══════════════════════════════════════════════════════════════════
+
+#define REPAIR_SWEEP_INTERVAL 30 // Seconds between scans for under-replicated files
+
+typedef struct {
+    char filename[MAX_FILENAME];
+    int live_copies;  // Lower is more urgent
+    long seq;         // FIFO among equal priority
+} RepairItem;
+
+// Progress counters reported by METRICS (data_mutex held)
+typedef struct {
+    int queued;
+    int repaired;
+    int deferred;  // Source busy, changed or no target yet: picked up by a later sweep
+    int failed;
+    long bytes_copied;
+    char current[MAX_FILENAME];
+} RepairStats;
+
+RepairItem* repair_heap = NULL; // Binary min-heap on (live_copies, seq)
+int repair_count = 0;
+long repair_seq = 0;
+RepairStats repair_stats;
+int repair_kbps = 1024; // Bandwidth cap for repair traffic, 0 = unlimited
+
+int repair_before(RepairItem* a, RepairItem* b) {
+    if (a->live_copies != b->live_copies) return a->live_copies < b->live_copies;
+    return a->seq < b->seq;
+}
+
+void repair_heap_swap(int i, int j) {
+    RepairItem tmp = repair_heap[i];
+    repair_heap[i] = repair_heap[j];
+    repair_heap[j] = tmp;
+}
+
+int server_is_live(int ss_index) {
+    return ss_index >= 0 && ss_index < num_storage_servers && storage_servers[ss_index].is_active;
+}
+
+int live_copies(FileNode* file) {
+    int copies = server_is_live(file->metadata.ss_index);
+    for (int slot = 0; slot < file->metadata.num_replicas; slot++) {
+        copies += server_is_live(file->metadata.replicas[slot]);
+    }
+    return copies;
+}
+
+int active_server_count() {
+    int count = 0;
+    for (int i = 0; i < num_storage_servers; i++) {
+        count += storage_servers[i].is_active;
+    }
+    return count;
+}
+
+// Queue a file that has lost a copy (data_mutex held). Files with no live
+// copy cannot be repaired and wait for their servers to return.
+void enqueue_repair(FileNode* file) {
+    int copies = live_copies(file);
+    if (file->repair_queued || copies == 0 || copies >= replication_target(file)) return;
+    if (active_server_count() <= copies) return; // Nowhere to put another copy yet
+    if (!repair_heap) {
+        repair_heap = (RepairItem*)malloc(MAX_FILES * sizeof(RepairItem));
+        if (!repair_heap) return;
+    }
+    if (repair_count >= MAX_FILES) return;
+    
+    int i = repair_count++;
+    strcpy(repair_heap[i].filename, file->metadata.filename);
+    repair_heap[i].live_copies = copies;
+    repair_heap[i].seq = repair_seq++;
+    while (i > 0 && repair_before(&repair_heap[i], &repair_heap[(i - 1) / 2])) {
+        repair_heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    
+    file->repair_queued = 1;
+    repair_stats.queued = repair_count;
+    pthread_cond_signal(&repair_cond);
+}
+
+// Take the most urgent item (data_mutex held)
+int dequeue_repair(RepairItem* item) {
+    if (repair_count == 0) return 0;
+    
+    *item = repair_heap[0];
+    repair_heap[0] = repair_heap[--repair_count];
+    int i = 0;
+    while (1) {
+        int smallest = i;
+        int left = 2 * i + 1, right = 2 * i + 2;
+        if (left < repair_count && repair_before(&repair_heap[left], &repair_heap[smallest])) smallest = left;
+        if (right < repair_count && repair_before(&repair_heap[right], &repair_heap[smallest])) smallest = right;
+        if (smallest == i) break;
+        repair_heap_swap(i, smallest);
+        i = smallest;
+    }
+    
+    repair_stats.queued = repair_count;
+    FileNode* file = find_file(item->filename);
+    if (file) file->repair_queued = 0;
+    return 1;
+}
+
+// Queue every under-replicated file (data_mutex held)
+void sweep_for_repairs() {
+    for (FileNode* file = file_list; file; file = file->next) {
+        enqueue_repair(file);
+    }
+}
+
+// Change how many copies a file keeps (data_mutex held). Extra copies are
+// queued for repair; surplus replicas are dropped from the set and their
+// deletes queued on drops, to be sent unlocked.
+void set_replication_factor(FileNode* file, int factor, SSBatch* drops) {
+    file->metadata.replication_factor = factor;
+    int target = replication_target(file);
+    
+    while (file->metadata.num_replicas > target - 1) {
+        int slot = file->metadata.num_replicas - 1;
+        int replica = file->metadata.replicas[slot];
+        remove_replica(file, slot);
+        if (!server_is_live(replica)) continue;
+        if (ss_batch_add(drops, replica, file->metadata.filename) != 0) {
+            log_message("NM", "Out of memory: surplus copy of %s left on SS%d", file->metadata.filename, replica);
+        }
+    }
+    
+    mark_replica_set_dirty(file);
+    enqueue_repair(file);
+}
+
+// New replica for a file: healthy, not already holding it, and outside the
+// holders' failure domains when possible (data_mutex held)
+int choose_repair_target(FileNode* file) {
+    int candidates[MAX_STORAGE_SERVERS];
+    int count = 0;
+    for (int i = 0; i < num_storage_servers; i++) {
+        if (!storage_servers[i].is_active || server_suspect(i) || server_low_on_space(i)) continue;
+        candidates[count++] = i;
+    }
+    
+    int holders[MAX_REPLICAS + 1];
+    holders[0] = file->metadata.ss_index;
+    memcpy(holders + 1, file->metadata.replicas, file->metadata.num_replicas * sizeof(int));
+    
+    refresh_server_load();
+    return choose_spread(file->metadata.filename, candidates, count, holders, file->metadata.num_replicas + 1);
+}
+
+// Copy one file from its surviving primary to a new replica. Returns 1 when
+// repaired (bytes copied in *bytes), 0 when deferred, -1 on failure.
+int execute_repair(const char* filename, SSCall* call, int* bytes) {
+    char src_ip[INET_ADDRSTRLEN], dst_ip[INET_ADDRSTRLEN];
+    int src_port, dst_port;
+    
+    pthread_mutex_lock(&data_mutex);
+    FileNode* file = find_file(filename);
+    if (!file || live_copies(file) >= replication_target(file) || !server_is_live(file->metadata.ss_index)) {
+        pthread_mutex_unlock(&data_mutex);
+        return 0; // Already repaired, deleted, or the source itself is down
+    }
+    int source = file->metadata.ss_index;
+    int target = choose_repair_target(file);
+    if (target < 0) {
+        pthread_mutex_unlock(&data_mutex);
+        return 0; // No healthy server to take the copy yet
+    }
+    strcpy(src_ip, storage_servers[source].ip);
+    src_port = storage_servers[source].nm_port;
+    strcpy(dst_ip, storage_servers[target].ip);
+    dst_port = storage_servers[target].nm_port;
+    pthread_mutex_unlock(&data_mutex);
+    
+    char before[32], copied[32], after[32];
+    int busy = 0;
+    if (fetch_source_checksum(call, src_ip, src_port, filename, before, &busy) != 0) return -1;
+    if (busy) return 0;
+    
+    // Target pulls file, undo copy and checkpoints straight from the source
+    memset(call, 0, sizeof(*call));
+    strcpy(call->ip, dst_ip);
+    call->port = dst_port;
+    call->request.type = MSG_SS_MIGRATE;
+    strcpy(call->request.filename, filename);
+    strcpy(call->request.ss_ip, src_ip);
+    call->request.ss_port = src_port;
+    ss_call_thread(call);
+    if (!call->ok || call->response.error_code != ERR_SUCCESS) return -1;
+    snprintf(copied, sizeof(copied), "%.31s", call->response.data);
+    *bytes = call->response.word_index;
+    
+    int verified = fetch_source_checksum(call, src_ip, src_port, filename, after, &busy) == 0 &&
+        !busy && strcmp(before, copied) == 0 && strcmp(after, copied) == 0;
+    
+    pthread_mutex_lock(&data_mutex);
+    file = find_file(filename);
+    if (!verified || !file || file->metadata.ss_index != source || live_copies(file) >= replication_target(file) ||
+        add_replica(file, target) < 0) {
+        pthread_mutex_unlock(&data_mutex);
+        memset(call, 0, sizeof(*call));
+        strcpy(call->ip, dst_ip);
+        call->port = dst_port;
+        call->request.type = MSG_SS_DELETE;
+        strcpy(call->request.filename, filename);
+        ss_call_thread(call);
+        return 0;
+    }
+    mark_replica_set_dirty(file);
+    int epoch = file->metadata.epoch;
+    save_metadata();
+    pthread_mutex_unlock(&data_mutex);
+    
+    // Reject leases older than the ones the primary already honours
+    push_file_epoch(dst_ip, dst_port, filename, epoch);
+    return 1;
+}
+
+#define REPLICA_SET_BATCH 256
+
+// "<file> <quorum> <ip:port>..." for the file's live replicas (data_mutex held)
+int format_replica_set(FileNode* file, char* line, size_t size) {
+    int len = snprintf(line, size, "%s %d", file->metadata.filename, file_write_quorum(file));
+    for (int slot = 0; slot < file->metadata.num_replicas; slot++) {
+        int replica = file->metadata.replicas[slot];
+        if (!server_is_live(replica)) continue;
+        len += snprintf(line + len, size - len, " %s:%d",
+            storage_servers[replica].ip, storage_servers[replica].nm_port);
+    }
+    return len;
+}
+
+typedef struct {
+    int primary;
+    char ip[INET_ADDRSTRLEN];
+    int port;
+    char line[MAX_FILENAME + 128]; // "<file> <quorum> <ip:port>..."
+} PendingSet;
+
+// A server back from being declared down may still hold sets for files that
+// failed over while it was away, and would push its stale copies over the new
+// primary's. Have it drop them all, then resend the ones it still leads
+// (data_mutex held; released while sending). A failed reset stays pending.
+void reset_replica_sets(SSCall* call) {
+    for (int i = 0; i < num_storage_servers; i++) {
+        if (!replica_sets_reset[i] || !server_is_live(i)) continue;
+        
+        memset(call, 0, sizeof(*call));
+        strcpy(call->ip, storage_servers[i].ip);
+        call->port = storage_servers[i].nm_port;
+        call->request.type = MSG_SS_REPLICA_SET;
+        call->request.flags = REPLICA_SET_RESET;
+        pthread_mutex_unlock(&data_mutex);
+        ss_call_thread(call);
+        pthread_mutex_lock(&data_mutex);
+        if (!call->ok || call->response.error_code != ERR_SUCCESS) {
+            log_message("NM", "Could not reset replica sets on SS%d", i);
+            continue;
+        }
+        
+        replica_sets_reset[i] = 0;
+        for (FileNode* file = file_list; file; file = file->next) {
+            if (file->metadata.ss_index == i) file->replica_set_dirty = 1;
+        }
+    }
+}
+
+// Send changed replica sets to their primaries, one message per primary per
+// batch (data_mutex held; released while sending). Primaries that are down
+// are skipped: they ask the NM to replicate until they hear a set again.
+void flush_replica_sets(SSCall* call) {
+    PendingSet* pending = (PendingSet*)malloc(REPLICA_SET_BATCH * sizeof(PendingSet));
+    if (!pending) return;
+    replica_sets_pending = 0;
+    reset_replica_sets(call);
+    
+    FileNode* file = file_list;
+    while (file) {
+        int count = 0;
+        for (; file && count < REPLICA_SET_BATCH; file = file->next) {
+            if (!file->replica_set_dirty) continue;
+            file->replica_set_dirty = 0;
+            
+            int primary = file->metadata.ss_index;
+            if (!server_is_live(primary)) continue;
+            
+            PendingSet* set = &pending[count++];
+            set->primary = primary;
+            strcpy(set->ip, storage_servers[primary].ip);
+            set->port = storage_servers[primary].nm_port;
+            format_replica_set(file, set->line, sizeof(set->line));
+        }
+        if (count == 0) break;
+        
+        // Resume by name: the list may change while unlocked
+        char resume_name[MAX_FILENAME] = "";
+        if (file) strcpy(resume_name, file->metadata.filename);
+        pthread_mutex_unlock(&data_mutex);
+        
+        int* sent = (int*)calloc(count, sizeof(int));
+        for (int i = 0; sent && i < count; i++) {
+            if (sent[i]) continue;
+            
+            memset(call, 0, sizeof(*call));
+            strcpy(call->ip, pending[i].ip);
+            call->port = pending[i].port;
+            call->request.type = MSG_SS_REPLICA_SET;
+            call->request.flags = chain_replication ? REPLICA_SET_CHAIN : 0;
+            int len = 0;
+            for (int j = i; j < count; j++) {
+                if (sent[j] || pending[j].primary != pending[i].primary) continue;
+                int line_len = strlen(pending[j].line);
+                if (len + line_len + 2 >= MAX_BUFFER_SIZE) break;
+                len += sprintf(call->request.data + len, "%s\n", pending[j].line);
+                sent[j] = 1;
+            }
+            call->request.data_len = len;
+            ss_call_thread(call);
+            if (!call->ok) {
+                log_message("NM", "Could not send replica sets to SS%d", pending[i].primary);
+            }
+        }
+        free(sent);
+        
+        pthread_mutex_lock(&data_mutex);
+        file = NULL;
+        if (resume_name[0]) {
+            file = find_file(resume_name);
+            if (!file) file = file_list; // Rescan; finished files are no longer dirty
+        }
+    }
+    
+    free(pending);
+}
+
+// ── Rejoin syncs ──
+
+#define MAX_PENDING_SYNCS 256
+
+// Anti-entropy rounds for the repair thread to request once the replica
+// sets changed by a rejoin have been delivered
+typedef struct {
+    int primary;
+    int target;
+} PendingSync;
+
+PendingSync pending_syncs[MAX_PENDING_SYNCS];
+int num_pending_syncs = 0;
+
+// Ask a primary to bring its copies on target up to date (data_mutex held)
+void queue_rejoin_sync(int primary, int target) {
+    for (int i = 0; i < num_pending_syncs; i++) {
+        if (pending_syncs[i].primary == primary && pending_syncs[i].target == target) return;
+    }
+    if (num_pending_syncs == MAX_PENDING_SYNCS) return; // The periodic round catches the rest
+    pending_syncs[num_pending_syncs].primary = primary;
+    pending_syncs[num_pending_syncs].target = target;
+    num_pending_syncs++;
+    pthread_cond_signal(&repair_cond);
+}
+
+// Send queued sync requests (data_mutex held; released while sending)
+void send_rejoin_syncs(SSCall* call) {
+    while (num_pending_syncs > 0) {
+        PendingSync sync = pending_syncs[--num_pending_syncs];
+        if (!server_is_live(sync.primary) || !server_is_live(sync.target)) continue;
+        
+        memset(call, 0, sizeof(*call));
+        strcpy(call->ip, storage_servers[sync.primary].ip);
+        call->port = storage_servers[sync.primary].nm_port;
+        call->request.type = MSG_SS_ANTI_ENTROPY;
+        strcpy(call->request.ss_ip, storage_servers[sync.target].ip);
+        call->request.ss_port = storage_servers[sync.target].nm_port;
+        pthread_mutex_unlock(&data_mutex);
+        
+        ss_call_thread(call);
+        if (!call->ok) {
+            log_message("NM", "Could not ask SS%d to sync SS%d", sync.primary, sync.target);
+        }
+        pthread_mutex_lock(&data_mutex);
+    }
+}
+
+void* repair_thread(void* arg) {
+    (void)arg;
+    SSCall* call = (SSCall*)malloc(sizeof(SSCall));
+    if (!call) {
+        log_message("NM", "Re-replication disabled: out of memory");
+        return NULL;
+    }
+    
+    // The first sweep waits one interval, so servers re-registering after a
+    // restart are not mistaken for lost copies
+    pthread_mutex_lock(&data_mutex);
+    while (1) {
+        if (replica_sets_pending) {
+            flush_replica_sets(call);
+        }
+        if (num_pending_syncs > 0 && !replica_sets_pending) {
+            send_rejoin_syncs(call);
+        }
+        if (repair_count == 0 && !replica_sets_pending && num_pending_syncs == 0) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += REPAIR_SWEEP_INTERVAL;
+            if (pthread_cond_timedwait(&repair_cond, &data_mutex, &deadline) == ETIMEDOUT) {
+                sweep_for_repairs();
+            }
+        }
+        
+        RepairItem item;
+        if (!dequeue_repair(&item)) continue;
+        strcpy(repair_stats.current, item.filename);
+        pthread_mutex_unlock(&data_mutex);
+        
+        int bytes = 0;
+        int result = execute_repair(item.filename, call, &bytes);
+        
+        pthread_mutex_lock(&data_mutex);
+        repair_stats.current[0] = '\0';
+        if (result > 0) {
+            repair_stats.repaired++;
+            repair_stats.bytes_copied += bytes;
+        } else if (result == 0) {
+            repair_stats.deferred++;
+        } else {
+            repair_stats.failed++;
+        }
+        pthread_mutex_unlock(&data_mutex);
+        
+        if (result > 0) {
+            log_message("NM", "Re-replication: restored copy of '%s' (%d bytes, was down to %d live copy)",
+                item.filename, bytes, item.live_copies);
+            log_to_file("REREPLICATE: %s", item.filename);
+        } else if (result < 0) {
+            log_message("NM", "Re-replication of '%s' failed, will retry on next sweep", item.filename);
+        }
+        throttle_transfer(bytes, repair_kbps);
+        
+        pthread_mutex_lock(&data_mutex);
+    }
+    
+    return NULL;
+}
+
+// ═══════════════════════════════════════════════════════════════════
+// REJOIN - Re-attach a registering storage server to its old slot and
+//          reconcile the files it reports with the metadata
+// ═══════════════════════════════════════════════════════════════════
+
+#define SERVERS_FILE "nm_servers.dat"
+#define SERVERS_MAGIC "NMST"
+#define SERVERS_VERSION 1 // Bump when StorageServerInfo changes
+
+// One line of a storage server's manifest: "<file> <size> <mtime> <hash>"
+typedef struct {
+    char filename[MAX_FILENAME];
+    long size;
+    long mtime;
+    unsigned long long hash;
+} ManifestEntry;
+
+int compare_manifest_entries(const void* a, const void* b) {
+    return strcmp(((const ManifestEntry*)a)->filename, ((const ManifestEntry*)b)->filename);
+}
+
+ManifestEntry* find_manifest_entry(ManifestEntry* entries, int count, const char* filename) {
+    ManifestEntry key;
+    strcpy(key.filename, filename);
+    return (ManifestEntry*)bsearch(&key, entries, count, sizeof(ManifestEntry), compare_manifest_entries);
+}
+
+// Append the manifest lines in data to *entries
+void parse_manifest(const char* data, ManifestEntry** entries, int* count, int* capacity) {
+    const char* line = data;
+    while (line && *line) {
+        ManifestEntry entry;
+        int used = 0;
+        if (sscanf(line, "%255s %ld %ld %llx%n", entry.filename, &entry.size, &entry.mtime, &entry.hash, &used) == 4 &&
+            (line[used] == '\n' || line[used] == '\0')) {
+            if (*count == *capacity) {
+                int grown_capacity = *capacity ? *capacity * 2 : 256;
+                ManifestEntry* grown = (ManifestEntry*)realloc(*entries, grown_capacity * sizeof(ManifestEntry));
+                if (!grown) return;
+                *entries = grown;
+                *capacity = grown_capacity;
+            }
+            (*entries)[(*count)++] = entry;
+        }
+        line = strchr(line, '\n');
+        if (line) line++;
+    }
+}
+
+// Compare what a (re)joining server holds with what the metadata says it
+// should hold (data_mutex held). Missing copies are re-replicated or failed
+// over, stale replicas are synced by their primary, copies of files that
+// are short of replicas are adopted, and other known files' copies are
+// dropped. Files the metadata does not know are left alone. An incomplete
+// manifest proves nothing about the files it leaves out, so then no copy is
+// declared lost and nothing is dropped.
+void reconcile_manifest(int index, ManifestEntry* entries, int count, int complete, SSBatch* drops,
+                        char* summary, size_t size) {
+    int current = 0, stale = 0, lost = 0, adopted = 0, surplus = 0, matched = 0;
+    
+    for (FileNode* file = file_list; file; file = file->next) {
+        ManifestEntry* entry = find_manifest_entry(entries, count, file->metadata.filename);
+        if (entry) matched++;
+        int primary = file->metadata.ss_index;
+        int slot = replica_slot(file, index);
+        
+        if (primary == index) {
+            if (entry) {
+                file->primary_hash = entry->hash;
+                rebase_write_counter(file);
+                mark_replica_set_dirty(file); // It lost its replica sets with the restart
+                current++;
+                continue;
+            }
+            if (!complete) continue;
+            // The primary copy is gone: fail over to a live replica
+            lost++;
+            int promote = -1;
+            for (int r = 0; r < file->metadata.num_replicas; r++) {
+                if (server_is_live(file->metadata.replicas[r])) {
+                    promote = r;
+                    break;
+                }
+            }
+            if (promote < 0) {
+                log_message("NM", "Rejoin: '%s' is missing on SS%d and has no other copy", file->metadata.filename, index);
+                continue;
+            }
+            file->metadata.ss_index = file->metadata.replicas[promote];
+            remove_replica(file, promote);
+            rebase_write_counter(file);
+            reset_replica_freshness(file);
+            bump_file_epoch(file);
+            mark_replica_set_dirty(file);
+            enqueue_repair(file);
+        } else if (slot >= 0) {
+            if (!entry) {
+                if (!complete) continue;
+                lost++;
+                remove_replica(file, slot);
+                mark_replica_set_dirty(file);
+                enqueue_repair(file);
+                continue;
+            }
+            file->replica_hash[slot] = entry->hash;
+            if (entry->hash != 0 && entry->hash == file->primary_hash) {
+                current++;
+            } else {
+                stale++;
+                if (server_is_live(primary)) queue_rejoin_sync(primary, index);
+            }
+        } else if (entry) {
+            if (primary < 0 || primary >= num_storage_servers) {
+                // Its primary's slot is unknown here (metadata older than the
+                // server table): this copy becomes the primary
+                file->metadata.ss_index = index;
+                file->primary_hash = entry->hash;
+                rebase_write_counter(file);
+                reset_replica_freshness(file);
+                bump_file_epoch(file);
+                mark_replica_set_dirty(file);
+                adopted++;
+            } else if (live_copies(file) < replication_target(file) && (slot = add_replica(file, index)) >= 0) {
+                file->replica_hash[slot] = entry->hash;
+                mark_replica_set_dirty(file);
+                if (entry->hash == 0 || entry->hash != file->primary_hash) queue_rejoin_sync(primary, index);
+                adopted++;
+            } else if (complete) {
+                // Moved or trimmed while the server was away
+                if (ss_batch_add(drops, index, file->metadata.filename) == 0) surplus++;
+            }
+        }
+    }
+    
+    snprintf(summary, size, "%d current, %d stale, %d lost, %d adopted, %d surplus, %d unknown",
+             current, stale, lost, adopted, surplus, count - matched);
+}
+
+// MSG_REGISTER_SS: data starts with "manifest <files> <chunks>"; the other
+// chunks follow as MSG_SS_MANIFEST. A server seen before (same address)
+// gets its old slot back, so the metadata's references to it stay valid.
+void register_storage_server(int sock, Message* msg) {
+    ManifestEntry* entries = NULL;
+    int count = 0, capacity = 0, files = 0, chunks = 1;
+    
+    msg->data[MAX_BUFFER_SIZE - 1] = '\0';
+    char* lines = msg->data;
+    if (sscanf(msg->data, "manifest %d %d", &files, &chunks) == 2) {
+        lines = strchr(msg->data, '\n');
+        lines = lines ? lines + 1 : msg->data + strlen(msg->data);
+    }
+    parse_manifest(lines, &entries, &count, &capacity);
+    Message* chunk = (Message*)malloc(sizeof(Message));
+    for (int i = 1; chunk && i < chunks; i++) {
+        if (receive_message(sock, chunk) != 0 || chunk->type != MSG_SS_MANIFEST) break;
+        chunk->data[MAX_BUFFER_SIZE - 1] = '\0';
+        parse_manifest(chunk->data, &entries, &count, &capacity);
+    }
+    free(chunk);
+    int complete = count >= files;
+    if (!complete) {
+        log_message("NM", "Manifest from %s:%d incomplete (%d of %d files); no copies will be written off",
+                    msg->ss_ip, msg->ss_port, count, files);
+    }
+    if (count > 0) qsort(entries, count, sizeof(ManifestEntry), compare_manifest_entries);
+    
+    Message response;
+    memset(&response, 0, sizeof(response));
+    response.type = MSG_ACK;
+    
+    pthread_mutex_lock(&data_mutex);
+    int index = -1;
+    for (int i = 0; i < num_storage_servers; i++) {
+        if (storage_servers[i].nm_port == msg->ss_port && strcmp(storage_servers[i].ip, msg->ss_ip) == 0) {
+            index = i;
+            break;
+        }
+    }
+    int rejoined = index >= 0;
+    if (!rejoined) {
+        if (num_storage_servers == MAX_STORAGE_SERVERS) {
+            pthread_mutex_unlock(&data_mutex);
+            response.error_code = ERR_SERVER_ERROR;
+            strcpy(response.data, "Too many storage servers");
+            send_message(sock, &response);
+            free(entries);
+            return;
+        }
+        index = num_storage_servers++;
+        strcpy(storage_servers[index].ip, msg->ss_ip);
+        storage_servers[index].nm_port = msg->ss_port;
+    }
+    storage_servers[index].client_port = msg->flags;
+    storage_servers[index].capacity_weight = msg->word_index > 0 ? msg->word_index : 1;
+    storage_servers[index].is_active = 1;
+    time(&storage_servers[index].last_heartbeat);
+    detector_reset(index);
+    
+    SSBatch drops;
+    ss_batch_init(&drops, MSG_SS_DELETE, SS_DELETE_BATCH);
+    char summary[160] = "no files";
+    if (count > 0 || rejoined) {
+        reconcile_manifest(index, entries, count, complete, &drops, summary, sizeof(summary));
+    }
+    
+    // A restarted server has forgotten every file's epoch and would take
+    // revoked leases again: hand it the current ones before it opens to clients
+    SSBatch epochs;
+    ss_batch_init(&epochs, MSG_SS_EPOCH, SS_EPOCH_BATCH);
+    for (FileNode* file = file_list; file; file = file->next) {
+        if (file->metadata.epoch <= 0 || !holds_copy(file, index)) continue;
+        char line[MAX_FILENAME + 16];
+        snprintf(line, sizeof(line), "%d %s", file->metadata.epoch, file->metadata.filename);
+        ss_batch_add(&epochs, index, line);
+    }
+    
+    rebuild_ring();
+    request_rebalance();
+    save_metadata();
+    pthread_mutex_unlock(&data_mutex);
+    free(entries);
+    
+    ss_batch_send(&epochs);
+    
+    response.error_code = ERR_SUCCESS;
+    sprintf(response.data, "Storage Server %s (index: %d): %s", rejoined ? "re-attached" : "registered successfully",
+            index, summary);
+    send_message(sock, &response);
+    
+    log_message("NM", "Storage Server %s:%d %s (index %d): %s", msg->ss_ip, msg->ss_port,
+        rejoined ? "re-attached" : "registered", index, summary);
+    log_to_file("Storage Server %s:%d registered", msg->ss_ip, msg->ss_port);
+    
+    ss_batch_send(&drops);
+}
+
+// Saved tables start with a 4-byte magic and a format version, so a build
+// with a different struct layout refuses them instead of loading garbage
+void write_table_header(FILE* fp, const char* magic, int version) {
+    fwrite(magic, 1, 4, fp);
+    fwrite(&version, sizeof(int), 1, fp);
+}
+
+// Version of the table fp is positioned at, leaving fp after the header.
+// Files written before headers existed have none and report version 0.
+int read_table_header(FILE* fp, const char* magic) {
+    char found[4];
+    int version;
+    if (fread(found, 1, 4, fp) == 4 && memcmp(found, magic, 4) == 0 &&
+        fread(&version, sizeof(int), 1, fp) == 1) {
+        return version;
+    }
+    rewind(fp);
+    return 0;
+}
+
+// Bytes left in fp from the current position
+long table_bytes_left(FILE* fp) {
+    long here = ftell(fp);
+    fseek(fp, 0, SEEK_END);
+    long end = ftell(fp);
+    fseek(fp, here, SEEK_SET);
+    return end - here;
+}
+
+// Loading a table this build cannot read would start the name server empty
+// and overwrite the file on the next save: stop instead
+void refuse_table(const char* path, int version) {
+    log_message("NM", "ERROR: %s has unsupported format version %d; move it aside or run a matching build",
+               path, version);
+    exit(1);
+}
+
+// The server table, so slots survive a name server restart. Servers load as
+// inactive until they register or heartbeat again.
+void save_server_table() {
+    FILE* fp = fopen(SERVERS_FILE, "wb");
+    if (!fp) {
+        log_message("NM", "Error saving server table: %s", strerror(errno));
+        return;
+    }
+    write_table_header(fp, SERVERS_MAGIC, SERVERS_VERSION);
+    fwrite(&num_storage_servers, sizeof(int), 1, fp);
+    fwrite(storage_servers, sizeof(StorageServerInfo), num_storage_servers, fp);
+    fclose(fp);
+}
+
+void load_server_table() {
+    FILE* fp = fopen(SERVERS_FILE, "rb");
+    if (!fp) return;
+    
+    int version = read_table_header(fp, SERVERS_MAGIC);
+    if (version == 0) {
+        // Headerless tables were only written with the current StorageServerInfo
+        int count;
+        int fits = fread(&count, sizeof(int), 1, fp) == 1 && count >= 0 &&
+                   table_bytes_left(fp) == (long)(count * sizeof(StorageServerInfo));
+        rewind(fp);
+        if (!fits) {
+            fclose(fp);
+            refuse_table(SERVERS_FILE, version);
+        }
+        log_message("NM", "Migrating %s from the headerless format", SERVERS_FILE);
+    } else if (version != SERVERS_VERSION) {
+        fclose(fp);
+        refuse_table(SERVERS_FILE, version);
+    }
+    
+    int count = 0;
+    if (fread(&count, sizeof(int), 1, fp) == 1 && count > 0 && count <= MAX_STORAGE_SERVERS &&
+        fread(storage_servers, sizeof(StorageServerInfo), count, fp) == (size_t)count) {
+        num_storage_servers = count;
+        for (int i = 0; i < count; i++) {
+            storage_servers[i].is_active = 0;
+        }
+        log_message("NM", "Server table loaded (%d slot(s))", count);
+    }
+    fclose(fp);
+}
+
+// ═══════════════════════════════════════════════════════════════════
+// ACCESS REQUESTS - Pending requests, indexed by (file, requester) and
+//                   queued per owner, oldest first
+// ═══════════════════════════════════════════════════════════════════
+
+#define REQUESTS_FILE "nm_requests.dat"
+#define ACCESS_REQUEST_TTL (7 * 24 * 3600) // Seconds a request waits before it lapses
+#define REQUESTS_PAGE_SIZE 25 // Requests per VIEWREQUESTS page
+#define OWNER_BUCKETS 1024
+
+typedef struct RequestNode {
+    AccessRequest request;
+    char owner[MAX_USERNAME]; // Owner of the file when the request was made
+    struct RequestNode* next_in_bucket;
+    struct RequestNode* older; // Owner's queue
+    struct RequestNode* newer;
+} RequestNode;
+
+typedef struct OwnerQueue {
+    char owner[MAX_USERNAME];
+    RequestNode* oldest;
+    RequestNode* newest;
+    int count;
+    struct OwnerQueue* next;
+} OwnerQueue;
+
+RequestNode** request_buckets = NULL; // Grows with the number of requests
+int request_bucket_count = 0;
+OwnerQueue* owner_queues[OWNER_BUCKETS];
+int num_access_requests = 0;
+int requests_version = 0; // Bumped on every change, so shipping can skip unchanged tables
+
+unsigned int request_hash(const char* filename, const char* requester) {
+    unsigned int hash = 5381;
+    for (const char* p = filename; *p; p++) hash = ((hash << 5) + hash) + (unsigned char)*p;
+    hash = ((hash << 5) + hash) + '\n';
+    for (const char* p = requester; *p; p++) hash = ((hash << 5) + hash) + (unsigned char)*p;
+    return hash;
+}
+
+OwnerQueue* owner_queue(const char* owner, int create) {
+    OwnerQueue** slot = &owner_queues[hash_function(owner) % OWNER_BUCKETS];
+    while (*slot && strcmp((*slot)->owner, owner) != 0) {
+        slot = &(*slot)->next;
+    }
+    if (!*slot && create) {
+        *slot = (OwnerQueue*)calloc(1, sizeof(OwnerQueue));
+        if (*slot) strcpy((*slot)->owner, owner);
+    }
+    return *slot;
+}
+
+// Double the (file, requester) index once chains average two entries
+void grow_request_buckets() {
+    int grown_count = request_bucket_count ? request_bucket_count * 2 : 256;
+    RequestNode** grown = (RequestNode**)calloc(grown_count, sizeof(RequestNode*));
+    if (!grown) return;
+    
+    for (int b = 0; b < request_bucket_count; b++) {
+        RequestNode* node = request_buckets[b];
+        while (node) {
+            RequestNode* next = node->next_in_bucket;
+            unsigned int index = request_hash(node->request.filename, node->request.requester) % grown_count;
+            node->next_in_bucket = grown[index];
+            grown[index] = node;
+            node = next;
+        }
+    }
+    free(request_buckets);
+    request_buckets = grown;
+    request_bucket_count = grown_count;
+}
+
+void unlink_request_bucket(RequestNode* node) {
+    unsigned int index = request_hash(node->request.filename, node->request.requester) % request_bucket_count;
+    RequestNode** slot = &request_buckets[index];
+    while (*slot && *slot != node) {
+        slot = &(*slot)->next_in_bucket;
+    }
+    if (*slot) *slot = node->next_in_bucket;
+}
+
+void link_request_bucket(RequestNode* node) {
+    unsigned int index = request_hash(node->request.filename, node->request.requester) % request_bucket_count;
+    node->next_in_bucket = request_buckets[index];
+    request_buckets[index] = node;
+}
+
+void remove_access_request(RequestNode* node) {
+    unlink_request_bucket(node);
+    
+    OwnerQueue* queue = owner_queue(node->owner, 0);
+    if (queue) {
+        if (node->older) node->older->newer = node->newer; else queue->oldest = node->newer;
+        if (node->newer) node->newer->older = node->older; else queue->newest = node->older;
+        queue->count--;
+    }
+    
+    free(node);
+    num_access_requests--;
+    requests_version++;
+}
+
+// Drop an owner's requests that have waited too long; they are oldest first
+void expire_owner_requests(OwnerQueue* queue, time_t now) {
+    while (queue && queue->oldest && now - queue->oldest->request.request_time > ACCESS_REQUEST_TTL) {
+        remove_access_request(queue->oldest);
+    }
+}
+
+RequestNode* find_access_request(const char* filename, const char* requester) {
+    if (request_bucket_count == 0) return NULL;
+    
+    unsigned int index = request_hash(filename, requester) % request_bucket_count;
+    for (RequestNode* node = request_buckets[index]; node; node = node->next_in_bucket) {
+        if (strcmp(node->request.filename, filename) != 0 || strcmp(node->request.requester, requester) != 0) continue;
+        if (time(NULL) - node->request.request_time > ACCESS_REQUEST_TTL) {
+            remove_access_request(node);
+            return NULL;
+        }
+        return node;
+    }
+    return NULL;
+}
+
+RequestNode* add_access_request(const char* owner, const AccessRequest* request) {
+    if (num_access_requests >= request_bucket_count * 2) grow_request_buckets();
+    OwnerQueue* queue = owner_queue(owner, 1);
+    RequestNode* node = (RequestNode*)calloc(1, sizeof(RequestNode));
+    if (!queue || !node || request_bucket_count == 0) {
+        free(node);
+        return NULL;
+    }
+    
+    node->request = *request;
+    strcpy(node->owner, owner);
+    link_request_bucket(node);
+    
+    node->older = queue->newest;
+    if (queue->newest) queue->newest->newer = node; else queue->oldest = node;
+    queue->newest = node;
+    queue->count++;
+    
+    num_access_requests++;
+    requests_version++;
+    return node;
+}
+
+// A file was deleted or moved to another shard: its requests go with it
+void drop_file_requests(const char* owner, const char* filename) {
+    OwnerQueue* queue = owner_queue(owner, 0);
+    RequestNode* node = queue ? queue->oldest : NULL;
+    while (node) {
+        RequestNode* newer = node->newer;
+        if (strcmp(node->request.filename, filename) == 0) remove_access_request(node);
+        node = newer;
+    }
+}
+
+// A file was moved into a folder: keep its requests under the new name
+void rename_file_requests(const char* owner, const char* old_filename, const char* new_filename) {
+    OwnerQueue* queue = owner_queue(owner, 0);
+    for (RequestNode* node = queue ? queue->oldest : NULL; node; node = node->newer) {
+        if (strcmp(node->request.filename, old_filename) != 0) continue;
+        unlink_request_bucket(node);
+        strcpy(node->request.filename, new_filename);
+        link_request_bucket(node);
+        requests_version++;
+    }
+}
+
+void clear_access_requests() {
+    for (int b = 0; b < OWNER_BUCKETS; b++) {
+        while (owner_queues[b]) {
+            OwnerQueue* queue = owner_queues[b];
+            while (queue->oldest) {
+                RequestNode* newer = queue->oldest->newer;
+                free(queue->oldest);
+                queue->oldest = newer;
+            }
+            owner_queues[b] = queue->next;
+            free(queue);
+        }
+    }
+    if (request_bucket_count > 0) memset(request_buckets, 0, request_bucket_count * sizeof(RequestNode*));
+    num_access_requests = 0;
+    requests_version++;
+}
+
+// Requests are saved with the metadata: owner, then the request.
+// The file is only rewritten when a request changed.
+void save_access_requests() {
+    static int saved_version = -1;
+    if (requests_version == saved_version) return;
+    
+    FILE* fp = fopen(REQUESTS_FILE, "wb");
+    if (!fp) {
+        log_message("NM", "Error saving access requests: %s", strerror(errno));
+        return;
+    }
+    saved_version = requests_version;
+    for (int b = 0; b < OWNER_BUCKETS; b++) {
+        for (OwnerQueue* queue = owner_queues[b]; queue; queue = queue->next) {
+            for (RequestNode* node = queue->oldest; node; node = node->newer) {
+                fwrite(node->owner, MAX_USERNAME, 1, fp);
+                fwrite(&node->request, sizeof(AccessRequest), 1, fp);
+            }
+        }
+    }
+    fclose(fp);
+}
+
+void load_access_requests() {
+    FILE* fp = fopen(REQUESTS_FILE, "rb");
+    if (!fp) return;
+    
+    char owner[MAX_USERNAME];
+    AccessRequest request;
+    time_t now = time(NULL);
+    while (fread(owner, MAX_USERNAME, 1, fp) == 1 && fread(&request, sizeof(AccessRequest), 1, fp) == 1) {
+        owner[MAX_USERNAME - 1] = '\0';
+        request.filename[MAX_FILENAME - 1] = '\0';
+        request.requester[MAX_USERNAME - 1] = '\0';
+        if (now - request.request_time > ACCESS_REQUEST_TTL) continue;
+        add_access_request(owner, &request);
+    }
+    fclose(fp);
+    if (num_access_requests > 0) {
+        log_message("NM", "Access requests loaded (%d pending)", num_access_requests);
+    }
+}
+
+// ═══════════════════════════════════════════════════════════════════
+// STANDBY - Ship metadata changes to hot standby name servers, and let a
+//           standby take over when the primary goes away
+// ═══════════════════════════════════════════════════════════════════
+
+#define FENCE_FILE "nm_fence.dat"
+#define SHIP_INTERVAL_MS 1000 // Keepalive and change sweep period
+#define STANDBY_TIMEOUT 3 // Seconds of silence before a standby gives up on the primary
+#define MAX_STANDBYS 4
+#define SHIPPED_BUCKETS 1024
+#define SHIP_SNAPSHOT_BEGIN 1 // word_index bits of MSG_NM_METADATA
+#define SHIP_SNAPSHOT_END 2
+
+int nm_port = NM_PORT;
+char fence_path[256] = FENCE_FILE;
+char primary_ip[INET_ADDRSTRLEN] = ""; // Set with --standby: follow this name server
+int primary_port = NM_PORT;
+long nm_generation = 0; // Our term as primary; a higher one in the fence file retires us
+char nm_node_id[320] = ""; // "<host>:<port>", recorded in the fence file next to our generation
+int force_primary = 0;     // --force-primary: start as primary over another node's fence
+
+// Last record shipped per file (primary), or received in the current
+// snapshot (standby)
+typedef struct ShippedRecord {
+    char filename[MAX_FILENAME];
+    unsigned long long hash;
+    int round;
+    struct ShippedRecord* next;
+} ShippedRecord;
+
+ShippedRecord* shipped[SHIPPED_BUCKETS];
+int ship_round = 0;
+unsigned long long shipped_servers_hash = 0;
+int shipped_requests_version = -1;
+
+int standby_socks[MAX_STANDBYS];
+int num_standbys = 0;
+int ship_requested = 0;
+int ship_resync = 0; // A standby joined: ship everything again
+int receiving_snapshot = 0; // Standby: between snapshot begin and end
+pthread_mutex_t ship_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ship_cond = PTHREAD_COND_INITIALIZER;
+
+// Batches of records being assembled for one ship
+typedef struct {
+    Message** batches;
+    int count;
+    int capacity;
+} ShipBuilder;
+
+// Fence file: "<generation> <node id>". The node id is empty when the file
+// predates it.
+long read_fence_owner(char* owner, size_t size) {
+    long generation = 0;
+    char node[320] = "";
+    FILE* fp = fopen(fence_path, "r");
+    if (fp) {
+        if (fscanf(fp, "%ld %319s", &generation, node) < 1) generation = 0;
+        fclose(fp);
+    }
+    if (owner) snprintf(owner, size, "%s", node);
+    return generation;
+}
+
+long read_fence() {
+    return read_fence_owner(NULL, 0);
+}
+
+int write_fence(long generation) {
+    char tmp_path[300];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", fence_path);
+    FILE* fp = fopen(tmp_path, "w");
+    if (!fp) {
+        log_message("NM", "Error writing fence file %s: %s", fence_path, strerror(errno));
+        return -1;
+    }
+    fprintf(fp, "%ld %s\n", generation, nm_node_id);
+    fclose(fp);
+    return rename(tmp_path, fence_path);
+}
+
+unsigned long long ship_hash(unsigned long long hash, const void* bytes, size_t len) {
+    const unsigned char* p = (const unsigned char*)bytes;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+unsigned long long file_record_hash(FileNode* file) {
+    unsigned long long hash = 14695981039346656037ULL;
+    hash = ship_hash(hash, &file->metadata, sizeof(FileMetadata));
+    hash = ship_hash(hash, &file->access_count, sizeof(int));
+    return ship_hash(hash, file->access_list, file->access_count * sizeof(UserAccess));
+}
+
+// Heartbeat times change every half second and are not worth shipping
+unsigned long long server_table_hash() {
+    unsigned long long hash = ship_hash(14695981039346656037ULL, &num_storage_servers, sizeof(int));
+    for (int i = 0; i < num_storage_servers; i++) {
+        StorageServerInfo info = storage_servers[i];
+        info.last_heartbeat = 0;
+        hash = ship_hash(hash, &info, sizeof(info));
+    }
+    return hash;
+}
+
+ShippedRecord** shipped_slot(const char* filename) {
+    ShippedRecord** slot = &shipped[hash_function(filename) % SHIPPED_BUCKETS];
+    while (*slot && strcmp((*slot)->filename, filename) != 0) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+// Remember a record; returns 1 if it is new or differs from the last one
+int shipped_note(const char* filename, unsigned long long hash) {
+    ShippedRecord** slot = shipped_slot(filename);
+    if (!*slot) {
+        ShippedRecord* record = (ShippedRecord*)calloc(1, sizeof(ShippedRecord));
+        if (!record) return 1;
+        strcpy(record->filename, filename);
+        *slot = record;
+    } else if ((*slot)->hash == hash) {
+        (*slot)->round = ship_round;
+        return 0;
+    }
+    (*slot)->hash = hash;
+    (*slot)->round = ship_round;
+    return 1;
+}
+
+void shipped_clear() {
+    for (int b = 0; b < SHIPPED_BUCKETS; b++) {
+        while (shipped[b]) {
+            ShippedRecord* next = shipped[b]->next;
+            free(shipped[b]);
+            shipped[b] = next;
+        }
+    }
+    shipped_servers_hash = 0;
+    shipped_requests_version = -1;
+}
+
+// Space for one record of len bytes, in a new batch if the current one is full
+char* ship_record(ShipBuilder* builder, char kind, int len) {
+    if (1 + len > MAX_BUFFER_SIZE) return NULL;
+    
+    Message* batch = builder->count > 0 ? builder->batches[builder->count - 1] : NULL;
+    if (!batch || batch->data_len + 1 + len > MAX_BUFFER_SIZE) {
+        if (builder->count == builder->capacity) {
+            int grown_capacity = builder->capacity * 2 + 4;
+            Message** grown = (Message**)realloc(builder->batches, grown_capacity * sizeof(Message*));
+            if (!grown) return NULL;
+            builder->batches = grown;
+            builder->capacity = grown_capacity;
+        }
+        batch = (Message*)calloc(1, sizeof(Message));
+        if (!batch) return NULL;
+        batch->type = MSG_NM_METADATA;
+        builder->batches[builder->count++] = batch;
+    }
+    
+    char* record = batch->data + batch->data_len;
+    record[0] = kind;
+    batch->data_len += 1 + len;
+    return record + 1;
+}
+
+// Records that changed since the last ship: 'F' file (metadata, access
+// count, access list), 'D' deleted file name, 'S' server table, and the
+// access requests as 'R' (reset) followed by one 'Q' (owner, request) each.
+// Caller holds data_mutex.
+void collect_metadata_changes(ShipBuilder* builder) {
+    ship_round++;
+    
+    for (FileNode* file = file_list; file; file = file->next) {
+        if (!shipped_note(file->metadata.filename, file_record_hash(file))) continue;
+        
+        int access_bytes = file->access_count * sizeof(UserAccess);
+        char* record = ship_record(builder, 'F', sizeof(FileMetadata) + sizeof(int) + access_bytes);
+        if (!record) {
+            log_message("NM", "Cannot ship metadata of %s", file->metadata.filename);
+            continue;
+        }
+        memcpy(record, &file->metadata, sizeof(FileMetadata));
+        memcpy(record + sizeof(FileMetadata), &file->access_count, sizeof(int));
+        memcpy(record + sizeof(FileMetadata) + sizeof(int), file->access_list, access_bytes);
+    }
+    
+    for (int b = 0; b < SHIPPED_BUCKETS; b++) {
+        ShippedRecord** slot = &shipped[b];
+        while (*slot) {
+            ShippedRecord* record = *slot;
+            if (record->round == ship_round) {
+                slot = &record->next;
+                continue;
+            }
+            char* deleted = ship_record(builder, 'D', MAX_FILENAME);
+            if (deleted) memcpy(deleted, record->filename, MAX_FILENAME);
+            *slot = record->next;
+            free(record);
+        }
+    }
+    
+    unsigned long long servers_hash = server_table_hash();
+    if (servers_hash != shipped_servers_hash) {
+        int table_bytes = num_storage_servers * sizeof(StorageServerInfo);
+        char* record = ship_record(builder, 'S', sizeof(int) + table_bytes);
+        if (record) {
+            memcpy(record, &num_storage_servers, sizeof(int));
+            memcpy(record + sizeof(int), storage_servers, table_bytes);
+            shipped_servers_hash = servers_hash;
+        }
+    }
+    
+    if (requests_version != shipped_requests_version && ship_record(builder, 'R', 0)) {
+        for (int b = 0; b < OWNER_BUCKETS; b++) {
+            for (OwnerQueue* queue = owner_queues[b]; queue; queue = queue->next) {
+                for (RequestNode* node = queue->oldest; node; node = node->newer) {
+                    char* record = ship_record(builder, 'Q', MAX_USERNAME + sizeof(AccessRequest));
+                    if (!record) continue;
+                    memcpy(record, node->owner, MAX_USERNAME);
+                    memcpy(record + MAX_USERNAME, &node->request, sizeof(AccessRequest));
+                }
+            }
+        }
+        shipped_requests_version = requests_version;
+    }
+}
+
+// Called with data_mutex held after metadata changes
+void request_metadata_ship() {
+    pthread_mutex_lock(&ship_mutex);
+    if (num_standbys > 0) {
+        ship_requested = 1;
+        pthread_cond_signal(&ship_cond);
+    }
+    pthread_mutex_unlock(&ship_mutex);
+}
+
+// Primary: stream changed records to the standbys, at every save and at
+// least once a second (an empty batch is the keepalive). Also steps down
+// if a standby has taken over in the meantime.
+void* ship_thread(void* arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&ship_mutex);
+        if (!ship_requested) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += SHIP_INTERVAL_MS / 1000;
+            pthread_cond_timedwait(&ship_cond, &ship_mutex, &deadline);
+        }
+        ship_requested = 0;
+        int resync = ship_resync;
+        ship_resync = 0;
+        int count = num_standbys;
+        int socks[MAX_STANDBYS];
+        memcpy(socks, standby_socks, sizeof(socks));
+        pthread_mutex_unlock(&ship_mutex);
+        
+        long fence = read_fence();
+        if (fence > nm_generation) {
+            log_message("NM", "Name server generation %ld has taken over (ours is %ld); stepping down",
+                       fence, nm_generation);
+            exit(1);
+        }
+        if (count == 0) continue;
+        
+        ShipBuilder builder = {NULL, 0, 0};
+        pthread_mutex_lock(&data_mutex);
+        if (resync) shipped_clear();
+        collect_metadata_changes(&builder);
+        int epoch = location_epoch;
+        pthread_mutex_unlock(&data_mutex);
+        
+        Message* keepalive = NULL;
+        if (builder.count == 0) {
+            keepalive = (Message*)calloc(1, sizeof(Message));
+            if (!keepalive) continue;
+            keepalive->type = MSG_NM_METADATA;
+        }
+        int batches = keepalive ? 1 : builder.count;
+        
+        int failed[MAX_STANDBYS] = {0};
+        for (int i = 0; i < batches; i++) {
+            Message* batch = keepalive ? keepalive : builder.batches[i];
+            batch->flags = (int)nm_generation;
+            batch->epoch = epoch;
+            if (resync && i == 0) batch->word_index |= SHIP_SNAPSHOT_BEGIN;
+            if (resync && i == batches - 1) batch->word_index |= SHIP_SNAPSHOT_END;
+            for (int s = 0; s < count; s++) {
+                if (!failed[s] && send_compact_message(socks[s], batch) < 0) failed[s] = 1;
+            }
+        }
+        
+        for (int i = 0; i < builder.count; i++) free(builder.batches[i]);
+        free(builder.batches);
+        free(keepalive);
+        
+        pthread_mutex_lock(&ship_mutex);
+        for (int s = 0; s < count; s++) {
+            if (!failed[s]) continue;
+            for (int j = 0; j < num_standbys; j++) {
+                if (standby_socks[j] != socks[s]) continue;
+                log_message("NM", "Standby name server dropped");
+                close(standby_socks[j]);
+                standby_socks[j] = standby_socks[--num_standbys];
+                break;
+            }
+        }
+        pthread_mutex_unlock(&ship_mutex);
+    }
+    return NULL;
+}
+
+// A standby asks for the metadata stream. Keeps the socket.
+void handle_standby_join(int standby_sock, Message* msg) {
+    Message response;
+    memset(&response, 0, sizeof(response));
+    response.type = MSG_ACK;
+    response.flags = (int)nm_generation;
+    
+    pthread_mutex_lock(&ship_mutex);
+    if (num_standbys >= MAX_STANDBYS) {
+        pthread_mutex_unlock(&ship_mutex);
+        response.error_code = ERR_SERVER_ERROR;
+        strcpy(response.data, "Too many standby name servers");
+        send_message(standby_sock, &response);
+        close(standby_sock);
+        return;
+    }
+    standby_socks[num_standbys++] = standby_sock;
+    ship_resync = 1;
+    ship_requested = 1;
+    pthread_cond_signal(&ship_cond);
+    pthread_mutex_unlock(&ship_mutex);
+    
+    send_message(standby_sock, &response);
+    
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    char standby_ip[INET_ADDRSTRLEN] = "?";
+    if (getpeername(standby_sock, (struct sockaddr*)&addr, &addr_len) == 0) {
+        inet_ntop(AF_INET, &addr.sin_addr, standby_ip, sizeof(standby_ip));
+    }
+    log_message("NM", "Standby name server %s:%d following (generation %ld)",
+               standby_ip, msg->ss_port, nm_generation);
+}
+
+// Standby: apply one batch from the primary. Returns 1 if a snapshot ended.
+int apply_metadata_batch(Message* msg) {
+    int snapshot_ended = 0;
+    
+    pthread_mutex_lock(&data_mutex);
+    if (msg->word_index & SHIP_SNAPSHOT_BEGIN) {
+        shipped_clear();
+        receiving_snapshot = 1;
+    }
+    if (msg->epoch > location_epoch) location_epoch = msg->epoch;
+    
+    int offset = 0;
+    while (offset < msg->data_len) {
+        char kind = msg->data[offset++];
+        const char* record = msg->data + offset;
+        int remaining = msg->data_len - offset;
+        
+        if (kind == 'F' && remaining >= (int)(sizeof(FileMetadata) + sizeof(int))) {
+            FileMetadata metadata;
+            int access_count;
+            memcpy(&metadata, record, sizeof(FileMetadata));
+            memcpy(&access_count, record + sizeof(FileMetadata), sizeof(int));
+            int access_bytes = access_count * sizeof(UserAccess);
+            if (access_count < 0 || remaining < (int)(sizeof(FileMetadata) + sizeof(int)) + access_bytes) break;
+            metadata.filename[MAX_FILENAME - 1] = '\0';
+            
+            UserAccess* access_list = (UserAccess*)malloc(access_bytes > 0 ? access_bytes : 1);
+            if (!access_list) break;
+            memcpy(access_list, record + sizeof(FileMetadata) + sizeof(int), access_bytes);
+            
+            FileNode* file = lookup_file_node(metadata.filename);
+            if (file) {
+                memcpy(&file->metadata, &metadata, sizeof(FileMetadata));
+                free(file->access_list);
+                file->access_list = access_list;
+                file->access_count = access_count;
+            } else {
+                insert_file_node(&metadata, access_count, access_list);
+            }
+            if (receiving_snapshot) shipped_note(metadata.filename, 0);
+            offset += sizeof(FileMetadata) + sizeof(int) + access_bytes;
+        } else if (kind == 'D' && remaining >= MAX_FILENAME) {
+            char filename[MAX_FILENAME];
+            memcpy(filename, record, MAX_FILENAME);
+            filename[MAX_FILENAME - 1] = '\0';
+            remove_file_node(filename);
+            offset += MAX_FILENAME;
+        } else if (kind == 'S' && remaining >= (int)sizeof(int)) {
+            int count;
+            memcpy(&count, record, sizeof(int));
+            if (count < 0 || count > MAX_STORAGE_SERVERS ||
+                remaining < (int)(sizeof(int) + count * sizeof(StorageServerInfo))) break;
+            memcpy(storage_servers, record + sizeof(int), count * sizeof(StorageServerInfo));
+            num_storage_servers = count;
+            offset += sizeof(int) + count * sizeof(StorageServerInfo);
+        } else if (kind == 'R') {
+            clear_access_requests();
+        } else if (kind == 'Q' && remaining >= (int)(MAX_USERNAME + sizeof(AccessRequest))) {
+            char owner[MAX_USERNAME];
+            AccessRequest request;
+            memcpy(owner, record, MAX_USERNAME);
+            memcpy(&request, record + MAX_USERNAME, sizeof(AccessRequest));
+            owner[MAX_USERNAME - 1] = '\0';
+            request.filename[MAX_FILENAME - 1] = '\0';
+            request.requester[MAX_USERNAME - 1] = '\0';
+            add_access_request(owner, &request);
+            offset += MAX_USERNAME + sizeof(AccessRequest);
+        } else {
+            log_message("NM", "Malformed metadata batch from the primary");
+            break;
+        }
+    }
+    
+    // Files the snapshot did not mention were deleted while we were away
+    if (receiving_snapshot && (msg->word_index & SHIP_SNAPSHOT_END)) {
+        FileNode* file = file_list;
+        while (file) {
+            FileNode* next = file->next;
+            if (!*shipped_slot(file->metadata.filename)) {
+                remove_file_node(file->metadata.filename);
+            }
+            file = next;
+        }
+        shipped_clear();
+        receiving_snapshot = 0;
+        snapshot_ended = 1;
+    }
+    pthread_mutex_unlock(&data_mutex);
+    return snapshot_ended;
+}
+
+// Follow the primary's metadata stream; returns once this server should
+// take over. Only a standby that holds a full snapshot ever takes over.
+long follow_primary() {
+    Message* msg = (Message*)calloc(1, sizeof(Message));
+    if (!msg) exit(1);
+    
+    int synced = 0; // Holds a complete snapshot
+    int misses = 0;
+    long primary_generation = 0;
+    time_t last_save = 0;
+    
+    while (1) {
+        int sock = connect_to_server(primary_ip, primary_port);
+        if (sock >= 0) {
+            struct timeval timeout = {STANDBY_TIMEOUT, 0};
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            
+            memset(msg, 0, sizeof(Message));
+            msg->type = MSG_NM_STANDBY;
+            msg->ss_port = nm_port;
+            send_message(sock, msg);
+            if (receive_message(sock, msg) == 0 && msg->error_code == ERR_SUCCESS) {
+                primary_generation = msg->flags;
+                misses = 0;
+                log_message("NM", "Following primary name server %s:%d (generation %ld)",
+                           primary_ip, primary_port, primary_generation);
+                
+                while (receive_compact_message(sock, msg) == 0 && msg->type == MSG_NM_METADATA) {
+                    primary_generation = msg->flags;
+                    if (apply_metadata_batch(msg) && !synced) {
+                        synced = 1;
+                        log_message("NM", "Standby holds a full copy of the metadata (%d file(s))", count_files());
+                    }
+                    if (msg->data_len > 0 && time(NULL) != last_save) {
+                        pthread_mutex_lock(&data_mutex);
+                        save_metadata();
+                        pthread_mutex_unlock(&data_mutex);
+                        last_save = time(NULL);
+                    }
+                }
+                log_message("NM", "Lost the metadata stream from the primary name server");
+            }
+            close(sock);
+        }
+        
+        // One retry before taking over, so a brief hiccup is not a failover
+        if (synced && ++misses >= 2) break;
+        sleep(1);
+    }
+    free(msg);
+    return primary_generation;
+}
+
+// The primary is gone: fence it off with a newer generation and serve with
+// the metadata already in memory
+void take_over(long primary_generation) {
+    long fence = read_fence();
+    nm_generation = (fence > primary_generation ? fence : primary_generation) + 1;
+    write_fence(nm_generation);
+    
+    pthread_mutex_lock(&data_mutex);
+    time_t now = time(NULL);
+    for (int i = 0; i < num_storage_servers; i++) {
+        storage_servers[i].last_heartbeat = now; // Their sessions move over to us
+        detector_reset(i);
+    }
+    rebuild_ring(); // The shipped server table never built one here
+    shipped_clear();
+    save_metadata();
+    pthread_mutex_unlock(&data_mutex);
+    
+    log_message("NM", "Taking over as primary name server (generation %ld, %d file(s), %d server(s))",
+               nm_generation, count_files(), num_storage_servers);
+}
+
+// ═══════════════════════════════════════════════════════════════════
+// SHARDING - Split the namespace across name servers by top-level name;
+//            a MOVE between shards is prepared, applied, then committed
+// ═══════════════════════════════════════════════════════════════════
+
+#define MAX_PREPARED_MOVES 16
+#define PREPARED_MOVE_TIMEOUT 30 // Seconds before an unfinished move in is dropped
+#define MOVE_COMMIT_ATTEMPTS 3 // Tried while the client waits; later ones come from the retry thread
+#define COMMITTED_MOVES 64 // Recent commits remembered, so a resent COMMIT succeeds again
+#define MAX_PENDING_COMMITS 64
+#define COMMIT_RETRY_INTERVAL 2 // Seconds between COMMIT resends to an unreachable shard
+#define PENDING_COMMITS_FILE "nm_moves.dat"
+
+char shard_ips[MAX_NM_SHARDS][INET_ADDRSTRLEN];
+int shard_ports[MAX_NM_SHARDS];
+int num_shards = 0; // 0 = this name server holds the whole namespace
+int shard_index = 0;
+
+// A file reserved by MSG_NM_MOVE_PREPARE, waiting for commit or abort
+typedef struct {
+    int in_use;
+    int source_shard; // Move id: the mover's shard and its sequence number
+    int move_seq;
+    FileMetadata metadata; // Under its new name; server indexes are ours
+    int access_count;
+    UserAccess* access_list;
+    time_t prepared_at;
+} PreparedMove;
+
+// A move this shard committed; a COMMIT resent after a lost reply finds it here
+typedef struct {
+    int source_shard;
+    int move_seq;
+    char filename[MAX_FILENAME];
+} CommittedMove;
+
+// A move out of this shard whose files are already renamed: the outcome is
+// commit, and COMMIT is resent until the destination answers. Only an
+// explicit refusal (its reservation expired) undoes the rename.
+typedef struct {
+    int in_use;
+    int in_flight; // Being settled by the MOVE request that started it
+    int dest;
+    int move_seq;
+    char from[MAX_FILENAME];
+    char to[MAX_FILENAME];
+    char ips[MAX_REPLICAS + 1][INET_ADDRSTRLEN]; // Holders, primary first
+    int ports[MAX_REPLICAS + 1];
+    int holders;
+} PendingCommit;
+
+PreparedMove prepared_moves[MAX_PREPARED_MOVES];
+CommittedMove committed_moves[COMMITTED_MOVES];
+PendingCommit pending_commits[MAX_PENDING_COMMITS];
+int next_committed_move = 0;
+int move_seq = 0; // Last move id this shard handed out
+
+int owns_name(const char* name) {
+    return num_shards <= 1 || shard_of(name, num_shards) == shard_index;
+}
+
+int format_shard_map(char* buffer, size_t size) {
+    int len = 0;
+    buffer[0] = '\0';
+    for (int i = 0; i < num_shards && len < (int)size; i++) {
+        len += snprintf(buffer + len, size - len, "%s%s:%d", i ? "," : "", shard_ips[i], shard_ports[i]);
+    }
+    return len;
+}
+
+void handle_shard_map(int client_sock) {
+    Message response;
+    memset(&response, 0, sizeof(response));
+    response.type = MSG_RESPONSE;
+    response.error_code = ERR_SUCCESS;
+    response.flags = num_shards;
+    response.word_index = shard_index;
+    format_shard_map(response.data, sizeof(response.data));
+    send_message(client_sock, &response);
+}
+
+// A client request for a name another shard owns: send it the map so it
+// can refresh its copy. Returns 1 if the request was turned away.
+int reject_foreign_request(int client_sock, Message* msg) {
+    if (msg->type < MSG_VIEW_FILES || msg->type > MSG_SET_REPLICATION) return 0;
+    const char* name = request_shard_name(msg);
+    if (!name || owns_name(name)) return 0;
+    
+    Message response;
+    memset(&response, 0, sizeof(response));
+    response.type = MSG_RESPONSE;
+    response.error_code = ERR_WRONG_SHARD;
+    response.flags = num_shards;
+    format_shard_map(response.data, sizeof(response.data));
+    send_message(client_sock, &response);
+    return 1;
+}
+
+int find_server_slot(const char* ip, int nm_port) {
+    for (int i = 0; i < num_storage_servers; i++) {
+        if (storage_servers[i].nm_port == nm_port && strcmp(storage_servers[i].ip, ip) == 0) return i;
+    }
+    return -1;
+}
+
+// One request to another name server
+int shard_call(int shard, Message* request, Message* reply) {
+    int sock = connect_to_server(shard_ips[shard], shard_ports[shard]);
+    if (sock < 0) return -1;
+    send_message(sock, request);
+    int result = receive_message(sock, reply);
+    close(sock);
+    return result;
+}
+
+// Drop reservations whose mover never came back (data_mutex held)
+void expire_prepared_moves(time_t now) {
+    for (int i = 0; i < MAX_PREPARED_MOVES; i++) {
+        PreparedMove* move = &prepared_moves[i];
+        if (move->in_use && now - move->prepared_at > PREPARED_MOVE_TIMEOUT) {
+            log_message("NM", "Dropping unfinished move of %s", move->metadata.filename);
+            free(move->access_list);
+            move->in_use = 0;
+        }
+    }
+}
+
+PreparedMove* find_prepared_move(const char* filename) {
+    for (int i = 0; i < MAX_PREPARED_MOVES; i++) {
+        if (prepared_moves[i].in_use && strcmp(prepared_moves[i].metadata.filename, filename) == 0) {
+            return &prepared_moves[i];
+        }
+    }
+    return NULL;
+}
+
+// The move id of a MSG_NM_MOVE_* request is flags (source shard) and word_index
+int is_same_move(PreparedMove* move, Message* msg) {
+    return move->source_shard == msg->flags && move->move_seq == msg->word_index;
+}
+
+int move_was_committed(Message* msg) {
+    for (int i = 0; i < COMMITTED_MOVES; i++) {
+        CommittedMove* move = &committed_moves[i];
+        if (move->move_seq == msg->word_index && move->source_shard == msg->flags &&
+            strcmp(move->filename, msg->filename) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Destination shard, phase one: check the folder and the name, map the
+// holders (sent as "<ip> <nm_port>" lines after the access list) onto our
+// server table and hold the record until commit
+void handle_move_prepare(int sock, Message* msg) {
+    Message response;
+    memset(&response, 0, sizeof(response));
+    response.type = MSG_RESPONSE;
+    response.error_code = ERR_SUCCESS;
+    
+    FileMetadata metadata;
+    int access_count = 0;
+    int header = sizeof(FileMetadata) + sizeof(int);
+    if (msg->data_len >= header) {
+        memcpy(&metadata, msg->data, sizeof(FileMetadata));
+        memcpy(&access_count, msg->data + sizeof(FileMetadata), sizeof(int));
+    }
+    int access_bytes = access_count * sizeof(UserAccess);
+    if (msg->data_len < header || access_count < 0 || msg->data_len < header + access_bytes) {
+        response.error_code = ERR_INVALID_COMMAND;
+        strcpy(response.data, "ERROR: Malformed move");
+        send_message(sock, &response);
+        return;
+    }
+    metadata.filename[MAX_FILENAME - 1] = '\0';
+    
+    pthread_mutex_lock(&data_mutex);
+    expire_prepared_moves(time(NULL));
+    
+    FolderNode* folder = folder_list;
+    while (folder && strcmp(folder->foldername, metadata.folder_path) != 0) {
+        folder = folder->next;
+    }
+    PreparedMove* slot = NULL;
+    for (int i = 0; i < MAX_PREPARED_MOVES && !slot; i++) {
+        if (!prepared_moves[i].in_use) slot = &prepared_moves[i];
+    }
+    
+    // Holders, primary first
+    char holders[MAX_BUFFER_SIZE];
+    int holders_len = msg->data_len - header - access_bytes;
+    if (holders_len >= (int)sizeof(holders)) holders_len = sizeof(holders) - 1;
+    memcpy(holders, msg->data + header + access_bytes, holders_len);
+    holders[holders_len] = '\0';
+    int servers[MAX_REPLICAS + 1];
+    int server_count = 0;
+    char* saveptr = NULL;
+    for (char* line = strtok_r(holders, "\n", &saveptr); line && server_count <= MAX_REPLICAS;
+         line = strtok_r(NULL, "\n", &saveptr)) {
+        char ip[INET_ADDRSTRLEN];
+        int port;
+        if (sscanf(line, "%15s %d", ip, &port) != 2) continue;
+        int index = find_server_slot(ip, port);
+        if (index >= 0 || server_count == 0) servers[server_count++] = index;
+    }
+    
+    if (!folder) {
+        response.error_code = ERR_FILE_NOT_FOUND;
+        sprintf(response.data, "ERROR: Folder '%s' not found. Create it first with CREATEFOLDER.", metadata.folder_path);
+    } else if (lookup_file_node(metadata.filename) || find_prepared_move(metadata.filename)) {
+        response.error_code = ERR_FILE_EXISTS;
+        sprintf(response.data, "ERROR: '%s' already exists", metadata.filename);
+    } else if (server_count == 0 || servers[0] < 0) {
+        response.error_code = ERR_NO_STORAGE_SERVER;
+        strcpy(response.data, "ERROR: Storage server not known to the destination name server");
+    } else if (!slot) {
+        response.error_code = ERR_SERVER_ERROR;
+        strcpy(response.data, "ERROR: Too many moves in progress");
+    } else {
+        slot->access_list = (UserAccess*)malloc(access_bytes > 0 ? access_bytes : 1);
+        if (!slot->access_list) {
+            response.error_code = ERR_SERVER_ERROR;
+            strcpy(response.data, "ERROR: Out of memory");
+        } else {
+            memcpy(slot->access_list, msg->data + header, access_bytes);
+            slot->access_count = access_count;
+            metadata.ss_index = servers[0];
+            metadata.num_replicas = server_count - 1;
+            memcpy(metadata.replicas, servers + 1, (server_count - 1) * sizeof(int));
+            memcpy(&slot->metadata, &metadata, sizeof(FileMetadata));
+            slot->source_shard = msg->flags;
+            slot->move_seq = msg->word_index;
+            slot->prepared_at = time(NULL);
+            slot->in_use = 1;
+        }
+    }
+    pthread_mutex_unlock(&data_mutex);
+    
+    send_message(sock, &response);
+}
+
+// Destination shard, phase two: the file is renamed on its storage servers
+void handle_move_commit(int sock, Message* msg) {
+    Message response;
+    memset(&response, 0, sizeof(response));
+    response.type = MSG_RESPONSE;
+    response.error_code = ERR_SUCCESS;
+    
+    SSBatch drops;
+    ss_batch_init(&drops, MSG_SS_DELETE, SS_DELETE_BATCH);
+    
+    pthread_mutex_lock(&data_mutex);
+    PreparedMove* move = find_prepared_move(msg->filename);
+    if (move && !is_same_move(move, msg)) move = NULL;
+    if (!move && move_was_committed(msg)) {
+        // Our reply to the first COMMIT was lost; the mover must not undo it
+        log_message("NM", "Move of %s already committed", msg->filename);
+    } else if (!move) {
+        response.error_code = ERR_FILE_NOT_FOUND;
+        strcpy(response.data, "ERROR: No such move in progress");
+    } else {
+        FileNode* file = insert_file_node(&move->metadata, move->access_count, move->access_list);
+        move->in_use = 0;
+        CommittedMove* committed = &committed_moves[next_committed_move];
+        next_committed_move = (next_committed_move + 1) % COMMITTED_MOVES;
+        committed->source_shard = move->source_shard;
+        committed->move_seq = move->move_seq;
+        strcpy(committed->filename, msg->filename);
+        if (file) {
+            FolderNode* folder = folder_list;
+            while (folder && strcmp(folder->foldername, file->metadata.folder_path) != 0) {
+                folder = folder->next;
+            }
+            if (folder && folder->replication_factor > 0) {
+                set_replication_factor(file, folder->replication_factor, &drops);
+            }
+            mark_replica_set_dirty(file);
+            enqueue_repair(file);
+            bump_file_epoch(file);
+            save_metadata();
+            log_message("NM", "File %s moved in from another shard", file->metadata.filename);
+        }
+    }
+    pthread_mutex_unlock(&data_mutex);
+    
+    ss_batch_send(&drops);
+    send_message(sock, &response);
+}
+
+void handle_move_abort(int sock, Message* msg) {
+    pthread_mutex_lock(&data_mutex);
+    PreparedMove* move = find_prepared_move(msg->filename);
+    if (move && is_same_move(move, msg)) {
+        free(move->access_list);
+        move->in_use = 0;
+    }
+    pthread_mutex_unlock(&data_mutex);
+    
+    Message response;
+    memset(&response, 0, sizeof(response));
+    response.type = MSG_RESPONSE;
+    response.error_code = ERR_SUCCESS;
+    send_message(sock, &response);
+}
+
+// Rename a file on its storage servers. Returns 0 if the primary did.
+int rename_on_servers(char ips[][INET_ADDRSTRLEN], int* ports, int count, const char* from, const char* to) {
+    Message request;
+    memset(&request, 0, sizeof(request));
+    request.type = MSG_SS_MOVE_FILE;
+    strcpy(request.filename, from);
+    strcpy(request.folder_path, to);
+    
+    int result = -1;
+    for (int i = 0; i < count; i++) {
+        int ss_sock = connect_to_server(ips[i], ports[i]);
+        if (ss_sock < 0) continue;
+        Message reply;
+        send_message(ss_sock, &request);
+        if (receive_message(ss_sock, &reply) == 0 && reply.error_code == ERR_SUCCESS) {
+            if (i == 0) result = 0;
+        } else if (i > 0) {
+            log_message("NM", "Replica %s:%d did not rename %s", ips[i], ports[i], from);
+        }
+        close(ss_sock);
+        if (i == 0 && result < 0) break; // Replicas follow the primary
+    }
+    return result;
+}
+
+// Pending commits, one per line: "<dest> <seq> <from> <to> <holders> <ip> <port>..."
+// (data_mutex held). Written before the first COMMIT goes out.
+void save_pending_commits() {
+    char tmp_path[64];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", PENDING_COMMITS_FILE);
+    FILE* fp = fopen(tmp_path, "w");
+    if (!fp) {
+        log_message("NM", "Error saving pending moves: %s", strerror(errno));
+        return;
+    }
+    for (int i = 0; i < MAX_PENDING_COMMITS; i++) {
+        PendingCommit* move = &pending_commits[i];
+        if (!move->in_use) continue;
+        fprintf(fp, "%d %d %s %s %d", move->dest, move->move_seq, move->from, move->to, move->holders);
+        for (int h = 0; h < move->holders; h++) fprintf(fp, " %s %d", move->ips[h], move->ports[h]);
+        fprintf(fp, "\n");
+    }
+    fclose(fp);
+    rename(tmp_path, PENDING_COMMITS_FILE);
+}
+
+void load_pending_commits() {
+    FILE* fp = fopen(PENDING_COMMITS_FILE, "r");
+    if (!fp) return;
+    
+    int loaded = 0;
+    char line[2 * MAX_FILENAME + 64 + (MAX_REPLICAS + 1) * 32];
+    while (loaded < MAX_PENDING_COMMITS && fgets(line, sizeof(line), fp)) {
+        PendingCommit* move = &pending_commits[loaded];
+        int used;
+        if (sscanf(line, "%d %d %255s %255s %d%n", &move->dest, &move->move_seq, move->from, move->to,
+                   &move->holders, &used) != 5 || move->dest < 0 || move->dest >= MAX_NM_SHARDS ||
+            move->holders < 1 || move->holders > MAX_REPLICAS + 1) continue;
+        char* cursor = line + used;
+        int h = 0;
+        for (; h < move->holders; h++) {
+            if (sscanf(cursor, " %15s %d%n", move->ips[h], &move->ports[h], &used) != 2) break;
+            cursor += used;
+        }
+        if (h < move->holders) continue;
+        move->in_use = 1;
+        move->in_flight = 0;
+        loaded++;
+    }
+    fclose(fp);
+    if (loaded > 0) log_message("NM", "Resuming %d cross-shard move commit(s)", loaded);
+}
+
+// Send one COMMIT for a pending move: 0 committed, 1 refused, -1 unreachable
+int send_move_commit(PendingCommit* move, Message* request, Message* reply) {
+    memset(request, 0, sizeof(Message));
+    request->type = MSG_NM_MOVE_COMMIT;
+    strcpy(request->filename, move->to);
+    request->flags = shard_index;
+    request->word_index = move->move_seq;
+    if (shard_call(move->dest, request, reply) != 0) return -1;
+    return reply->error_code == ERR_SUCCESS ? 0 : 1;
+}
+
+// Apply the destination's answer to a pending move and forget it. A
+// refusal means the destination never made the file visible: rename it
+// back. (data_mutex not held)
+void settle_move(PendingCommit* move, int outcome, Message* request, Message* reply) {
+    if (outcome == 1) {
+        if (rename_on_servers(move->ips, move->ports, move->holders, move->to, move->from) != 0) {
+            log_message("NM", "Could not rename %s back to %s after the move was refused", move->to, move->from);
+        }
+        memset(request, 0, sizeof(Message));
+        request->type = MSG_NM_MOVE_ABORT;
+        strcpy(request->filename, move->to);
+        request->flags = shard_index;
+        request->word_index = move->move_seq;
+        shard_call(move->dest, request, reply);
+    }
+    
+    pthread_mutex_lock(&data_mutex);
+    if (outcome == 0) {
+        remove_file_node(move->from);
+        log_to_file("MOVE: %s to %s (shard %d) committed", move->from, move->to, move->dest);
+    }
+    move->in_use = 0;
+    save_pending_commits();
+    save_metadata();
+    pthread_mutex_unlock(&data_mutex);
+}
+
+// Resend COMMIT for moves the destination has not answered yet
+void* commit_retry_thread(void* arg) {
+    (void)arg;
+    Message* request = (Message*)malloc(sizeof(Message));
+    Message* reply = (Message*)malloc(sizeof(Message));
+    if (!request || !reply) {
+        log_message("NM", "Cross-shard move retries disabled: out of memory");
+        free(request);
+        free(reply);
+        return NULL;
+    }
+    
+    while (1) {
+        sleep(COMMIT_RETRY_INTERVAL);
+        for (int i = 0; i < MAX_PENDING_COMMITS; i++) {
+            pthread_mutex_lock(&data_mutex);
+            int waiting = pending_commits[i].in_use && !pending_commits[i].in_flight;
+            if (waiting) pending_commits[i].in_flight = 1;
+            pthread_mutex_unlock(&data_mutex);
+            if (!waiting) continue;
+            
+            PendingCommit* move = &pending_commits[i];
+            int outcome = send_move_commit(move, request, reply);
+            if (outcome < 0) {
+                pthread_mutex_lock(&data_mutex);
+                move->in_flight = 0;
+                pthread_mutex_unlock(&data_mutex);
+                continue;
+            }
+            log_message("NM", "Move of %s to %s %s on retry", move->from, move->to,
+                       outcome == 0 ? "committed" : "refused");
+            settle_move(move, outcome, request, reply);
+        }
+    }
+    return NULL;
+}
+
+// MOVE into a folder another shard owns. Runs without data_mutex, so two
+// shards moving files to each other cannot deadlock.
+void move_file_across_shards(int client_sock, Message* msg, const char* new_filename) {
+    Message response;
+    memset(&response, 0, sizeof(response));
+    response.type = MSG_RESPONSE;
+    
+    Message* request = (Message*)calloc(1, sizeof(Message));
+    Message* reply = (Message*)calloc(1, sizeof(Message));
+    if (!request || !reply) {
+        free(request);
+        free(reply);
+        response.error_code = ERR_SERVER_ERROR;
+        strcpy(response.data, "ERROR: Out of memory");
+        send_message(client_sock, &response);
+        return;
+    }
+    int dest = shard_of(new_filename, num_shards);
+    
+    // The record under its new name, with holders as addresses
+    char ips[MAX_REPLICAS + 1][INET_ADDRSTRLEN];
+    int ports[MAX_REPLICAS + 1];
+    int holders = 0;
+    
+    pthread_mutex_lock(&data_mutex);
+    if (move_seq == 0) move_seq = (int)(time(NULL) & 0x3fffffff); // Ids stay unique across restarts
+    int seq = ++move_seq;
+    FileNode* file = find_file(msg->filename);
+    PendingCommit* pending = NULL;
+    for (int i = 0; i < MAX_PENDING_COMMITS && !pending; i++) {
+        if (!pending_commits[i].in_use) pending = &pending_commits[i];
+    }
+    if (pending && file && server_is_live(file->metadata.ss_index)) {
+        FileMetadata metadata = file->metadata;
+        strcpy(metadata.filename, new_filename);
+        strcpy(metadata.folder_path, msg->folder_path);
+        
+        int access_bytes = file->access_count * sizeof(UserAccess);
+        int len = sizeof(FileMetadata) + sizeof(int) + access_bytes;
+        memcpy(request->data, &metadata, sizeof(FileMetadata));
+        memcpy(request->data + sizeof(FileMetadata), &file->access_count, sizeof(int));
+        memcpy(request->data + sizeof(FileMetadata) + sizeof(int), file->access_list, access_bytes);
+        
+        int servers[MAX_REPLICAS + 1];
+        servers[0] = file->metadata.ss_index;
+        int count = 1;
+        for (int slot = 0; slot < file->metadata.num_replicas; slot++) {
+            if (server_is_live(file->metadata.replicas[slot])) servers[count++] = file->metadata.replicas[slot];
+        }
+        for (int i = 0; i < count && len < MAX_BUFFER_SIZE - 64; i++) {
+            strcpy(ips[holders], storage_servers[servers[i]].ip);
+            ports[holders] = storage_servers[servers[i]].nm_port;
+            len += sprintf(request->data + len, "%s %d\n", ips[holders], ports[holders]);
+            holders++;
+        }
+        request->data_len = len;
+    }
+    pthread_mutex_unlock(&data_mutex);
+    
+    if (!pending && file) {
+        response.error_code = ERR_SERVER_ERROR;
+        strcpy(response.data, "ERROR: Too many moves in progress");
+    } else if (holders == 0) {
+        response.error_code = file ? ERR_NO_STORAGE_SERVER : ERR_FILE_NOT_FOUND;
+        strcpy(response.data, file ? "ERROR: Storage server not available" : "ERROR: File not found");
+    } else {
+        request->type = MSG_NM_MOVE_PREPARE;
+        request->flags = shard_index;
+        request->word_index = seq;
+        if (shard_call(dest, request, reply) != 0 || reply->error_code != ERR_SUCCESS) {
+            response.error_code = reply->error_code ? reply->error_code : ERR_CONNECTION_FAILED;
+            strcpy(response.data, reply->error_code ? reply->data : "ERROR: Cannot reach the destination name server");
+        } else if (rename_on_servers(ips, ports, holders, msg->filename, new_filename) != 0) {
+            memset(request, 0, sizeof(Message));
+            request->type = MSG_NM_MOVE_ABORT;
+            strcpy(request->filename, new_filename);
+            request->flags = shard_index;
+            request->word_index = seq;
+            shard_call(dest, request, reply); // The reservation expires if this is lost too
+            response.error_code = ERR_SERVER_ERROR;
+            strcpy(response.data, "ERROR: Move to the other name server failed; file left in place");
+        } else {
+            // Renamed: from here the move only goes forward, so record that
+            // before asking the destination to commit
+            pthread_mutex_lock(&data_mutex);
+            pending->in_use = 1;
+            pending->in_flight = 1;
+            pending->dest = dest;
+            pending->move_seq = seq;
+            strcpy(pending->from, msg->filename);
+            strcpy(pending->to, new_filename);
+            memcpy(pending->ips, ips, sizeof(ips));
+            memcpy(pending->ports, ports, sizeof(ports));
+            pending->holders = holders;
+            save_pending_commits();
+            pthread_mutex_unlock(&data_mutex);
+            
+            int outcome = -1; // 0 committed, 1 refused, -1 unreachable
+            for (int attempt = 0; attempt < MOVE_COMMIT_ATTEMPTS && outcome < 0; attempt++) {
+                if (attempt > 0) sleep(1);
+                outcome = send_move_commit(pending, request, reply);
+            }
+            
+            if (outcome < 0) {
+                // Stays pending; the retry thread keeps resending COMMIT
+                pthread_mutex_lock(&data_mutex);
+                pending->in_flight = 0;
+                pthread_mutex_unlock(&data_mutex);
+                response.error_code = ERR_SUCCESS;
+                sprintf(response.data, "✓ File moved to '%s'; it appears there once the other name server "
+                        "is reachable again", new_filename);
+                log_to_file("MOVE: %s to %s (shard %d) by %s, commit pending", msg->filename, new_filename,
+                           dest, msg->username);
+            } else {
+                settle_move(pending, outcome, request, reply);
+                if (outcome == 0) {
+                    response.error_code = ERR_SUCCESS;
+                    sprintf(response.data, "✓ File moved to '%s'", new_filename);
+                    log_to_file("MOVE: %s to %s (shard %d) by %s", msg->filename, new_filename, dest, msg->username);
+                } else {
+                    response.error_code = ERR_SERVER_ERROR;
+                    strcpy(response.data, "ERROR: The other name server refused the move; file left in place");
+                }
+            }
+        }
+    }
+    
+    free(request);
+    free(reply);
+    send_message(client_sock, &response);
+}
+
+// ═══════════════════════════════════════════════════════════════════
+// FAIR SCHEDULING - Per-user token buckets per operation class, weighted
+//                   fair queueing for request slots, and load shedding
+// ═══════════════════════════════════════════════════════════════════
+
+#define OP_READ 0  // Lookups and views
+#define OP_WRITE 1 // Anything that changes metadata or content
+#define OP_HEAVY 2 // SEARCH and EXEC fan out or run for a while
+#define OP_CLASSES 3
+#define LIMITER_BUCKETS 256
+#define METRICS_TOP_USERS 8 // Users listed in METRICS, most recently active first
+
+const char* op_class_names[OP_CLASSES] = {"read", "write", "heavy"};
+double op_rate[OP_CLASSES] = {100, 20, 2}; // Requests per second per user (0 = unlimited)
+double op_cost[OP_CLASSES] = {1, 2, 8};    // Virtual time a request costs in the fair queue
+int nm_workers = 8; // Client requests handled at once
+int user_slots = 0; // Slots one user may hold at once (0 = half of nm_workers)
+int max_wait_ms = 2000; // Longer expected waits for a token or a slot are refused as busy
+int max_queue = 64; // Requests waiting for a slot beyond this are refused as busy
+#define BUSY_RETRY_MIN_MS 50
+#define LIMITER_IDLE_MS 600000 // Users idle this long are forgotten (their buckets are full by then)
+#define LIMITER_SWEEP_MS 60000
+
+typedef struct UserLimiter {
+    char username[MAX_USERNAME];
+    double tokens[OP_CLASSES];
+    double refilled_ms[OP_CLASSES];
+    double finish_tag; // Virtual finish time of the user's last queued request
+    long requests[OP_CLASSES];
+    long throttled[OP_CLASSES]; // Requests that had to wait for a token
+    double throttled_ms; // Total time spent waiting for tokens
+    long shed; // Requests refused as busy
+    int queued; // Requests waiting for a slot
+    int running;
+    int refs; // Requests between user_limiter() and release; never evicted while held
+    double last_seen_ms;
+    struct UserLimiter* next;
+} UserLimiter;
+
+// A request waiting for a slot; signalled when it is granted one
+typedef struct SlotWaiter {
+    double tag;
+    UserLimiter* limiter;
+    int granted;
+    pthread_cond_t cond;
+    struct SlotWaiter* next;
+} SlotWaiter;
+
+UserLimiter* limiters[LIMITER_BUCKETS];
+SlotWaiter* slot_waiters = NULL;
+int slots_busy = 0;
+int slots_waiting = 0;
+double virtual_time = 0; // Tag of the request granted a slot most recently
+double service_avg_ms = 0; // Moving average of how long a request holds its slot
+double limiters_swept_ms = 0;
+long total_throttled = 0;
+long shed_for_tokens = 0;
+long shed_for_queue = 0;
+pthread_mutex_t sched_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int op_class_of(int type) {
+    switch (type) {
+        case MSG_VIEW_FILES:
+        case MSG_READ_FILE:
+        case MSG_INFO_FILE:
+        case MSG_STREAM_FILE:
+        case MSG_LIST_USERS:
+        case MSG_VIEW_FOLDER:
+        case MSG_VIEW_CHECKPOINT:
+        case MSG_LIST_CHECKPOINTS:
+        case MSG_VIEW_REQUESTS:
+        case MSG_GET_METRICS:
+            return OP_READ;
+        case MSG_SEARCH_FILE:
+        case MSG_EXEC_FILE:
+            return OP_HEAVY;
+        default:
+            return OP_WRITE;
+    }
+}
+
+// Client requests go through the limiter; registration and server traffic do not
+int is_scheduled_request(int type) {
+    return type >= MSG_VIEW_FILES && type <= MSG_SET_REPLICATION;
+}
+
+// "read=100,write=20,heavy=2"; classes not named keep their rate
+int parse_rate_limits(const char* spec) {
+    char copy[256];
+    strncpy(copy, spec, sizeof(copy) - 1);
+    copy[sizeof(copy) - 1] = '\0';
+    
+    char* saveptr;
+    for (char* item = strtok_r(copy, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+        char* equals = strchr(item, '=');
+        if (!equals) return -1;
+        *equals = '\0';
+        int op = -1;
+        for (int c = 0; c < OP_CLASSES; c++) {
+            if (strcmp(item, op_class_names[c]) == 0) op = c;
+        }
+        if (op < 0 || atof(equals + 1) < 0) return -1;
+        op_rate[op] = atof(equals + 1);
+    }
+    return 0;
+}
+
+// Bursts of up to two seconds' worth of requests pass untouched
+double op_burst(int op) {
+    return op_rate[op] * 2 > 1 ? op_rate[op] * 2 : 1;
+}
+
+// Forget users that have been idle for LIMITER_IDLE_MS (sched_mutex held)
+void evict_idle_limiters(double now_ms) {
+    for (int b = 0; b < LIMITER_BUCKETS; b++) {
+        UserLimiter** slot = &limiters[b];
+        while (*slot) {
+            UserLimiter* limiter = *slot;
+            if (limiter->refs == 0 && now_ms - limiter->last_seen_ms > LIMITER_IDLE_MS) {
+                *slot = limiter->next;
+                free(limiter);
+            } else {
+                slot = &limiter->next;
+            }
+        }
+    }
+}
+
+// The user's limiter, held for one request until release_slot or
+// put_user_limiter (sched_mutex held)
+UserLimiter* user_limiter(const char* username) {
+    double now_ms = monotonic_ms();
+    if (now_ms - limiters_swept_ms > LIMITER_SWEEP_MS) {
+        evict_idle_limiters(now_ms);
+        limiters_swept_ms = now_ms;
+    }
+    
+    UserLimiter** slot = &limiters[hash_function(username) % LIMITER_BUCKETS];
+    while (*slot && strcmp((*slot)->username, username) != 0) {
+        slot = &(*slot)->next;
+    }
+    if (!*slot) {
+        UserLimiter* limiter = (UserLimiter*)calloc(1, sizeof(UserLimiter));
+        if (!limiter) return NULL;
+        strncpy(limiter->username, username, MAX_USERNAME - 1);
+        for (int c = 0; c < OP_CLASSES; c++) {
+            limiter->tokens[c] = op_burst(c);
+            limiter->refilled_ms[c] = now_ms;
+        }
+        *slot = limiter;
+    }
+    (*slot)->refs++;
+    (*slot)->last_seen_ms = now_ms;
+    return *slot;
+}
+
+// Drop a request's hold on its limiter without having run it
+void put_user_limiter(UserLimiter* limiter) {
+    pthread_mutex_lock(&sched_mutex);
+    limiter->refs--;
+    pthread_mutex_unlock(&sched_mutex);
+}
+
+int user_slot_cap() {
+    int cap = user_slots > 0 ? user_slots : nm_workers / 2;
+    return cap > 0 ? cap : 1;
+}
+
+// Hand free slots to the waiters with the lowest tags among users below
+// their slot cap (sched_mutex held)
+void grant_slots() {
+    while (slots_busy < nm_workers) {
+        SlotWaiter** best = NULL;
+        for (SlotWaiter** slot = &slot_waiters; *slot; slot = &(*slot)->next) {
+            if ((*slot)->limiter->running >= user_slot_cap()) continue;
+            if (!best || (*slot)->tag < (*best)->tag) best = slot;
+        }
+        if (!best) return;
+        
+        SlotWaiter* waiter = *best;
+        *best = waiter->next;
+        slots_waiting--;
+        slots_busy++;
+        virtual_time = waiter->tag;
+        waiter->limiter->running++;
+        waiter->granted = 1;
+        pthread_cond_signal(&waiter->cond);
+    }
+}
+
+// Top up a bucket to the present (sched_mutex held)
+void refill_tokens(UserLimiter* limiter, int op, double now_ms) {
+    limiter->tokens[op] += (now_ms - limiter->refilled_ms[op]) / 1000.0 * op_rate[op];
+    if (limiter->tokens[op] > op_burst(op)) limiter->tokens[op] = op_burst(op);
+    limiter->refilled_ms[op] = now_ms;
+}
+
+// Take a token, waiting for it when the user's bucket for this class is
+// empty. Tokens are reserved up front, so several connections of one user
+// queue behind each other instead of racing for the refill. Returns 0, or
+// a retry-after hint in ms when the wait would exceed max_wait_ms.
+int take_token(UserLimiter* limiter, int op) {
+    if (op_rate[op] <= 0) return 0;
+    
+    pthread_mutex_lock(&sched_mutex);
+    refill_tokens(limiter, op, monotonic_ms());
+    double wait_ms = limiter->tokens[op] < 1 ? (1 - limiter->tokens[op]) / op_rate[op] * 1000.0 : 0;
+    if (wait_ms > max_wait_ms) {
+        limiter->shed++;
+        shed_for_tokens++;
+        pthread_mutex_unlock(&sched_mutex);
+        int retry_ms = (int)(wait_ms - max_wait_ms);
+        return retry_ms > BUSY_RETRY_MIN_MS ? retry_ms : BUSY_RETRY_MIN_MS;
+    }
+    limiter->tokens[op] -= 1;
+    if (wait_ms > 0) {
+        limiter->throttled[op]++;
+        limiter->throttled_ms += wait_ms;
+        total_throttled++;
+    }
+    pthread_mutex_unlock(&sched_mutex);
+    
+    if (wait_ms > 0) usleep((useconds_t)(wait_ms * 1000));
+    return 0;
+}
+
+// Wait for one of the nm_workers request slots. Waiters are served in
+// order of virtual finish time: a user's next request finishes `cost`
+// after the later of its previous one and the current virtual time, so a
+// user with many requests in flight falls behind one with a single request.
+// One user holds at most user_slot_cap() slots, so a few long EXECs cannot
+// take every worker. Returns 0 once a slot is held, or a retry-after hint
+// in ms when the queue is full or would take longer than max_wait_ms to
+// reach this request (its token is then given back).
+int acquire_slot(UserLimiter* limiter, int op) {
+    pthread_mutex_lock(&sched_mutex);
+    limiter->last_seen_ms = monotonic_ms();
+    
+    if (slots_busy >= nm_workers) {
+        double expected_ms = (slots_waiting + 1) * service_avg_ms / nm_workers;
+        if (slots_waiting >= max_queue || expected_ms > max_wait_ms) {
+            if (op_rate[op] > 0) limiter->tokens[op] += 1;
+            limiter->shed++;
+            shed_for_queue++;
+            pthread_mutex_unlock(&sched_mutex);
+            return expected_ms > BUSY_RETRY_MIN_MS ? (int)expected_ms : BUSY_RETRY_MIN_MS;
+        }
+    }
+    limiter->requests[op]++;
+    
+    double start = limiter->finish_tag > virtual_time ? limiter->finish_tag : virtual_time;
+    limiter->finish_tag = start + op_cost[op];
+    
+    // Queue up and take a free slot if this request is next in line; a user
+    // at the cap waits for one of their own requests to finish
+    SlotWaiter waiter;
+    waiter.tag = limiter->finish_tag;
+    waiter.limiter = limiter;
+    waiter.granted = 0;
+    pthread_cond_init(&waiter.cond, NULL);
+    waiter.next = slot_waiters;
+    slot_waiters = &waiter;
+    slots_waiting++;
+    limiter->queued++;
+    grant_slots();
+    while (!waiter.granted) {
+        pthread_cond_wait(&waiter.cond, &sched_mutex);
+    }
+    limiter->queued--;
+    pthread_cond_destroy(&waiter.cond);
+    pthread_mutex_unlock(&sched_mutex);
+    return 0;
+}
+
+// Give the slot back, pass free slots on, and drop the request's hold on
+// its limiter
+void release_slot(UserLimiter* limiter, double held_ms) {
+    pthread_mutex_lock(&sched_mutex);
+    limiter->running--;
+    limiter->refs--;
+    slots_busy--;
+    service_avg_ms = service_avg_ms > 0 ? 0.9 * service_avg_ms + 0.1 * held_ms : held_ms;
+    grant_slots();
+    pthread_mutex_unlock(&sched_mutex);
+}
+
+// Tell a client to come back later instead of queueing it
+void send_busy(int client_sock, int retry_ms) {
+    Message response;
+    memset(&response, 0, sizeof(response));
+    response.type = MSG_RESPONSE;
+    response.error_code = ERR_SERVER_BUSY;
+    response.flags = retry_ms;
+    sprintf(response.data, "ERROR: Name server busy, retry in %d ms", retry_ms);
+    send_message(client_sock, &response);
+}
+
+// Rate limits and the most recently active users, for METRICS
+int format_scheduler_metrics(char* buffer, int room) {
+    int offset = 0;
+    pthread_mutex_lock(&sched_mutex);
+    double now_ms = monotonic_ms();
+    
+    offset += snprintf(buffer + offset, room - offset, "║ Request Slots:           %d busy of %d, %d waiting\n",
+        slots_busy, nm_workers, slots_waiting);
+    offset += snprintf(buffer + offset, room - offset, "║ Per-user Limits:        ");
+    for (int c = 0; c < OP_CLASSES; c++) {
+        if (op_rate[c] > 0) {
+            offset += snprintf(buffer + offset, room - offset, " %s %.0f/s", op_class_names[c], op_rate[c]);
+        } else {
+            offset += snprintf(buffer + offset, room - offset, " %s unlimited", op_class_names[c]);
+        }
+    }
+    offset += snprintf(buffer + offset, room - offset, "\n║ Throttled Requests:      %ld\n", total_throttled);
+    offset += snprintf(buffer + offset, room - offset,
+        "║ Refused as Busy:         %ld (%ld over rate, %ld queue full)\n",
+        shed_for_tokens + shed_for_queue, shed_for_tokens, shed_for_queue);
+    offset += snprintf(buffer + offset, room - offset,
+        "║ Admission:               wait up to %d ms, queue up to %d, %.1f ms per request\n",
+        max_wait_ms, max_queue, service_avg_ms);
+    
+    UserLimiter* top[METRICS_TOP_USERS];
+    int shown = 0;
+    for (int b = 0; b < LIMITER_BUCKETS; b++) {
+        for (UserLimiter* limiter = limiters[b]; limiter; limiter = limiter->next) {
+            int pos = shown < METRICS_TOP_USERS ? shown++ : METRICS_TOP_USERS;
+            while (pos > 0 && top[pos - 1]->last_seen_ms < limiter->last_seen_ms) {
+                if (pos < METRICS_TOP_USERS) top[pos] = top[pos - 1];
+                pos--;
+            }
+            if (pos < METRICS_TOP_USERS) top[pos] = limiter;
+        }
+    }
+    
+    for (int i = 0; i < shown && offset < room - 256; i++) {
+        UserLimiter* limiter = top[i];
+        long requests = 0, throttled = 0;
+        offset += snprintf(buffer + offset, room - offset, "║   • %-12s tokens", limiter->username);
+        for (int c = 0; c < OP_CLASSES; c++) {
+            requests += limiter->requests[c];
+            throttled += limiter->throttled[c];
+            if (op_rate[c] <= 0) continue;
+            refill_tokens(limiter, c, now_ms);
+            offset += snprintf(buffer + offset, room - offset, " %c %.0f/%.0f", op_class_names[c][0],
+                limiter->tokens[c] > 0 ? limiter->tokens[c] : 0, op_burst(c));
+        }
+        offset += snprintf(buffer + offset, room - offset,
+            "  %ld req, %ld throttled (%.1fs), %ld busy, %d running, %d queued\n",
+            requests, throttled, limiter->throttled_ms / 1000.0, limiter->shed,
+            limiter->running, limiter->queued);
+    }
+    pthread_mutex_unlock(&sched_mutex);
+    return offset < room ? offset : room - 1;
+}
+
+// ═══════════════════════════════════════════════════════════════════
+// READ ROUTING - Spread READ/STREAM over primary and current replicas
+// ═══════════════════════════════════════════════════════════════════
+
+// Seconds a replica may lag the primary and still serve reads. 0 = only
+// replicas whose content hash matches the primary's latest report.
+int max_replica_staleness = 0;
+unsigned int read_rr_counter = 0;
+
+typedef struct {
+    const char* name;
+    // Pick one of candidates[0..count-1]; candidates[0] is the primary
+    int (*choose)(const char* username, const int* candidates, int count);
+} ReadPolicy;
+
+int read_primary_only(const char* username, const int* candidates, int count);
+int read_round_robin(const char* username, const int* candidates, int count);
+int read_least_loaded(const char* username, const int* candidates, int count);
+int read_sticky(const char* username, const int* candidates, int count);
+
+ReadPolicy read_policies[] = {
+    {"primary", read_primary_only},
+    {"round-robin", read_round_robin},
+    {"least-loaded", read_least_loaded},
+    {"sticky", read_sticky},
+};
+ReadPolicy* read_policy = &read_policies[0];
+
+int set_read_policy(const char* name) {
+    for (size_t i = 0; i < sizeof(read_policies) / sizeof(read_policies[0]); i++) {
+        if (strcmp(read_policies[i].name, name) == 0) {
+            read_policy = &read_policies[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int read_primary_only(const char* username, const int* candidates, int count) {
+    (void)username;
+    (void)count;
+    return candidates[0];
+}
+
+int read_round_robin(const char* username, const int* candidates, int count) {
+    (void)username;
+    return candidates[read_rr_counter++ % count];
+}
+
+// Fewest recently routed requests per unit of capacity
+int read_least_loaded(const char* username, const int* candidates, int count) {
+    (void)username;
+    time_t now = time(NULL);
+    int best = candidates[0];
+    double best_load = -1;
+    for (int i = 0; i < count; i++) {
+        decay_server_requests(candidates[i], now);
+        double load = server_request_load(candidates[i]) / server_weight(candidates[i]);
+        if (best_load < 0 || load < best_load) {
+            best = candidates[i];
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+// Same user, same server: keeps a user's reads monotonic while copies agree
+int read_sticky(const char* username, const int* candidates, int count) {
+    return candidates[ring_hash(username) % count];
+}
+
+// Replica may serve a read: it holds the primary's latest reported content
+// (and no WRITE was handed out since that report), or it was current within
+// the staleness bound (data_mutex held)
+int replica_is_readable(FileNode* file, int slot, time_t now) {
+    int replica = file->metadata.replicas[slot];
+    if (!server_is_live(replica)) return 0;
+    
+    if (file->replica_hash[slot] != 0 && file->replica_hash[slot] == file->primary_hash && !stats_are_stale(file)) {
+        file->replica_fresh_at[slot] = now;
+        return 1;
+    }
+    return file->replica_fresh_at[slot] != 0 && now - file->replica_fresh_at[slot] <= max_replica_staleness;
+}
+
+// Storage server that should serve a READ/STREAM of file (data_mutex held)
+int route_read(FileNode* file, const char* username) {
+    int candidates[MAX_REPLICAS + 1];
+    int count = 0;
+    
+    int primary = file->metadata.ss_index;
+    
+    // Chain mode: the tail only holds writes every copy has, so it alone
+    // serves reads. A replica added at the tail has none of the file until
+    // repair copies it there, so reads stay with the previous hop until the
+    // new one has matched the primary once.
+    if (chain_replication) {
+        for (int slot = file->metadata.num_replicas - 1; slot >= 0; slot--) {
+            int replica = file->metadata.replicas[slot];
+            if (!server_is_live(replica)) continue;
+            if (file->replica_fresh_at[slot] != 0 ||
+                (file->replica_hash[slot] != 0 && file->replica_hash[slot] == file->primary_hash)) {
+                return replica;
+            }
+        }
+        return primary;
+    }
+    
+    // A suspect primary is probably failing: any policy reads from a healthy
+    // replica that last matched it
+    if (server_is_live(primary) && server_suspect(primary)) {
+        for (int slot = 0; slot < file->metadata.num_replicas; slot++) {
+            int replica = file->metadata.replicas[slot];
+            if (server_is_live(replica) && !server_suspect(replica) &&
+                file->replica_hash[slot] != 0 && file->replica_hash[slot] == file->primary_hash) {
+                return replica;
+            }
+        }
+    }
+    
+    if (server_is_live(primary)) {
+        candidates[count++] = primary;
+    }
+    if (read_policy->choose != read_primary_only) {
+        time_t now = time(NULL);
+        for (int slot = 0; slot < file->metadata.num_replicas; slot++) {
+            if (replica_is_readable(file, slot, now)) {
+                candidates[count++] = file->metadata.replicas[slot];
+            }
+        }
+    }
+    
+    if (count == 0) return primary; // Client gets a connection error, as before
+    return read_policy->choose(username, candidates, count);
+}
+
+// Handle CREATE command
+void handle_create(int client_sock, Message* msg) {
+    pthread_mutex_lock(&data_mutex);
+    
+    FileNode* existing = find_file(msg->filename);
+    
+    Message response;
+    memset(&response, 0, sizeof(response));
+    response.type = MSG_RESPONSE;
+    
+    if (existing) {
+        response.error_code = ERR_FILE_EXISTS;
+        strcpy(response.data, "ERROR: File already exists");
+        pthread_mutex_unlock(&data_mutex);
+        send_message(client_sock, &response);
+        return;
+    }
+    
+    // Pick primary and replicas with the configured placement policy
+    int ss_index = -1;
+    int replicas[MAX_REPLICAS];
+    int replication_factor = default_replication;
+    if (replication_factor > MAX_REPLICAS + 1) replication_factor = MAX_REPLICAS + 1;
+    int num_replicas = choose_placement(msg->filename, &ss_index, replicas, replication_factor - 1);
+    
+    char replica_list[64] = "";
+    for (int i = 0; i < num_replicas; i++) {
+        int len = strlen(replica_list);
+        snprintf(replica_list + len, sizeof(replica_list) - len, "%sSS%d", i > 0 ? "," : "", replicas[i]);
+    }
+    
+    int epoch = ++location_epoch;
+    if (ss_index >= 0) {
+        note_server_request(ss_index);
+        if (num_replicas > 0) {
+            log_message("NM", "File '%s' assigned (%s): Primary=SS%d, Secondary=%s", 
+                       msg->filename, placement_policy->name, ss_index, replica_list);
+        } else {
+            log_message("NM", "File '%s' assigned (%s): Primary=SS%d (No secondary available)", 
+                       msg->filename, placement_policy->name, ss_index);
+        }
+    }
+    
+    if (ss_index < 0) {
+        response.error_code = ERR_NO_STORAGE_SERVER;
+        strcpy(response.data, "ERROR: No storage server available");
+        pthread_mutex_unlock(&data_mutex);
+        send_message(client_sock, &response);
+        return;
+    }
+    
+    // Addresses are copied now; the creates run after data_mutex is released
+    char ss_ip[INET_ADDRSTRLEN];
+    strcpy(ss_ip, storage_servers[ss_index].ip);
+    int ss_port = storage_servers[ss_index].nm_port;
+    SSCall* replica_creates = num_replicas > 0 ? (SSCall*)calloc(num_replicas, sizeof(SSCall)) : NULL;
+    for (int i = 0; replica_creates && i < num_replicas; i++) {
+        SSCall* call = &replica_creates[i];
+        strcpy(call->ip, storage_servers[replicas[i]].ip);
+        call->port = storage_servers[replicas[i]].nm_port;
+        call->request.type = MSG_SS_CREATE;
+        strcpy(call->request.filename, msg->filename);
+        strcpy(call->request.username, msg->username);
+        call->request.epoch = epoch;
+    }
+    
+    pthread_mutex_unlock(&data_mutex);
+    
+    // Forward to storage server
+    int ss_sock = connect_to_server(ss_ip, ss_port);
+    
     if (ss_sock < 0) {
         response.error_code = ERR_CONNECTION_FAILED;
         strcpy(response.data, "ERROR: Cannot connect to storage server");
+        free(replica_creates);
         send_message(client_sock, &response);
         return;
     }
@@ -650,6 +4569,7 @@ void handle_create(int client_sock, Message* msg) {
     ss_msg.type = MSG_SS_CREATE;
     strcpy(ss_msg.filename, msg->filename);
     strcpy(ss_msg.username, msg->username);
+    ss_msg.epoch = epoch;
     
     send_message(ss_sock, &ss_msg);
     
@@ -669,39 +4589,32 @@ void handle_create(int client_sock, Message* msg) {
             metadata.word_count = 0;
             metadata.char_count = 0;
             metadata.ss_index = ss_index;
-            metadata.replica_ss_index = replica_ss_index; // Assign replica if available
+            memcpy(metadata.replicas, replicas, num_replicas * sizeof(int)); // Assign replicas if available
+            metadata.num_replicas = num_replicas;
+            metadata.replication_factor = replication_factor;
+            metadata.epoch = epoch;
             
             add_file(&metadata);
+            save_metadata();
+            pthread_mutex_unlock(&data_mutex);
             
-            // If replica server exists, create file there too
-            if (replica_ss_index >= 0) {
-                int replica_sock = connect_to_server(storage_servers[replica_ss_index].ip,
-                                                     storage_servers[replica_ss_index].nm_port);
-                if (replica_sock >= 0) {
-                    Message replica_msg;
-                    memset(&replica_msg, 0, sizeof(replica_msg));
-                    replica_msg.type = MSG_SS_CREATE;
-                    strcpy(replica_msg.filename, msg->filename);
-                    strcpy(replica_msg.username, msg->username);
-                    send_message(replica_sock, &replica_msg);
-                    
-                    Message replica_response;
-                    receive_message(replica_sock, &replica_response);
-                    close(replica_sock);
-                    
-                    if (replica_response.error_code == ERR_SUCCESS) {
-                        log_message("NM", "Replica created for %s on SS %d", msg->filename, replica_ss_index);
-                    }
+            // Create the file on every replica server too
+            if (replica_creates) ss_call_parallel(replica_creates, num_replicas);
+            for (int i = 0; replica_creates && i < num_replicas; i++) {
+                if (replica_creates[i].ok && replica_creates[i].response.error_code == ERR_SUCCESS) {
+                    log_message("NM", "Replica created for %s on SS %d", msg->filename, replicas[i]);
                 }
             }
             
-            save_metadata();
+            pthread_mutex_lock(&data_mutex);
+            FileNode* created = find_file(msg->filename);
+            if (created) mark_replica_set_dirty(created);
             pthread_mutex_unlock(&data_mutex);
             
             response.error_code = ERR_SUCCESS;
-            if (replica_ss_index >= 0) {
-                sprintf(response.data, "File Created Successfully! (Primary: SS%d, Replica: SS%d)", 
-                        ss_index, replica_ss_index);
+            if (num_replicas > 0) {
+                sprintf(response.data, "File Created Successfully! (Primary: SS%d, Replica: %s)", 
+                        ss_index, replica_list);
             } else {
                 strcpy(response.data, "File Created Successfully!");
             }
@@ -715,6 +4628,7 @@ void handle_create(int client_sock, Message* msg) {
     }
     
     close(ss_sock);
+    free(replica_creates);
     send_message(client_sock, &response);
     log_to_file("CREATE request from %s for file %s", msg->username, msg->filename);
 }
@@ -746,6 +4660,17 @@ void handle_delete(int client_sock, Message* msg) {
     }
     
     int ss_index = file->metadata.ss_index;
+    SSCall* replica_deletes = (SSCall*)calloc(MAX_REPLICAS, sizeof(SSCall));
+    int replica_delete_count = 0;
+    for (int slot = 0; replica_deletes && slot < file->metadata.num_replicas; slot++) {
+        int replica = file->metadata.replicas[slot];
+        if (!server_is_live(replica)) continue;
+        SSCall* call = &replica_deletes[replica_delete_count++];
+        strcpy(call->ip, storage_servers[replica].ip);
+        call->port = storage_servers[replica].nm_port;
+        call->request.type = MSG_SS_DELETE;
+        strcpy(call->request.filename, msg->filename);
+    }
     pthread_mutex_unlock(&data_mutex);
     
     // Forward to storage server
@@ -755,6 +4680,7 @@ void handle_delete(int client_sock, Message* msg) {
     if (ss_sock < 0) {
         response.error_code = ERR_CONNECTION_FAILED;
         strcpy(response.data, "ERROR: Cannot connect to storage server");
+        free(replica_deletes);
         send_message(client_sock, &response);
         return;
     }
@@ -771,58 +4697,13 @@ void handle_delete(int client_sock, Message* msg) {
         if (ss_response.error_code == ERR_SUCCESS) {
             // Remove from metadata
             pthread_mutex_lock(&data_mutex);
-            
-            // Remove from linked list
-            FileNode* prev = NULL;
-            FileNode* current = file_list;
-            while (current) {
-                if (strcmp(current->metadata.filename, msg->filename) == 0) {
-                    if (prev) {
-                        prev->next = current->next;
-                    } else {
-                        file_list = current->next;
-                    }
-                    free(current->access_list);
-                    free(current);
-                    break;
-                }
-                prev = current;
-                current = current->next;
-            }
-            
-            // Remove from hash table (properly handle chaining)
-            unsigned int index = hash_function(msg->filename);
-            HashEntry* hash_prev = NULL;
-            HashEntry* hash_current = file_hash[index];
-            while (hash_current) {
-                if (strcmp(hash_current->key, msg->filename) == 0) {
-                    if (hash_prev) {
-                        hash_prev->file->next = hash_current->file->next;
-                    } else {
-                        if (hash_current->file->next) {
-                            file_hash[index] = (HashEntry*)hash_current->file->next;
-                        } else {
-                            file_hash[index] = NULL;
-                        }
-                    }
-                    free(hash_current);
-                    break;
-                }
-                hash_prev = hash_current;
-                hash_current = (HashEntry*)hash_current->file->next;
-            }
-            
-            // Clear from cache
-            unsigned int cache_index = hash_function(msg->filename) % LRU_CACHE_SIZE;
-            if (cache.cache_map[cache_index] && 
-                strcmp(cache.cache_map[cache_index]->key, msg->filename) == 0) {
-                free(cache.cache_map[cache_index]);
-                cache.cache_map[cache_index] = NULL;
-            }
+            remove_file_node(msg->filename);
             
             save_metadata();
             pthread_mutex_unlock(&data_mutex);
             
+            if (replica_delete_count > 0) ss_call_parallel(replica_deletes, replica_delete_count);
+            
             response.error_code = ERR_SUCCESS;
             sprintf(response.data, "File '%s' deleted successfully!", msg->filename);
         } else {
@@ -835,6 +4716,7 @@ void handle_delete(int client_sock, Message* msg) {
     }
     
     close(ss_sock);
+    free(replica_deletes);
     send_message(client_sock, &response);
     log_to_file("DELETE request from %s for file %s", msg->username, msg->filename);
 }
@@ -866,23 +4748,35 @@ void handle_direct_ss_operation(int client_sock, Message* msg) {
             // Update last modified time for write operations
             if (msg->type == MSG_WRITE_FILE) {
                 time(&file->metadata.last_modified);
+                response.write_seq = ++file->metadata.writes_issued;
+            }
+            
+            int target = file->metadata.ss_index;
+            if (msg->type == MSG_READ_FILE || msg->type == MSG_STREAM_FILE) {
+                target = route_read(file, msg->username);
             }
             
             response.error_code = ERR_SUCCESS;
-            strcpy(response.ss_ip, storage_servers[file->metadata.ss_index].ip);
-            response.ss_port = storage_servers[file->metadata.ss_index].client_port;
+            response.epoch = file->metadata.epoch;
+            response.lease_ttl = LOCATION_LEASE_SECONDS;
+            if (target != file->metadata.ss_index && response.lease_ttl > max_replica_staleness) {
+                response.lease_ttl = max_replica_staleness; // A cached replica must not outlive the bound
+            }
+            note_server_request(target);
+            strcpy(response.ss_ip, storage_servers[target].ip);
+            response.ss_port = storage_servers[target].client_port;
             strcpy(response.folder_path, file->metadata.folder_path); // Send folder path to client
             
             // Include replica information in the response
-            if (msg->type == MSG_WRITE_FILE && file->metadata.replica_ss_index >= 0 && 
-                file->metadata.replica_ss_index < num_storage_servers &&
-                storage_servers[file->metadata.replica_ss_index].is_active) {
-                // Add replica info to data: PRIMARY_SS_INDEX|REPLICA_SS_INDEX|REPLICA_IP|REPLICA_PORT
-                sprintf(response.data, "Primary:SS%d|Replica:SS%d:%s:%d", 
-                       file->metadata.ss_index,
-                       file->metadata.replica_ss_index,
-                       storage_servers[file->metadata.replica_ss_index].ip,
-                       storage_servers[file->metadata.replica_ss_index].nm_port);
+            if (msg->type == MSG_WRITE_FILE && file->metadata.num_replicas > 0) {
+                // Add replica info to data: Primary:SS<i>|Replica:SS<j>:<ip>:<port>|...
+                int len = sprintf(response.data, "Primary:SS%d", file->metadata.ss_index);
+                for (int slot = 0; slot < file->metadata.num_replicas; slot++) {
+                    int replica = file->metadata.replicas[slot];
+                    if (!server_is_live(replica)) continue;
+                    len += sprintf(response.data + len, "|Replica:SS%d:%s:%d", replica,
+                        storage_servers[replica].ip, storage_servers[replica].nm_port);
+                }
             } else {
                 sprintf(response.data, "Connect to SS at %s:%d", response.ss_ip, response.ss_port);
             }
@@ -1039,6 +4933,7 @@ void handle_create_folder(int client_sock, Message* msg) {
     strcpy(new_folder->foldername, msg->folder_path);
     strcpy(new_folder->owner, msg->username);
     time(&new_folder->created);
+    new_folder->replication_factor = 0;
     new_folder->next = folder_list;
     folder_list = new_folder;
     
@@ -1076,6 +4971,30 @@ void handle_move_file(int client_sock, Message* msg) {
         return;
     }
     
+    // Extract just the filename (without any current folder path)
+    char base_filename[MAX_FILENAME];
+    char* last_slash = strrchr(msg->filename, '/');
+    if (last_slash) {
+        strcpy(base_filename, last_slash + 1);
+    } else {
+        strcpy(base_filename, msg->filename);
+    }
+    
+    // Construct new filename with folder path
+    char new_filename[MAX_FILENAME];
+    if (strlen(msg->folder_path) > 0 && strcmp(msg->folder_path, "/") != 0) {
+        snprintf(new_filename, sizeof(new_filename), "%s/%s", msg->folder_path, base_filename);
+    } else {
+        strcpy(new_filename, base_filename);
+    }
+    
+    // The folder and the new name belong to another name server
+    if (!owns_name(new_filename)) {
+        pthread_mutex_unlock(&data_mutex);
+        move_file_across_shards(client_sock, msg, new_filename);
+        return;
+    }
+    
     // Check if target folder exists
     FolderNode* folder = folder_list;
     int folder_found = 0;
@@ -1095,23 +5014,6 @@ void handle_move_file(int client_sock, Message* msg) {
         return;
     }
     
-    // Extract just the filename (without any current folder path)
-    char base_filename[MAX_FILENAME];
-    char* last_slash = strrchr(msg->filename, '/');
-    if (last_slash) {
-        strcpy(base_filename, last_slash + 1);
-    } else {
-        strcpy(base_filename, msg->filename);
-    }
-    
-    // Construct new filename with folder path
-    char new_filename[MAX_FILENAME];
-    if (strlen(msg->folder_path) > 0 && strcmp(msg->folder_path, "/") != 0) {
-        snprintf(new_filename, sizeof(new_filename), "%s/%s", msg->folder_path, base_filename);
-    } else {
-        strcpy(new_filename, base_filename);
-    }
-    
     // Get the storage server for this file
     int ss_idx = file->metadata.ss_index;
     if (ss_idx < 0 || ss_idx >= num_storage_servers || !storage_servers[ss_idx].is_active) {
@@ -1122,12 +5024,32 @@ void handle_move_file(int client_sock, Message* msg) {
         return;
     }
     
+    // Copy the holders' addresses; the renames run after data_mutex is released
+    char ss_ip[INET_ADDRSTRLEN];
+    strcpy(ss_ip, storage_servers[ss_idx].ip);
+    int ss_port = storage_servers[ss_idx].nm_port;
+    SSCall* replica_renames = (SSCall*)calloc(MAX_REPLICAS, sizeof(SSCall));
+    int replica_ids[MAX_REPLICAS];
+    int replica_rename_count = 0;
+    for (int slot = 0; replica_renames && slot < file->metadata.num_replicas; slot++) {
+        int replica = file->metadata.replicas[slot];
+        if (!server_is_live(replica)) continue;
+        replica_ids[replica_rename_count] = replica;
+        SSCall* call = &replica_renames[replica_rename_count++];
+        strcpy(call->ip, storage_servers[replica].ip);
+        call->port = storage_servers[replica].nm_port;
+        call->request.type = MSG_SS_MOVE_FILE;
+        strcpy(call->request.filename, msg->filename);
+        strcpy(call->request.folder_path, new_filename);
+    }
+    pthread_mutex_unlock(&data_mutex);
+    
     // Send physical move request to Storage Server
-    int ss_sock = connect_to_server(storage_servers[ss_idx].ip, storage_servers[ss_idx].nm_port);
+    int ss_sock = connect_to_server(ss_ip, ss_port);
     if (ss_sock < 0) {
         response.error_code = ERR_NO_STORAGE_SERVER;
         strcpy(response.data, "ERROR: Cannot connect to storage server");
-        pthread_mutex_unlock(&data_mutex);
+        free(replica_renames);
         send_message(client_sock, &response);
         return;
     }
@@ -1145,29 +5067,140 @@ void handle_move_file(int client_sock, Message* msg) {
         response.error_code = ERR_INVALID_COMMAND;
         sprintf(response.data, "ERROR: Failed to move file on storage server: %s", ss_response.data);
         close(ss_sock);
-        pthread_mutex_unlock(&data_mutex);
+        free(replica_renames);
         send_message(client_sock, &response);
         return;
     }
     
     close(ss_sock);
     
+    // Rename the replicas too; one that misses it is refreshed by the next WRITE
+    // or dropped and re-copied if it fails later
+    if (replica_rename_count > 0) ss_call_parallel(replica_renames, replica_rename_count);
+    for (int i = 0; i < replica_rename_count; i++) {
+        if (!replica_renames[i].ok || replica_renames[i].response.error_code != ERR_SUCCESS) {
+            log_message("NM", "Replica SS%d did not rename %s", replica_ids[i], msg->filename);
+        }
+    }
+    free(replica_renames);
+    
+    pthread_mutex_lock(&data_mutex);
+    
+    // The file may have been deleted or moved while the renames ran
+    file = find_file(msg->filename);
+    if (!file || file->metadata.ss_index != ss_idx) {
+        response.error_code = ERR_SERVER_ERROR;
+        sprintf(response.data, "ERROR: '%s' changed while it was being moved", msg->filename);
+        pthread_mutex_unlock(&data_mutex);
+        send_message(client_sock, &response);
+        return;
+    }
+    for (folder = folder_list; folder; folder = folder->next) {
+        if (strcmp(folder->foldername, msg->folder_path) == 0) break;
+    }
+    
     // Update hash table with new filename as key
     update_file_hash(msg->filename, new_filename, file);
+    rename_file_requests(file->metadata.owner, msg->filename, new_filename);
     
     // Update metadata - change the filename to include folder path
     strcpy(file->metadata.filename, new_filename);
     // Update folder_path for VIEWFOLDER compatibility
     strcpy(file->metadata.folder_path, msg->folder_path);
+    reset_replica_freshness(file);
+    SSBatch drops;
+    ss_batch_init(&drops, MSG_SS_DELETE, SS_DELETE_BATCH);
+    if (folder && folder->replication_factor > 0) {
+        set_replication_factor(file, folder->replication_factor, &drops);
+    }
+    mark_replica_set_dirty(file);
+    bump_file_epoch(file);
     response.error_code = ERR_SUCCESS;
     sprintf(response.data, "✓ File moved to '%s'", new_filename);
     save_metadata();
     
     pthread_mutex_unlock(&data_mutex);
+    ss_batch_send(&drops);
     send_message(client_sock, &response);
     log_to_file("MOVE: %s to %s by %s", msg->filename, new_filename, msg->username);
 }
 
+// Handle REPLICATION command - set the copy count of a file, or of a folder
+// and every file in it (new files moved in later adopt the folder's count)
+void handle_set_replication(int client_sock, Message* msg) {
+    Message response;
+    memset(&response, 0, sizeof(response));
+    response.type = MSG_RESPONSE;
+    
+    int factor = msg->flags;
+    if (factor < 1 || factor > MAX_REPLICAS + 1) {
+        response.error_code = ERR_INVALID_COMMAND;
+        sprintf(response.data, "ERROR: Replication factor must be between 1 and %d", MAX_REPLICAS + 1);
+        send_message(client_sock, &response);
+        return;
+    }
+    
+    pthread_mutex_lock(&data_mutex);
+    
+    FileNode* file = find_file(msg->filename);
+    FolderNode* folder = NULL;
+    if (!file) {
+        for (folder = folder_list; folder; folder = folder->next) {
+            if (strcmp(folder->foldername, msg->filename) == 0) break;
+        }
+    }
+    
+    if (!file && !folder) {
+        response.error_code = ERR_FILE_NOT_FOUND;
+        sprintf(response.data, "ERROR: No file or folder named '%s'", msg->filename);
+        pthread_mutex_unlock(&data_mutex);
+        send_message(client_sock, &response);
+        return;
+    }
+    
+    const char* owner = file ? file->metadata.owner : folder->owner;
+    if (strcmp(owner, msg->username) != 0) {
+        response.error_code = ERR_UNAUTHORIZED;
+        strcpy(response.data, "ERROR: Only owner can change replication");
+        pthread_mutex_unlock(&data_mutex);
+        send_message(client_sock, &response);
+        return;
+    }
+    
+    // Surplus replicas of every affected file, deleted once unlocked
+    SSBatch drops;
+    ss_batch_init(&drops, MSG_SS_DELETE, SS_DELETE_BATCH);
+    int changed = 0;
+    
+    if (file) {
+        set_replication_factor(file, factor, &drops);
+        changed = 1;
+    } else {
+        folder->replication_factor = factor;
+        for (FileNode* f = file_list; f; f = f->next) {
+            if (strcmp(f->metadata.folder_path, folder->foldername) != 0) continue;
+            set_replication_factor(f, factor, &drops);
+            changed++;
+        }
+    }
+    save_metadata();
+    pthread_mutex_unlock(&data_mutex);
+    
+    int drop_count = drops.items;
+    ss_batch_send(&drops);
+    
+    response.error_code = ERR_SUCCESS;
+    if (file) {
+        sprintf(response.data, "✓ '%s' will keep %d cop%s (%d surplus removed)",
+                msg->filename, factor, factor == 1 ? "y" : "ies", drop_count);
+    } else {
+        sprintf(response.data, "✓ Folder '%s' and its %d file(s) will keep %d cop%s (%d surplus removed)",
+                msg->filename, changed, factor, factor == 1 ? "y" : "ies", drop_count);
+    }
+    send_message(client_sock, &response);
+    log_to_file("REPLICATION: %s set to %d by %s", msg->filename, factor, msg->username);
+}
+
 // Handle VIEWFOLDER command
 void handle_view_folder(int client_sock, Message* msg) {
     pthread_mutex_lock(&data_mutex);
@@ -1208,6 +5241,131 @@ void handle_view_folder(int client_sock, Message* msg) {
     log_to_file("VIEWFOLDER: %s by %s", msg->folder_path, msg->username);
 }
 
+// ═══════════════════════════════════════════════════════════════════
+// CHECKPOINT CATALOG - Tags, times, sizes and hashes of each file's
+//                      checkpoints, so LISTCHECKPOINTS needs no SS
+// ═══════════════════════════════════════════════════════════════════
+
+#define CHECKPOINTS_FILE "nm_checkpoints.dat"
+
+// Parse a "C <created> <size> <hash> <tag>" record from a storage server
+int parse_checkpoint_record(const char* line, CheckpointInfo* info) {
+    long created;
+    int tag_start = 0;
+    memset(info, 0, sizeof(*info));
+    if (sscanf(line, "C %ld %ld %llx %n", &created, &info->size, &info->hash, &tag_start) != 3 ||
+        tag_start == 0) {
+        return -1;
+    }
+    info->created = (time_t)created;
+    
+    int len = strcspn(line + tag_start, "\n");
+    if (len == 0 || len >= MAX_USERNAME) return -1;
+    memcpy(info->tag, line + tag_start, len);
+    return 0;
+}
+
+// Record a new checkpoint; re-using a tag replaces it (data_mutex held)
+void catalog_checkpoint(FileNode* file, const CheckpointInfo* info) {
+    for (int i = 0; i < file->checkpoint_count; i++) {
+        if (strcmp(file->checkpoint_list[i].tag, info->tag) == 0) {
+            file->checkpoint_list[i] = *info;
+            return;
+        }
+    }
+    
+    CheckpointInfo* grown = (CheckpointInfo*)realloc(file->checkpoint_list,
+                                                     (file->checkpoint_count + 1) * sizeof(CheckpointInfo));
+    if (!grown) {
+        file->checkpoints_known = 0; // Incomplete now; ask the SS next time
+        return;
+    }
+    file->checkpoint_list = grown;
+    file->checkpoint_list[file->checkpoint_count++] = *info;
+    num_checkpoints++;
+}
+
+// Replace a file's catalog with the records the primary listed (data_mutex held)
+void catalog_from_listing(FileNode* file, const char* listing) {
+    num_checkpoints -= file->checkpoint_count;
+    free(file->checkpoint_list);
+    file->checkpoint_list = NULL;
+    file->checkpoint_count = 0;
+    file->checkpoints_known = 1;
+    
+    for (const char* line = listing; *line; ) {
+        CheckpointInfo info;
+        if (parse_checkpoint_record(line, &info) == 0) catalog_checkpoint(file, &info);
+        const char* end = strchr(line, '\n');
+        if (!end) break;
+        line = end + 1;
+    }
+}
+
+// Saved with the metadata: for each catalogued file its name, the
+// number of checkpoints and the checkpoints
+void save_checkpoint_catalog() {
+    FILE* fp = fopen(CHECKPOINTS_FILE, "wb");
+    if (!fp) {
+        log_message("NM", "Error saving checkpoint catalog: %s", strerror(errno));
+        return;
+    }
+    for (FileNode* file = file_list; file; file = file->next) {
+        if (!file->checkpoints_known) continue;
+        fwrite(file->metadata.filename, MAX_FILENAME, 1, fp);
+        fwrite(&file->checkpoint_count, sizeof(int), 1, fp);
+        fwrite(file->checkpoint_list, sizeof(CheckpointInfo), file->checkpoint_count, fp);
+    }
+    fclose(fp);
+}
+
+void load_checkpoint_catalog() {
+    FILE* fp = fopen(CHECKPOINTS_FILE, "rb");
+    if (!fp) return;
+    
+    char filename[MAX_FILENAME];
+    int count;
+    while (fread(filename, MAX_FILENAME, 1, fp) == 1 && fread(&count, sizeof(int), 1, fp) == 1) {
+        if (count < 0) break;
+        filename[MAX_FILENAME - 1] = '\0';
+        
+        CheckpointInfo* list = (CheckpointInfo*)malloc(count > 0 ? count * sizeof(CheckpointInfo) : 1);
+        if (!list) break;
+        if ((int)fread(list, sizeof(CheckpointInfo), count, fp) != count) {
+            free(list);
+            break;
+        }
+        
+        FileNode* file = lookup_file_node(filename);
+        if (!file) {
+            free(list);
+            continue;
+        }
+        num_checkpoints -= file->checkpoint_count;
+        free(file->checkpoint_list);
+        file->checkpoint_list = list;
+        file->checkpoint_count = count;
+        file->checkpoints_known = 1;
+        num_checkpoints += count;
+    }
+    fclose(fp);
+    log_message("NM", "Checkpoint catalog loaded (%d checkpoints)", num_checkpoints);
+}
+
+// LISTCHECKPOINTS output from the catalog (data_mutex held)
+void format_checkpoint_list(FileNode* file, char* buffer) {
+    int offset = sprintf(buffer, "─── Checkpoints for '%s' ───\n", file->metadata.filename);
+    for (int i = 0; i < file->checkpoint_count && offset < MAX_BUFFER_SIZE - 512; i++) {
+        char time_str[64];
+        format_time(file->checkpoint_list[i].created, time_str, sizeof(time_str));
+        offset += sprintf(buffer + offset, "  • %s  (%s, %ld bytes)\n",
+                          file->checkpoint_list[i].tag, time_str, file->checkpoint_list[i].size);
+    }
+    if (file->checkpoint_count == 0) {
+        sprintf(buffer + offset, "(no checkpoints)\n");
+    }
+}
+
 // Handle CHECKPOINT command - Create a snapshot of a file
 void handle_checkpoint(int client_sock, Message* msg) {
     pthread_mutex_lock(&data_mutex);
@@ -1273,8 +5431,26 @@ void handle_checkpoint(int client_sock, Message* msg) {
         response.error_code = ERR_SERVER_ERROR;
         strcpy(response.data, "ERROR: Communication with storage server failed");
     }
-    
     close(ss_sock);
+    
+    // The SS answers with the checkpoint's record for the catalog
+    if (response.error_code == ERR_SUCCESS) {
+        CheckpointInfo info;
+        pthread_mutex_lock(&data_mutex);
+        file = lookup_file_node(msg->filename);
+        if (file && file->checkpoints_known) {
+            if (parse_checkpoint_record(ss_response.data, &info) == 0) {
+                catalog_checkpoint(file, &info);
+            } else {
+                file->checkpoints_known = 0;
+            }
+            save_metadata();
+        }
+        pthread_mutex_unlock(&data_mutex);
+        sprintf(response.data, "✓ Checkpoint '%s' created for file '%s'", 
+                msg->checkpoint_tag, msg->filename);
+    }
+    
     send_message(client_sock, &response);
     log_to_file("CHECKPOINT: %s tag=%s by %s", msg->filename, msg->checkpoint_tag, msg->username);
 }
@@ -1451,6 +5627,18 @@ void handle_list_checkpoints(int client_sock, Message* msg) {
         return;
     }
     
+    // Answered from the catalog unless this name server has not seen the
+    // file's checkpoints yet (metadata from before the catalog, a file
+    // moved in from another shard, or a standby that took over)
+    if (file->checkpoints_known) {
+        response.error_code = ERR_SUCCESS;
+        format_checkpoint_list(file, response.data);
+        pthread_mutex_unlock(&data_mutex);
+        send_message(client_sock, &response);
+        log_to_file("LISTCHECKPOINTS: %s by %s", msg->filename, msg->username);
+        return;
+    }
+    
     int ss_index = file->metadata.ss_index;
     if (ss_index < 0 || ss_index >= num_storage_servers || !storage_servers[ss_index].is_active) {
         response.error_code = ERR_NO_STORAGE_SERVER;
@@ -1488,8 +5676,20 @@ void handle_list_checkpoints(int client_sock, Message* msg) {
         response.error_code = ERR_SERVER_ERROR;
         strcpy(response.data, "ERROR: Communication with storage server failed");
     }
-    
     close(ss_sock);
+    
+    if (response.error_code == ERR_SUCCESS) {
+        pthread_mutex_lock(&data_mutex);
+        file = lookup_file_node(msg->filename);
+        if (file) {
+            ss_response.data[ss_response.data_len < MAX_BUFFER_SIZE ? ss_response.data_len : MAX_BUFFER_SIZE - 1] = '\0';
+            catalog_from_listing(file, ss_response.data);
+            format_checkpoint_list(file, response.data);
+            save_metadata();
+        }
+        pthread_mutex_unlock(&data_mutex);
+    }
+    
     send_message(client_sock, &response);
     log_to_file("LISTCHECKPOINTS: %s by %s", msg->filename, msg->username);
 }
@@ -1532,31 +5732,29 @@ void handle_request_access(int client_sock, Message* msg) {
     }
     
     // Check if request already exists
-    for (int i = 0; i < num_access_requests; i++) {
-        if (strcmp(access_requests[i].filename, msg->filename) == 0 &&
-            strcmp(access_requests[i].requester, msg->username) == 0) {
-            response.error_code = ERR_INVALID_COMMAND;
-            strcpy(response.data, "ERROR: You already have a pending request for this file");
-            pthread_mutex_unlock(&data_mutex);
-            send_message(client_sock, &response);
-            return;
-        }
+    if (find_access_request(msg->filename, msg->username)) {
+        response.error_code = ERR_INVALID_COMMAND;
+        strcpy(response.data, "ERROR: You already have a pending request for this file");
+        pthread_mutex_unlock(&data_mutex);
+        send_message(client_sock, &response);
+        return;
     }
     
     // Add new access request
-    if (num_access_requests >= max_access_requests) {
+    AccessRequest request;
+    memset(&request, 0, sizeof(request));
+    strcpy(request.filename, msg->filename);
+    strcpy(request.requester, msg->username);
+    request.requested_rights = msg->flags;
+    time(&request.request_time);
+    if (!add_access_request(file->metadata.owner, &request)) {
         response.error_code = ERR_SERVER_ERROR;
-        strcpy(response.data, "ERROR: Too many pending access requests");
+        strcpy(response.data, "ERROR: Could not record the access request");
         pthread_mutex_unlock(&data_mutex);
         send_message(client_sock, &response);
         return;
     }
-    
-    strcpy(access_requests[num_access_requests].filename, msg->filename);
-    strcpy(access_requests[num_access_requests].requester, msg->username);
-    access_requests[num_access_requests].requested_rights = msg->flags;
-    time(&access_requests[num_access_requests].request_time);
-    num_access_requests++;
+    save_metadata();
     
     response.error_code = ERR_SUCCESS;
     sprintf(response.data, "✓ Access request sent to owner of '%s' (%s)", 
@@ -1582,26 +5780,43 @@ void handle_view_requests(int client_sock, Message* msg) {
     
     offset += sprintf(buffer + offset, "─── Pending Access Requests ───\n");
     
+    // Only this owner's queue is walked, oldest first, one page at a time
+    OwnerQueue* queue = owner_queue(msg->username, 0);
+    int expired_before = num_access_requests;
+    expire_owner_requests(queue, time(NULL));
+    if (num_access_requests != expired_before) save_metadata();
+    
+    int total = queue ? queue->count : 0;
+    int pages = (total + REQUESTS_PAGE_SIZE - 1) / REQUESTS_PAGE_SIZE;
+    int page = msg->flags > 0 ? msg->flags : 1;
+    if (pages > 0 && page > pages) page = pages;
+    
+    int skip = (page - 1) * REQUESTS_PAGE_SIZE;
     int count = 0;
-    for (int i = 0; i < num_access_requests && offset < MAX_BUFFER_SIZE - 256; i++) {
-        // Find the file to check ownership
-        FileNode* file = find_file(access_requests[i].filename);
-        if (file && strcmp(file->metadata.owner, msg->username) == 0) {
-            char time_str[64];
-            format_time(access_requests[i].request_time, time_str, sizeof(time_str));
-            const char* access_type = (access_requests[i].requested_rights == ACCESS_READ) ? "READ" : "WRITE";
-            
-            offset += sprintf(buffer + offset, "  • %s requests %s access to '%s' (%s)\n",
-                            access_requests[i].requester, access_type, 
-                            access_requests[i].filename, time_str);
-            count++;
+    for (RequestNode* node = queue ? queue->oldest : NULL;
+         node && count < REQUESTS_PAGE_SIZE && offset < MAX_BUFFER_SIZE - 512; node = node->newer) {
+        if (skip > 0) {
+            skip--;
+            continue;
         }
+        char time_str[64];
+        format_time(node->request.request_time, time_str, sizeof(time_str));
+        const char* access_type = (node->request.requested_rights == ACCESS_READ) ? "READ" : "WRITE";
+        
+        offset += sprintf(buffer + offset, "  • %s requests %s access to '%s' (%s)\n",
+                        node->request.requester, access_type, 
+                        node->request.filename, time_str);
+        count++;
     }
     
-    if (count == 0) {
+    if (total == 0) {
         offset += sprintf(buffer + offset, "(no pending requests)\n");
     } else {
-        offset += sprintf(buffer + offset, "\nUse: APPROVEREQUEST <requester> <filename>\n");
+        offset += sprintf(buffer + offset, "\nPage %d of %d (%d pending)\n", page, pages, total);
+        if (page < pages) {
+            offset += sprintf(buffer + offset, "More: VIEWREQUESTS %d\n", page + 1);
+        }
+        offset += sprintf(buffer + offset, "Use: APPROVEREQUEST <requester> <filename>\n");
         offset += sprintf(buffer + offset, "     DENYREQUEST <requester> <filename>\n");
     }
     
@@ -1640,16 +5855,9 @@ void handle_approve_request(int client_sock, Message* msg) {
     }
     
     // Find the access request
-    int request_index = -1;
-    for (int i = 0; i < num_access_requests; i++) {
-        if (strcmp(access_requests[i].filename, msg->filename) == 0 &&
-            strcmp(access_requests[i].requester, msg->target_user) == 0) {
-            request_index = i;
-            break;
-        }
-    }
+    RequestNode* request = find_access_request(msg->filename, msg->target_user);
     
-    if (request_index < 0) {
+    if (!request) {
         response.error_code = ERR_INVALID_COMMAND;
         sprintf(response.data, "ERROR: No pending request from '%s' for '%s'", 
                 msg->target_user, msg->filename);
@@ -1659,7 +5867,7 @@ void handle_approve_request(int client_sock, Message* msg) {
     }
     
     // Grant the requested access
-    int requested_rights = access_requests[request_index].requested_rights;
+    int requested_rights = request->request.requested_rights;
     
     // Check if user already has access in the access list
     int user_found = 0;
@@ -1682,10 +5890,7 @@ void handle_approve_request(int client_sock, Message* msg) {
     }
     
     // Remove the request from the queue
-    for (int i = request_index; i < num_access_requests - 1; i++) {
-        access_requests[i] = access_requests[i + 1];
-    }
-    num_access_requests--;
+    remove_access_request(request);
     
     // Save metadata
     save_metadata();
@@ -1728,39 +5933,176 @@ void handle_deny_request(int client_sock, Message* msg) {
         return;
     }
     
-    // Find and remove the access request
-    int request_index = -1;
-    for (int i = 0; i < num_access_requests; i++) {
-        if (strcmp(access_requests[i].filename, msg->filename) == 0 &&
-            strcmp(access_requests[i].requester, msg->target_user) == 0) {
-            request_index = i;
-            break;
+    // Find and remove the access request
+    RequestNode* request = find_access_request(msg->filename, msg->target_user);
+    
+    if (!request) {
+        response.error_code = ERR_INVALID_COMMAND;
+        sprintf(response.data, "ERROR: No pending request from '%s' for '%s'", 
+                msg->target_user, msg->filename);
+        pthread_mutex_unlock(&data_mutex);
+        send_message(client_sock, &response);
+        return;
+    }
+    
+    // Remove the request from the queue
+    remove_access_request(request);
+    save_metadata();
+    
+    response.error_code = ERR_SUCCESS;
+    sprintf(response.data, "✓ Access request from '%s' for '%s' denied", 
+            msg->target_user, msg->filename);
+    
+    pthread_mutex_unlock(&data_mutex);
+    send_message(client_sock, &response);
+    log_to_file("DENY: %s denied access to %s for %s", 
+                msg->username, msg->filename, msg->target_user);
+}
+
+// Content hit reported by a storage server for SEARCH
+typedef struct {
+    char filename[MAX_FILENAME];
+    int score;
+} SearchHit;
+
+int compare_hits_by_name(const void* a, const void* b) {
+    return strcmp(((const SearchHit*)a)->filename, ((const SearchHit*)b)->filename);
+}
+
+int compare_hits_by_score(const void* a, const void* b) {
+    const SearchHit* x = (const SearchHit*)a;
+    const SearchHit* y = (const SearchHit*)b;
+    if (x->score != y->score) return y->score - x->score;
+    return strcmp(x->filename, y->filename);
+}
+
+// Handle SEARCH command - filename matches plus ranked content matches
+void handle_search(int client_sock, Message* msg) {
+    // Snapshot the active servers, then query their content indexes in parallel
+    pthread_mutex_lock(&data_mutex);
+    int call_count = 0;
+    SSCall* calls = (SSCall*)calloc(num_storage_servers > 0 ? num_storage_servers : 1, sizeof(SSCall));
+    for (int i = 0; calls && i < num_storage_servers; i++) {
+        if (!storage_servers[i].is_active) continue;
+        strcpy(calls[call_count].ip, storage_servers[i].ip);
+        calls[call_count].port = storage_servers[i].nm_port;
+        calls[call_count].request.type = MSG_SS_SEARCH;
+        strcpy(calls[call_count].request.username, msg->username);
+        strcpy(calls[call_count].request.data, msg->data);
+        call_count++;
+    }
+    pthread_mutex_unlock(&data_mutex);
+    
+    if (calls) {
+        ss_call_parallel(calls, call_count);
+    }
+    
+    // Collect hits; a file comes back from both its primary and its replica
+    SearchHit* hits = NULL;
+    int hit_count = 0;
+    int hit_capacity = 0;
+    int hits_full = 0; // Out of memory: report the hits gathered so far
+    for (int i = 0; i < call_count && !hits_full; i++) {
+        if (!calls[i].ok || calls[i].response.error_code != ERR_SUCCESS) continue;
+        
+        char* saveptr;
+        char* line = strtok_r(calls[i].response.data, "\n", &saveptr);
+        while (line && !hits_full) {
+            SearchHit hit;
+            if (sscanf(line, "%255s %d", hit.filename, &hit.score) == 2) {
+                if (hit_count == hit_capacity) {
+                    int grown_capacity = hit_capacity ? hit_capacity * 2 : 64;
+                    SearchHit* grown = (SearchHit*)realloc(hits, grown_capacity * sizeof(SearchHit));
+                    if (grown) {
+                        hits = grown;
+                        hit_capacity = grown_capacity;
+                    } else {
+                        hits_full = 1;
+                    }
+                }
+                if (!hits_full) hits[hit_count++] = hit;
+            }
+            line = strtok_r(NULL, "\n", &saveptr);
+        }
+    }
+    free(calls);
+    
+    // Merge duplicates, keeping the best score
+    int merged = 0;
+    if (hit_count > 0) {
+        qsort(hits, hit_count, sizeof(SearchHit), compare_hits_by_name);
+        for (int i = 0; i < hit_count; i++) {
+            if (merged > 0 && strcmp(hits[merged - 1].filename, hits[i].filename) == 0) {
+                if (hits[i].score > hits[merged - 1].score) {
+                    hits[merged - 1].score = hits[i].score;
+                }
+            } else {
+                hits[merged++] = hits[i];
+            }
+        }
+        qsort(hits, merged, sizeof(SearchHit), compare_hits_by_score);
+    }
+    
+    pthread_mutex_lock(&data_mutex);
+    
+    Message response;
+    memset(&response, 0, sizeof(response));
+    response.type = MSG_RESPONSE;
+    response.error_code = ERR_SUCCESS;
+    
+    char buffer[MAX_BUFFER_SIZE] = {0};
+    int offset = 0;
+    
+    offset += sprintf(buffer + offset, "─── Search Results for '%.256s' ───\n", msg->data);
+    
+    // Filename matches
+    int name_count = 0;
+    FileNode* current = file_list;
+    while (current && offset < MAX_BUFFER_SIZE - 512) {
+        if (strstr(current->metadata.filename, msg->data) != NULL &&
+            get_user_access(current, msg->username) != ACCESS_NONE) {
+            if (name_count == 0) {
+                offset += sprintf(buffer + offset, "Filename matches:\n");
+            }
+            offset += sprintf(buffer + offset, "  • %s (owner: %s, folder: %s)\n", 
+                current->metadata.filename,
+                current->metadata.owner,
+                current->metadata.folder_path[0] ? current->metadata.folder_path : "/");
+            name_count++;
         }
+        current = current->next;
     }
     
-    if (request_index < 0) {
-        response.error_code = ERR_INVALID_COMMAND;
-        sprintf(response.data, "ERROR: No pending request from '%s' for '%s'", 
-                msg->target_user, msg->filename);
-        pthread_mutex_unlock(&data_mutex);
-        send_message(client_sock, &response);
-        return;
+    // Content matches, best first; skip files unknown to metadata or not readable
+    int content_count = 0;
+    for (int i = 0; i < merged && offset < MAX_BUFFER_SIZE - 512; i++) {
+        FileNode* file = find_file(hits[i].filename);
+        if (!file || get_user_access(file, msg->username) == ACCESS_NONE) continue;
+        
+        if (content_count == 0) {
+            offset += sprintf(buffer + offset, "Content matches:\n");
+        }
+        offset += sprintf(buffer + offset, "  • %s (%d hit%s, owner: %s)\n",
+            hits[i].filename, hits[i].score, hits[i].score == 1 ? "" : "s",
+            file->metadata.owner);
+        content_count++;
     }
+    free(hits);
     
-    // Remove the request from the queue
-    for (int i = request_index; i < num_access_requests - 1; i++) {
-        access_requests[i] = access_requests[i + 1];
+    if (name_count + content_count == 0) {
+        offset += sprintf(buffer + offset, "  (no files found)\n");
+    } else {
+        offset += sprintf(buffer + offset, "Total: %d filename match(es), %d content match(es)\n",
+            name_count, content_count);
     }
-    num_access_requests--;
     
-    response.error_code = ERR_SUCCESS;
-    sprintf(response.data, "✓ Access request from '%s' for '%s' denied", 
-            msg->target_user, msg->filename);
+    strcpy(response.data, buffer);
+    response.data_len = strlen(buffer);
     
     pthread_mutex_unlock(&data_mutex);
     send_message(client_sock, &response);
-    log_to_file("DENY: %s denied access to %s for %s", 
-                msg->username, msg->filename, msg->target_user);
+    log_to_file("SEARCH: '%s' by %s (%d name, %d content)", msg->data, msg->username,
+        name_count, content_count);
 }
 
 // Helper functions for metrics
@@ -1784,8 +6126,192 @@ int count_folders() {
     return count;
 }
 
+// Handle METRICS command
+void handle_metrics(int client_sock, Message* msg) {
+    pthread_mutex_lock(&data_mutex);
+    
+    Message response;
+    memset(&response, 0, sizeof(response));
+    response.type = MSG_RESPONSE;
+    response.error_code = ERR_SUCCESS;
+    
+    char* buffer = response.data;
+    int offset = 0;
+    
+    time_t now;
+    time(&now);
+    int uptime = (int)difftime(now, metrics.start_time);
+    
+    int active_servers = 0;
+    for (int i = 0; i < num_storage_servers; i++) {
+        if (storage_servers[i].is_active) active_servers++;
+    }
+    
+    offset += sprintf(buffer + offset, 
+        "╔═══════════════════════════════════════════════════════╗\n"
+        "║            DISTRIBUTED FILE SYSTEM METRICS            ║\n"
+        "╠═══════════════════════════════════════════════════════╣\n");
+    
+    offset += sprintf(buffer + offset, "║ System Uptime:           %d seconds\n", uptime);
+    offset += sprintf(buffer + offset, "║ Active Storage Servers:  %d of %d\n", active_servers, num_storage_servers);
+    offset += sprintf(buffer + offset, "║ Connected Clients:       %d\n", num_clients);
+    offset += sprintf(buffer + offset, "║ Total Files:             %d\n", count_files());
+    offset += sprintf(buffer + offset, "║ Total Folders:           %d\n", count_folders());
+    offset += sprintf(buffer + offset, "╠═══════════════════════════════════════════════════════╣\n");
+    offset += sprintf(buffer + offset, "║ Operations Count:\n");
+    offset += sprintf(buffer + offset, "║   • Reads:               %d\n", metrics.total_reads);
+    offset += sprintf(buffer + offset, "║   • Writes:              %d\n", metrics.total_writes);
+    offset += sprintf(buffer + offset, "║   • Creates:             %d\n", metrics.total_creates);
+    offset += sprintf(buffer + offset, "║   • Deletes:             %d\n", metrics.total_deletes);
+    offset += sprintf(buffer + offset, "╠═══════════════════════════════════════════════════════╣\n");
+    offset += sprintf(buffer + offset, "║ Placement Policy:        %s\n", placement_policy->name);
+    offset += sprintf(buffer + offset, "║ Read Policy:             %s (max staleness %ds)\n",
+        read_policy->name, max_replica_staleness);
+    
+    refresh_server_load();
+    for (int i = 0; i < num_storage_servers && offset < MAX_BUFFER_SIZE - 1024; i++) {
+        offset += sprintf(buffer + offset, "║   • SS%d %s:%d  %s  weight %d  files %d  phi %.1f\n", i,
+            storage_servers[i].ip, storage_servers[i].client_port,
+            !storage_servers[i].is_active ? "down" : server_suspect(i) ? "suspect" : "up  ",
+            server_weight(i), server_load[i].file_count, detector_phi(i, monotonic_ms()));
+        
+        TelemetrySample* sample = telemetry_sample(i, 0);
+        if (sample) {
+            offset += sprintf(buffer + offset, 
+                "║       %.1f req/s (r %.1f w %.1f s %.1f u %.1f)  p99 %lldus  conns %d\n",
+                reported_request_rate(i), sample->read_rate, sample->write_rate, 
+                sample->stream_rate, sample->undo_rate, reported_p99_us(i), sample->conns);
+            offset += sprintf(buffer + offset, "║       %d file(s), %lld bytes stored, %lld MB free\n",
+                sample->files, sample->bytes, sample->free_kb >= 0 ? sample->free_kb / 1024 : -1);
+            if (sample->repl_bps > 0 || sample->resyncs > 0 || sample->repl_queue > 0) {
+                offset += sprintf(buffer + offset, "║       replicating %.1f KB/s, %d resync(s)\n",
+                    sample->repl_bps / 1024, sample->resyncs);
+                offset += sprintf(buffer + offset, "║       replication queue %d file(s), lag %.0f ms\n",
+                    sample->repl_queue, sample->repl_lag_ms);
+            }
+            if (sample->ae_repairs > 0) {
+                offset += sprintf(buffer + offset, "║       anti-entropy repaired %d replica file(s)\n",
+                    sample->ae_repairs);
+            }
+            if (sample->shed > 0) {
+                offset += sprintf(buffer + offset, "║       turned away %d client request(s) as busy\n",
+                    sample->shed);
+            }
+        }
+    }
+    
+    offset += sprintf(buffer + offset, "╠═══════════════════════════════════════════════════════╣\n");
+    offset += sprintf(buffer + offset, "║ Rebalancer:              %s\n",
+        rebalance_stats.pending > 0 ? "running" : "idle");
+    if (rebalance_stats.current[0]) {
+        offset += sprintf(buffer + offset, "║   • Moving:              %.200s (%d left in round)\n",
+            rebalance_stats.current, rebalance_stats.pending);
+    }
+    offset += sprintf(buffer + offset, "║   • Moves:               %d done, %d deferred, %d failed of %d planned\n",
+        rebalance_stats.moved, rebalance_stats.deferred, rebalance_stats.failed, rebalance_stats.planned);
+    offset += sprintf(buffer + offset, "║   • Bytes Moved:         %ld\n", rebalance_stats.bytes_moved);
+    if (rebalance_kbps > 0) {
+        offset += sprintf(buffer + offset, "║   • Bandwidth Cap:       %d KB/s\n", rebalance_kbps);
+    } else {
+        offset += sprintf(buffer + offset, "║   • Bandwidth Cap:       unlimited\n");
+    }
+    if (rebalance_stats.last_round) {
+        char time_str[64];
+        format_time(rebalance_stats.last_round, time_str, sizeof(time_str));
+        offset += sprintf(buffer + offset, "║   • Last Round:          %s (%d round(s))\n", time_str, rebalance_stats.rounds);
+    }
+    offset += sprintf(buffer + offset, "╠═══════════════════════════════════════════════════════╣\n");
+    int under_replicated = 0;
+    for (FileNode* file = file_list; file; file = file->next) {
+        if (live_copies(file) < replication_target(file)) under_replicated++;
+    }
+    offset += sprintf(buffer + offset, "║ Re-replication:          %s\n",
+        repair_stats.current[0] ? "running" : repair_stats.queued > 0 ? "queued" : "idle");
+    if (repair_stats.current[0]) {
+        offset += sprintf(buffer + offset, "║   • Copying:             %.200s\n", repair_stats.current);
+    }
+    if (chain_replication) {
+        offset += sprintf(buffer + offset, "║   • Default Copies:      %d (chain, reads from tail)\n",
+            default_replication);
+    } else {
+        offset += sprintf(buffer + offset, "║   • Default Copies:      %d (write quorum %d)\n",
+            default_replication, write_quorum);
+    }
+    offset += sprintf(buffer + offset, "║   • Under-replicated:    %d file(s), %d queued\n",
+        under_replicated, repair_stats.queued);
+    offset += sprintf(buffer + offset, "║   • Repairs:             %d done, %d deferred, %d failed\n",
+        repair_stats.repaired, repair_stats.deferred, repair_stats.failed);
+    offset += sprintf(buffer + offset, "║   • Bytes Copied:        %ld\n", repair_stats.bytes_copied);
+    if (repair_kbps > 0) {
+        offset += sprintf(buffer + offset, "║   • Bandwidth Cap:       %d KB/s\n", repair_kbps);
+    } else {
+        offset += sprintf(buffer + offset, "║   • Bandwidth Cap:       unlimited\n");
+    }
+    offset += sprintf(buffer + offset, "╠═══════════════════════════════════════════════════════╣\n");
+    offset += format_scheduler_metrics(buffer + offset, MAX_BUFFER_SIZE - 512 - offset);
+    offset += sprintf(buffer + offset, "╠═══════════════════════════════════════════════════════╣\n");
+    offset += sprintf(buffer + offset, "║ Checkpoints:             %d\n", num_checkpoints);
+    offset += sprintf(buffer + offset, "║ Pending Access Requests: %d\n", num_access_requests);
+    offset += sprintf(buffer + offset, 
+        "╚═══════════════════════════════════════════════════════╝\n");
+    
+    response.data_len = offset;
+    
+    pthread_mutex_unlock(&data_mutex);
+    send_message(client_sock, &response);
+    log_to_file("METRICS viewed by %s", msg->username);
+}
+
+// Apply file stats a storage server piggybacked on its heartbeat.
+// Lines look like "S <filename> <words> <chars> <mtime> <hash> <write seq>"
+// (data_mutex must be held)
+void apply_pushed_stats(int ss_index, char* data) {
+    time_t now = time(NULL);
+    int applied = 0;
+    
+    char* saveptr;
+    char* line = strtok_r(data, "\n", &saveptr);
+    while (line) {
+        char filename[MAX_FILENAME];
+        int word_count, char_count;
+        long modified;
+        unsigned long long hash = 0;
+        int write_seq = 0;
+        
+        if (sscanf(line, "S %255s %d %d %ld %llx %d", filename, &word_count, &char_count, &modified, &hash,
+                   &write_seq) >= 4) {
+            FileNode* file = find_file(filename);
+            int slot = file ? replica_slot(file, ss_index) : -1;
+            if (slot >= 0) {
+                // Replica copies only tell us how current they are
+                file->replica_hash[slot] = hash;
+                if (hash != 0 && hash == file->primary_hash) file->replica_fresh_at[slot] = now;
+            }
+            // Only the primary's copy is authoritative
+            if (file && file->metadata.ss_index == ss_index) {
+                note_replicas_current(file, now); // Replicas held the previous version until now
+                file->primary_hash = hash;
+                file->metadata.word_count = word_count;
+                file->metadata.char_count = char_count;
+                if ((time_t)modified > file->metadata.last_modified) {
+                    file->metadata.last_modified = (time_t)modified;
+                }
+                if (write_seq > file->writes_seen) file->writes_seen = write_seq;
+                file->stats_updated = now;
+                applied++;
+            }
+        }
+        line = strtok_r(NULL, "\n", &saveptr);
+    }
+    
+    if (applied > 0) {
+        log_message("NM", "Applied %d pushed file stat(s) from SS%d", applied, ss_index);
+    }
+}
+
 // Handle heartbeat from storage server
 void handle_heartbeat(Message* msg) {
+    double arrival_ms = monotonic_ms(); // Before waiting on the lock
     pthread_mutex_lock(&data_mutex);
     
     // Find the storage server by IP and port
@@ -1797,8 +6323,21 @@ void handle_heartbeat(Message* msg) {
             // Mark as active if it was inactive
             if (!storage_servers[i].is_active) {
                 storage_servers[i].is_active = 1;
+                detector_reset(i);
+                // Its files may have failed over and its replicas changed
+                // while it was away: replace every set it holds
+                replica_sets_reset[i] = 1;
+                replica_sets_pending = 1;
+                pthread_cond_signal(&repair_cond);
+                rebuild_ring();
                 log_message("NM", "Storage Server %s:%d is now ACTIVE", msg->ss_ip, msg->ss_port);
             }
+            detector_heartbeat(i, arrival_ms);
+            
+            if (msg->data[0] != '\0') {
+                apply_telemetry(i, msg->data);
+                apply_pushed_stats(i, msg->data);
+            }
             
             pthread_mutex_unlock(&data_mutex);
             return;
@@ -1809,113 +6348,179 @@ void handle_heartbeat(Message* msg) {
     log_message("NM", "Received heartbeat from unknown SS %s:%d", msg->ss_ip, msg->ss_port);
 }
 
-// Handle replication request - Notifies secondary to replicate from primary
-void handle_replication_request(int client_sock, Message* msg) {
-    printf("[DEBUG NM] Received replication request for: %s\n", msg->filename);
-    fflush(stdout);
+// A storage server has served a newer primary than us: another name server
+// took over while we were cut off, and serving on would split the namespace
+void step_down_for(const char* ss_ip, int ss_port, long generation) {
+    log_message("NM", "SS %s:%d has seen name server generation %ld (ours is %ld); stepping down",
+               ss_ip, ss_port, generation, nm_generation);
+    exit(1);
+}
+
+// A primary with no replica set for a file (new file, restart) asks for it
+// directly; replicas are then updated by the primary itself
+void handle_replica_set_request(int client_sock, Message* msg) {
+    Message* response = (Message*)calloc(1, sizeof(Message));
+    if (!response) return;
+    response->type = MSG_SS_REPLICA_SET;
+    response->flags = chain_replication ? REPLICA_SET_CHAIN : 0;
     
     pthread_mutex_lock(&data_mutex);
-    
     FileNode* file = find_file(msg->filename);
-    
-    Message response;
-    memset(&response, 0, sizeof(response));
-    response.type = MSG_ACK;
-    
+    int primary = file ? file->metadata.ss_index : -1;
     if (!file) {
-        printf("[DEBUG NM] File not found: %s\n", msg->filename);
-        fflush(stdout);
-        response.error_code = ERR_FILE_NOT_FOUND;
-        strcpy(response.data, "File not found");
-        pthread_mutex_unlock(&data_mutex);
-        send_message(client_sock, &response);
-        return;
-    }
-    
-    int replica_idx = file->metadata.replica_ss_index;
-    
-    printf("[DEBUG NM] File found. Primary SS: %d, Replica SS: %d\n", 
-           file->metadata.ss_index, replica_idx);
-    fflush(stdout);
-    
-    if (replica_idx < 0 || replica_idx >= num_storage_servers || !storage_servers[replica_idx].is_active) {
-        response.error_code = ERR_NO_STORAGE_SERVER;
-        strcpy(response.data, "No active replica server");
-        pthread_mutex_unlock(&data_mutex);
-        send_message(client_sock, &response);
-        log_message("NM", "No active replica for %s", msg->filename);
-        return;
+        response->error_code = ERR_FILE_NOT_FOUND;
+        strcpy(response->data, "File not found");
+    } else if (primary < 0 || primary >= num_storage_servers || storage_servers[primary].nm_port != msg->ss_port ||
+               strcmp(storage_servers[primary].ip, msg->ss_ip) != 0) {
+        // The asker no longer leads the file: an empty set, so it pushes to no one
+        response->error_code = ERR_SUCCESS;
+        response->data_len = sprintf(response->data, "%s %d\n", file->metadata.filename, 1);
+    } else {
+        response->error_code = ERR_SUCCESS;
+        int len = format_replica_set(file, response->data, MAX_BUFFER_SIZE - 1);
+        response->data[len++] = '\n';
+        response->data_len = len;
     }
-    
-    int primary_idx = file->metadata.ss_index;
-    
     pthread_mutex_unlock(&data_mutex);
     
-    // Connect to secondary/replica storage server
-    int replica_sock = connect_to_server(storage_servers[replica_idx].ip, 
-                                         storage_servers[replica_idx].nm_port);
+    send_message(client_sock, response);
+    free(response);
+}
+
+// Long-lived channel from a storage server. After the handshake, heartbeats,
+// pushed stats and replication notices arrive with compact framing and get no
+// reply, so the SS can send them back to back.
+void handle_ss_session(int ss_sock, Message* msg) {
+    char ss_ip[INET_ADDRSTRLEN];
+    strcpy(ss_ip, msg->ss_ip);
+    int ss_port = msg->ss_port;
     
-    if (replica_sock < 0) {
-        response.error_code = ERR_CONNECTION_FAILED;
-        strcpy(response.data, "Cannot connect to replica server");
-        send_message(client_sock, &response);
-        log_message("NM", "Failed to connect to replica SS%d for %s", replica_idx, msg->filename);
-        return;
+    Message response;
+    memset(&response, 0, sizeof(response));
+    response.type = MSG_ACK;
+    response.error_code = ERR_SUCCESS;
+    response.flags = (int)nm_generation;
+    if (msg->flags > nm_generation) {
+        response.error_code = ERR_UNAUTHORIZED;
+        strcpy(response.data, "Name server generation is stale");
+        send_message(ss_sock, &response);
+        step_down_for(ss_ip, ss_port, msg->flags);
     }
+    send_message(ss_sock, &response);
     
-    // Send replication command to secondary
-    Message repl_msg;
-    memset(&repl_msg, 0, sizeof(repl_msg));
-    repl_msg.type = MSG_SS_REPLICATE;
-    strcpy(repl_msg.filename, msg->filename);
-    strcpy(repl_msg.ss_ip, storage_servers[primary_idx].ip);
-    repl_msg.ss_port = storage_servers[primary_idx].client_port;
-    repl_msg.flags = primary_idx; // Store primary index
-    
-    send_message(replica_sock, &repl_msg);
+    log_message("NM", "Session opened by SS %s:%d", ss_ip, ss_port);
     
-    Message repl_response;
-    if (receive_message(replica_sock, &repl_response) == 0) {
-        response.error_code = repl_response.error_code;
-        strcpy(response.data, repl_response.data);
-        log_message("NM", "🔄 Replication of '%s' from SS%d to SS%d: %s", 
-                   msg->filename, primary_idx, replica_idx, repl_response.data);
-    } else {
-        response.error_code = ERR_SERVER_ERROR;
-        strcpy(response.data, "Replication communication failed");
+    while (receive_compact_message(ss_sock, msg) == 0) {
+        switch (msg->type) {
+            case MSG_HEARTBEAT:
+                if (msg->flags > nm_generation) step_down_for(ss_ip, ss_port, msg->flags);
+                handle_heartbeat(msg);
+                break;
+            
+            case MSG_SS_REPLICATE: {
+                // The primary kept failing to reach a replica: resend its set
+                // (membership may have changed), delivered by the repair thread
+                pthread_mutex_lock(&data_mutex);
+                FileNode* file = find_file(msg->filename);
+                if (file) mark_replica_set_dirty(file);
+                pthread_mutex_unlock(&data_mutex);
+                break;
+            }
+            
+            default:
+                log_message("NM", "Unexpected message type %d on SS session", msg->type);
+        }
     }
     
-    close(replica_sock);
-    send_message(client_sock, &response);
+    log_message("NM", "Session closed by SS %s:%d", ss_ip, ss_port);
+    detector_session_lost(ss_ip, ss_port);
 }
 
 // Monitor storage servers for failures
 void* monitor_storage_servers(void* arg) {
+    (void)arg;
     log_message("NM", "Starting storage server monitoring thread");
+    double last_tick_ms = monotonic_ms();
     
     while (1) {
-        sleep(5); // Check every 5 seconds
+        usleep(MONITOR_INTERVAL_MS * 1000);
+        
+        // Verdicts are logged after the lock is dropped
+        int suspects[MAX_STORAGE_SERVERS], failures[MAX_STORAGE_SERVERS];
+        double suspect_phi[MAX_STORAGE_SERVERS], failure_phi[MAX_STORAGE_SERVERS];
+        long failure_silence[MAX_STORAGE_SERVERS];
+        int num_suspects = 0, num_failures = 0;
         
         pthread_mutex_lock(&data_mutex);
         time_t current_time = time(NULL);
+        double now_ms = monotonic_ms();
+        double stall_ms = now_ms - last_tick_ms - MONITOR_INTERVAL_MS;
+        last_tick_ms = now_ms;
+        
+        // If this tick ran late (a long data_mutex hold, a paused process), the
+        // heartbeats that arrived meanwhile are still queued behind the lock.
+        // Shift arrival times by the stall and judge again next tick.
+        if (stall_ms > MONITOR_STALL_MS) {
+            for (int i = 0; i < num_storage_servers; i++) {
+                if (detectors[i].last_arrival_ms > 0) detectors[i].last_arrival_ms += stall_ms;
+                if (storage_servers[i].last_heartbeat > 0) {
+                    storage_servers[i].last_heartbeat += (time_t)(stall_ms / 1000);
+                }
+            }
+            pthread_mutex_unlock(&data_mutex);
+            log_message("NM", "Monitor tick ran %.0f ms late; skipping failure verdicts", stall_ms);
+            continue;
+        }
         
         for (int i = 0; i < num_storage_servers; i++) {
             if (storage_servers[i].is_active) {
                 time_t time_since_heartbeat = current_time - storage_servers[i].last_heartbeat;
+                double phi = detector_phi(i, now_ms);
+                
+                // Without enough history, fall back to the fixed timeout
+                int failed = phi < 0 ? time_since_heartbeat > PHI_FALLBACK_TIMEOUT : phi >= PHI_FAIL;
                 
-                // If no heartbeat for 30 seconds, mark as inactive
-                if (time_since_heartbeat > 30) {
+                if (!failed && phi >= PHI_SUSPECT && !detectors[i].suspect) {
+                    if (!server_suspect(i)) {
+                        suspect_phi[num_suspects] = phi;
+                        suspects[num_suspects++] = i;
+                    }
+                    detectors[i].suspect = 1;
+                }
+                
+                if (failed) {
                     storage_servers[i].is_active = 0;
-                    log_message("NM", "Storage Server %s:%d marked INACTIVE (no heartbeat for %ld seconds)",
-                               storage_servers[i].ip, storage_servers[i].nm_port, time_since_heartbeat);
+                    failure_phi[num_failures] = phi;
+                    failure_silence[num_failures] = (long)time_since_heartbeat;
+                    failures[num_failures++] = i;
                     
                     // Trigger failover for files on this server
                     FileNode* current = file_list;
                     while (current) {
-                        if (current->metadata.ss_index == i && current->metadata.replica_ss_index != -1) {
-                            log_message("NM", "Failover: Promoting replica for file %s", current->metadata.filename);
-                            current->metadata.ss_index = current->metadata.replica_ss_index;
-                            current->metadata.replica_ss_index = -1; // No more replica
+                        int slot = replica_slot(current, i);
+                        if (slot >= 0) {
+                            remove_replica(current, slot); // Repair finds it a new home
+                            mark_replica_set_dirty(current);
+                            enqueue_repair(current);
+                        } else if (current->metadata.ss_index == i) {
+                            // Promote the live replica that last matched the primary, else any live one
+                            int promote = -1;
+                            for (int r = 0; r < current->metadata.num_replicas; r++) {
+                                if (!server_is_live(current->metadata.replicas[r])) continue;
+                                if (promote < 0 || (current->replica_hash[r] != 0 &&
+                                                    current->replica_hash[r] == current->primary_hash)) {
+                                    promote = r;
+                                }
+                            }
+                            if (promote >= 0) {
+                                current->metadata.ss_index = current->metadata.replicas[promote];
+                                remove_replica(current, promote);
+                                rebase_write_counter(current);
+                                reset_replica_freshness(current);
+                                bump_file_epoch(current);
+                                mark_replica_set_dirty(current);
+                                enqueue_repair(current);
+                            }
                         }
                         current = current->next;
                     }
@@ -1924,6 +6529,14 @@ void* monitor_storage_servers(void* arg) {
         }
         
         pthread_mutex_unlock(&data_mutex);
+        
+        for (int k = 0; k < num_suspects; k++) {
+            log_message("NM", "Storage Server SS%d is suspect (phi %.1f)", suspects[k], suspect_phi[k]);
+        }
+        for (int k = 0; k < num_failures; k++) {
+            log_message("NM", "Storage Server SS%d marked INACTIVE (no heartbeat for %ld seconds, phi %.1f); failing over its files",
+                       failures[k], failure_silence[k], failure_phi[k]);
+        }
     }
     
     return NULL;
@@ -1938,6 +6551,29 @@ void* handle_client(void* arg) {
     while (receive_message(client_sock, &msg) == 0) {
         log_message("NM", "Received message type %d from client %s", msg.type, msg.username);
         
+        if (reject_foreign_request(client_sock, &msg)) continue;
+        
+        // Client requests wait for a token and then for a fair share of the
+        // slots, or are turned away when either wait would be too long
+        UserLimiter* limiter = NULL;
+        double admitted_ms = 0;
+        if (is_scheduled_request(msg.type)) {
+            int op = op_class_of(msg.type);
+            pthread_mutex_lock(&sched_mutex);
+            limiter = user_limiter(msg.username);
+            pthread_mutex_unlock(&sched_mutex);
+            if (limiter) {
+                int retry_ms = take_token(limiter, op);
+                if (retry_ms == 0) retry_ms = acquire_slot(limiter, op);
+                if (retry_ms > 0) {
+                    put_user_limiter(limiter);
+                    send_busy(client_sock, retry_ms);
+                    continue;
+                }
+                admitted_ms = monotonic_ms();
+            }
+        }
+        
         switch (msg.type) {
             case MSG_REGISTER_CLIENT:
                 pthread_mutex_lock(&data_mutex);
@@ -1960,41 +6596,7 @@ void* handle_client(void* arg) {
                 break;
                 
             case MSG_REGISTER_SS:
-                pthread_mutex_lock(&data_mutex);
-                if (num_storage_servers < MAX_STORAGE_SERVERS) {
-                    strcpy(storage_servers[num_storage_servers].ip, msg.ss_ip);
-                    storage_servers[num_storage_servers].nm_port = msg.ss_port;
-                    storage_servers[num_storage_servers].client_port = msg.flags;
-                    storage_servers[num_storage_servers].is_active = 1;
-                    time(&storage_servers[num_storage_servers].last_heartbeat);
-                    
-                    // Parse file list from msg.data (for recovery/sync purposes only)
-                    // Note: We don't add these to metadata as they should only be created via client CREATE
-                    char data_copy[MAX_BUFFER_SIZE];
-                    strcpy(data_copy, msg.data);
-                    char* token = strtok(data_copy, "\n");
-                    while (token) {
-                        // Just acknowledge existing files, don't add to metadata
-                        // Files should only be in metadata if created via CREATE command
-                        token = strtok(NULL, "\n");
-                    }
-                    
-                    Message response;
-                    memset(&response, 0, sizeof(response));
-                    response.type = MSG_ACK;
-                    response.error_code = ERR_SUCCESS;
-                    sprintf(response.data, "Storage Server registered successfully (index: %d)", 
-                        num_storage_servers);
-                    send_message(client_sock, &response);
-                    
-                    log_message("NM", "Storage Server %s:%d registered (index %d)", 
-                        msg.ss_ip, msg.ss_port, num_storage_servers);
-                    log_to_file("Storage Server %s:%d registered", msg.ss_ip, msg.ss_port);
-                    
-                    num_storage_servers++;
-                    save_metadata();
-                }
-                pthread_mutex_unlock(&data_mutex);
+                register_storage_server(client_sock, &msg);
                 break;
                 
             case MSG_VIEW_FILES:
@@ -2049,6 +6651,10 @@ void* handle_client(void* arg) {
                 handle_view_folder(client_sock, &msg);
                 break;
                 
+            case MSG_SET_REPLICATION:
+                handle_set_replication(client_sock, &msg);
+                break;
+                
             // Bonus: Checkpoint operations
             case MSG_CHECKPOINT:
                 metrics.total_creates++;
@@ -2083,16 +6689,11 @@ void* handle_client(void* arg) {
                 break;
                 
             case MSG_SEARCH_FILE:
+                handle_search(client_sock, &msg);
+                break;
+                
             case MSG_GET_METRICS:
-                {
-                    // Simplified handlers for remaining bonus features
-                    Message response;
-                    memset(&response, 0, sizeof(response));
-                    response.type = MSG_RESPONSE;
-                    response.error_code = ERR_SUCCESS;
-                    sprintf(response.data, "✓ Feature under development (bonus)");
-                    send_message(client_sock, &response);
-                }
+                handle_metrics(client_sock, &msg);
                 break;
             
             case MSG_HEARTBEAT:
@@ -2100,12 +6701,39 @@ void* handle_client(void* arg) {
                 break;
             
             case MSG_SS_REPLICATE:
-                handle_replication_request(client_sock, &msg);
+                handle_replica_set_request(client_sock, &msg);
+                break;
+            
+            case MSG_SS_SESSION:
+                handle_ss_session(client_sock, &msg);
+                close(client_sock);
+                return NULL;
+                
+            case MSG_NM_STANDBY:
+                handle_standby_join(client_sock, &msg); // Keeps the socket
+                return NULL;
+                
+            case MSG_NM_SHARD_MAP:
+                handle_shard_map(client_sock);
+                break;
+                
+            case MSG_NM_MOVE_PREPARE:
+                handle_move_prepare(client_sock, &msg);
+                break;
+                
+            case MSG_NM_MOVE_COMMIT:
+                handle_move_commit(client_sock, &msg);
+                break;
+                
+            case MSG_NM_MOVE_ABORT:
+                handle_move_abort(client_sock, &msg);
                 break;
                 
             default:
                 log_message("NM", "Unknown message type: %d", msg.type);
         }
+        
+        if (limiter) release_slot(limiter, monotonic_ms() - admitted_ms);
     }
     
     log_message("NM", "Client disconnected");
@@ -2120,39 +6748,7 @@ void* handle_storage_server(void* arg) {
     
     Message msg;
     if (receive_message(ss_sock, &msg) == 0 && msg.type == MSG_REGISTER_SS) {
-        pthread_mutex_lock(&data_mutex);
-        
-        if (num_storage_servers < MAX_STORAGE_SERVERS) {
-            strcpy(storage_servers[num_storage_servers].ip, msg.ss_ip);
-            storage_servers[num_storage_servers].nm_port = msg.ss_port;
-            storage_servers[num_storage_servers].client_port = msg.flags;
-            storage_servers[num_storage_servers].is_active = 1;
-            time(&storage_servers[num_storage_servers].last_heartbeat);
-            
-            // Parse file list from msg.data (for recovery/sync purposes only)
-            // Note: We don't add these to metadata as they should only be created via client CREATE
-            char* token = strtok(msg.data, "\n");
-            while (token) {
-                // Just acknowledge existing files, don't add to metadata
-                // Files should only be in metadata if created via CREATE command
-                token = strtok(NULL, "\n");
-            }
-            
-            num_storage_servers++;
-            
-            Message response;
-            memset(&response, 0, sizeof(response));
-            response.type = MSG_ACK;
-            response.error_code = ERR_SUCCESS;
-            sprintf(response.data, "Storage Server registered successfully (index: %d)", 
-                num_storage_servers - 1);
-            send_message(ss_sock, &response);
-            
-            log_message("NM", "Storage Server %s:%d registered", msg.ss_ip, msg.ss_port);
-            save_metadata();
-        }
-        
-        pthread_mutex_unlock(&data_mutex);
+        register_storage_server(ss_sock, &msg);
     }
     
     close(ss_sock);
@@ -2167,6 +6763,7 @@ void save_metadata() {
         return;
     }
     
+    write_table_header(fp, METADATA_MAGIC, METADATA_VERSION);
     FileNode* current = file_list;
     while (current) {
         fwrite(&current->metadata, sizeof(FileMetadata), 1, fp);
@@ -2176,10 +6773,45 @@ void save_metadata() {
     }
     
     fclose(fp);
+    save_server_table();
+    save_access_requests();
+    save_checkpoint_catalog();
+    request_metadata_ship();
     log_message("NM", "Metadata saved");
 }
 
 // Load metadata from disk
+// Size of a FileMetadata record in headerless metadata files
+size_t legacy_metadata_size() {
+    size_t align = _Alignof(FileMetadata);
+    return (offsetof(FileMetadata, writes_issued) + align - 1) / align * align;
+}
+
+// Whether the rest of fp is a whole number of records of record_size each,
+// leaving fp where it was
+int metadata_records_fit(FILE* fp, size_t record_size) {
+    long start = ftell(fp);
+    long left = table_bytes_left(fp);
+    int fits = 1;
+    while (left > 0) {
+        int access_count;
+        if (left < (long)(record_size + sizeof(int)) || fseek(fp, record_size, SEEK_CUR) != 0 ||
+            fread(&access_count, sizeof(int), 1, fp) != 1 || access_count < 0) {
+            fits = 0;
+            break;
+        }
+        left -= record_size + sizeof(int);
+        if ((long)access_count * (long)sizeof(UserAccess) > left) {
+            fits = 0;
+            break;
+        }
+        left -= access_count * sizeof(UserAccess);
+        fseek(fp, access_count * sizeof(UserAccess), SEEK_CUR);
+    }
+    fseek(fp, start, SEEK_SET);
+    return fits;
+}
+
 void load_metadata() {
     FILE* fp = fopen(METADATA_FILE, "rb");
     if (!fp) {
@@ -2187,43 +6819,160 @@ void load_metadata() {
         return;
     }
     
+    // Headerless files hold records from before writes_issued was added:
+    // FileMetadata up to that field. Migrate them if they parse cleanly.
+    size_t record_size = sizeof(FileMetadata);
+    int version = read_table_header(fp, METADATA_MAGIC);
+    if (version == 0) {
+        record_size = legacy_metadata_size();
+        if (!metadata_records_fit(fp, record_size)) {
+            fclose(fp);
+            refuse_table(METADATA_FILE, version);
+        }
+        log_message("NM", "Migrating %s from the headerless format", METADATA_FILE);
+    } else if (version != METADATA_VERSION) {
+        fclose(fp);
+        refuse_table(METADATA_FILE, version);
+    }
+    
     while (!feof(fp)) {
         FileMetadata metadata;
-        if (fread(&metadata, sizeof(FileMetadata), 1, fp) != 1) break;
+        memset(&metadata, 0, sizeof(metadata));
+        if (fread(&metadata, record_size, 1, fp) != 1) break;
         
         int access_count;
         if (fread(&access_count, sizeof(int), 1, fp) != 1) break;
         
-        FileNode* node = (FileNode*)malloc(sizeof(FileNode));
-        memcpy(&node->metadata, &metadata, sizeof(FileMetadata));
-        node->access_count = access_count;
-        node->access_list = (UserAccess*)malloc(access_count * sizeof(UserAccess));
-        
-        if (fread(node->access_list, sizeof(UserAccess), access_count, fp) != (size_t)access_count) {
-            free(node->access_list);
-            free(node);
+        UserAccess* access_list = (UserAccess*)malloc(access_count * sizeof(UserAccess));
+        if (!access_list) break;
+        if (fread(access_list, sizeof(UserAccess), access_count, fp) != (size_t)access_count) {
+            free(access_list);
             break;
         }
         
-        node->next = file_list;
-        file_list = node;
-        
-        // Add to hash table
-        unsigned int index = hash_function(metadata.filename);
-        if (file_hash[index] == NULL) {
-            HashEntry* entry = (HashEntry*)malloc(sizeof(HashEntry));
-            strcpy(entry->key, metadata.filename);
-            entry->file = node;
-            file_hash[index] = entry;
-        }
+        if (metadata.epoch > location_epoch) location_epoch = metadata.epoch;
+        insert_file_node(&metadata, access_count, access_list);
     }
     
     fclose(fp);
     log_message("NM", "Metadata loaded");
 }
 
-int main() {
-    log_message("NM", "Starting Name Server on port %d", NM_PORT);
+int main(int argc, char* argv[]) {
+    int port_given = 0;
+    int fence_given = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--placement") == 0 && i + 1 < argc) {
+            if (set_placement_policy(argv[++i]) < 0) {
+                printf("Unknown placement policy '%s' (use random, p2c, weighted or ring)\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--rebalance-kbps") == 0 && i + 1 < argc) {
+            rebalance_kbps = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--repair-kbps") == 0 && i + 1 < argc) {
+            repair_kbps = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--read-policy") == 0 && i + 1 < argc) {
+            if (set_read_policy(argv[++i]) < 0) {
+                printf("Unknown read policy '%s' (use primary, round-robin, least-loaded or sticky)\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--max-staleness") == 0 && i + 1 < argc) {
+            max_replica_staleness = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--replication") == 0 && i + 1 < argc) {
+            default_replication = atoi(argv[++i]);
+            if (default_replication < 1 || default_replication > MAX_REPLICAS + 1) {
+                printf("Replication factor must be between 1 and %d\n", MAX_REPLICAS + 1);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--replication-mode") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "chain") == 0) {
+                chain_replication = 1;
+            } else if (strcmp(argv[i], "fanout") == 0) {
+                chain_replication = 0;
+            } else {
+                printf("Unknown replication mode '%s' (use fanout or chain)\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--write-quorum") == 0 && i + 1 < argc) {
+            write_quorum = atoi(argv[++i]);
+            if (write_quorum < 1) {
+                printf("Write quorum must be at least 1\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            nm_port = atoi(argv[++i]);
+            port_given = 1;
+        } else if (strcmp(argv[i], "--standby") == 0 && i + 1 < argc) {
+            char ips[1][INET_ADDRSTRLEN];
+            if (parse_server_list(argv[++i], ips, &primary_port, 1, NM_PORT) != 1) {
+                printf("Cannot parse primary name server '%s' (use ip[:port])\n", argv[i]);
+                return 1;
+            }
+            strcpy(primary_ip, ips[0]);
+        } else if (strcmp(argv[i], "--fence-file") == 0 && i + 1 < argc) {
+            strncpy(fence_path, argv[++i], sizeof(fence_path) - 1);
+            fence_given = 1;
+        } else if (strcmp(argv[i], "--force-primary") == 0) {
+            force_primary = 1;
+        } else if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+            num_shards = parse_server_list(argv[++i], shard_ips, shard_ports, MAX_NM_SHARDS, NM_PORT);
+            if (num_shards == 0) {
+                printf("Cannot parse shard list '%s' (use ip[:port],ip[:port],...)\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--shard-index") == 0 && i + 1 < argc) {
+            shard_index = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rate-limit") == 0 && i + 1 < argc) {
+            if (parse_rate_limits(argv[++i]) < 0) {
+                printf("Cannot parse rate limits '%s' (use read=N,write=N,heavy=N; 0 = unlimited)\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--max-wait-ms") == 0 && i + 1 < argc) {
+            max_wait_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-queue") == 0 && i + 1 < argc) {
+            max_queue = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--user-slots") == 0 && i + 1 < argc) {
+            user_slots = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--nm-workers") == 0 && i + 1 < argc) {
+            nm_workers = atoi(argv[++i]);
+            if (nm_workers < 1) {
+                printf("Worker count must be at least 1\n");
+                return 1;
+            }
+        } else {
+            printf("Usage: %s [--placement random|p2c|weighted|ring] [--rebalance-kbps N] [--repair-kbps N]\n"
+                   "       [--read-policy primary|round-robin|least-loaded|sticky] [--max-staleness SECONDS]\n"
+                   "       [--replication N] [--write-quorum W] [--replication-mode fanout|chain]\n"
+                   "       [--port N] [--standby PRIMARY_IP[:PORT]] [--fence-file PATH] [--force-primary]\n"
+                   "       [--shards IP:PORT,IP:PORT,... --shard-index I]\n"
+                   "       [--rate-limit read=N,write=N,heavy=N] [--nm-workers N] [--user-slots N]\n"
+                   "       [--max-wait-ms N] [--max-queue N]\n",
+                   argv[0]);
+            return 1;
+        }
+    }
+    if (num_shards > 0 && (shard_index < 0 || shard_index >= num_shards)) {
+        printf("Shard index must be between 0 and %d\n", num_shards - 1);
+        return 1;
+    }
+    // A standby fencing through its own local file would take over without
+    // the primary ever seeing the new generation
+    if (primary_ip[0] && !fence_given) {
+        printf("--standby needs --fence-file PATH on storage the primary also uses\n");
+        return 1;
+    }
+    if (num_shards > 0 && !port_given) nm_port = shard_ports[shard_index];
+    char host[256];
+    if (gethostname(host, sizeof(host)) != 0) strcpy(host, "localhost");
+    host[sizeof(host) - 1] = '\0';
+    snprintf(nm_node_id, sizeof(nm_node_id), "%s:%d", host, nm_port);
+    placement_seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+    
+    log_message("NM", "Starting Name Server on port %d (placement: %s)", nm_port, placement_policy->name);
+    if (num_shards > 1) {
+        log_message("NM", "Serving namespace shard %d of %d", shard_index, num_shards);
+    }
     
     // Initialize
     init_cache();
@@ -2234,15 +6983,7 @@ int main() {
     // Bonus: Initialize metrics and bonus data structures
     time(&metrics.start_time);
     folder_list = NULL;
-    checkpoints = (Checkpoint*)calloc(max_checkpoints, sizeof(Checkpoint));
-    access_requests = (AccessRequest*)calloc(max_access_requests, sizeof(AccessRequest));
     num_checkpoints = 0;
-    num_access_requests = 0;
-    
-    if (!checkpoints || !access_requests) {
-        log_message("NM", "ERROR: Cannot allocate memory for bonus features");
-        return 1;
-    }
     
     // Open log file
     log_file = fopen("nm_log.txt", "a");
@@ -2252,11 +6993,40 @@ int main() {
     
     // Load existing metadata
     load_metadata();
+    load_server_table();
+    rebuild_ring(); // Placement works before any server re-registers
+    load_access_requests();
+    if (num_shards > 1) load_pending_commits();
+    // A standby's own catalog may predate the primary's; it asks the SS instead
+    if (!primary_ip[0]) load_checkpoint_catalog();
     
     log_message("NM", "✓ Bonus Features Enabled: Folders, Checkpoints, Access Requests, Search, Metrics");
     
+    // A standby only mirrors the primary until it has to take over
+    if (primary_ip[0]) {
+        log_message("NM", "Standing by for primary name server %s:%d", primary_ip, primary_port);
+        take_over(follow_primary());
+    } else {
+        // Another node's generation in the fence file means a standby took
+        // over from us (or we are not the usual primary): serving now would
+        // split the namespace between two primaries
+        char owner[320];
+        long fence = read_fence_owner(owner, sizeof(owner));
+        if (fence > 0 && owner[0] && strcmp(owner, nm_node_id) != 0) {
+            if (!force_primary) {
+                log_message("NM", "Fence file %s holds generation %ld from %s, not this node (%s).",
+                           fence_path, fence, owner, nm_node_id);
+                log_message("NM", "Start with --standby <primary> to follow it, or --force-primary if it is gone for good");
+                return 1;
+            }
+            log_message("NM", "Taking over generation %ld from %s (--force-primary)", fence, owner);
+        }
+        nm_generation = fence + 1;
+        write_fence(nm_generation);
+    }
+    
     // Create server socket
-    int server_sock = create_socket(NM_PORT);
+    int server_sock = create_socket(nm_port);
     if (server_sock < 0) {
         log_message("NM", "Failed to create server socket");
         return 1;
@@ -2273,6 +7043,36 @@ int main() {
         log_message("NM", "✓ Storage Server monitoring thread started");
     }
     
+    pthread_t rebalancer;
+    if (pthread_create(&rebalancer, NULL, rebalance_thread, NULL) != 0) {
+        log_message("NM", "Warning: Failed to start rebalancer thread");
+    } else {
+        pthread_detach(rebalancer);
+    }
+    
+    pthread_t repairer;
+    if (pthread_create(&repairer, NULL, repair_thread, NULL) != 0) {
+        log_message("NM", "Warning: Failed to start re-replication thread");
+    } else {
+        pthread_detach(repairer);
+    }
+    
+    pthread_t shipper;
+    if (pthread_create(&shipper, NULL, ship_thread, NULL) != 0) {
+        log_message("NM", "Warning: Failed to start metadata shipping thread");
+    } else {
+        pthread_detach(shipper);
+    }
+    
+    if (num_shards > 1) {
+        pthread_t committer;
+        if (pthread_create(&committer, NULL, commit_retry_thread, NULL) != 0) {
+            log_message("NM", "Warning: Failed to start cross-shard move retry thread");
+        } else {
+            pthread_detach(committer);
+        }
+    }
+    
     // Accept connections
     while (1) {
         struct sockaddr_in client_addr;
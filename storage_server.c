@@ -2,6 +2,9 @@
 #include <stdarg.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <ctype.h>
+#include <sys/statvfs.h>
+#include <netinet/tcp.h>
 
 // Dynamic storage directories (set based on port number)
 char STORAGE_DIR[256] = "./storage";
@@ -18,16 +21,33 @@ typedef struct {
 char nm_ip[INET_ADDRSTRLEN] = "127.0.0.1";
 char my_ip[INET_ADDRSTRLEN] = "127.0.0.1";  // This server's IP address
 int nm_port = 8080;
+// Name servers to fail over between (a primary and its standbys); nm_ip and
+// nm_port are the one in use
+char nm_ips[MAX_NAME_SERVERS][INET_ADDRSTRLEN];
+int nm_ports[MAX_NAME_SERVERS];
+int num_name_servers = 0;
+int current_nm = 0;
+pthread_mutex_t nm_addr_mutex = PTHREAD_MUTEX_INITIALIZER;
 int client_port = 9000;
 int nm_listen_port = 9001;
+int capacity_weight = 1; // Relative capacity advertised to the NM for placement
 SentenceLock sentence_locks[MAX_FILES];
 int num_locks = 0;
 pthread_mutex_t locks_mutex = PTHREAD_MUTEX_INITIALIZER;
 FILE* log_file = NULL;
 
-// Bonus: Fault Tolerance - Persistent NM connection for heartbeat
-int nm_heartbeat_sock = -1;
+// Bonus: Fault Tolerance - Persistent NM session for heartbeats and notices
+int nm_session_sock = -1;
 pthread_mutex_t nm_sock_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Name servers sharing the namespace, from the shard map (0 = not sharded)
+char shard_ips[MAX_NM_SHARDS][INET_ADDRSTRLEN];
+int shard_ports[MAX_NM_SHARDS];
+int num_shards = 0;
+int shard_session_socks[MAX_NM_SHARDS];
+// Highest name server generation seen on the session (per shard when
+// sharded); a name server behind it was replaced by a standby
+int nm_generation_seen = 0;
+int shard_generations[MAX_NM_SHARDS];
 int should_exit = 0; // Flag to stop threads on shutdown
 
 // Function prototypes
@@ -45,9 +65,34 @@ void create_file(const char* filename, const char* owner);
 void delete_file(const char* filename);
 void save_for_undo(const char* filename);
 void log_to_file(const char* format, ...);
-void trigger_replication(const char* filename);
-void* async_replicate_thread(void* arg);
-void handle_replicate_from_primary(int nm_sock, Message* msg);
+void notify_nm_replication(const char* filename);
+void start_replication_workers();
+void replication_backlog(int* depth, double* lag_ms);
+int nm_session_send(Message* msg);
+// Content index for SEARCH
+void index_file_content(const char* filename, const char* content);
+void index_remove_file(const char* filename);
+void index_build_from_disk(const char* rel_dir);
+int index_search(const char* query, char* output, size_t size);
+// File change hooks (content index + stats pushed to the NM)
+void file_changed(const char* filename, const char* content);
+void file_changed_on_disk(const char* filename);
+void file_removed(const char* filename);
+int check_file_epoch(const char* filename, int epoch);
+void set_file_epoch(const char* filename, int epoch, int force);
+int create_folder_recursive(const char* path);
+// Migration between storage servers (rebalancer)
+void handle_export(Message* msg, Message* response);
+void handle_migrate_from_peer(Message* msg, Message* response);
+// Replica updates pushed by primaries
+void handle_replica_put(Message* msg, Message* response);
+void handle_replica_delta(Message* msg, Message* response);
+void handle_merkle_root(Message* msg, Message* response);
+void handle_merkle_bucket(Message* msg, Message* response);
+void handle_merkle_blocks(Message* msg, Message* response);
+void handle_repair_patch(Message* msg, Message* response);
+void* anti_entropy_thread(void* arg);
+void start_anti_entropy_round(const char* ip, int port);
 
 // Logging
 void log_to_file(const char* format, ...) {
@@ -282,6 +327,7 @@ void create_file(const char* filename, const char* owner) {
     FILE* fp = fopen(filepath, "w");
     if (fp) {
         fclose(fp);
+        file_changed(filename, ""); // Fresh empty file replaces any stale index/stats
         log_message("SS", "Created file: %s (owner: %s)", filename, owner);
         log_to_file("CREATE: %s by %s", filename, owner);
     }
@@ -293,6 +339,7 @@ void delete_file(const char* filename) {
     snprintf(filepath, sizeof(filepath), "%s/%s", STORAGE_DIR, filename);
     
     if (unlink(filepath) == 0) {
+        file_removed(filename);
         log_message("SS", "Deleted file: %s", filename);
         log_to_file("DELETE: %s", filename);
         
@@ -351,49 +398,2521 @@ void save_for_undo(const char* filename) {
     save_for_undo_with_folder("", filename);
 }
 
-// Asynchronously replicate file to replica storage server
-void replicate_to_secondary(const char* filename, const char* replica_ip, int replica_port) {
-    // This should be called in a separate thread for async replication
-    char file_path[512];
-    snprintf(file_path, sizeof(file_path), "%s/%s", STORAGE_DIR, filename);
+// ═══════════════════════════════════════════════════════════════════
+// CONTENT INDEX - Inverted word index used by SEARCH
+// ═══════════════════════════════════════════════════════════════════
+
+#define INDEX_BUCKETS 4096
+#define MAX_QUERY_TERMS 16
+
+typedef struct Posting {
+    char filename[MAX_FILENAME];
+    int count; // Occurrences of the term in this file
+    struct Posting* next;
+} Posting;
+
+typedef struct IndexTerm {
+    char word[MAX_WORD_LENGTH];
+    Posting* postings;
+    struct IndexTerm* next;
+} IndexTerm;
+
+// Forward entry: the terms a file contributed, so re-indexing only touches those
+typedef struct IndexedFile {
+    char filename[MAX_FILENAME];
+    IndexTerm** terms;
+    int term_count;
+    int term_capacity;
+    struct IndexedFile* next;
+} IndexedFile;
+
+IndexTerm* index_terms[INDEX_BUCKETS];
+IndexedFile* indexed_files[INDEX_BUCKETS];
+pthread_mutex_t index_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Word separators - same rule MSG_SS_STAT uses to count words
+int is_word_separator(char c) {
+    return c == ' ' || c == '\n' || c == '\t';
+}
+
+unsigned int index_hash(const char* str) {
+    unsigned int hash = 5381;
+    int c;
+    while ((c = *str++)) {
+        hash = ((hash << 5) + hash) + c;
+    }
+    return hash % INDEX_BUCKETS;
+}
+
+// Lowercase a token and strip surrounding punctuation ("Hello," -> "hello")
+int normalize_word(const char* token, int len, char* out) {
+    int start = 0;
+    int end = len;
+    while (start < end && !isalnum((unsigned char)token[start])) start++;
+    while (end > start && !isalnum((unsigned char)token[end - 1])) end--;
     
-    // Read file content
-    char buffer[MAX_BUFFER_SIZE];
-    FILE* f = fopen(file_path, "r");
-    if (!f) {
-        log_message("SS", "Failed to read file for replication: %s", filename);
+    int n = 0;
+    for (int i = start; i < end && n < MAX_WORD_LENGTH - 1; i++) {
+        out[n++] = tolower((unsigned char)token[i]);
+    }
+    out[n] = '\0';
+    return n;
+}
+
+IndexTerm* index_find_term(const char* word) {
+    IndexTerm* term = index_terms[index_hash(word)];
+    while (term && strcmp(term->word, word) != 0) {
+        term = term->next;
+    }
+    return term;
+}
+
+IndexedFile* index_find_file(const char* filename) {
+    IndexedFile* file = indexed_files[index_hash(filename)];
+    while (file && strcmp(file->filename, filename) != 0) {
+        file = file->next;
+    }
+    return file;
+}
+
+// Retract all postings of a file (index_mutex must be held)
+void index_remove_file_locked(const char* filename) {
+    unsigned int bucket = index_hash(filename);
+    IndexedFile* prev = NULL;
+    IndexedFile* file = indexed_files[bucket];
+    while (file && strcmp(file->filename, filename) != 0) {
+        prev = file;
+        file = file->next;
+    }
+    if (!file) return;
+    
+    for (int i = 0; i < file->term_count; i++) {
+        IndexTerm* term = file->terms[i];
+        Posting* p_prev = NULL;
+        Posting* posting = term->postings;
+        while (posting && strcmp(posting->filename, filename) != 0) {
+            p_prev = posting;
+            posting = posting->next;
+        }
+        if (posting) {
+            if (p_prev) {
+                p_prev->next = posting->next;
+            } else {
+                term->postings = posting->next;
+            }
+            free(posting);
+        }
+        // Terms are kept even when empty; they are reused by later writes
+    }
+    
+    if (prev) {
+        prev->next = file->next;
+    } else {
+        indexed_files[bucket] = file->next;
+    }
+    free(file->terms);
+    free(file);
+}
+
+void index_remove_file(const char* filename) {
+    pthread_mutex_lock(&index_mutex);
+    index_remove_file_locked(filename);
+    pthread_mutex_unlock(&index_mutex);
+}
+
+// Replace the indexed terms of a file with the words of its new content
+void index_file_content(const char* filename, const char* content) {
+    pthread_mutex_lock(&index_mutex);
+    index_remove_file_locked(filename);
+    
+    IndexedFile* file = (IndexedFile*)calloc(1, sizeof(IndexedFile));
+    if (!file) {
+        pthread_mutex_unlock(&index_mutex);
         return;
     }
+    strcpy(file->filename, filename);
+    
+    const char* p = content;
+    while (*p) {
+        while (*p && is_word_separator(*p)) p++;
+        const char* start = p;
+        while (*p && !is_word_separator(*p)) p++;
+        if (p == start) continue;
+        
+        char word[MAX_WORD_LENGTH];
+        if (normalize_word(start, p - start, word) == 0) continue;
+        
+        IndexTerm* term = index_find_term(word);
+        if (!term) {
+            term = (IndexTerm*)calloc(1, sizeof(IndexTerm));
+            if (!term) continue;
+            strcpy(term->word, word);
+            unsigned int bucket = index_hash(word);
+            term->next = index_terms[bucket];
+            index_terms[bucket] = term;
+        }
+        
+        // Postings of this file were retracted above, so ours is always at the head
+        if (term->postings && strcmp(term->postings->filename, filename) == 0) {
+            term->postings->count++;
+            continue;
+        }
+        
+        // Make room in the file's term list first: a posting it does not
+        // list could never be retracted
+        if (file->term_count == file->term_capacity) {
+            int capacity = file->term_capacity ? file->term_capacity * 2 : 32;
+            IndexTerm** terms = (IndexTerm**)realloc(file->terms, capacity * sizeof(IndexTerm*));
+            if (!terms) continue;
+            file->terms = terms;
+            file->term_capacity = capacity;
+        }
+        
+        Posting* posting = (Posting*)malloc(sizeof(Posting));
+        if (!posting) continue;
+        strcpy(posting->filename, filename);
+        posting->count = 1;
+        posting->next = term->postings;
+        term->postings = posting;
+        file->terms[file->term_count++] = term;
+    }
+    
+    unsigned int bucket = index_hash(filename);
+    file->next = indexed_files[bucket];
+    indexed_files[bucket] = file;
+    
+    pthread_mutex_unlock(&index_mutex);
+}
+
+// Index every file below STORAGE_DIR (rel_dir is relative to it, "" for the root)
+// and queue their stats for the first heartbeat
+void index_build_from_disk(const char* rel_dir) {
+    char dir_path[512];
+    if (strlen(rel_dir) > 0) {
+        snprintf(dir_path, sizeof(dir_path), "%s/%s", STORAGE_DIR, rel_dir);
+    } else {
+        snprintf(dir_path, sizeof(dir_path), "%s", STORAGE_DIR);
+    }
+    
+    DIR* dir = opendir(dir_path);
+    if (!dir) return;
+    
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        
+        char rel_path[MAX_FILENAME];
+        int len;
+        if (strlen(rel_dir) > 0) {
+            len = snprintf(rel_path, sizeof(rel_path), "%s/%s", rel_dir, entry->d_name);
+        } else {
+            len = snprintf(rel_path, sizeof(rel_path), "%s", entry->d_name);
+        }
+        if (len < 0 || len >= (int)sizeof(rel_path)) continue; // Too deep to be a DFS filename
+        
+        char full_path[768];
+        snprintf(full_path, sizeof(full_path), "%s/%s", STORAGE_DIR, rel_path);
+        struct stat st;
+        if (stat(full_path, &st) != 0) continue;
+        
+        if (S_ISDIR(st.st_mode)) {
+            index_build_from_disk(rel_path);
+        } else if (S_ISREG(st.st_mode)) {
+            // Skip swap files left behind by an interrupted WRITE
+            if (len > 4 && strcmp(rel_path + len - 4, ".tmp") == 0) continue;
+            file_changed_on_disk(rel_path);
+        }
+    }
+    closedir(dir);
+}
+
+// Find files containing every query term; output is "filename score\n" per hit
+int index_search(const char* query, char* output, size_t size) {
+    char terms[MAX_QUERY_TERMS][MAX_WORD_LENGTH];
+    int term_count = 0;
+    
+    const char* p = query;
+    while (*p && term_count < MAX_QUERY_TERMS) {
+        while (*p && is_word_separator(*p)) p++;
+        const char* start = p;
+        while (*p && !is_word_separator(*p)) p++;
+        if (p > start && normalize_word(start, p - start, terms[term_count]) > 0) {
+            term_count++;
+        }
+    }
+    
+    output[0] = '\0';
+    if (term_count == 0) return 0;
+    
+    pthread_mutex_lock(&index_mutex);
+    
+    IndexTerm* first = index_find_term(terms[0]);
+    int hits = 0;
+    size_t offset = 0;
+    
+    for (Posting* posting = first ? first->postings : NULL; posting; posting = posting->next) {
+        int score = posting->count;
+        int matches_all = 1;
+        
+        for (int t = 1; t < term_count && matches_all; t++) {
+            IndexTerm* term = index_find_term(terms[t]);
+            Posting* other = term ? term->postings : NULL;
+            while (other && strcmp(other->filename, posting->filename) != 0) {
+                other = other->next;
+            }
+            if (other) {
+                score += other->count;
+            } else {
+                matches_all = 0;
+            }
+        }
+        
+        if (!matches_all) continue;
+        
+        int written = snprintf(output + offset, size - offset, "%s %d\n", posting->filename, score);
+        if (written < 0 || (size_t)written >= size - offset) break;
+        offset += written;
+        hits++;
+    }
+    
+    pthread_mutex_unlock(&index_mutex);
+    return hits;
+}
+
+// ═══════════════════════════════════════════════════════════════════
+// FILE STATE - Per-file stats pushed to the Name Server with heartbeats,
+//              and the location epoch client leases are checked against
+// ═══════════════════════════════════════════════════════════════════
+
+#define FILE_STATE_BUCKETS 1024
+#define HEARTBEAT_INTERVAL_MS 500 // Liveness pulse period; the NM learns its jitter
+#define TELEMETRY_INTERVAL 2      // Seconds between telemetry samples in heartbeats
+#define STATS_PUSH_DELAY_MS 200 // Batching window for stats pushed ahead of the interval
+
+typedef struct FileState {
+    char filename[MAX_FILENAME];
+    int word_count;
+    int char_count;
+    time_t modified;
+    int stats_dirty; // Changed since the last push to the NM
+    int stats_known; // word_count/char_count/content_hash are valid
+    unsigned long long content_hash; // Reported so the NM can tell whether replicas are current
+    long size;       // Bytes on disk, for the heartbeat telemetry
+    int epoch;       // Highest location epoch seen for this file
+    int write_seq;   // Highest NM WRITE counter applied, echoed with the stats
+    // Replica set (as primary) and replica PUT version (either role)
+    char replica_ips[MAX_REPLICAS][INET_ADDRSTRLEN];
+    int replica_ports[MAX_REPLICAS]; // Replicas' NM ports
+    int num_replicas;
+    int write_quorum;      // Copies, this one included, a WRITE waits for
+    int replica_set_known; // The NM has sent the set since this process started
+    int chain;             // Writes go down the set in order instead of fanning out
+    long long version;     // Last version pushed or applied
+    char* pushed;          // Content as of version when this server pushed it, for deltas
+    int pushed_len;
+    char origin_ip[INET_ADDRSTRLEN]; // Primary this copy was last updated from (replica role)
+    int origin_port;
+    struct FileState* next;
+} FileState;
+
+FileState* file_states[FILE_STATE_BUCKETS];
+int num_dirty_stats = 0;
+pthread_mutex_t state_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t stats_cond = PTHREAD_COND_INITIALIZER; // Wakes the heartbeat thread early
+
+// 64-bit FNV-1a over file content. Identical copies on different servers
+// hash the same, which is how the NM compares primary and replica contents.
+unsigned long long checksum_extend(unsigned long long h, const char* content, int n) {
+    for (int i = 0; i < n; i++) {
+        h ^= (unsigned char)content[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+unsigned long long content_checksum(const char* content, int n) {
+    return checksum_extend(1469598103934665603ULL, content, n);
+}
+
+// One checkpoint as the NM catalogs it: "C <created> <size> <hash> <tag>"
+int format_checkpoint_record(char* out, size_t size, const char* path, const char* tag) {
+    FILE* f = fopen(path, "r");
+    if (!f) return -1;
+    
+    unsigned long long hash = 1469598103934665603ULL;
+    long total = 0;
+    char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+        hash = checksum_extend(hash, buffer, n);
+        total += n;
+    }
+    fclose(f);
+    
+    struct stat st;
+    time_t created = (stat(path, &st) == 0) ? st.st_mtime : time(NULL);
+    return snprintf(out, size, "C %ld %ld %016llx %s\n", (long)created, total, hash, tag);
+}
+
+// Count words and characters the same way MSG_SS_STAT always has
+void count_words_chars(const char* content, int n, int* word_count, int* char_count) {
+    int in_word = 0;
+    *word_count = 0;
+    *char_count = n;
+    
+    for (int i = 0; i < n; i++) {
+        if (is_word_separator(content[i])) {
+            in_word = 0;
+        } else if (!in_word) {
+            (*word_count)++;
+            in_word = 1;
+        }
+    }
+}
+
+// Find (or create) the state entry of a file (state_mutex must be held)
+FileState* file_state_get(const char* filename, int create) {
+    unsigned int bucket = index_hash(filename) % FILE_STATE_BUCKETS;
+    FileState* state = file_states[bucket];
+    while (state && strcmp(state->filename, filename) != 0) {
+        state = state->next;
+    }
+    
+    if (!state && create) {
+        state = (FileState*)calloc(1, sizeof(FileState));
+        if (state) {
+            strcpy(state->filename, filename);
+            state->next = file_states[bucket];
+            file_states[bucket] = state;
+        }
+    }
+    return state;
+}
+
+// Record new counts for a file, last changed at modified, and queue them
+// for the next heartbeat. write_seq is the NM's counter of the WRITE that
+// produced them (0 for other changes); it goes out in the same push.
+void file_state_update_stats(const char* filename, const char* content, time_t modified, int write_seq) {
+    int word_count, char_count;
+    int n = strlen(content);
+    count_words_chars(content, n, &word_count, &char_count);
+    unsigned long long hash = content_checksum(content, n);
+    
+    pthread_mutex_lock(&state_mutex);
+    FileState* state = file_state_get(filename, 1);
+    if (state) {
+        state->word_count = word_count;
+        state->char_count = char_count;
+        state->content_hash = hash;
+        state->size = n;
+        state->stats_known = 1;
+        state->modified = modified;
+        if (write_seq > state->write_seq) state->write_seq = write_seq;
+        if (!state->stats_dirty) {
+            state->stats_dirty = 1;
+            num_dirty_stats++;
+        }
+        pthread_cond_signal(&stats_cond);
+    }
+    pthread_mutex_unlock(&state_mutex);
+}
+
+void file_state_remove(const char* filename) {
+    pthread_mutex_lock(&state_mutex);
+    unsigned int bucket = index_hash(filename) % FILE_STATE_BUCKETS;
+    FileState* prev = NULL;
+    FileState* state = file_states[bucket];
+    while (state && strcmp(state->filename, filename) != 0) {
+        prev = state;
+        state = state->next;
+    }
+    if (state) {
+        if (prev) {
+            prev->next = state->next;
+        } else {
+            file_states[bucket] = state->next;
+        }
+        if (state->stats_dirty) num_dirty_stats--;
+        free(state->pushed);
+        free(state);
+    }
+    pthread_mutex_unlock(&state_mutex);
+}
+
+// Current counts of a file, from its state entry or (first time) from disk.
+// Returns -1 if the file does not exist.
+int file_state_get_stats(const char* filename, int* word_count, int* char_count,
+                         unsigned long long* hash) {
+    pthread_mutex_lock(&state_mutex);
+    FileState* state = file_state_get(filename, 0);
+    if (state && state->stats_known) {
+        *word_count = state->word_count;
+        *char_count = state->char_count;
+        *hash = state->content_hash;
+        pthread_mutex_unlock(&state_mutex);
+        return 0;
+    }
+    pthread_mutex_unlock(&state_mutex);
+    
+    char* buffer = (char*)malloc(MAX_BUFFER_SIZE);
+    if (!buffer) return -1;
+    int n = read_file_content(filename, buffer, MAX_BUFFER_SIZE);
+    if (n < 0) {
+        free(buffer);
+        return -1;
+    }
+    count_words_chars(buffer, n, word_count, char_count);
+    *hash = content_checksum(buffer, n);
+    free(buffer);
+    
+    // Cache without queueing a push - the NM asked for these itself
+    pthread_mutex_lock(&state_mutex);
+    state = file_state_get(filename, 1);
+    if (state) {
+        state->word_count = *word_count;
+        state->char_count = *char_count;
+        state->content_hash = *hash;
+        state->size = n;
+        state->stats_known = 1;
+    }
+    pthread_mutex_unlock(&state_mutex);
+    return 0;
+}
+
+// Drain changed stats into heartbeat payload lines:
+// "S <file> <words> <chars> <mtime> <hash> <write seq>"
+int collect_dirty_stats(char* output, size_t size) {
+    size_t offset = 0;
+    int count = 0;
+    output[0] = '\0';
+    
+    pthread_mutex_lock(&state_mutex);
+    for (int b = 0; b < FILE_STATE_BUCKETS && num_dirty_stats > 0; b++) {
+        for (FileState* state = file_states[b]; state; state = state->next) {
+            if (!state->stats_dirty) continue;
+            
+            int written = snprintf(output + offset, size - offset, "S %s %d %d %ld %016llx %d\n",
+                state->filename, state->word_count, state->char_count, (long)state->modified,
+                state->content_hash, state->write_seq);
+            if (written < 0 || (size_t)written >= size - offset) {
+                output[offset] = '\0';
+                pthread_mutex_unlock(&state_mutex);
+                return count; // Payload full; the rest goes with the next heartbeat
+            }
+            offset += written;
+            state->stats_dirty = 0;
+            num_dirty_stats--;
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&state_mutex);
+    return count;
+}
+
+// Mark the files named in an unsent payload dirty again
+void requeue_dirty_stats(const char* payload) {
+    char filename[MAX_FILENAME];
+    const char* line = payload;
+    
+    pthread_mutex_lock(&state_mutex);
+    while (line && *line) {
+        if (sscanf(line, "S %255s", filename) == 1) {
+            FileState* state = file_state_get(filename, 0);
+            if (state && !state->stats_dirty) {
+                state->stats_dirty = 1;
+                num_dirty_stats++;
+            }
+        }
+        line = strchr(line, '\n');
+        if (line) line++;
+    }
+    pthread_mutex_unlock(&state_mutex);
+}
+
+// Check a client's lease epoch against the file's. Only set_file_epoch raises
+// a file's epoch, so a client cannot move it forward (or grow the state table)
+// by sending a made-up one. Returns -1 when the lease is stale. Epoch 0
+// (internal traffic) and files with no known epoch always pass.
+int check_file_epoch(const char* filename, int epoch) {
+    if (epoch <= 0) return 0;
+    
+    int result = 0;
+    pthread_mutex_lock(&state_mutex);
+    FileState* state = file_state_get(filename, 0);
+    if (state && epoch < state->epoch) {
+        result = -1;
+    }
+    pthread_mutex_unlock(&state_mutex);
+    return result;
+}
+
+// Set a file's epoch on NM request; force is used on CREATE where the NM is
+// authoritative even if an old file of the same name had a higher one
+void set_file_epoch(const char* filename, int epoch, int force) {
+    pthread_mutex_lock(&state_mutex);
+    FileState* state = file_state_get(filename, 1);
+    if (state && (force || epoch > state->epoch)) {
+        state->epoch = epoch;
+    }
+    pthread_mutex_unlock(&state_mutex);
+}
+
+// A file's content changed: refresh its index terms and push its new stats
+void file_changed(const char* filename, const char* content) {
+    index_file_content(filename, content);
+    file_state_update_stats(filename, content, time(NULL), 0);
+}
+
+// Same as file_changed, for changes made directly on disk (undo, revert,
+// move) and files found at startup. The file's own mtime is pushed, so a
+// restart does not make every file look freshly written.
+void file_changed_on_disk(const char* filename) {
+    char* buffer = (char*)malloc(MAX_BUFFER_SIZE);
+    if (!buffer) return;
+    
+    char filepath[512];
+    snprintf(filepath, sizeof(filepath), "%s/%s", STORAGE_DIR, filename);
+    struct stat st;
+    if (stat(filepath, &st) == 0 && read_file_content(filename, buffer, MAX_BUFFER_SIZE) >= 0) {
+        index_file_content(filename, buffer);
+        file_state_update_stats(filename, buffer, st.st_mtime, 0);
+    } else {
+        file_removed(filename);
+    }
+    free(buffer);
+}
+
+// Latest NM WRITE counter applied to a file (0 = none since this process started)
+int file_state_write_seq(const char* filename) {
+    pthread_mutex_lock(&state_mutex);
+    FileState* state = file_state_get(filename, 0);
+    int write_seq = state ? state->write_seq : 0;
+    pthread_mutex_unlock(&state_mutex);
+    return write_seq;
+}
+
+void file_removed(const char* filename) {
+    index_remove_file(filename);
+    file_state_remove(filename);
+}
+
+// ═══════════════════════════════════════════════════════════════════
+// TELEMETRY - Load and health counters reported with each heartbeat
+// ═══════════════════════════════════════════════════════════════════
+
+#define LATENCY_BUCKETS 32 // Bucket i holds requests that took < 2^i microseconds
+#define SS_MAX_INFLIGHT 64 // Client requests served at once; more are told to retry
+#define SS_LATENCY_TARGET_US 250000 // Shed above this recent p99 READ/UNDO latency...
+#define SS_SHED_MIN_INFLIGHT 8 // ...once this many requests are in flight
+#define SS_LATENCY_WINDOW_MS 1000 // Admission judges latency over the last one or two windows
+#define BUSY_RETRY_MIN_MS 50
+#define BUSY_RETRY_MAX_MS 2000
+
+enum { REQ_READ, REQ_WRITE, REQ_STREAM, REQ_UNDO, REQ_NM, REQ_TYPES };
+
+typedef struct {
+    int requests[REQ_TYPES];
+    int latency[LATENCY_BUCKETS];
+    int active_conns; // Client requests being served plus open NM connections
+    int inflight;     // Client requests being served
+    int sessions;     // WRITE and STREAM sessions among them, left out of admission
+    long long replica_bytes; // File bytes sent to replicas (PUTs and deltas)
+    int replica_resyncs;     // Deltas a replica could not apply
+    int antientropy_repairs; // Replica files repaired by anti-entropy since start (not reset)
+    int recent_latency[LATENCY_BUCKETS];   // Admission window: the current one...
+    int previous_latency[LATENCY_BUCKETS]; // ...and the one before (not reset by reports)
+    struct timespec window_start;
+    int shed; // Client requests turned away as busy since start (not reset)
+    struct timespec since; // Start of the current reporting interval
+} Telemetry;
+
+Telemetry telemetry;
+pthread_mutex_t telemetry_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+long long elapsed_us(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000LL + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+void telemetry_conn_opened(int is_client) {
+    pthread_mutex_lock(&telemetry_mutex);
+    telemetry.active_conns++;
+    if (is_client) telemetry.inflight++;
+    pthread_mutex_unlock(&telemetry_mutex);
+}
+
+void telemetry_conn_closed(int is_client) {
+    pthread_mutex_lock(&telemetry_mutex);
+    telemetry.active_conns--;
+    if (is_client) telemetry.inflight--;
+    pthread_mutex_unlock(&telemetry_mutex);
+}
+
+// A WRITE or STREAM session started (1) or ended (-1). Sessions last as
+// long as the user types or reads, so they do not count as queued work.
+void telemetry_session(int delta) {
+    pthread_mutex_lock(&telemetry_mutex);
+    telemetry.sessions += delta;
+    pthread_mutex_unlock(&telemetry_mutex);
+}
+
+void telemetry_replica_sent(int bytes, int resync) {
+    pthread_mutex_lock(&telemetry_mutex);
+    telemetry.replica_bytes += bytes;
+    telemetry.replica_resyncs += resync;
+    pthread_mutex_unlock(&telemetry_mutex);
+}
+
+void telemetry_antientropy_repaired(int bytes) {
+    pthread_mutex_lock(&telemetry_mutex);
+    telemetry.replica_bytes += bytes;
+    telemetry.antientropy_repairs++;
+    pthread_mutex_unlock(&telemetry_mutex);
+}
+
+// Start a new admission window once the current one is over; after a
+// quiet spell both windows start empty (telemetry_mutex held)
+void rotate_latency_window() {
+    long long age_us = elapsed_us(&telemetry.window_start);
+    if (age_us < SS_LATENCY_WINDOW_MS * 1000LL) return;
+    
+    if (age_us < 2 * SS_LATENCY_WINDOW_MS * 1000LL) {
+        memcpy(telemetry.previous_latency, telemetry.recent_latency, sizeof(telemetry.recent_latency));
+    } else {
+        memset(telemetry.previous_latency, 0, sizeof(telemetry.previous_latency));
+    }
+    memset(telemetry.recent_latency, 0, sizeof(telemetry.recent_latency));
+    clock_gettime(CLOCK_MONOTONIC, &telemetry.window_start);
+}
+
+// Count a request; latency_us < 0 leaves it out of the latency histogram
+// (WRITE sessions last as long as the user keeps typing)
+void telemetry_record(int type, long long latency_us) {
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && latency_us >= (1LL << bucket)) {
+        bucket++;
+    }
+    
+    pthread_mutex_lock(&telemetry_mutex);
+    telemetry.requests[type]++;
+    if (latency_us >= 0) {
+        telemetry.latency[bucket]++;
+        rotate_latency_window();
+        telemetry.recent_latency[bucket]++;
+    }
+    pthread_mutex_unlock(&telemetry_mutex);
+}
+
+
+// Upper bound of the bucket holding the 99th percentile, 0 with no samples
+long long latency_p99_us(const int* latency) {
+    int total = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) total += latency[i];
+    if (total == 0) return 0;
+    
+    int seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += latency[i];
+        if (seen * 100LL >= total * 99LL) return 1LL << i;
+    }
+    return 1LL << (LATENCY_BUCKETS - 1);
+}
+
+// Admission control for a client request that has just been counted as in
+// flight: 0 to serve it, otherwise the milliseconds it should wait before
+// retrying. Requests are refused when too many are in flight, or when the
+// p99 latency of the last second or two is past the target with a queue
+// behind it. Open WRITE and STREAM sessions are not counted as a queue.
+int admit_client_request() {
+    int retry_ms = 0;
+    pthread_mutex_lock(&telemetry_mutex);
+    int inflight = telemetry.inflight - telemetry.sessions;
+    rotate_latency_window();
+    int window[LATENCY_BUCKETS];
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        window[i] = telemetry.recent_latency[i] + telemetry.previous_latency[i];
+    }
+    long long p99_us = latency_p99_us(window);
+    if (inflight > SS_MAX_INFLIGHT ||
+        (inflight > SS_SHED_MIN_INFLIGHT && p99_us > SS_LATENCY_TARGET_US)) {
+        // Roughly the time for the requests ahead of it to drain
+        retry_ms = (int)(p99_us / 1000.0 * inflight / SS_MAX_INFLIGHT);
+        if (retry_ms < BUSY_RETRY_MIN_MS) retry_ms = BUSY_RETRY_MIN_MS;
+        if (retry_ms > BUSY_RETRY_MAX_MS) retry_ms = BUSY_RETRY_MAX_MS;
+        telemetry.shed++;
+    }
+    pthread_mutex_unlock(&telemetry_mutex);
+    return retry_ms;
+}
+
+// Write the "L key=value ..." heartbeat line and start a new interval
+int format_telemetry(char* output, size_t size) {
+    Telemetry snapshot;
+    pthread_mutex_lock(&telemetry_mutex);
+    snapshot = telemetry;
+    memset(telemetry.requests, 0, sizeof(telemetry.requests));
+    memset(telemetry.latency, 0, sizeof(telemetry.latency));
+    telemetry.replica_bytes = 0;
+    telemetry.replica_resyncs = 0;
+    clock_gettime(CLOCK_MONOTONIC, &telemetry.since);
+    pthread_mutex_unlock(&telemetry_mutex);
+    
+    double seconds = elapsed_us(&snapshot.since) / 1e6;
+    if (seconds < 0.001) seconds = 0.001;
+    
+    int files = 0;
+    long long bytes = 0;
+    pthread_mutex_lock(&state_mutex);
+    for (int b = 0; b < FILE_STATE_BUCKETS; b++) {
+        for (FileState* state = file_states[b]; state; state = state->next) {
+            if (!state->stats_known) continue;
+            files++;
+            bytes += state->size;
+        }
+    }
+    pthread_mutex_unlock(&state_mutex);
+    
+    int repl_queue;
+    double repl_lag_ms;
+    replication_backlog(&repl_queue, &repl_lag_ms);
+    
+    long long free_kb = -1;
+    struct statvfs fs;
+    if (statvfs(STORAGE_DIR, &fs) == 0) {
+        free_kb = (long long)fs.f_bavail * fs.f_frsize / 1024;
+    }
+    
+    return snprintf(output, size,
+        "L read=%.2f write=%.2f stream=%.2f undo=%.2f nm=%.2f p99_us=%lld "
+        "conns=%d inflight=%d free_kb=%lld files=%d bytes=%lld repl_bps=%.0f resyncs=%d "
+        "repl_queue=%d repl_lag_ms=%.0f ae_repairs=%d shed=%d\n",
+        snapshot.requests[REQ_READ] / seconds, snapshot.requests[REQ_WRITE] / seconds,
+        snapshot.requests[REQ_STREAM] / seconds, snapshot.requests[REQ_UNDO] / seconds,
+        snapshot.requests[REQ_NM] / seconds, latency_p99_us(snapshot.latency),
+        snapshot.active_conns, snapshot.inflight, free_kb, files, bytes,
+        snapshot.replica_bytes / seconds, snapshot.replica_resyncs,
+        repl_queue, repl_lag_ms, snapshot.antientropy_repairs, snapshot.shed);
+}
+
+// ═══════════════════════════════════════════════════════════════════
+// MIGRATION - Export file data to peers and pull files for the rebalancer
+// ═══════════════════════════════════════════════════════════════════
+
+// True while a WRITE session holds any sentence lock on the file
+int file_has_active_writer(const char* filename) {
+    int active = 0;
+    pthread_mutex_lock(&locks_mutex);
+    for (int i = 0; i < num_locks; i++) {
+        if (strcmp(sentence_locks[i].filename, filename) == 0 &&
+            sentence_locks[i].locked_by[0] != '\0') {
+            active = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&locks_mutex);
+    return active;
+}
+
+int read_whole_file(const char* path, char* buffer, size_t size) {
+    FILE* f = fopen(path, "r");
+    if (!f) return -1;
+    size_t n = fread(buffer, 1, size - 1, f);
+    buffer[n] = '\0';
+    fclose(f);
+    return n;
+}
+
+// Write via a temp file and rename so readers never see a partial copy
+int write_whole_file(const char* path, const char* content, int n) {
+    char tmp_path[600];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    
+    char parent[512];
+    snprintf(parent, sizeof(parent), "%s", path);
+    char* slash = strrchr(parent, '/');
+    if (slash && slash != parent) {
+        *slash = '\0';
+        create_folder_recursive(parent);
+    }
     
-    size_t content_len = fread(buffer, 1, sizeof(buffer) - 1, f);
-    buffer[content_len] = '\0';
+    FILE* f = fopen(tmp_path, "w");
+    if (!f) return -1;
+    if (n > 0 && fwrite(content, 1, n, f) != (size_t)n) {
+        fclose(f);
+        unlink(tmp_path);
+        return -1;
+    }
     fclose(f);
     
-    // Connect to replica server
-    int replica_sock = connect_to_server(replica_ip, replica_port);
-    if (replica_sock < 0) {
-        log_message("SS", "Failed to connect to replica server for %s", filename);
-        return;
+    if (rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Serve one part of a file (content, undo copy, checkpoints, checksum) to a peer
+void handle_export(Message* msg, Message* response) {
+    char path[600];
+    
+    switch (msg->flags) {
+        case EXPORT_FILE:
+        case EXPORT_CHECKSUM: {
+            snprintf(path, sizeof(path), "%s/%s", STORAGE_DIR, msg->filename);
+            int n = read_whole_file(path, response->data, sizeof(response->data));
+            if (n < 0) {
+                response->error_code = ERR_FILE_NOT_FOUND;
+                strcpy(response->data, "ERROR: File not found");
+                return;
+            }
+            response->error_code = ERR_SUCCESS;
+            response->data_len = n;
+            if (msg->flags == EXPORT_CHECKSUM) {
+                snprintf(response->data, sizeof(response->data), "%016llx", 
+                    content_checksum(response->data, n));
+                response->data_len = strlen(response->data);
+                response->word_index = file_has_active_writer(msg->filename);
+            }
+            return;
+        }
+        
+        case EXPORT_UNDO: {
+            snprintf(path, sizeof(path), "%s/%s", UNDO_DIR, msg->filename);
+            int n = read_whole_file(path, response->data, sizeof(response->data));
+            if (n < 0) {
+                response->error_code = ERR_NO_UNDO_AVAILABLE;
+                response->data[0] = '\0';
+                return;
+            }
+            response->error_code = ERR_SUCCESS;
+            response->data_len = n;
+            return;
+        }
+        
+        case EXPORT_CHECKPOINT_LIST: {
+            snprintf(path, sizeof(path), "checkpoints/%s", msg->filename);
+            response->error_code = ERR_SUCCESS;
+            DIR* dir = opendir(path);
+            if (!dir) return;
+            
+            int offset = 0;
+            struct dirent* entry;
+            while ((entry = readdir(dir)) != NULL) {
+                if (entry->d_name[0] == '.') continue;
+                int len = strlen(entry->d_name);
+                if (offset + len + 2 >= (int)sizeof(response->data)) break;
+                offset += sprintf(response->data + offset, "%s\n", entry->d_name);
+            }
+            closedir(dir);
+            response->data_len = offset;
+            return;
+        }
+        
+        case EXPORT_CHECKPOINT: {
+            snprintf(path, sizeof(path), "checkpoints/%s/%s", msg->filename, msg->checkpoint_tag);
+            int n = read_whole_file(path, response->data, sizeof(response->data));
+            if (n < 0) {
+                response->error_code = ERR_FILE_NOT_FOUND;
+                response->data[0] = '\0';
+                return;
+            }
+            response->error_code = ERR_SUCCESS;
+            response->data_len = n;
+            return;
+        }
+    }
+    
+    response->error_code = ERR_INVALID_COMMAND;
+}
+
+// Request one export part from the source over an open connection
+int request_export(int sock, const char* filename, int part, const char* tag, Message* reply) {
+    Message request;
+    memset(&request, 0, sizeof(request));
+    request.type = MSG_SS_EXPORT;
+    request.flags = part;
+    strcpy(request.filename, filename);
+    if (tag) {
+        strncpy(request.checkpoint_tag, tag, sizeof(request.checkpoint_tag) - 1);
+    }
+    
+    send_message(sock, &request);
+    return receive_message(sock, reply);
+}
+
+// Pull a file with its undo copy and checkpoints from the storage server at
+// msg->ss_ip:msg->ss_port. Replies with the checksum of the copied content
+// (data) and the number of bytes transferred (word_index).
+void handle_migrate_from_peer(Message* msg, Message* response) {
+    int source_sock = connect_to_server(msg->ss_ip, msg->ss_port);
+    if (source_sock < 0) {
+        response->error_code = ERR_CONNECTION_FAILED;
+        strcpy(response->data, "ERROR: Cannot connect to source server");
+        return;
+    }
+    
+    Message* reply = (Message*)malloc(sizeof(Message));
+    if (!reply) {
+        close(source_sock);
+        response->error_code = ERR_SERVER_ERROR;
+        strcpy(response->data, "ERROR: Out of memory");
+        return;
+    }
+    
+    char path[600];
+    int bytes = 0;
+    
+    // File content first: without it there is nothing to migrate
+    if (request_export(source_sock, msg->filename, EXPORT_FILE, NULL, reply) != 0 ||
+        reply->error_code != ERR_SUCCESS) {
+        response->error_code = ERR_FILE_NOT_FOUND;
+        strcpy(response->data, "ERROR: Source cannot export file");
+        goto done;
+    }
+    
+    snprintf(path, sizeof(path), "%s/%s", STORAGE_DIR, msg->filename);
+    if (write_whole_file(path, reply->data, reply->data_len) != 0) {
+        response->error_code = ERR_SERVER_ERROR;
+        strcpy(response->data, "ERROR: Cannot write migrated file");
+        goto done;
+    }
+    bytes += reply->data_len;
+    unsigned long long checksum = content_checksum(reply->data, reply->data_len);
+    file_changed(msg->filename, reply->data);
+    
+    // Undo copy, if the source has one
+    if (request_export(source_sock, msg->filename, EXPORT_UNDO, NULL, reply) == 0 &&
+        reply->error_code == ERR_SUCCESS) {
+        snprintf(path, sizeof(path), "%s/%s", UNDO_DIR, msg->filename);
+        write_whole_file(path, reply->data, reply->data_len);
+        bytes += reply->data_len;
+    }
+    
+    // Checkpoints
+    if (request_export(source_sock, msg->filename, EXPORT_CHECKPOINT_LIST, NULL, reply) == 0 &&
+        reply->error_code == ERR_SUCCESS && reply->data_len > 0) {
+        char* tags = strdup(reply->data);
+        char* saveptr = NULL;
+        for (char* tag = tags ? strtok_r(tags, "\n", &saveptr) : NULL; tag; 
+             tag = strtok_r(NULL, "\n", &saveptr)) {
+            if (request_export(source_sock, msg->filename, EXPORT_CHECKPOINT, tag, reply) == 0 &&
+                reply->error_code == ERR_SUCCESS) {
+                snprintf(path, sizeof(path), "checkpoints/%s/%s", msg->filename, tag);
+                write_whole_file(path, reply->data, reply->data_len);
+                bytes += reply->data_len;
+            }
+        }
+        free(tags);
+    }
+    
+    response->error_code = ERR_SUCCESS;
+    snprintf(response->data, sizeof(response->data), "%016llx", checksum);
+    response->word_index = bytes;
+    log_message("SS", "Migrated '%s' from %s:%d (%d bytes)", msg->filename, 
+        msg->ss_ip, msg->ss_port, bytes);
+    log_to_file("MIGRATE: %s from %s:%d (%d bytes)", msg->filename, msg->ss_ip, msg->ss_port, bytes);
+    
+done:
+    free(reply);
+    close(source_sock);
+}
+
+// ═══════════════════════════════════════════════════════════════════
+// REPLICATION - Push committed writes to the replica set the NM assigned
+//               and hold the client's answer until the write quorum has it
+// ═══════════════════════════════════════════════════════════════════
+
+#define REPLICA_PUT_TIMEOUT 5 // Seconds to wait for one replica's ack
+
+// Serializes taking a version with reading the content it covers (primary)
+// and checking a version with writing its content (replica), so a newer
+// version always carries newer content
+pthread_mutex_t replica_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Replica PUT versions are 64-bit; they travel split over flags/word_index
+void set_put_version(Message* msg, long long version) {
+    msg->flags = (int)(version >> 32);
+    msg->word_index = (int)(version & 0xffffffffLL);
+}
+
+long long get_put_version(const Message* msg) {
+    return ((long long)msg->flags << 32) | (unsigned int)msg->word_index;
+}
+
+// Remember which primary an update came from, so anti-entropy knows whose
+// files this copy belongs to (state_mutex held)
+void set_file_origin(FileState* state, const Message* msg) {
+    if (msg->ss_ip[0] == '\0') return;
+    strcpy(state->origin_ip, msg->ss_ip);
+    state->origin_port = msg->ss_port;
+}
+
+// Wall-clock microseconds: versions keep growing across restarts and
+// failovers as long as server clocks roughly agree
+long long realtime_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (long long)now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+// MSG_SS_REPLICA_SET: one line per file this server is primary of,
+// "<file> <quorum> <ip>:<port> ..." with the replicas' NM ports. With
+// REPLICA_SET_RESET every set held so far is dropped first: the files may
+// have failed over to another server.
+int apply_replica_sets(Message* msg) {
+    int files = 0;
+    char* saveptr = NULL;
+    msg->data[MAX_BUFFER_SIZE - 1] = '\0';
+    
+    pthread_mutex_lock(&state_mutex);
+    if (msg->flags & REPLICA_SET_RESET) {
+        for (int b = 0; b < FILE_STATE_BUCKETS; b++) {
+            for (FileState* state = file_states[b]; state; state = state->next) {
+                state->num_replicas = 0;
+                state->replica_set_known = 0;
+            }
+        }
+    }
+    for (char* line = strtok_r(msg->data, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+        char filename[MAX_FILENAME];
+        int quorum, consumed;
+        if (sscanf(line, "%255s %d%n", filename, &quorum, &consumed) != 2) continue;
+        
+        FileState* state = file_state_get(filename, 1);
+        if (!state) continue;
+        state->write_quorum = quorum;
+        state->chain = (msg->flags & REPLICA_SET_CHAIN) != 0;
+        state->num_replicas = 0;
+        state->origin_ip[0] = '\0'; // Primary now: no longer anyone's replica
+        if (state->version == 0) {
+            // Restarted: versions continue from now, so repairs of copies
+            // this server pushed before the restart are not refused
+            state->version = realtime_us();
+        }
+        
+        char* cursor = line + consumed;
+        char ip[INET_ADDRSTRLEN];
+        int port, used;
+        while (state->num_replicas < MAX_REPLICAS &&
+               sscanf(cursor, " %15[^:]:%d%n", ip, &port, &used) == 2) {
+            cursor += used;
+            int slot = state->num_replicas++;
+            strcpy(state->replica_ips[slot], ip);
+            state->replica_ports[slot] = port;
+        }
+        state->replica_set_known = 1;
+        files++;
+    }
+    pthread_mutex_unlock(&state_mutex);
+    return files;
+}
+
+void handle_replica_set(Message* msg, Message* response) {
+    int files = apply_replica_sets(msg);
+    response->error_code = ERR_SUCCESS;
+    sprintf(response->data, "%d replica set(s) updated", files);
+}
+
+// ── Peer links ──
+// One long-lived connection per replica, compact framing after the
+// handshake, so an update costs its own size rather than a full Message
+// and a connection setup. Updates to the same replica go one at a time.
+
+typedef struct {
+    char ip[INET_ADDRSTRLEN];
+    int port;
+    int sock; // -1 when closed
+    pthread_mutex_t lock;
+} PeerLink;
+
+PeerLink peer_links[MAX_STORAGE_SERVERS];
+int num_peer_links = 0;
+pthread_mutex_t peer_links_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+PeerLink* peer_link_get(const char* ip, int port) {
+    PeerLink* link = NULL;
+    pthread_mutex_lock(&peer_links_mutex);
+    for (int i = 0; i < num_peer_links; i++) {
+        if (peer_links[i].port == port && strcmp(peer_links[i].ip, ip) == 0) {
+            link = &peer_links[i];
+            break;
+        }
+    }
+    if (!link && num_peer_links < MAX_STORAGE_SERVERS) {
+        link = &peer_links[num_peer_links++];
+        strcpy(link->ip, ip);
+        link->port = port;
+        link->sock = -1;
+        pthread_mutex_init(&link->lock, NULL);
+    }
+    pthread_mutex_unlock(&peer_links_mutex);
+    return link;
+}
+
+// Connect and handshake (link->lock held)
+int peer_link_open(PeerLink* link) {
+    int sock = connect_to_server(link->ip, link->port);
+    if (sock < 0) return -1;
+    
+    Message* msg = (Message*)calloc(1, sizeof(Message));
+    if (!msg) {
+        close(sock);
+        return -1;
+    }
+    msg->type = MSG_SS_PEER_SESSION;
+    strcpy(msg->ss_ip, my_ip);
+    msg->ss_port = nm_listen_port;
+    send_message(sock, msg);
+    
+    int ok = receive_message(sock, msg) == 0 && msg->error_code == ERR_SUCCESS;
+    free(msg);
+    if (!ok) {
+        close(sock);
+        return -1;
+    }
+    
+    // Compact messages go out in several small sends; don't let Nagle hold them
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return sock;
+}
+
+// Send a request to a peer and wait up to timeout_s for its reply. A link
+// that was already open may have gone stale, so that case is retried once
+// on a fresh connection. Returns 0 when a reply arrived.
+int peer_call(const char* ip, int port, Message* request, Message* reply, int timeout_s) {
+    PeerLink* link = peer_link_get(ip, port);
+    if (!link) return -1;
+    
+    pthread_mutex_lock(&link->lock);
+    int result = -1;
+    for (int attempt = 0; attempt < 2 && result < 0; attempt++) {
+        int reused = link->sock >= 0;
+        if (!reused) {
+            link->sock = peer_link_open(link);
+            if (link->sock < 0) break;
+        }
+        
+        struct timeval timeout = { timeout_s, 0 };
+        setsockopt(link->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        if (send_compact_message(link->sock, request) == 0 &&
+            receive_compact_message(link->sock, reply) == 0) {
+            result = 0;
+        } else {
+            close(link->sock);
+            link->sock = -1;
+            if (!reused) break;
+        }
+    }
+    pthread_mutex_unlock(&link->lock);
+    return result;
+}
+
+// Replication channel opened by a primary: updates in, acks out
+void handle_peer_session(int sock) {
+    Message* msg = (Message*)malloc(sizeof(Message));
+    Message* response = (Message*)malloc(sizeof(Message));
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    
+    while (msg && response && receive_compact_message(sock, msg) == 0) {
+        telemetry_record(REQ_NM, -1);
+        memset(response, 0, sizeof(*response));
+        response->type = MSG_ACK;
+        
+        switch (msg->type) {
+            case MSG_SS_REPLICA_PUT:
+                handle_replica_put(msg, response);
+                break;
+            case MSG_SS_REPLICA_DELTA:
+                handle_replica_delta(msg, response);
+                break;
+            case MSG_SS_MERKLE_ROOT:
+                handle_merkle_root(msg, response);
+                break;
+            case MSG_SS_MERKLE_BUCKET:
+                handle_merkle_bucket(msg, response);
+                break;
+            case MSG_SS_MERKLE_BLOCKS:
+                handle_merkle_blocks(msg, response);
+                break;
+            case MSG_SS_REPAIR_PATCH:
+                handle_repair_patch(msg, response);
+                break;
+            default:
+                response->error_code = ERR_INVALID_COMMAND;
+        }
+        
+        if (response->data_len == 0) response->data_len = strlen(response->data);
+        if (send_compact_message(sock, response) < 0) break;
+    }
+    
+    free(msg);
+    free(response);
+}
+
+// ── Updates ──
+
+// Build a PUT carrying this server's own copy of a file at its current
+// version, for a downstream replica that could not apply a delta
+Message* local_full_update(const Message* update) {
+    Message* full = (Message*)calloc(1, sizeof(Message));
+    if (!full) return NULL;
+    full->type = MSG_SS_REPLICA_PUT;
+    strcpy(full->filename, update->filename);
+    strcpy(full->folder_path, update->folder_path);
+    strcpy(full->ss_ip, update->ss_ip); // Chain hops keep the primary as origin
+    full->ss_port = update->ss_port;
+    
+    pthread_mutex_lock(&replica_mutex);
+    int n = read_file_content(update->filename, full->data, MAX_BUFFER_SIZE);
+    pthread_mutex_lock(&state_mutex);
+    FileState* state = file_state_get(update->filename, 0);
+    long long version = state ? state->version : 0;
+    pthread_mutex_unlock(&state_mutex);
+    pthread_mutex_unlock(&replica_mutex);
+    
+    if (n < 0) {
+        free(full);
+        return NULL;
+    }
+    full->data_len = n;
+    set_put_version(full, version);
+    return full;
+}
+
+// Send an update (PUT or delta) to a replica, allowing REPLICA_PUT_TIMEOUT
+// per hop. A replica that cannot apply a delta gets the whole file instead:
+// full if given, else this server's own copy. Returns the copies the ack
+// reports (0 if none came back).
+int push_replica_update(const char* ip, int port, Message* update, Message* full, int hops) {
+    Message* reply = (Message*)malloc(sizeof(Message));
+    if (!reply) return 0;
+    
+    int copies = 0;
+    if (peer_call(ip, port, update, reply, REPLICA_PUT_TIMEOUT * hops) == 0) {
+        telemetry_replica_sent(update->data_len, 0);
+        if (reply->error_code == ERR_RESYNC_NEEDED && update->type == MSG_SS_REPLICA_DELTA) {
+            Message* own = full ? NULL : local_full_update(update);
+            Message* resync = full ? full : own;
+            if (resync && peer_call(ip, port, resync, reply, REPLICA_PUT_TIMEOUT * hops) == 0) {
+                telemetry_replica_sent(resync->data_len, 1);
+            } else {
+                reply->error_code = ERR_SERVER_ERROR;
+            }
+            free(own);
+        }
+        if (reply->error_code == ERR_SUCCESS) {
+            copies = reply->word_index > 0 ? reply->word_index : 1;
+        }
+    }
+    free(reply);
+    return copies;
+}
+
+// Hops listed in a chain PUT's folder_path
+int count_chain_hops(const char* chain) {
+    int hops = 0;
+    char ip[INET_ADDRSTRLEN];
+    int port, used;
+    while (sscanf(chain, " %15[^:]:%d%n", ip, &port, &used) == 2) {
+        chain += used;
+        hops++;
+    }
+    return hops;
+}
+
+// Chain mode: pass an applied update on to the next hop in its folder_path.
+// Returns the copies downstream that hold it.
+int forward_down_chain(Message* msg) {
+    char next_ip[INET_ADDRSTRLEN];
+    int next_port, used;
+    if (sscanf(msg->folder_path, " %15[^:]:%d%n", next_ip, &next_port, &used) != 2) return 0;
+    
+    memmove(msg->folder_path, msg->folder_path + used, strlen(msg->folder_path + used) + 1);
+    int hops = 1 + count_chain_hops(msg->folder_path);
+    return push_replica_update(next_ip, next_port, msg, NULL, hops);
+}
+
+// MSG_SS_REPLICA_PUT on a replica: apply the content unless a newer version
+// is already here (either way this server then holds the write). In chain
+// mode the PUT is passed on to the next hop before acking, so the ack tells
+// the sender how many copies down the chain, this one included, have it.
+void handle_replica_put(Message* msg, Message* response) {
+    long long version = get_put_version(msg);
+    
+    pthread_mutex_lock(&replica_mutex);
+    pthread_mutex_lock(&state_mutex);
+    FileState* state = file_state_get(msg->filename, 1);
+    int stale = state && version <= state->version;
+    if (state && !stale) {
+        state->version = version;
+        free(state->pushed); // Another server is primary now
+        state->pushed = NULL;
+        set_file_origin(state, msg);
+    }
+    pthread_mutex_unlock(&state_mutex);
+    
+    int data_len = msg->data_len < MAX_BUFFER_SIZE ? msg->data_len : MAX_BUFFER_SIZE - 1;
+    msg->data[data_len] = '\0';
+    if (!stale) {
+        char path[600];
+        snprintf(path, sizeof(path), "%s/%s", STORAGE_DIR, msg->filename);
+        int result = write_whole_file(path, msg->data, data_len);
+        pthread_mutex_unlock(&replica_mutex);
+        if (result != 0) {
+            response->error_code = ERR_SERVER_ERROR;
+            strcpy(response->data, "ERROR: Cannot write replica");
+            return; // The chain stops here; the head reports the shortfall
+        }
+        file_changed(msg->filename, msg->data);
+    } else {
+        pthread_mutex_unlock(&replica_mutex);
+    }
+    
+    response->error_code = ERR_SUCCESS;
+    response->word_index = 1 + forward_down_chain(msg);
+    sprintf(response->data, "%s (%d bytes, %d cop%s from here)", stale ? "Newer copy already held" :
+            "✓ Replica updated", data_len, response->word_index, response->word_index == 1 ? "y" : "ies");
+}
+
+// MSG_SS_REPLICA_DELTA on a replica: splice the edit into the copy at the
+// delta's base version. The spliced content must hash to what the primary
+// has, otherwise (missed update, copy changed by a pull) the whole file is
+// requested with ERR_RESYNC_NEEDED.
+void handle_replica_delta(Message* msg, Message* response) {
+    long long version = get_put_version(msg);
+    int data_len = msg->data_len < MAX_BUFFER_SIZE ? msg->data_len : MAX_BUFFER_SIZE - 1;
+    msg->data[data_len] = '\0';
+    
+    long long base;
+    int offset, removed;
+    unsigned long long hash;
+    char* text = memchr(msg->data, '\n', data_len);
+    if (!text || sscanf(msg->data, "%lld %d %d %llx", &base, &offset, &removed, &hash) != 4 ||
+        offset < 0 || removed < 0) {
+        response->error_code = ERR_INVALID_COMMAND;
+        strcpy(response->data, "ERROR: Malformed delta");
+        return;
+    }
+    text++;
+    int text_len = data_len - (text - msg->data);
+    
+    char* buffer = (char*)malloc(MAX_BUFFER_SIZE);
+    if (!buffer) {
+        response->error_code = ERR_SERVER_ERROR;
+        strcpy(response->data, "ERROR: Out of memory");
+        return;
+    }
+    
+    pthread_mutex_lock(&replica_mutex);
+    pthread_mutex_lock(&state_mutex);
+    FileState* state = file_state_get(msg->filename, 1);
+    long long current = state ? state->version : 0;
+    pthread_mutex_unlock(&state_mutex);
+    
+    int stale = version <= current;
+    int applied = 0;
+    if (!stale && current == base) {
+        int n = read_file_content(msg->filename, buffer, MAX_BUFFER_SIZE);
+        if (n >= 0 && offset + removed <= n && n - removed + text_len < MAX_BUFFER_SIZE) {
+            memmove(buffer + offset + text_len, buffer + offset + removed, n - offset - removed);
+            memcpy(buffer + offset, text, text_len);
+            n += text_len - removed;
+            buffer[n] = '\0';
+            
+            char path[600];
+            snprintf(path, sizeof(path), "%s/%s", STORAGE_DIR, msg->filename);
+            if (content_checksum(buffer, n) == hash && write_whole_file(path, buffer, n) == 0) {
+                pthread_mutex_lock(&state_mutex);
+                state = file_state_get(msg->filename, 1);
+                if (state) {
+                    state->version = version;
+                    free(state->pushed); // Another server is primary now
+                    state->pushed = NULL;
+                    set_file_origin(state, msg);
+                }
+                pthread_mutex_unlock(&state_mutex);
+                applied = 1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&replica_mutex);
+    
+    if (!stale && !applied) {
+        free(buffer);
+        response->error_code = ERR_RESYNC_NEEDED;
+        strcpy(response->data, "Delta does not apply; send the whole file");
+        return;
+    }
+    if (applied) file_changed(msg->filename, buffer);
+    free(buffer);
+    
+    response->error_code = ERR_SUCCESS;
+    response->word_index = 1 + forward_down_chain(msg);
+    sprintf(response->data, "%s (%d byte edit, %d cop%s from here)", stale ? "Newer copy already held" :
+            "✓ Delta applied", text_len, response->word_index, response->word_index == 1 ? "y" : "ies");
+}
+
+// ── Replication queue ──
+// A WRITE queues its file instead of pushing it itself. A fixed pool of
+// workers sends each queued file's latest content, so a burst of edits to
+// one file coalesces into one update per replica. Pushes that miss a
+// replica are retried with backoff; after REPLICATION_MAX_ATTEMPTS the NM
+// is asked for a fresh replica set and anti-entropy catches the replica up.
+
+#define REPLICATION_WORKERS 4
+#define REPLICATION_QUEUE_MAX 1024  // Files with pending updates; beyond this WRITEs push inline
+#define REPLICATION_MAX_ATTEMPTS 5
+#define REPLICATION_BACKOFF_MS 200  // Doubles with each failed attempt
+
+typedef struct {
+    char filename[MAX_FILENAME];
+    int in_use;
+    int queued;          // Waiting for a worker (not before retry_at_ms)
+    int running;         // A worker is pushing it
+    long long order;     // FIFO order among ready jobs
+    double since_ms;     // When its oldest unsent change was queued
+    double retry_at_ms;
+    int attempts;        // Consecutive pushes that missed a replica
+    int requested;       // Ticket of the latest WRITE queued
+    int progress_ticket; // Ticket covered by the current (or last) push
+    int progress_copies; // Copies that push has reached so far
+    int finished_ticket; // Ticket covered by the last completed push
+    int finished_copies;
+    int waiters;         // WRITEs waiting for their quorum
+} ReplicationJob;
+
+ReplicationJob replication_jobs[REPLICATION_QUEUE_MAX];
+long long replication_order = 0;
+pthread_mutex_t replication_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t replication_ready = PTHREAD_COND_INITIALIZER;    // Wakes workers
+pthread_cond_t replication_progress = PTHREAD_COND_INITIALIZER; // Wakes waiting WRITEs
+
+double monotonic_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+// Delta from the content last pushed (state->pushed at state->version) to
+// put's content, or NULL when there is no base or the whole file is no
+// bigger. The changed span is found by trimming the common prefix and
+// suffix, so one edited sentence ships as just that sentence (state_mutex held).
+Message* make_delta(FileState* state, Message* put, long long version) {
+    if (!state->pushed || state->version == 0) return NULL;
+    
+    const char* old = state->pushed;
+    const char* new_content = put->data;
+    int old_len = state->pushed_len, new_len = put->data_len;
+    
+    int prefix = 0;
+    while (prefix < old_len && prefix < new_len && old[prefix] == new_content[prefix]) prefix++;
+    int suffix = 0;
+    while (suffix < old_len - prefix && suffix < new_len - prefix &&
+           old[old_len - 1 - suffix] == new_content[new_len - 1 - suffix]) {
+        suffix++;
+    }
+    int removed = old_len - prefix - suffix;
+    int text_len = new_len - prefix - suffix;
+    
+    char header[96];
+    int header_len = snprintf(header, sizeof(header), "%lld %d %d %016llx\n", state->version, prefix,
+                              removed, content_checksum(new_content, new_len));
+    if (header_len + text_len >= new_len || header_len + text_len >= MAX_BUFFER_SIZE) return NULL;
+    
+    Message* delta = (Message*)calloc(1, sizeof(Message));
+    if (!delta) return NULL;
+    delta->type = MSG_SS_REPLICA_DELTA;
+    strcpy(delta->filename, put->filename);
+    memcpy(delta->data, header, header_len);
+    memcpy(delta->data + header_len, new_content + prefix, text_len);
+    delta->data_len = header_len + text_len;
+    set_put_version(delta, version);
+    return delta;
+}
+
+// Move on from name server `tried` to the next in the list, unless another
+// thread already has
+void skip_nm(int tried, const char* reason) {
+    pthread_mutex_lock(&nm_addr_mutex);
+    if (current_nm == tried && num_name_servers > 1) {
+        current_nm = (tried + 1) % num_name_servers;
+        log_message("SS", "Name Server %s:%d %s, trying %s:%d", nm_ips[tried], nm_ports[tried], reason,
+                   nm_ips[current_nm], nm_ports[current_nm]);
+        strcpy(nm_ip, nm_ips[current_nm]);
+        nm_port = nm_ports[current_nm];
+    }
+    pthread_mutex_unlock(&nm_addr_mutex);
+}
+
+// Connect to the name server in use, moving on to the next one in the list
+// if it does not answer. Returns -1 if none does.
+int connect_to_nm() {
+    pthread_mutex_lock(&nm_addr_mutex);
+    int count = num_name_servers;
+    pthread_mutex_unlock(&nm_addr_mutex);
+    
+    for (int attempt = 0; attempt < count; attempt++) {
+        pthread_mutex_lock(&nm_addr_mutex);
+        int tried = current_nm;
+        char ip[INET_ADDRSTRLEN];
+        strcpy(ip, nm_ips[tried]);
+        int port = nm_ports[tried];
+        pthread_mutex_unlock(&nm_addr_mutex);
+        
+        int sock = connect_to_server(ip, port);
+        if (sock >= 0) return sock;
+        skip_nm(tried, "unreachable");
+    }
+    return -1;
+}
+
+// No replica set from the NM yet (new file, restart): ask for it. Returns
+// 0 once the set is known.
+int fetch_replica_set(const char* filename) {
+    int shard = shard_of(filename, num_shards);
+    int sock = num_shards > 1 ? connect_to_server(shard_ips[shard], shard_ports[shard]) : connect_to_nm();
+    if (sock < 0) return -1;
+    
+    Message* msg = (Message*)calloc(1, sizeof(Message));
+    if (!msg) {
+        close(sock);
+        return -1;
+    }
+    msg->type = MSG_SS_REPLICATE;
+    strcpy(msg->filename, filename);
+    strcpy(msg->ss_ip, my_ip);
+    msg->ss_port = nm_listen_port;
+    
+    int known = -1;
+    send_message(sock, msg);
+    if (receive_message(sock, msg) == 0 && msg->error_code == ERR_SUCCESS &&
+        apply_replica_sets(msg) > 0) {
+        known = 0;
+    }
+    free(msg);
+    close(sock);
+    return known;
+}
+
+// One replica's share of a fan-out push
+typedef struct {
+    const char* ip;
+    int port;
+    Message* update;
+    Message* full;
+    const char* filename;
+    ReplicationJob* job;
+    int ticket;
+    int* copies; // Shared count, guarded by replication_mutex
+} FanoutPush;
+
+void* fanout_push_thread(void* arg) {
+    FanoutPush* push = (FanoutPush*)arg;
+    int ok = push_replica_update(push->ip, push->port, push->update, push->full, 1) > 0;
+    if (!ok) {
+        log_message("SS", "Replica %s:%d did not take '%s'", push->ip, push->port, push->filename);
+    }
+    
+    pthread_mutex_lock(&replication_mutex);
+    if (ok) (*push->copies)++;
+    if (push->job) {
+        push->job->progress_ticket = push->ticket;
+        push->job->progress_copies = *push->copies;
+        pthread_cond_broadcast(&replication_progress);
+    }
+    pthread_mutex_unlock(&replication_mutex);
+    return NULL;
+}
+
+// Send the latest content of a file to its replica set: one update per
+// replica, or one down the chain. Progress is published on job (if any)
+// as acks arrive. Returns the copies holding it; *total gets the replicas.
+int push_file_update(const char* filename, ReplicationJob* job, int ticket, int* total) {
+    char ips[MAX_REPLICAS][INET_ADDRSTRLEN];
+    int ports[MAX_REPLICAS];
+    int count = 0, chain = 0;
+    
+    pthread_mutex_lock(&state_mutex);
+    FileState* state = file_state_get(filename, 0);
+    if (state && state->replica_set_known) {
+        chain = state->chain;
+        count = state->num_replicas;
+        memcpy(ips, state->replica_ips, sizeof(ips));
+        memcpy(ports, state->replica_ports, sizeof(ports));
+    }
+    pthread_mutex_unlock(&state_mutex);
+    
+    *total = count;
+    if (count == 0) return 1;
+    
+    Message* put = (Message*)calloc(1, sizeof(Message));
+    if (!put) return 1;
+    put->type = MSG_SS_REPLICA_PUT;
+    strcpy(put->filename, filename);
+    Message* delta = NULL;
+    
+    pthread_mutex_lock(&replica_mutex);
+    int n = read_file_content(filename, put->data, MAX_BUFFER_SIZE);
+    put->data_len = n > 0 ? n : 0;
+    pthread_mutex_lock(&state_mutex);
+    state = file_state_get(filename, 1);
+    long long version = realtime_us();
+    if (state) {
+        if (version <= state->version) version = state->version + 1;
+        delta = make_delta(state, put, version);
+        
+        char* pushed = (char*)realloc(state->pushed, put->data_len + 1);
+        if (pushed) {
+            memcpy(pushed, put->data, put->data_len + 1);
+            state->pushed = pushed;
+            state->pushed_len = put->data_len;
+        }
+        state->version = version;
+    }
+    pthread_mutex_unlock(&state_mutex);
+    pthread_mutex_unlock(&replica_mutex);
+    set_put_version(put, version);
+    strcpy(put->ss_ip, my_ip);
+    put->ss_port = nm_listen_port;
+    if (delta) {
+        strcpy(delta->ss_ip, my_ip);
+        delta->ss_port = nm_listen_port;
+    }
+    Message* update = delta ? delta : put;
+    
+    int copies = 1;
+    if (chain) {
+        // The first replica passes it on; the ack comes back once the tail has it
+        int len = 0;
+        for (int i = 1; i < count; i++) {
+            len += snprintf(put->folder_path + len, sizeof(put->folder_path) - len,
+                            "%s:%d ", ips[i], ports[i]);
+        }
+        if (delta) strcpy(delta->folder_path, put->folder_path);
+        copies += push_replica_update(ips[0], ports[0], update, put, count);
+        if (copies < 1 + count) {
+            log_message("SS", "Chain update of '%s' reached %d of %d copies", filename, copies, 1 + count);
+        }
+    } else {
+        // Every replica is pushed at once, so one slow or dead replica does
+        // not hold up the others; each ack is published as it arrives and
+        // waiting WRITEs return once their quorum is in
+        FanoutPush pushes[MAX_REPLICAS];
+        pthread_t threads[MAX_REPLICAS];
+        int started[MAX_REPLICAS];
+        for (int i = 0; i < count; i++) {
+            pushes[i].ip = ips[i];
+            pushes[i].port = ports[i];
+            pushes[i].update = update;
+            pushes[i].full = put;
+            pushes[i].filename = filename;
+            pushes[i].job = job;
+            pushes[i].ticket = ticket;
+            pushes[i].copies = &copies;
+            started[i] = pthread_create(&threads[i], NULL, fanout_push_thread, &pushes[i]) == 0;
+            if (!started[i]) fanout_push_thread(&pushes[i]);
+        }
+        for (int i = 0; i < count; i++) {
+            if (started[i]) pthread_join(threads[i], NULL);
+        }
+    }
+    
+    free(delta);
+    free(put);
+    return copies;
+}
+
+// Updates keep missing a replica: ask the NM to resend the file's replica
+// set, which drops the replica if the NM has failed it over meanwhile
+void notify_nm_replication(const char* filename) {
+    Message* msg = (Message*)calloc(1, sizeof(Message));
+    if (!msg) return;
+    msg->type = MSG_SS_REPLICATE;
+    strcpy(msg->filename, filename);
+    strcpy(msg->ss_ip, my_ip);
+    msg->ss_port = nm_listen_port;
+    
+    if (nm_session_send(msg) == 0) {
+        log_message("SS", "Asked NM for a fresh replica set for '%s'", filename);
+    } else {
+        log_message("SS", "Failed to reach NM for replication of %s", filename);
+    }
+    free(msg);
+}
+
+// Free a job's slot once nothing refers to it (replication_mutex held)
+void release_replication_job(ReplicationJob* job) {
+    if (job->queued || job->running || job->waiters > 0) return;
+    job->in_use = 0;
+}
+
+ReplicationJob* find_replication_job(const char* filename) {
+    for (int i = 0; i < REPLICATION_QUEUE_MAX; i++) {
+        if (replication_jobs[i].in_use && strcmp(replication_jobs[i].filename, filename) == 0) {
+            return &replication_jobs[i];
+        }
+    }
+    return NULL;
+}
+
+// Queue a file after a WRITE, merging with a pending entry for it. The
+// WRITE's ticket is job->requested afterwards. Returns NULL when the
+// backlog is full (replication_mutex held).
+ReplicationJob* queue_replication(const char* filename) {
+    ReplicationJob* job = find_replication_job(filename);
+    if (!job) {
+        for (int i = 0; i < REPLICATION_QUEUE_MAX && !job; i++) {
+            if (!replication_jobs[i].in_use) job = &replication_jobs[i];
+        }
+        if (!job) return NULL;
+        memset(job, 0, sizeof(*job));
+        job->in_use = 1;
+        strcpy(job->filename, filename);
+    }
+    
+    job->requested++;
+    if (job->since_ms == 0) job->since_ms = monotonic_ms();
+    if (!job->queued) {
+        job->queued = 1;
+        job->order = replication_order++;
+        if (job->attempts == 0) job->retry_at_ms = 0;
+        pthread_cond_signal(&replication_ready);
+    }
+    return job;
+}
+
+void* replication_worker(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&replication_mutex);
+    while (!should_exit) {
+        double now = monotonic_ms();
+        ReplicationJob* job = NULL;
+        double next_retry = 0;
+        for (int i = 0; i < REPLICATION_QUEUE_MAX; i++) {
+            ReplicationJob* candidate = &replication_jobs[i];
+            if (!candidate->in_use || !candidate->queued || candidate->running) continue;
+            if (candidate->retry_at_ms > now) {
+                if (next_retry == 0 || candidate->retry_at_ms < next_retry) next_retry = candidate->retry_at_ms;
+            } else if (!job || candidate->order < job->order) {
+                job = candidate;
+            }
+        }
+        
+        if (!job) {
+            if (next_retry > 0) {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                long long wait_ns = (long long)((next_retry - now) * 1e6);
+                deadline.tv_sec += wait_ns / 1000000000LL;
+                deadline.tv_nsec += wait_ns % 1000000000LL;
+                if (deadline.tv_nsec >= 1000000000L) {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000L;
+                }
+                pthread_cond_timedwait(&replication_ready, &replication_mutex, &deadline);
+            } else {
+                pthread_cond_wait(&replication_ready, &replication_mutex);
+            }
+            continue;
+        }
+        
+        // Everything queued so far is covered: the content is read after this
+        job->queued = 0;
+        job->running = 1;
+        int ticket = job->requested;
+        job->progress_ticket = ticket;
+        job->progress_copies = 1;
+        char filename[MAX_FILENAME];
+        strcpy(filename, job->filename);
+        pthread_mutex_unlock(&replication_mutex);
+        
+        int total = 0;
+        int copies = push_file_update(filename, job, ticket, &total);
+        
+        pthread_mutex_lock(&replication_mutex);
+        job->running = 0;
+        job->progress_ticket = ticket;
+        job->progress_copies = copies;
+        job->finished_ticket = ticket;
+        job->finished_copies = copies;
+        
+        int give_up = 0;
+        if (copies < 1 + total) {
+            job->attempts++;
+            if (job->attempts >= REPLICATION_MAX_ATTEMPTS) {
+                job->attempts = 0;
+                give_up = 1;
+            } else if (!job->queued) {
+                job->queued = 1;
+                job->order = replication_order++;
+            }
+            if (!give_up) {
+                job->retry_at_ms = monotonic_ms() + (REPLICATION_BACKOFF_MS << (job->attempts - 1));
+            }
+        } else {
+            job->attempts = 0;
+        }
+        if (!job->queued) job->since_ms = 0; // Every queued change reached the replicas (or was handed to the NM)
+        pthread_cond_broadcast(&replication_progress);
+        release_replication_job(job);
+        
+        if (give_up) {
+            pthread_mutex_unlock(&replication_mutex);
+            notify_nm_replication(filename);
+            pthread_mutex_lock(&replication_mutex);
+        }
+    }
+    pthread_mutex_unlock(&replication_mutex);
+    return NULL;
+}
+
+void start_replication_workers() {
+    for (int i = 0; i < REPLICATION_WORKERS; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, replication_worker, NULL) == 0) {
+            pthread_detach(thread);
+        } else {
+            log_message("SS", "Warning: Failed to start replication worker");
+        }
+    }
+}
+
+// Queue depth and age of the oldest unsent change, for telemetry
+void replication_backlog(int* depth, double* lag_ms) {
+    double now = monotonic_ms();
+    *depth = 0;
+    *lag_ms = 0;
+    pthread_mutex_lock(&replication_mutex);
+    for (int i = 0; i < REPLICATION_QUEUE_MAX; i++) {
+        ReplicationJob* job = &replication_jobs[i];
+        if (!job->in_use || (!job->queued && !job->running)) continue;
+        (*depth)++;
+        if (job->since_ms > 0 && now - job->since_ms > *lag_ms) *lag_ms = now - job->since_ms;
+    }
+    pthread_mutex_unlock(&replication_mutex);
+}
+
+// Replicate a committed WRITE and wait until the write quorum (primary
+// included, returned in *quorum) holds it. Returns copies known to hold it.
+int replicate_write(const char* filename, int* quorum) {
+    int count = 0, known = 0;
+    pthread_mutex_lock(&state_mutex);
+    FileState* state = file_state_get(filename, 0);
+    if (state && state->replica_set_known) {
+        known = 1;
+        *quorum = state->write_quorum;
+        count = state->num_replicas;
+    }
+    pthread_mutex_unlock(&state_mutex);
+    
+    if (!known) {
+        if (fetch_replica_set(filename) != 0) {
+            log_message("SS", "No replica set for '%s'; not replicated", filename);
+            return 1;
+        }
+        pthread_mutex_lock(&state_mutex);
+        state = file_state_get(filename, 0);
+        if (state) {
+            *quorum = state->write_quorum;
+            count = state->num_replicas;
+        }
+        pthread_mutex_unlock(&state_mutex);
+    }
+    if (count == 0) return 1;
+    
+    pthread_mutex_lock(&replication_mutex);
+    ReplicationJob* job = queue_replication(filename);
+    if (!job) {
+        // Backlog full: this WRITE pushes its own update
+        pthread_mutex_unlock(&replication_mutex);
+        int total;
+        return push_file_update(filename, NULL, 0, &total);
+    }
+    if (*quorum <= 1) {
+        pthread_mutex_unlock(&replication_mutex);
+        return 1;
+    }
+    
+    int ticket = job->requested;
+    job->waiters++;
+    while (job->finished_ticket < ticket &&
+           !(job->progress_ticket >= ticket && job->progress_copies >= *quorum)) {
+        pthread_cond_wait(&replication_progress, &replication_mutex);
+    }
+    int copies = job->progress_ticket >= ticket && job->progress_copies >= *quorum ?
+                 job->progress_copies : job->finished_copies;
+    job->waiters--;
+    release_replication_job(job);
+    pthread_mutex_unlock(&replication_mutex);
+    return copies;
+}
+
+// ═══════════════════════════════════════════════════════════════════
+// ANTI-ENTROPY - Find replicas that drifted from their primary and send
+//                only the part that differs
+// ═══════════════════════════════════════════════════════════════════
+
+// Every ANTI_ENTROPY_INTERVAL seconds a primary walks a hash tree with each
+// of its replicas. The root covers MERKLE_BUCKETS buckets. Each bucket is the
+// XOR of its files' (name, content hash) leaves, and under each file are its
+// sentence blocks. Only differing buckets are listed, only differing files
+// have their blocks compared, and only the run of blocks between the first
+// and last difference is sent.
+
+#define ANTI_ENTROPY_INTERVAL 30 // Seconds between rounds
+#define MERKLE_BUCKETS 256
+#define MERKLE_MAX_BLOCKS 2048   // Later sentences stay in the last block
+
+unsigned long long fnv_mix(unsigned long long h, unsigned long long value) {
+    for (int i = 0; i < 8; i++) {
+        h ^= (value >> (i * 8)) & 0xff;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+unsigned long long merkle_leaf(const char* filename, unsigned long long content_hash) {
+    return fnv_mix(content_checksum(filename, strlen(filename)), content_hash);
+}
+
+unsigned long long merkle_root(const unsigned long long* buckets) {
+    unsigned long long h = 1469598103934665603ULL;
+    for (int b = 0; b < MERKLE_BUCKETS; b++) h = fnv_mix(h, buckets[b]);
+    return h;
+}
+
+int merkle_bucket_of(const char* filename) {
+    return index_hash(filename) % MERKLE_BUCKETS;
+}
+
+// Whether this server shares the file with a peer: as primary when the peer
+// is in its replica set, as replica when the peer is the file's origin
+// (state_mutex held)
+int shares_file_with(FileState* state, const char* peer_ip, int peer_port, int as_primary) {
+    if (!as_primary) {
+        return state->origin_port == peer_port && strcmp(state->origin_ip, peer_ip) == 0;
+    }
+    if (!state->replica_set_known) return 0;
+    for (int i = 0; i < state->num_replicas; i++) {
+        if (state->replica_ports[i] == peer_port && strcmp(state->replica_ips[i], peer_ip) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Bucket hashes over the files shared with a peer. Hashes come from the
+// file state cache; files not hashed since startup are read once first.
+void merkle_buckets(const char* peer_ip, int peer_port, int as_primary, unsigned long long* buckets) {
+    char (*unknown)[MAX_FILENAME] = NULL;
+    int num_unknown = 0, capacity = 0;
+    
+    pthread_mutex_lock(&state_mutex);
+    for (int b = 0; b < FILE_STATE_BUCKETS; b++) {
+        for (FileState* state = file_states[b]; state; state = state->next) {
+            if (state->stats_known || !shares_file_with(state, peer_ip, peer_port, as_primary)) continue;
+            if (num_unknown == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                void* grown = realloc(unknown, capacity * sizeof(*unknown));
+                if (!grown) break;
+                unknown = grown;
+            }
+            strcpy(unknown[num_unknown++], state->filename);
+        }
+    }
+    pthread_mutex_unlock(&state_mutex);
+    
+    for (int i = 0; i < num_unknown; i++) {
+        int words, chars;
+        unsigned long long hash;
+        file_state_get_stats(unknown[i], &words, &chars, &hash);
+    }
+    free(unknown);
+    
+    memset(buckets, 0, MERKLE_BUCKETS * sizeof(*buckets));
+    pthread_mutex_lock(&state_mutex);
+    for (int b = 0; b < FILE_STATE_BUCKETS; b++) {
+        for (FileState* state = file_states[b]; state; state = state->next) {
+            if (!state->stats_known || !shares_file_with(state, peer_ip, peer_port, as_primary)) continue;
+            buckets[merkle_bucket_of(state->filename)] ^= merkle_leaf(state->filename, state->content_hash);
+        }
+    }
+    pthread_mutex_unlock(&state_mutex);
+}
+
+// Split content into sentence blocks (each ends after . ! or ?); every byte
+// belongs to exactly one block. Returns the number of blocks.
+int split_blocks(const char* content, int n, int* lens, unsigned long long* hashes) {
+    int count = 0, start = 0;
+    for (int i = 0; i < n; i++) {
+        int delimiter = content[i] == '.' || content[i] == '!' || content[i] == '?';
+        if ((delimiter && count < MERKLE_MAX_BLOCKS - 1) || i == n - 1) {
+            lens[count] = i + 1 - start;
+            hashes[count] = content_checksum(content + start, lens[count]);
+            count++;
+            start = i + 1;
+        }
+    }
+    return count;
+}
+
+// A round in progress for a file skips it: the update on its way will (or
+// a later round will) bring the replica up to date
+int replication_pending(const char* filename) {
+    pthread_mutex_lock(&replication_mutex);
+    ReplicationJob* job = find_replication_job(filename);
+    int pending = job && (job->queued || job->running);
+    pthread_mutex_unlock(&replication_mutex);
+    return pending;
+}
+
+// ── Replica side ──
+
+// MSG_SS_MERKLE_ROOT: compare roots; on a mismatch list this side's buckets
+void handle_merkle_root(Message* msg, Message* response) {
+    unsigned long long* buckets = (unsigned long long*)malloc(MERKLE_BUCKETS * sizeof(unsigned long long));
+    if (!buckets) {
+        response->error_code = ERR_SERVER_ERROR;
+        strcpy(response->data, "ERROR: Out of memory");
+        return;
+    }
+    merkle_buckets(msg->ss_ip, msg->ss_port, 0, buckets);
+    
+    unsigned long long theirs = strtoull(msg->data, NULL, 16);
+    response->error_code = ERR_SUCCESS;
+    if (merkle_root(buckets) == theirs) {
+        response->flags = 1;
+    } else {
+        int len = 0;
+        for (int b = 0; b < MERKLE_BUCKETS; b++) {
+            len += sprintf(response->data + len, "%016llx ", buckets[b]);
+        }
+    }
+    free(buckets);
+}
+
+// MSG_SS_MERKLE_BUCKET: the primary's "<file> <hash>" lines for one bucket.
+// Files that match are (re)claimed for that primary; the rest are listed in
+// the reply. With a complete list (flags 1), files in the bucket the
+// primary no longer names are released.
+void handle_merkle_bucket(Message* msg, Message* response) {
+    int bucket = msg->word_index;
+    int len = 0;
+    char* saveptr = NULL;
+    msg->data[msg->data_len >= 0 && msg->data_len < MAX_BUFFER_SIZE ? msg->data_len : MAX_BUFFER_SIZE - 1] = '\0';
+    response->data[0] = '\0';
+    
+    for (char* line = strtok_r(msg->data, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+        char filename[MAX_FILENAME];
+        unsigned long long hash;
+        if (sscanf(line, "%255s %llx", filename, &hash) != 2) continue;
+        
+        int words, chars;
+        unsigned long long ours;
+        int match = file_state_get_stats(filename, &words, &chars, &ours) == 0 && ours == hash;
+        if (match) {
+            pthread_mutex_lock(&state_mutex);
+            FileState* state = file_state_get(filename, 1);
+            if (state) set_file_origin(state, msg);
+            pthread_mutex_unlock(&state_mutex);
+        } else if (len + (int)strlen(filename) + 2 < MAX_BUFFER_SIZE) {
+            len += sprintf(response->data + len, "%s\n", filename);
+        }
+        line[strlen(filename)] = '\0'; // Keep just the name for the release pass
+    }
+    
+    if (msg->flags) {
+        pthread_mutex_lock(&state_mutex);
+        for (int b = 0; b < FILE_STATE_BUCKETS; b++) {
+            for (FileState* state = file_states[b]; state; state = state->next) {
+                if (merkle_bucket_of(state->filename) != bucket ||
+                    !shares_file_with(state, msg->ss_ip, msg->ss_port, 0)) continue;
+                
+                int named = 0;
+                for (char* name = msg->data; name < msg->data + MAX_BUFFER_SIZE && *name && !named;
+                     name += strlen(name) + 1) {
+                    named = strcmp(name, state->filename) == 0;
+                }
+                if (!named) state->origin_ip[0] = '\0';
+            }
+        }
+        pthread_mutex_unlock(&state_mutex);
+    }
+    
+    response->error_code = ERR_SUCCESS;
+    response->data_len = len;
+}
+
+// MSG_SS_MERKLE_BLOCKS: "<length> <blocks> <version>\n" then "<len> <hash>"
+// per block
+void handle_merkle_blocks(Message* msg, Message* response) {
+    char* buffer = (char*)malloc(MAX_BUFFER_SIZE);
+    int* lens = (int*)malloc(MERKLE_MAX_BLOCKS * sizeof(int));
+    unsigned long long* hashes = (unsigned long long*)malloc(MERKLE_MAX_BLOCKS * sizeof(unsigned long long));
+    pthread_mutex_lock(&replica_mutex);
+    int n = buffer && lens && hashes ? read_file_content(msg->filename, buffer, MAX_BUFFER_SIZE) : -1;
+    pthread_mutex_lock(&state_mutex);
+    FileState* state = file_state_get(msg->filename, 0);
+    long long version = state ? state->version : 0;
+    pthread_mutex_unlock(&state_mutex);
+    pthread_mutex_unlock(&replica_mutex);
+    
+    if (n < 0) {
+        response->error_code = ERR_FILE_NOT_FOUND;
+        strcpy(response->data, "No copy here");
+    } else {
+        int count = split_blocks(buffer, n, lens, hashes);
+        int len = sprintf(response->data, "%d %d %lld\n", n, count, version);
+        for (int i = 0; i < count; i++) {
+            len += sprintf(response->data + len, "%d %016llx\n", lens[i], hashes[i]);
+        }
+        response->error_code = ERR_SUCCESS;
+        response->data_len = len;
+    }
+    free(buffer);
+    free(lens);
+    free(hashes);
+}
+
+// MSG_SS_REPAIR_PATCH: splice the primary's bytes into this copy. A copy at a
+// newer version than the patch is left alone and the patch refused with
+// ERR_STALE_VERSION (a regular update overtook it, or the sender is a stale
+// primary); otherwise the result must hash to the primary's content, else
+// ERR_RESYNC_NEEDED asks for the whole file.
+void handle_repair_patch(Message* msg, Message* response) {
+    long long version = get_put_version(msg);
+    int data_len = msg->data_len < MAX_BUFFER_SIZE ? msg->data_len : MAX_BUFFER_SIZE - 1;
+    msg->data[data_len] = '\0';
+    
+    int offset, removed;
+    unsigned long long hash;
+    char* text = memchr(msg->data, '\n', data_len);
+    if (!text || sscanf(msg->data, "%d %d %llx", &offset, &removed, &hash) != 3 || offset < 0) {
+        response->error_code = ERR_INVALID_COMMAND;
+        strcpy(response->data, "ERROR: Malformed patch");
+        return;
+    }
+    text++;
+    int text_len = data_len - (text - msg->data);
+    
+    char* buffer = (char*)malloc(MAX_BUFFER_SIZE);
+    if (!buffer) {
+        response->error_code = ERR_SERVER_ERROR;
+        strcpy(response->data, "ERROR: Out of memory");
+        return;
+    }
+    
+    pthread_mutex_lock(&replica_mutex);
+    pthread_mutex_lock(&state_mutex);
+    FileState* state = file_state_get(msg->filename, 1);
+    int stale = state && state->version > version;
+    pthread_mutex_unlock(&state_mutex);
+    
+    int applied = 0;
+    if (!stale) {
+        int n = removed < 0 ? 0 : read_file_content(msg->filename, buffer, MAX_BUFFER_SIZE);
+        if (removed < 0) removed = 0;
+        if (n >= 0 && offset + removed <= n && n - removed + text_len < MAX_BUFFER_SIZE) {
+            memmove(buffer + offset + text_len, buffer + offset + removed, n - offset - removed);
+            memcpy(buffer + offset, text, text_len);
+            n += text_len - removed;
+            buffer[n] = '\0';
+            
+            char path[600];
+            snprintf(path, sizeof(path), "%s/%s", STORAGE_DIR, msg->filename);
+            if (content_checksum(buffer, n) == hash && write_whole_file(path, buffer, n) == 0) {
+                pthread_mutex_lock(&state_mutex);
+                state = file_state_get(msg->filename, 1);
+                if (state) {
+                    state->version = version;
+                    free(state->pushed);
+                    state->pushed = NULL;
+                    set_file_origin(state, msg);
+                }
+                pthread_mutex_unlock(&state_mutex);
+                applied = 1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&replica_mutex);
+    
+    if (stale) {
+        free(buffer);
+        response->error_code = ERR_STALE_VERSION;
+        strcpy(response->data, "A newer version is already here");
+        return;
+    }
+    if (!applied) {
+        free(buffer);
+        response->error_code = ERR_RESYNC_NEEDED;
+        strcpy(response->data, "Patch does not apply; send the whole file");
+        return;
+    }
+    if (applied) {
+        file_changed(msg->filename, buffer);
+        log_message("SS", "Anti-entropy repaired '%s' (%d bytes)", msg->filename, text_len);
+    }
+    free(buffer);
+    response->error_code = ERR_SUCCESS;
+}
+
+// ── Primary side ──
+
+// Bring one file on a replica in line with this copy. Returns 1 if repaired.
+int repair_replica_file(const char* ip, int port, const char* filename, Message* request, Message* reply) {
+    memset(request, 0, sizeof(*request));
+    request->type = MSG_SS_MERKLE_BLOCKS;
+    strcpy(request->filename, filename);
+    strcpy(request->ss_ip, my_ip);
+    request->ss_port = nm_listen_port;
+    if (peer_call(ip, port, request, reply, REPLICA_PUT_TIMEOUT) != 0) return 0;
+    
+    int* their_lens = (int*)malloc(MERKLE_MAX_BLOCKS * sizeof(int));
+    unsigned long long* their_hashes = (unsigned long long*)malloc(MERKLE_MAX_BLOCKS * sizeof(unsigned long long));
+    int* our_lens = (int*)malloc(MERKLE_MAX_BLOCKS * sizeof(int));
+    unsigned long long* our_hashes = (unsigned long long*)malloc(MERKLE_MAX_BLOCKS * sizeof(unsigned long long));
+    char* content = (char*)malloc(MAX_BUFFER_SIZE);
+    int repaired = 0;
+    if (!their_lens || !their_hashes || !our_lens || !our_hashes || !content) goto done;
+    
+    // The replica's blocks; a missing copy is an empty one
+    int their_len = 0, their_count = 0;
+    long long their_version = 0;
+    if (reply->error_code == ERR_SUCCESS) {
+        reply->data[MAX_BUFFER_SIZE - 1] = '\0';
+        char* cursor = reply->data;
+        int used;
+        if (sscanf(cursor, "%d %d %lld%n", &their_len, &their_count, &their_version, &used) != 3 ||
+            their_count > MERKLE_MAX_BLOCKS) goto done;
+        cursor += used;
+        for (int i = 0; i < their_count; i++) {
+            if (sscanf(cursor, "%d %llx%n", &their_lens[i], &their_hashes[i], &used) != 2) goto done;
+            cursor += used;
+        }
+    } else if (reply->error_code != ERR_FILE_NOT_FOUND) {
+        goto done;
+    }
+    
+    pthread_mutex_lock(&replica_mutex);
+    int n = read_file_content(filename, content, MAX_BUFFER_SIZE);
+    pthread_mutex_lock(&state_mutex);
+    FileState* state = file_state_get(filename, 0);
+    long long version = state ? state->version : 0;
+    pthread_mutex_unlock(&state_mutex);
+    pthread_mutex_unlock(&replica_mutex);
+    if (n < 0) goto done;
+    
+    // A replica at a newer version got it from a later primary: leave it, and
+    // the replica refuses the patch anyway
+    if (version < their_version) goto done;
+    
+    // Skip the blocks both copies share at either end
+    int our_count = split_blocks(content, n, our_lens, our_hashes);
+    int prefix = 0, prefix_bytes = 0;
+    while (prefix < our_count && prefix < their_count && our_lens[prefix] == their_lens[prefix] &&
+           our_hashes[prefix] == their_hashes[prefix]) {
+        prefix_bytes += our_lens[prefix++];
+    }
+    int suffix = 0, suffix_bytes = 0;
+    while (suffix < our_count - prefix && suffix < their_count - prefix &&
+           our_lens[our_count - 1 - suffix] == their_lens[their_count - 1 - suffix] &&
+           our_hashes[our_count - 1 - suffix] == their_hashes[their_count - 1 - suffix]) {
+        suffix_bytes += our_lens[our_count - 1 - suffix++];
+    }
+    
+    unsigned long long hash = content_checksum(content, n);
+    int removed = reply->error_code == ERR_SUCCESS ? their_len - prefix_bytes - suffix_bytes : -1;
+    int text_len = n - prefix_bytes - suffix_bytes;
+    for (int attempt = 0; attempt < 2 && !repaired; attempt++) {
+        memset(request, 0, sizeof(*request));
+        request->type = MSG_SS_REPAIR_PATCH;
+        strcpy(request->filename, filename);
+        strcpy(request->ss_ip, my_ip);
+        request->ss_port = nm_listen_port;
+        set_put_version(request, version);
+        
+        // The whole file if the replica could not take the span
+        int start = attempt == 0 ? prefix_bytes : 0;
+        int length = attempt == 0 ? text_len : n;
+        int header = snprintf(request->data, MAX_BUFFER_SIZE, "%d %d %016llx\n",
+                              start, attempt == 0 ? removed : -1, hash);
+        if (header + length >= MAX_BUFFER_SIZE) break;
+        memcpy(request->data + header, content + start, length);
+        request->data_len = header + length;
+        
+        if (peer_call(ip, port, request, reply, REPLICA_PUT_TIMEOUT) != 0) break;
+        if (reply->error_code == ERR_SUCCESS) {
+            telemetry_antientropy_repaired(length);
+            repaired = 1;
+        } else if (reply->error_code != ERR_RESYNC_NEEDED) {
+            break;
+        }
     }
     
-    // Send replication message
-    Message msg;
-    memset(&msg, 0, sizeof(msg));
-    msg.type = MSG_SS_REPLICATE;
-    strcpy(msg.filename, filename);
-    memcpy(msg.data, buffer, content_len);
-    msg.data_len = content_len;
+done:
+    free(their_lens);
+    free(their_hashes);
+    free(our_lens);
+    free(our_hashes);
+    free(content);
+    return repaired;
+}
+
+// One anti-entropy round with a replica. Returns the files repaired.
+int anti_entropy_round(const char* ip, int port) {
+    unsigned long long* buckets = (unsigned long long*)malloc(MERKLE_BUCKETS * sizeof(unsigned long long));
+    Message* request = (Message*)malloc(sizeof(Message));
+    Message* reply = (Message*)malloc(sizeof(Message));
+    char (*differing)[MAX_FILENAME] = (char (*)[MAX_FILENAME])malloc(MERKLE_BUCKETS * sizeof(*differing));
+    int repaired = 0;
+    if (!buckets || !request || !reply || !differing) goto done;
+    
+    merkle_buckets(ip, port, 1, buckets);
+    memset(request, 0, sizeof(*request));
+    request->type = MSG_SS_MERKLE_ROOT;
+    strcpy(request->ss_ip, my_ip);
+    request->ss_port = nm_listen_port;
+    request->data_len = sprintf(request->data, "%016llx", merkle_root(buckets));
+    if (peer_call(ip, port, request, reply, REPLICA_PUT_TIMEOUT) != 0 ||
+        reply->error_code != ERR_SUCCESS || reply->flags == 1) goto done;
+    
+    reply->data[MAX_BUFFER_SIZE - 1] = '\0';
+    int mismatched[MERKLE_BUCKETS];
+    int num_mismatched = 0;
+    char* cursor = reply->data;
+    for (int b = 0; b < MERKLE_BUCKETS; b++) {
+        char* end;
+        unsigned long long theirs = strtoull(cursor, &end, 16);
+        if (end == cursor) break;
+        cursor = end;
+        if (theirs != buckets[b]) mismatched[num_mismatched++] = b;
+    }
     
-    send_message(replica_sock, &msg);
+    for (int m = 0; m < num_mismatched; m++) {
+        int bucket = mismatched[m];
+        memset(request, 0, sizeof(*request));
+        request->type = MSG_SS_MERKLE_BUCKET;
+        strcpy(request->ss_ip, my_ip);
+        request->ss_port = nm_listen_port;
+        request->word_index = bucket;
+        request->flags = 1; // Complete unless the list overflows
+        
+        int len = 0;
+        pthread_mutex_lock(&state_mutex);
+        for (int b = 0; b < FILE_STATE_BUCKETS; b++) {
+            for (FileState* state = file_states[b]; state; state = state->next) {
+                if (!state->stats_known || merkle_bucket_of(state->filename) != bucket ||
+                    !shares_file_with(state, ip, port, 1)) continue;
+                if (len + (int)strlen(state->filename) + 20 >= MAX_BUFFER_SIZE) {
+                    request->flags = 0;
+                    continue;
+                }
+                len += sprintf(request->data + len, "%s %016llx\n", state->filename, state->content_hash);
+            }
+        }
+        pthread_mutex_unlock(&state_mutex);
+        request->data_len = len;
+        
+        if (peer_call(ip, port, request, reply, REPLICA_PUT_TIMEOUT) != 0 ||
+            reply->error_code != ERR_SUCCESS) continue;
+        
+        // Names first: the reply buffer is reused by the repairs
+        int num_differing = 0;
+        char* saveptr = NULL;
+        reply->data[MAX_BUFFER_SIZE - 1] = '\0';
+        for (char* name = strtok_r(reply->data, "\n", &saveptr); name && num_differing < MERKLE_BUCKETS;
+             name = strtok_r(NULL, "\n", &saveptr)) {
+            snprintf(differing[num_differing++], MAX_FILENAME, "%s", name);
+        }
+        
+        for (int i = 0; i < num_differing; i++) {
+            if (file_has_active_writer(differing[i]) || replication_pending(differing[i])) continue;
+            if (repair_replica_file(ip, port, differing[i], request, reply)) {
+                repaired++;
+            } else {
+                log_message("SS", "Anti-entropy could not repair '%s' on %s:%d", differing[i], ip, port);
+            }
+        }
+    }
     
-    Message response;
-    if (receive_message(replica_sock, &response) == 0 && response.error_code == ERR_SUCCESS) {
-        log_message("SS", "Successfully replicated %s to secondary", filename);
+done:
+    free(buckets);
+    free(request);
+    free(reply);
+    free(differing);
+    return repaired;
+}
+
+typedef struct {
+    char ip[INET_ADDRSTRLEN];
+    int port;
+} AntiEntropyTarget;
+
+void* anti_entropy_round_thread(void* arg) {
+    AntiEntropyTarget* target = (AntiEntropyTarget*)arg;
+    int repaired = anti_entropy_round(target->ip, target->port);
+    log_message("SS", "Sync of %s:%d on NM request: %d file(s) repaired", target->ip, target->port, repaired);
+    free(target);
+    return NULL;
+}
+
+// NM request after the server rejoined: sync it now rather than at the
+// next periodic round
+void start_anti_entropy_round(const char* ip, int port) {
+    AntiEntropyTarget* target = (AntiEntropyTarget*)malloc(sizeof(AntiEntropyTarget));
+    if (!target) return;
+    snprintf(target->ip, sizeof(target->ip), "%s", ip);
+    target->port = port;
+    
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, anti_entropy_round_thread, target) == 0) {
+        pthread_detach(thread);
     } else {
-        log_message("SS", "Failed to replicate %s to secondary", filename);
+        free(target);
     }
+}
+
+void* anti_entropy_thread(void* arg) {
+    (void)arg;
+    char ips[MAX_STORAGE_SERVERS][INET_ADDRSTRLEN];
+    int ports[MAX_STORAGE_SERVERS];
     
-    close(replica_sock);
+    while (!should_exit) {
+        sleep(ANTI_ENTROPY_INTERVAL);
+        
+        // Every server that replicates a file this one is primary of
+        int num_peers = 0;
+        pthread_mutex_lock(&state_mutex);
+        for (int b = 0; b < FILE_STATE_BUCKETS; b++) {
+            for (FileState* state = file_states[b]; state; state = state->next) {
+                if (!state->replica_set_known) continue;
+                for (int r = 0; r < state->num_replicas; r++) {
+                    int known = 0;
+                    for (int p = 0; p < num_peers && !known; p++) {
+                        known = ports[p] == state->replica_ports[r] && strcmp(ips[p], state->replica_ips[r]) == 0;
+                    }
+                    if (!known && num_peers < MAX_STORAGE_SERVERS) {
+                        strcpy(ips[num_peers], state->replica_ips[r]);
+                        ports[num_peers++] = state->replica_ports[r];
+                    }
+                }
+            }
+        }
+        pthread_mutex_unlock(&state_mutex);
+        
+        for (int p = 0; p < num_peers; p++) {
+            int repaired = anti_entropy_round(ips[p], ports[p]);
+            if (repaired > 0) {
+                log_message("SS", "Anti-entropy repaired %d file(s) on %s:%d", repaired, ips[p], ports[p]);
+            }
+        }
+    }
+    return NULL;
 }
 
 // Get sentence lock
@@ -424,135 +2943,6 @@ SentenceLock* get_sentence_lock(const char* filename, int sentence_index) {
     return NULL;
 }
 
-// Trigger replication asynchronously after write
-void trigger_replication(const char* filename) {
-    printf("[DEBUG] trigger_replication() called for: %s\n", filename);
-    fflush(stdout);
-    
-    char* filename_copy = strdup(filename);
-    if (!filename_copy) {
-        printf("[DEBUG] strdup failed!\n");
-        fflush(stdout);
-        return;
-    }
-    
-    pthread_t repl_thread;
-    if (pthread_create(&repl_thread, NULL, async_replicate_thread, filename_copy) == 0) {
-        pthread_detach(repl_thread);
-        printf("[DEBUG] ✅ Replication thread created for: %s\n", filename);
-        fflush(stdout);
-        log_message("SS", "🔄 Triggered async replication for %s", filename);
-    } else {
-        free(filename_copy);
-        printf("[DEBUG] ❌ pthread_create failed for: %s\n", filename);
-        fflush(stdout);
-        log_message("SS", "⚠️ Failed to create replication thread for %s", filename);
-    }
-}
-
-// Async thread to request replication from Name Server
-void* async_replicate_thread(void* arg) {
-    char* filename = (char*)arg;
-    
-    printf("[DEBUG] async_replicate_thread started for: %s\n", filename);
-    printf("[DEBUG] Connecting to Name Server at %s:%d\n", nm_ip, nm_port);
-    fflush(stdout);
-    
-    // Connect to Name Server
-    int nm_sock = connect_to_server(nm_ip, nm_port);
-    if (nm_sock < 0) {
-        printf("[DEBUG] ❌ Failed to connect to NM for replication\n");
-        fflush(stdout);
-        log_message("SS", "Failed to connect to NM for replication of %s", filename);
-        free(filename);
-        return NULL;
-    }
-    
-    printf("[DEBUG] ✅ Connected to Name Server, sending MSG_SS_REPLICATE\n");
-    fflush(stdout);
-    
-    // Send replication request
-    Message msg;
-    memset(&msg, 0, sizeof(msg));
-    msg.type = MSG_SS_REPLICATE;
-    strcpy(msg.filename, filename);
-    strcpy(msg.ss_ip, my_ip);
-    msg.ss_port = nm_listen_port;
-    
-    send_message(nm_sock, &msg);
-    
-    // Wait for acknowledgment
-    Message response;
-    if (receive_message(nm_sock, &response) == 0) {
-        if (response.error_code == ERR_SUCCESS) {
-            log_message("SS", "✅ Replication request for '%s' acknowledged", filename);
-        } else {
-            log_message("SS", "⚠️ Replication request for '%s' failed: %s", filename, response.data);
-        }
-    }
-    
-    close(nm_sock);
-    free(filename);
-    return NULL;
-}
-
-// Handle replication request from Name Server (this is the SECONDARY receiving the request)
-void handle_replicate_from_primary(int nm_sock, Message* msg) {
-    log_message("SS", "🔄 Replication request for '%s' from primary at %s:%d", 
-               msg->filename, msg->ss_ip, msg->ss_port);
-    
-    Message response;
-    memset(&response, 0, sizeof(response));
-    response.type = MSG_ACK;
-    
-    // Connect to primary storage server to get file content
-    int primary_sock = connect_to_server(msg->ss_ip, msg->ss_port);
-    if (primary_sock < 0) {
-        response.error_code = ERR_CONNECTION_FAILED;
-        strcpy(response.data, "Cannot connect to primary server");
-        send_message(nm_sock, &response);
-        log_message("SS", "❌ Failed to connect to primary %s:%d", msg->ss_ip, msg->ss_port);
-        return;
-    }
-    
-    // Request file content from primary
-    Message read_msg;
-    memset(&read_msg, 0, sizeof(read_msg));
-    read_msg.type = MSG_READ_FILE;
-    strcpy(read_msg.filename, msg->filename);
-    strcpy(read_msg.username, "REPLICATION");
-    
-    send_message(primary_sock, &read_msg);
-    
-    // Receive file content
-    Message file_response;
-    if (receive_message(primary_sock, &file_response) != 0 || 
-        file_response.error_code != ERR_SUCCESS) {
-        response.error_code = ERR_FILE_NOT_FOUND;
-        strcpy(response.data, "Failed to read from primary");
-        send_message(nm_sock, &response);
-        close(primary_sock);
-        log_message("SS", "❌ Failed to read '%s' from primary", msg->filename);
-        return;
-    }
-    
-    close(primary_sock);
-    
-    // Write content to local file
-    if (write_file_content(msg->filename, file_response.data) == 0) {
-        response.error_code = ERR_SUCCESS;
-        sprintf(response.data, "✓ Replicated %d bytes", file_response.data_len);
-        log_message("SS", "✅ Successfully replicated '%s' (%d bytes)", 
-                   msg->filename, file_response.data_len);
-    } else {
-        response.error_code = ERR_SERVER_ERROR;
-        strcpy(response.data, "Failed to write replica");
-        log_message("SS", "❌ Failed to write replica of '%s'", msg->filename);
-    }
-    
-    send_message(nm_sock, &response);
-}
-
 // Handle READ request
 void handle_read(int sock, Message* msg) {
     char buffer[MAX_BUFFER_SIZE];
@@ -914,26 +3304,33 @@ skip_word_update:  // Label for skipping invalid word updates
         return;
     }
     
+    // Keep the content index and pushed stats in step with the committed file,
+    // pushing the NM's counter for this WRITE along with them
+    index_file_content(msg->filename, final_content);
+    file_state_update_stats(msg->filename, final_content, time(NULL), msg->write_seq);
+    
     // Release the sentence lock
     pthread_mutex_unlock(&lock->lock);
     lock->locked_by[0] = '\0';
     
-    // Send success response
+    // Replicate before answering, so success means the write quorum has it
+    int quorum = 1;
+    int copies = replicate_write(msg->filename, &quorum);
+    
     memset(&response, 0, sizeof(response));
     response.type = MSG_RESPONSE;
-    response.error_code = ERR_SUCCESS;
-    sprintf(response.data, "Write Successful! Sentence %d updated.", sentence_index);
+    if (copies >= quorum) {
+        response.error_code = ERR_SUCCESS;
+        sprintf(response.data, "Write Successful! Sentence %d updated.", sentence_index);
+    } else {
+        response.error_code = ERR_QUORUM_FAILED;
+        sprintf(response.data, "ERROR: Sentence %d saved on %d of %d required copies; "
+                "it will reach the rest once they recover", sentence_index, copies, quorum);
+    }
     send_message(sock, &response);
     
-    log_to_file("WRITE: %s by %s, sentence %d (%d total sentences)", 
-                msg->filename, msg->username, sentence_index, fresh_sentence_count);
-    
-    // Trigger async replication to secondary storage server
-    printf("[DEBUG] About to trigger replication for: %s\n", msg->filename);
-    fflush(stdout);
-    trigger_replication(msg->filename);
-    printf("[DEBUG] trigger_replication() call completed for: %s\n", msg->filename);
-    fflush(stdout);
+    log_to_file("WRITE: %s by %s, sentence %d (%d total sentences, %d/%d copies)", 
+                msg->filename, msg->username, sentence_index, fresh_sentence_count, copies, quorum);
 }
 
 // Handle STREAM request
@@ -1031,6 +3428,8 @@ void handle_undo(int sock, Message* msg) {
     fclose(src);
     fclose(dst);
     
+    file_changed_on_disk(msg->filename);
+    
     response.error_code = ERR_SUCCESS;
     strcpy(response.data, "Undo Successful!");
     send_message(sock, &response);
@@ -1043,25 +3442,64 @@ void* handle_client_request(void* arg) {
     int client_sock = *(int*)arg;
     free(arg);
     
+    telemetry_conn_opened(1);
+    
     Message msg;
     if (receive_message(client_sock, &msg) == 0) {
         log_message("SS", "Client request: type=%d, file=%s", msg.type, msg.filename);
         
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        
+        int retry_ms = admit_client_request();
+        if (retry_ms > 0) {
+            Message response;
+            memset(&response, 0, sizeof(response));
+            response.type = MSG_RESPONSE;
+            response.error_code = ERR_SERVER_BUSY;
+            response.flags = retry_ms;
+            sprintf(response.data, "ERROR: Storage server busy, retry in %d ms", retry_ms);
+            send_message(client_sock, &response);
+            close(client_sock);
+            telemetry_conn_closed(1);
+            return NULL;
+        }
+        
+        if (check_file_epoch(msg.filename, msg.epoch) != 0) {
+            Message response;
+            memset(&response, 0, sizeof(response));
+            response.type = MSG_RESPONSE;
+            response.error_code = ERR_STALE_EPOCH;
+            strcpy(response.data, "ERROR: Stale file location, ask the Name Server again");
+            send_message(client_sock, &response);
+            close(client_sock);
+            telemetry_conn_closed(1);
+            return NULL;
+        }
+        
         switch (msg.type) {
             case MSG_READ_FILE:
                 handle_read(client_sock, &msg);
+                telemetry_record(REQ_READ, elapsed_us(&start));
                 break;
                 
             case MSG_WRITE_FILE:
+                telemetry_session(1);
                 handle_write(client_sock, &msg);
+                telemetry_session(-1);
+                telemetry_record(REQ_WRITE, -1);
                 break;
                 
             case MSG_STREAM_FILE:
-                handle_stream(client_sock, &msg);
+                telemetry_session(1);
+                handle_stream(client_sock, &msg); // Paced per word, so no latency sample
+                telemetry_session(-1);
+                telemetry_record(REQ_STREAM, -1);
                 break;
                 
             case MSG_UNDO_FILE:
                 handle_undo(client_sock, &msg);
+                telemetry_record(REQ_UNDO, elapsed_us(&start));
                 break;
                 
             default:
@@ -1070,6 +3508,7 @@ void* handle_client_request(void* arg) {
     }
     
     close(client_sock);
+    telemetry_conn_closed(1);
     return NULL;
 }
 
@@ -1078,9 +3517,12 @@ void* handle_nm_request(void* arg) {
     int nm_sock = *(int*)arg;
     free(arg);
     
+    telemetry_conn_opened(0);
+    
     Message msg;
     while (receive_message(nm_sock, &msg) == 0) {
         log_message("SS", "NM request: type=%d, file=%s", msg.type, msg.filename);
+        telemetry_record(REQ_NM, -1);
         
         Message response;
         memset(&response, 0, sizeof(response));
@@ -1089,11 +3531,25 @@ void* handle_nm_request(void* arg) {
         switch (msg.type) {
             case MSG_SS_CREATE:
                 create_file(msg.filename, msg.username);
+                set_file_epoch(msg.filename, msg.epoch, 1);
                 response.error_code = ERR_SUCCESS;
                 strcpy(response.data, "File created");
                 break;
                 
             case MSG_SS_DELETE:
+                if (msg.flags == SS_DELETE_BATCH) {
+                    int count = 0;
+                    char* saveptr;
+                    char* name = strtok_r(msg.data, "\n", &saveptr);
+                    while (name) {
+                        delete_file(name);
+                        count++;
+                        name = strtok_r(NULL, "\n", &saveptr);
+                    }
+                    response.error_code = ERR_SUCCESS;
+                    sprintf(response.data, "%d file(s) deleted", count);
+                    break;
+                }
                 delete_file(msg.filename);
                 response.error_code = ERR_SUCCESS;
                 strcpy(response.data, "File deleted");
@@ -1120,20 +3576,8 @@ void* handle_nm_request(void* arg) {
                     strcpy(response.data, "0 0");
                 } else {
                     // Count words and characters
-                    int word_count = 0;
-                    int char_count = n;
-                    int in_word = 0;
-                    
-                    for (int i = 0; i < n; i++) {
-                        if (buffer[i] == ' ' || buffer[i] == '\n' || buffer[i] == '\t') {
-                            in_word = 0;
-                        } else {
-                            if (!in_word) {
-                                word_count++;
-                                in_word = 1;
-                            }
-                        }
-                    }
+                    int word_count, char_count;
+                    count_words_chars(buffer, n, &word_count, &char_count);
                     
                     response.error_code = ERR_SUCCESS;
                     sprintf(response.data, "%d %d", word_count, char_count);
@@ -1141,6 +3585,51 @@ void* handle_nm_request(void* arg) {
                 break;
             }
             
+            case MSG_SS_STAT_BATCH: {
+                // msg.data: one filename per line; reply "<file> <words> <chars> <mtime> <hash> <write seq>" each
+                int offset = 0;
+                int count = 0;
+                char* saveptr;
+                char* name = strtok_r(msg.data, "\n", &saveptr);
+                while (name) {
+                    int word_count = -1, char_count = -1;
+                    long modified = 0;
+                    unsigned long long hash = 0;
+                    
+                    char filepath[512];
+                    snprintf(filepath, sizeof(filepath), "%s/%s", STORAGE_DIR, name);
+                    struct stat st;
+                    if (stat(filepath, &st) == 0 &&
+                        file_state_get_stats(name, &word_count, &char_count, &hash) == 0) {
+                        modified = (long)st.st_mtime;
+                    }
+                    
+                    int written = snprintf(response.data + offset, sizeof(response.data) - offset,
+                        "%s %d %d %ld %016llx %d\n", name, word_count, char_count, modified, hash,
+                        file_state_write_seq(name));
+                    if (written < 0 || written >= (int)sizeof(response.data) - offset) {
+                        response.data[offset] = '\0';
+                        break; // Reply full; the NM sizes batches so this does not happen
+                    }
+                    offset += written;
+                    count++;
+                    name = strtok_r(NULL, "\n", &saveptr);
+                }
+                response.error_code = ERR_SUCCESS;
+                response.data_len = offset;
+                log_message("SS", "Batch stat: %d file(s)", count);
+                break;
+            }
+            
+            case MSG_SS_SEARCH: {
+                // Content search: msg.data holds the query words
+                int hits = index_search(msg.data, response.data, sizeof(response.data));
+                response.error_code = ERR_SUCCESS;
+                response.data_len = strlen(response.data);
+                log_message("SS", "Content search '%s': %d file(s)", msg.data, hits);
+                break;
+            }
+            
             case MSG_SS_CREATE_FOLDER: {
                 // Create physical folder in storage directory
                 char folder_path[512];
@@ -1183,6 +3672,8 @@ void* handle_nm_request(void* arg) {
                     response.error_code = ERR_SUCCESS;
                     sprintf(response.data, "✓ File moved successfully");
                     log_message("SS", "Moved file: %s -> %s", old_path, new_path);
+                    file_removed(msg.filename);
+                    file_changed_on_disk(msg.folder_path);
                     
                     // Also move undo file if it exists
                     char old_undo[512], new_undo[512];
@@ -1246,9 +3737,11 @@ void* handle_nm_request(void* arg) {
                     fclose(src);
                     fclose(dst);
                     
+                    // The NM adds the record to its catalog and answers the client
                     response.error_code = ERR_SUCCESS;
-                    sprintf(response.data, "✓ Checkpoint '%s' created for file '%s'", 
-                            msg.checkpoint_tag, msg.filename);
+                    format_checkpoint_record(response.data, sizeof(response.data),
+                                             checkpoint_path, msg.checkpoint_tag);
+                    response.data_len = strlen(response.data);
                     log_message("SS", "Checkpoint created: %s for %s", msg.checkpoint_tag, msg.filename);
                     
                 } else if (msg.flags == 1) {
@@ -1297,54 +3790,93 @@ void* handle_nm_request(void* arg) {
                     fclose(src);
                     fclose(dst);
                     
+                    file_changed_on_disk(msg.filename);
+                    
                     response.error_code = ERR_SUCCESS;
                     sprintf(response.data, "✓ File '%s' reverted to checkpoint '%s'", 
                             msg.filename, msg.checkpoint_tag);
                     log_message("SS", "File reverted: %s to checkpoint %s", msg.filename, msg.checkpoint_tag);
                     
                 } else if (msg.flags == 3) {
-                    // LIST CHECKPOINTS: List all checkpoint tags for file
+                    // LIST CHECKPOINTS: one record per checkpoint, for the NM to
+                    // rebuild its catalog of a file it has no entries for
+                    response.error_code = ERR_SUCCESS;
                     DIR* dir = opendir(checkpoint_dir);
-                    if (!dir) {
-                        response.error_code = ERR_SUCCESS;
-                        sprintf(response.data, "─── Checkpoints for '%s' ───\n(no checkpoints)\n", msg.filename);
-                        break;
-                    }
+                    if (!dir) break;
                     
-                    char buffer[MAX_BUFFER_SIZE];
                     int offset = 0;
-                    offset += sprintf(buffer + offset, "─── Checkpoints for '%s' ───\n", msg.filename);
-                    
                     struct dirent* entry;
                     int count = 0;
-                    while ((entry = readdir(dir)) != NULL && offset < MAX_BUFFER_SIZE - 100) {
+                    while ((entry = readdir(dir)) != NULL && offset < MAX_BUFFER_SIZE - 512) {
                         if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
                             continue;
                         }
                         
-                        offset += sprintf(buffer + offset, "  • %s\n", entry->d_name);
+                        char entry_path[1024];
+                        snprintf(entry_path, sizeof(entry_path), "%s/%s", checkpoint_dir, entry->d_name);
+                        int written = format_checkpoint_record(response.data + offset, MAX_BUFFER_SIZE - offset,
+                                                               entry_path, entry->d_name);
+                        if (written < 0) continue;
+                        offset += written;
                         count++;
                     }
                     
-                    if (count == 0) {
-                        offset += sprintf(buffer + offset, "(no checkpoints)\n");
-                    }
-                    
                     closedir(dir);
-                    strcpy(response.data, buffer);
-                    response.error_code = ERR_SUCCESS;
+                    response.data_len = offset;
                     log_message("SS", "Checkpoints listed for %s: %d found", msg.filename, count);
                 }
                 break;
             }
             
-            case MSG_SS_REPLICATE: {
-                // This secondary server receives replication request from Name Server
-                // msg.ss_ip and msg.ss_port contain primary server info
-                handle_replicate_from_primary(nm_sock, &msg);
-                // Response is sent inside the handler
-                continue; // Skip the send_message at the end
-            }
+            case MSG_SS_EXPORT:
+                handle_export(&msg, &response);
+                break;
+                
+            case MSG_SS_EPOCH:
+                if (msg.flags == SS_EPOCH_BATCH) {
+                    // Current epochs of every file we hold, sent when we register
+                    int count = 0;
+                    char* saveptr;
+                    for (char* line = strtok_r(msg.data, "\n", &saveptr); line;
+                         line = strtok_r(NULL, "\n", &saveptr)) {
+                        int epoch;
+                        char name[MAX_FILENAME];
+                        if (sscanf(line, "%d %255s", &epoch, name) != 2) continue;
+                        set_file_epoch(name, epoch, 0);
+                        count++;
+                    }
+                    log_message("SS", "Received epochs of %d file(s)", count);
+                } else {
+                    set_file_epoch(msg.filename, msg.epoch, 0);
+                }
+                response.error_code = ERR_SUCCESS;
+                break;
+                
+            case MSG_SS_MIGRATE:
+                handle_migrate_from_peer(&msg, &response);
+                break;
+                
+            case MSG_SS_REPLICA_SET:
+                handle_replica_set(&msg, &response);
+                break;
+                
+            case MSG_SS_REPLICA_PUT:
+                handle_replica_put(&msg, &response);
+                break;
+                
+            case MSG_SS_ANTI_ENTROPY:
+                start_anti_entropy_round(msg.ss_ip, msg.ss_port);
+                response.error_code = ERR_SUCCESS;
+                break;
+                
+            case MSG_SS_PEER_SESSION:
+                // Replication channel from a primary; compact framing from here on
+                response.error_code = ERR_SUCCESS;
+                send_message(nm_sock, &response);
+                handle_peer_session(nm_sock);
+                close(nm_sock);
+                telemetry_conn_closed(0);
+                return NULL;
                 
             default:
                 log_message("SS", "Unknown NM request: %d", msg.type);
@@ -1355,91 +3887,284 @@ void* handle_nm_request(void* arg) {
     }
     
     close(nm_sock);
+    telemetry_conn_closed(0);
     return NULL;
 }
 
-// Register with Name Server
+// ═══════════════════════════════════════════════════════════════════
+// NM SESSION - One long-lived channel for heartbeats and notices
+// ═══════════════════════════════════════════════════════════════════
+
+// The NM never writes after the handshake, so a readable socket means it
+// closed the session (or restarted)
+int nm_session_closed(int sock) {
+    char byte;
+    ssize_t n = recv(sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+// Generation seen on a shard's session, or the single name server's when
+// shard is -1 (nm_sock_mutex held)
+int* session_generation(int shard) {
+    return shard < 0 ? &nm_generation_seen : &shard_generations[shard];
+}
+
+// Connect and handshake with a shard's name server, or with the one in use
+// when shard is -1 (nm_sock_mutex held). Both sides compare generations: a
+// name server behind the highest one seen is refused here, and steps down
+// itself when it sees ours.
+int nm_session_open(int shard) {
+    int sock = shard < 0 ? connect_to_nm() : connect_to_server(shard_ips[shard], shard_ports[shard]);
+    if (sock < 0) return -1;
+    pthread_mutex_lock(&nm_addr_mutex);
+    int connected = current_nm;
+    pthread_mutex_unlock(&nm_addr_mutex);
+    
+    int* generation = session_generation(shard);
+    Message msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = MSG_SS_SESSION;
+    strcpy(msg.ss_ip, my_ip);
+    msg.ss_port = nm_listen_port;
+    msg.flags = *generation;
+    send_message(sock, &msg);
+    
+    Message response;
+    if (receive_message(sock, &response) != 0 || response.error_code != ERR_SUCCESS) {
+        close(sock);
+        return -1;
+    }
+    if (response.flags < *generation) {
+        close(sock);
+        log_message("SS", "Name Server is at generation %d, behind %d: refusing it", response.flags, *generation);
+        if (shard < 0) skip_nm(connected, "is stale");
+        return -1;
+    }
+    *generation = response.flags;
+    
+    log_message("SS", "Session with Name Server established (generation %d)", *generation);
+    return sock;
+}
+
+// Send on one session, reconnecting once if it dropped (nm_sock_mutex held)
+int nm_session_send_on(int* session, int shard, Message* msg) {
+    int result = -1;
+    for (int attempt = 0; attempt < 2 && result < 0; attempt++) {
+        if (*session >= 0 && nm_session_closed(*session)) {
+            log_message("SS", "Session with Name Server lost");
+            close(*session);
+            *session = -1;
+        }
+        if (*session < 0) {
+            *session = nm_session_open(shard);
+            if (*session < 0) break;
+        }
+        
+        if (msg->type == MSG_HEARTBEAT) msg->flags = *session_generation(shard);
+        result = send_compact_message(*session, msg);
+        if (result < 0) {
+            close(*session);
+            *session = -1;
+        }
+    }
+    return result;
+}
+
+// Send one message to the name server. With a sharded namespace heartbeats
+// (and the stats on them) go to every shard, file notices to the file's.
+int nm_session_send(Message* msg) {
+    msg->data_len = strnlen(msg->data, MAX_BUFFER_SIZE);
+    
+    pthread_mutex_lock(&nm_sock_mutex);
+    
+    int result;
+    if (num_shards <= 1) {
+        result = nm_session_send_on(&nm_session_sock, -1, msg);
+    } else if (msg->type == MSG_HEARTBEAT) {
+        result = 0;
+        for (int shard = 0; shard < num_shards; shard++) {
+            if (nm_session_send_on(&shard_session_socks[shard], shard, msg) < 0) result = -1;
+        }
+    } else {
+        int shard = shard_of(msg->filename, num_shards);
+        result = nm_session_send_on(&shard_session_socks[shard], shard, msg);
+    }
+    
+    pthread_mutex_unlock(&nm_sock_mutex);
+    return result;
+}
+
+// Manifest lines "<file> <size> <mtime> <hash>" for every file under dir
+// (names relative to STORAGE_DIR), appended to a growing buffer
+void collect_manifest(const char* relative, char** manifest, int* len, int* capacity, int* files) {
+    char dir_path[600];
+    snprintf(dir_path, sizeof(dir_path), "%s%s%s", STORAGE_DIR, relative[0] ? "/" : "", relative);
+    DIR* dir = opendir(dir_path);
+    if (!dir) return;
+    
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        size_t name_len = strlen(entry->d_name);
+        if (name_len > 4 && strcmp(entry->d_name + name_len - 4, ".tmp") == 0) continue; // Unfinished write
+        
+        char name[MAX_FILENAME];
+        if (snprintf(name, sizeof(name), "%s%s%s", relative, relative[0] ? "/" : "", entry->d_name) >= (int)sizeof(name)) {
+            continue;
+        }
+        char path[600];
+        snprintf(path, sizeof(path), "%s/%s", STORAGE_DIR, name);
+        struct stat st;
+        if (stat(path, &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            collect_manifest(name, manifest, len, capacity, files);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode)) continue;
+        
+        int words, chars;
+        unsigned long long hash;
+        if (file_state_get_stats(name, &words, &chars, &hash) != 0) continue;
+        
+        if (*len + MAX_FILENAME + 64 > *capacity) {
+            int grown_capacity = *capacity * 2 + MAX_FILENAME + 64;
+            char* grown = (char*)realloc(*manifest, grown_capacity);
+            if (!grown) break;
+            *manifest = grown;
+            *capacity = grown_capacity;
+        }
+        *len += sprintf(*manifest + *len, "%s %ld %ld %016llx\n", name, (long)st.st_size, (long)st.st_mtime, hash);
+        (*files)++;
+    }
+    closedir(dir);
+}
+
+// End of the manifest chunk starting at offset: whole lines that fit in a
+// message with room for the registration header
+int manifest_chunk_end(const char* manifest, int len, int offset) {
+    int end = offset + MAX_BUFFER_SIZE - 64;
+    if (end >= len) return len;
+    while (end > offset && manifest[end - 1] != '\n') end--;
+    return end;
+}
+
+// Send the registration and manifest on sock; returns 0 once accepted
+int send_registration(int sock, const char* manifest, int manifest_len, int files, Message* msg) {
+    int chunks = 0;
+    for (int offset = 0; offset < manifest_len || chunks == 0; offset = manifest_chunk_end(manifest, manifest_len, offset)) {
+        chunks++;
+    }
+    
+    memset(msg, 0, sizeof(*msg));
+    msg->type = MSG_REGISTER_SS;
+    strcpy(msg->ss_ip, my_ip);  // Use actual IP instead of 127.0.0.1
+    msg->ss_port = nm_listen_port;
+    msg->flags = client_port; // Store client port in flags
+    msg->word_index = capacity_weight; // Capacity weight for placement
+    int len = sprintf(msg->data, "manifest %d %d\n", files, chunks);
+    int offset = 0;
+    for (int i = 0; i < chunks; i++) {
+        if (i > 0) {
+            memset(msg, 0, sizeof(*msg));
+            msg->type = MSG_SS_MANIFEST;
+            len = 0;
+        }
+        int end = manifest_chunk_end(manifest, manifest_len, offset);
+        if (end > offset) memcpy(msg->data + len, manifest + offset, end - offset);
+        msg->data_len = len + end - offset;
+        msg->data[msg->data_len] = '\0';
+        send_message(sock, msg);
+        offset = end;
+    }
+    
+    if (receive_message(sock, msg) == 0 && msg->error_code == ERR_SUCCESS) return 0;
+    return -1;
+}
+
+// Register with Name Server, reporting what this server holds so the NM can
+// re-attach it to its old slot and repair only what differs. With a sharded
+// namespace every shard places files here, so each gets the manifest.
 void register_with_nm() {
     log_message("SS", "Registering with Name Server at %s:%d", nm_ip, nm_port);
     
-    int sock = connect_to_server(nm_ip, nm_port);
+    int sock = connect_to_nm();
     if (sock < 0) {
         log_message("SS", "Failed to connect to Name Server");
         exit(1);
     }
     
-    // Get list of files
-    DIR* dir = opendir(STORAGE_DIR);
-    if (!dir) {
-        mkdir(STORAGE_DIR, 0755);
-        dir = opendir(STORAGE_DIR);
+    mkdir(STORAGE_DIR, 0755);
+    char* manifest = NULL;
+    int manifest_len = 0, capacity = 0, files = 0;
+    collect_manifest("", &manifest, &manifest_len, &capacity, &files);
+    
+    Message* msg = (Message*)calloc(1, sizeof(Message));
+    if (!msg) {
+        free(manifest);
+        close(sock);
+        exit(1);
     }
     
-    char file_list[MAX_BUFFER_SIZE] = {0};
-    int offset = 0;
+    if (send_registration(sock, manifest, manifest_len, files, msg) == 0) {
+        log_message("SS", "Successfully registered with Name Server (%d file(s) reported)", files);
+        log_message("SS", "%s", msg->data);
+    } else {
+        log_message("SS", "Failed to register with Name Server");
+    }
     
-    if (dir) {
-        struct dirent* entry;
-        while ((entry = readdir(dir)) != NULL) {
-            // Skip . and .. directories
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-                continue;
-            }
+    memset(msg, 0, sizeof(*msg));
+    msg->type = MSG_NM_SHARD_MAP;
+    send_message(sock, msg);
+    if (receive_message(sock, msg) == 0 && msg->error_code == ERR_SUCCESS && msg->flags > 1) {
+        num_shards = parse_server_list(msg->data, shard_ips, shard_ports, MAX_NM_SHARDS, nm_port);
+        for (int shard = 0; shard < num_shards; shard++) {
+            shard_session_socks[shard] = -1;
+            if (shard_ports[shard] == nm_port && strcmp(shard_ips[shard], nm_ip) == 0) continue;
             
-            // Check if it's a regular file by trying to stat it
-            char filepath[512];
-            snprintf(filepath, sizeof(filepath), "%s/%s", STORAGE_DIR, entry->d_name);
-            struct stat st;
-            if (stat(filepath, &st) == 0 && S_ISREG(st.st_mode)) {
-                offset += snprintf(file_list + offset, sizeof(file_list) - offset, 
-                    "%s\n", entry->d_name);
+            int shard_sock = connect_to_server(shard_ips[shard], shard_ports[shard]);
+            if (shard_sock >= 0 && send_registration(shard_sock, manifest, manifest_len, files, msg) == 0) {
+                log_message("SS", "Registered with name server shard %d (%s:%d)", shard, shard_ips[shard], shard_ports[shard]);
+            } else {
+                log_message("SS", "Failed to register with name server shard %d (%s:%d)", shard, shard_ips[shard], shard_ports[shard]);
             }
+            if (shard_sock >= 0) close(shard_sock);
         }
-        closedir(dir);
-    }
-    
-    // Send registration message
-    Message msg;
-    memset(&msg, 0, sizeof(msg));
-    msg.type = MSG_REGISTER_SS;
-    strcpy(msg.ss_ip, my_ip);  // Use actual IP instead of 127.0.0.1
-    msg.ss_port = nm_listen_port;
-    msg.flags = client_port; // Store client port in flags
-    strcpy(msg.data, file_list);
-    msg.data_len = strlen(file_list);
-    
-    send_message(sock, &msg);
-    
-    Message response;
-    if (receive_message(sock, &response) == 0 && response.error_code == ERR_SUCCESS) {
-        log_message("SS", "Successfully registered with Name Server");
-        log_message("SS", "%s", response.data);
-    } else {
-        log_message("SS", "Failed to register with Name Server");
     }
     
+    free(manifest);
+    free(msg);
     close(sock);
 }
 
-// Bonus: Heartbeat thread - sends periodic heartbeats to Name Server
+// Bonus: Heartbeat thread - sends periodic heartbeats to Name Server.
+// File stats changed by writes are piggybacked, and wake the thread early.
 void* heartbeat_thread(void* arg) {
     (void)arg; // Unused
     
     log_message("SS", "Heartbeat thread started");
+    time_t last_telemetry = 0;
     
     while (!should_exit) {
-        sleep(10); // Send heartbeat every 10 seconds
+        // Sleep until the interval elapses or new stats are waiting
+        pthread_mutex_lock(&state_mutex);
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += HEARTBEAT_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        while (num_dirty_stats == 0 && !should_exit) {
+            if (pthread_cond_timedwait(&stats_cond, &state_mutex, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        int stats_waiting = (num_dirty_stats > 0);
+        pthread_mutex_unlock(&state_mutex);
         
         if (should_exit) break;
         
-        // Connect to NM for heartbeat
-        pthread_mutex_lock(&nm_sock_mutex);
-        int sock = connect_to_server(nm_ip, nm_port);
-        pthread_mutex_unlock(&nm_sock_mutex);
-        
-        if (sock < 0) {
-            log_message("SS", "Failed to send heartbeat - cannot connect to NM");
-            continue;
+        // Let a burst of writes settle so they share one push
+        if (stats_waiting) {
+            usleep(STATS_PUSH_DELAY_MS * 1000);
         }
         
         Message msg;
@@ -1448,10 +4173,24 @@ void* heartbeat_thread(void* arg) {
         strcpy(msg.ss_ip, my_ip);  // Use actual IP instead of 127.0.0.1
         msg.ss_port = nm_listen_port;
         
-        send_message(sock, &msg);
-        log_message("SS", "Heartbeat sent to Name Server");
+        // Most pulses are bare; telemetry rides along every few seconds
+        int offset = 0;
+        time_t now = time(NULL);
+        if (now - last_telemetry >= TELEMETRY_INTERVAL) {
+            offset = format_telemetry(msg.data, sizeof(msg.data));
+            last_telemetry = now;
+        }
+        int stats_count = collect_dirty_stats(msg.data + offset, sizeof(msg.data) - offset);
         
-        close(sock);
+        if (nm_session_send(&msg) < 0) {
+            log_message("SS", "Failed to send heartbeat - cannot reach NM");
+            requeue_dirty_stats(msg.data + offset);
+            sleep(1); // Don't spin while the NM is unreachable and stats are pending
+            continue;
+        }
+        if (stats_count > 0) {
+            log_message("SS", "Heartbeat sent to Name Server (%d file stat update(s))", stats_count);
+        }
     }
     
     log_message("SS", "Heartbeat thread stopped");
@@ -1492,15 +4231,24 @@ void* nm_listener(void* arg) {
 
 int main(int argc, char* argv[]) {
     if (argc < 4) {
-        printf("Usage: %s <client_port> <nm_port> <nm_ip>\n", argv[0]);
+        printf("Usage: %s <client_port> <nm_port> <nm_ip[:port][,standby_ip[:port]...]> [capacity_weight]\n", argv[0]);
         printf("Example: %s 9000 9001 10.42.0.238\n", argv[0]);
         return 1;
     }
     
     client_port = atoi(argv[1]);
     nm_listen_port = atoi(argv[2]);
-    strncpy(nm_ip, argv[3], sizeof(nm_ip) - 1);
-    nm_ip[sizeof(nm_ip) - 1] = '\0';
+    num_name_servers = parse_server_list(argv[3], nm_ips, nm_ports, MAX_NAME_SERVERS, nm_port);
+    if (num_name_servers == 0) {
+        printf("Cannot parse name server list '%s' (use ip[:port][,ip[:port]...])\n", argv[3]);
+        return 1;
+    }
+    strcpy(nm_ip, nm_ips[0]);
+    nm_port = nm_ports[0];
+    if (argc > 4) {
+        capacity_weight = atoi(argv[4]);
+        if (capacity_weight < 1) capacity_weight = 1;
+    }
     
     // Set unique storage directories based on client port
     snprintf(STORAGE_DIR, sizeof(STORAGE_DIR), "./storage%d", client_port);
@@ -1512,7 +4260,7 @@ int main(int argc, char* argv[]) {
     log_message("SS", "Starting Storage Server");
     log_message("SS", "My IP: %s", my_ip);
     log_message("SS", "Client port: %d, NM listen port: %d", client_port, nm_listen_port);
-    log_message("SS", "Name Server IP: %s:%d", nm_ip, nm_port);
+    log_message("SS", "Name Server IP: %s:%d (%d listed)", nm_ip, nm_port, num_name_servers);
     log_message("SS", "Storage directory: %s", STORAGE_DIR);
     log_message("SS", "Undo directory: %s", UNDO_DIR);
     
@@ -1520,6 +4268,11 @@ int main(int argc, char* argv[]) {
     mkdir(STORAGE_DIR, 0755);
     mkdir(UNDO_DIR, 0755);
     
+    // Build the content index from files already on disk
+    index_build_from_disk("");
+    log_message("SS", "Content index built");
+    clock_gettime(CLOCK_MONOTONIC, &telemetry.since);
+    
     // Open log file (unique per storage server)
     char log_filename[256];
     snprintf(log_filename, sizeof(log_filename), "ss_log_%d.txt", client_port);
@@ -1544,6 +4297,13 @@ int main(int argc, char* argv[]) {
     
     log_message("SS", "Registration complete!");
     
+    start_replication_workers();
+    
+    pthread_t anti_entropy_tid;
+    if (pthread_create(&anti_entropy_tid, NULL, anti_entropy_thread, NULL) == 0) {
+        pthread_detach(anti_entropy_tid);
+    }
+    
     // Bonus: Start heartbeat thread for fault tolerance
     pthread_t heartbeat_tid;
     if (pthread_create(&heartbeat_tid, NULL, heartbeat_thread, NULL) == 0) {